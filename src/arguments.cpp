@@ -174,6 +174,49 @@ Error Arguments::parse(const char* args) {
             CASE("memlimit")
                 _mem_limit = value == NULL ? 0 : parseUnits(value, BYTES);
 
+            CASE("shards")
+                if (value == NULL) {
+                    _shards = OS::getCpuCount();
+                } else if ((_shards = atoi(value)) <= 0) {
+                    msg = "shards must be > 0";
+                }
+
+            CASE("parsethreads")
+                if (value == NULL || (_parse_threads = atoi(value)) <= 0) {
+                    msg = "parsethreads must be > 0";
+                }
+
+            CASE("overhead")
+                // Percentage of the process CPU time, with or without the % sign
+                if (value == NULL || (_overhead = atof(value) / 100) <= 0 || _overhead > 1) {
+                    msg = "overhead must be a percentage in (0, 100]";
+                }
+
+            CASE("storage")
+                if (value != NULL) {
+                    if (strstr(value, "trie"))   _storage |= STORAGE_TRIE;
+                    if (strstr(value, "evict"))  _storage |= STORAGE_EVICT;
+                    if (strstr(value, "verify")) _storage |= STORAGE_VERIFY;
+                    if (strstr(value, "swap"))   _storage |= STORAGE_SWAP;
+                }
+
+            CASE("memory")
+                if (value != NULL) {
+                    const char* node = strstr(value, "node");
+                    if (strstr(value, "thp"))        _memory |= ALLOC_THP;
+                    if (strstr(value, "hugetlb"))    _memory |= ALLOC_HUGETLB;
+                    if (strstr(value, "interleave")) _memory |= ALLOC_INTERLEAVE;
+                    if (node != NULL) {
+                        _memory |= ALLOC_BIND;
+                        _numa_node = node[4] >= '0' && node[4] <= '9' ? atoi(node + 4) : -1;
+                    }
+                    if ((_memory & ALLOC_INTERLEAVE) && (_memory & ALLOC_BIND)) {
+                        msg = "memory=interleave and memory=nodeN are mutually exclusive";
+                    } else if ((_memory & ALLOC_BIND) && _numa_node < 0) {
+                        msg = "Invalid NUMA node";
+                    }
+                }
+
             CASE("alloc")
                 _alloc = value == NULL ? 0 : parseUnits(value, BYTES);
 
@@ -265,6 +308,7 @@ Error Arguments::parse(const char* args) {
                     if (strstr(value, "vtable"))   _features.vtable_target = 1;
                     if (strstr(value, "comptask")) _features.comp_task = 1;
                     if (strstr(value, "pcaddr"))   _features.pc_addr = 1;
+                    if (strstr(value, "stackcache")) _features.stack_cache = 1;
                 }
 
             CASE("file")
@@ -311,6 +355,9 @@ Error Arguments::parse(const char* args) {
             CASE("record-cpu")
                 _record_cpu = true;
 
+            CASE("deferred")
+                _deferred = true;
+
             CASE("live")
                 _live = true;
 
@@ -320,6 +367,24 @@ Error Arguments::parse(const char* args) {
             CASE("alluser")
                 _alluser = true;
 
+            CASE("lazysymbols")
+                _lazy_symbols = true;
+
+            CASE("nativepc")
+                _native_pc = true;
+
+            CASE("symcache")
+                _symcache = value == NULL || value[0] == 0 ? NULL : value;
+
+            CASE("userstack")
+                _user_stack = value == NULL ? DEFAULT_USER_STACK : parseUnits(value, BYTES);
+                if (_user_stack < MIN_USER_STACK || _user_stack > MAX_USER_STACK) {
+                    msg = "userstack must be between 256 and 61440 bytes";
+                } else {
+                    // perf_events requires a multiple of 8
+                    _user_stack &= ~7L;
+                }
+
             CASE("cstack")
                 if (value != NULL) {
                     if (strcmp(value, "fp") == 0) {
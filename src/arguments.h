@@ -15,6 +15,9 @@ const long DEFAULT_ALLOC_INTERVAL = 524287;  // 512 KiB
 const long DEFAULT_LOCK_INTERVAL = 10000;    // 10 us
 const long DEFAULT_PROC_INTERVAL = 30;       // 30 seconds
 const int DEFAULT_JSTACKDEPTH = 2048;
+const long DEFAULT_USER_STACK = 8192;        // 8 KiB
+const long MIN_USER_STACK = 256;
+const long MAX_USER_STACK = 61440;           // a perf sample with the stack copy must fit in 64 KiB
 
 const char* const EVENT_CPU        = "cpu";
 const char* const EVENT_ALLOC      = "alloc";
@@ -92,6 +95,13 @@ enum JfrOption {
     JFR_SYNC_OPTS   = NO_SYSTEM_INFO | NO_SYSTEM_PROPS | NO_NATIVE_LIBS | NO_CPU_LOAD | NO_HEAP_SUMMARY
 };
 
+enum StorageOption {
+    STORAGE_TRIE    = 0x1,  // share common stack trace prefixes in a tree of frames
+    STORAGE_EVICT   = 0x2,  // evict cold stack traces when memlimit is reached
+    STORAGE_VERIFY  = 0x4,  // compare frames of stack traces with equal hashes
+    STORAGE_SWAP    = 0x8   // dump from a standby copy of the storage, so that each dump covers one interval
+};
+
 // Keep this in sync with JfrSync.java
 enum EventCategory {
     EC_CPU,         // jdk.ExecutionSample
@@ -113,7 +123,8 @@ struct StackWalkFeatures {
     unsigned short vtable_target : 1;  // show receiver classes of vtable/itable stubs
     unsigned short comp_task     : 1;  // display current compilation task for JIT threads
     unsigned short pc_addr       : 1;  // record exact PC address for each sample
-    unsigned short _padding      : 9;  // pad structure to 16 bits
+    unsigned short stack_cache   : 1;  // reuse outer frames of the previous stack trace of the same thread
+    unsigned short _padding      : 8;  // pad structure to 16 bits
 };
 
 
@@ -168,6 +179,13 @@ class Arguments {
     int _timeout;
     int _loop;
     size_t _mem_limit;
+    int _shards;
+    int _parse_threads;
+    long _user_stack;
+    int _storage;
+    int _memory;
+    int _numa_node;
+    double _overhead;
     long _interval;
     long _alloc;
     long _nativemem;
@@ -192,14 +210,18 @@ class Arguments {
     bool _threads;
     bool _sched;
     bool _record_cpu;
+    bool _deferred;
     bool _tlab;
     bool _live;
     bool _nofree;
     bool _nobatch;
     bool _nostop;
     bool _alluser;
+    bool _lazy_symbols;
+    bool _native_pc;
     bool _fdtransfer;
     const char* _fdtransfer_path;
+    const char* _symcache;
     int _target_cpu;
     int _style;
     StackWalkFeatures _features;
@@ -232,6 +254,13 @@ class Arguments {
         _timeout(0),
         _loop(0),
         _mem_limit(0),
+        _shards(0),
+        _parse_threads(0),
+        _user_stack(0),
+        _storage(0),
+        _memory(0),
+        _numa_node(-1),
+        _overhead(0),
         _interval(0),
         _alloc(-1),
         _nativemem(-1),
@@ -256,14 +285,18 @@ class Arguments {
         _threads(false),
         _sched(false),
         _record_cpu(false),
+        _deferred(false),
         _tlab(false),
         _live(false),
         _nofree(false),
         _nobatch(false),
         _nostop(false),
         _alluser(false),
+        _lazy_symbols(false),
+        _native_pc(false),
         _fdtransfer(false),
         _fdtransfer_path(NULL),
+        _symcache(NULL),
         _target_cpu(-1),
         _style(0),
         _features{},
@@ -3,17 +3,37 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <algorithm>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "callTraceStorage.h"
 #include "os.h"
 
+#if defined(__x86_64__)
+#  include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#  include <sys/auxv.h>
+#  ifndef HWCAP_CRC32
+#    define HWCAP_CRC32 (1 << 7)
+#  endif
+#endif
+
 #define COMMA ,
 
 static const u32 INITIAL_CAPACITY = 65536;
 static const u32 CALL_TRACE_CHUNK = 8 * 1024 * 1024;
 static const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
 static const size_t MEM_LIMIT_EXTRA = 0x10000;  // reserve up to 64 KB for LongHashTable headers
+static const u32 MIN_SHARD_CAPACITY = 4096;
+static const u32 MIN_SHARD_CHUNK = 1024 * 1024;
+static const u32 INITIAL_NODE_CAPACITY = 65536;
+static const int NODE_PUBLISH_SPINS = 1000;
+// Enough generations that a trace ID kept by a wall clock thread or a live object
+// is not mistaken for an ID of a later generation
+static const u32 GENERATION_BITS = 8;
+// Approximate cost of a hash table slot with 0.75 load factor, including smaller tables of the chain
+static const size_t EVICTION_SLOT_COST = 3 * (sizeof(u64) + sizeof(CallTraceSample));
 
 
 class LongHashTable {
@@ -25,11 +45,23 @@ class LongHashTable {
     volatile u32 _size;
     u32 _padding2[15];
 
+    static u32 bitmapWords(u32 capacity) {
+        return (capacity + 63) / 64;
+    }
+
     static size_t getSize(u32 capacity) {
-        size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity;
+        size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity
+                    + 2 * sizeof(u64) * bitmapWords(capacity);
         return (size + OS::page_mask) & ~OS::page_mask;
     }
 
+    static void setBit(u64* bitmap, u32 slot) {
+        u64 mask = 1ULL << (slot & 63);
+        if ((bitmap[slot / 64] & mask) == 0) {
+            __sync_fetch_and_or(&bitmap[slot / 64], mask);
+        }
+    }
+
   public:
     static LongHashTable* allocate(LongHashTable* prev, u32 capacity) {
         LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity));
@@ -75,61 +107,332 @@ class LongHashTable {
         return (CallTraceSample*)(keys() + _capacity);
     }
 
+    // Slots with a key; lets collectors skip empty parts of the table
+    u64* usedBits() {
+        return (u64*)(values() + _capacity);
+    }
+
+    // Slots whose samples changed from zero since the last collectTraces
+    u64* dirtyBits() {
+        return usedBits() + bitmapWords(_capacity);
+    }
+
+    u32 bitmapWords() {
+        return bitmapWords(_capacity);
+    }
+
+    void markUsed(u32 slot) {
+        setBit(usedBits(), slot);
+    }
+
+    void markDirty(u32 slot) {
+        setBit(dirtyBits(), slot);
+    }
+
     void clear() {
-        memset(keys(), 0, (sizeof(u64) + sizeof(CallTraceSample)) * _capacity);
+        memset(keys(), 0, (sizeof(u64) + sizeof(CallTraceSample)) * _capacity + 2 * sizeof(u64) * bitmapWords());
         _size = 0;
     }
 };
 
+// Calls fn(slot) for each bit set in the bitmap
+template<typename Fn>
+static inline void forEachBit(u64* bitmap, u32 words, Fn fn) {
+    for (u32 w = 0; w < words; w++) {
+        for (u64 bits = bitmap[w]; bits != 0; bits &= bits - 1) {
+            fn(w * 64 + __builtin_ctzll(bits));
+        }
+    }
+}
+
+// Index of prefix tree nodes keyed by (parent, frame).
+// Nodes are allocated by shards, while the index is shared, so that equal paths coincide.
+class TraceNodeTable {
+  private:
+    TraceNodeTable* _prev;
+    void* _padding0;
+    u32 _capacity;
+    u32 _padding1[15];
+    volatile u32 _size;
+    u32 _padding2[15];
+
+    static size_t getSize(u32 capacity) {
+        size_t size = sizeof(TraceNodeTable) + (sizeof(u64) + sizeof(TraceNode*)) * capacity;
+        return (size + OS::page_mask) & ~OS::page_mask;
+    }
+
+  public:
+    static TraceNodeTable* allocate(TraceNodeTable* prev, u32 capacity) {
+        TraceNodeTable* table = (TraceNodeTable*)OS::safeAlloc(getSize(capacity));
+        if (table != NULL) {
+            table->_prev = prev;
+            table->_capacity = capacity;
+            table->_size = 0;
+        }
+        return table;
+    }
+
+    TraceNodeTable* destroy() {
+        TraceNodeTable* prev = _prev;
+        OS::safeFree(this, getSize(_capacity));
+        return prev;
+    }
+
+    size_t usedMemory() {
+        return getSize(_capacity);
+    }
+
+    TraceNodeTable* prev() {
+        return _prev;
+    }
+
+    u32 capacity() {
+        return _capacity;
+    }
+
+    u32 incSize() {
+        return __sync_add_and_fetch(&_size, 1);
+    }
+
+    u64* keys() {
+        return (u64*)(this + 1);
+    }
+
+    TraceNode** values() {
+        return (TraceNode**)(keys() + _capacity);
+    }
+
+    void clear() {
+        memset(keys(), 0, (sizeof(u64) + sizeof(TraceNode*)) * _capacity);
+        _size = 0;
+    }
+};
+
+static u64 nodeHash(TraceNode* parent, const ASGCT_CallFrame& frame) {
+    u64 h = (u64)(uintptr_t)parent * 0xc6a4a7935bd1e995ULL;
+    h ^= (u64)(uintptr_t)frame.method_id + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= (u64)(u32)frame.bci * 0xff51afd7ed558ccdULL;
+
+    // fmix64 finalizer of MurmurHash3
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h != 0 ? h : 1;
+}
+
+static bool nodeEquals(TraceNode* node, TraceNode* parent, const ASGCT_CallFrame& frame) {
+    return node->parent == parent && node->frame.bci == frame.bci && node->frame.method_id == frame.method_id;
+}
+
+static TraceNode* findNode(TraceNodeTable* table, u64 hash, TraceNode* parent, const ASGCT_CallFrame& frame) {
+    u64* keys = table->keys();
+    u32 capacity = table->capacity();
+    u32 slot = hash & (capacity - 1);
+    u32 step = 0;
+
+    while (keys[slot] != 0) {
+        if (keys[slot] == hash) {
+            TraceNode* node = loadAcquire(table->values()[slot]);
+            if (node != NULL && nodeEquals(node, parent, frame)) {
+                return node;
+            }
+        }
+        if (++step >= capacity) {
+            break;
+        }
+        slot = (slot + step) & (capacity - 1);
+    }
+    return NULL;
+}
+
+CallTraceUnpacker::~CallTraceUnpacker() {
+    free(_buf);
+}
+
+CallTrace* CallTraceUnpacker::unpack(CallTrace* trace) {
+    if (trace->num_frames >= 0) {
+        return trace;
+    }
+
+    TraceNode* node = (TraceNode*)trace;
+    int depth = -node->num_frames;
+    if (depth > _capacity) {
+        _buf = (CallTrace*)realloc(_buf, sizeof(CallTrace) + (depth - 1) * sizeof(ASGCT_CallFrame));
+        _capacity = depth;
+    }
+
+    _buf->num_frames = depth;
+    for (int i = 0; i < depth; i++, node = node->parent) {
+        _buf->frames[i] = node->frame;
+    }
+    return _buf;
+}
+
 CallTrace CallTraceStorage::_overflow_trace = {1, {BCI_ERROR, LP64_ONLY(0 COMMA) (jmethodID)"storage_overflow"}};
 
-CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK) {
-    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
-    _used_memory = _current_table->usedMemory();
+static bool hotterFirst(const CallTraceSample& a, const CallTraceSample& b) {
+    if (a.epoch != b.epoch) {
+        return a.epoch > b.epoch;
+    }
+    return a.counter > b.counter;
+}
+
+CallTraceStorage::CallTraceStorage() {
+    initShards(0);
+    _node_table = NULL;
+    _node_memory = 0;
     _mem_limit = SIZE_MAX;
+    _options = 0;
     _overflow = 0;
+    _trace_count = 0;
+    _trace_bytes = 0;
+    _verify = false;
+    _collisions = 0;
+
+    _evict = false;
+    _gen_bits = 0;
+    _generation = 0;
+    _epoch = 0;
+    _evictions = 0;
+    _evicted_traces = 0;
+    _survivors = 0;
 }
 
 CallTraceStorage::~CallTraceStorage() {
-    while (_current_table != NULL) {
-        _current_table = _current_table->destroy();
+    destroyShards(_shards, _shard_mask + 1);
+    destroyNodeTables(_node_table);
+}
+
+void CallTraceStorage::initShards(u32 shard_bits) {
+    // Split the default amount of memory between shards, but keep reasonable minimum per shard
+    size_t chunk_size = CALL_TRACE_CHUNK >> shard_bits;
+    _shard_bits = shard_bits;
+    _shard_mask = (1 << shard_bits) - 1;
+    _initial_capacity = INITIAL_CAPACITY >> shard_bits;
+    if (_initial_capacity < MIN_SHARD_CAPACITY) {
+        _initial_capacity = MIN_SHARD_CAPACITY;
+    }
+
+    for (u32 i = 0; i <= _shard_mask; i++) {
+        CallTraceShard& shard = _shards[i];
+        shard.allocator = new LinearAllocator(chunk_size < MIN_SHARD_CHUNK ? MIN_SHARD_CHUNK : chunk_size);
+        shard.table = LongHashTable::allocate(NULL, _initial_capacity);
+        shard.used_memory = shard.table->usedMemory();
     }
 }
 
-void CallTraceStorage::clear(size_t mem_limit) {
-    while (_current_table->prev() != NULL) {
-        _current_table = _current_table->destroy();
+void CallTraceStorage::destroyShards(CallTraceShard* shards, u32 count) {
+    for (u32 i = 0; i < count; i++) {
+        CallTraceShard& shard = shards[i];
+        while (shard.table != NULL) {
+            shard.table = shard.table->destroy();
+        }
+        delete shard.allocator;
+        shard.allocator = NULL;
+    }
+}
+
+void CallTraceStorage::destroyNodeTables(TraceNodeTable* table) {
+    while (table != NULL) {
+        table = table->destroy();
     }
-    _current_table->clear();
-    _used_memory = _current_table->usedMemory();
-    _allocator.clear();
+}
+
+void CallTraceStorage::clear(size_t mem_limit, int shards, int options) {
+    u32 shard_bits = 0;
+    while ((1 << shard_bits) < shards && (1 << shard_bits) < MAX_TRACE_SHARDS) {
+        shard_bits++;
+    }
+
+    if (shard_bits != _shard_bits) {
+        destroyShards(_shards, _shard_mask + 1);
+        initShards(shard_bits);
+    } else {
+        for (u32 i = 0; i <= _shard_mask; i++) {
+            CallTraceShard& shard = _shards[i];
+            while (shard.table->prev() != NULL) {
+                shard.table = shard.table->destroy();
+            }
+            shard.table->clear();
+            shard.used_memory = shard.table->usedMemory();
+            shard.allocator->clear();
+        }
+    }
+
+    // Nodes live in shard allocators, so the index is dropped together with them
+    destroyNodeTables(_node_table);
+    _node_table = NULL;
+    _node_memory = 0;
+    if (options & STORAGE_TRIE) {
+        _node_table = TraceNodeTable::allocate(NULL, INITIAL_NODE_CAPACITY);
+        _node_memory = _node_table->usedMemory();
+    }
+
     _mem_limit = mem_limit ? mem_limit | MEM_LIMIT_EXTRA : SIZE_MAX;
+    _options = options;
     _overflow = 0;
+    _trace_count = 0;
+    _trace_bytes = 0;
+
+    _verify = (options & STORAGE_VERIFY) != 0;
+    _collisions = 0;
+
+    _evict = (options & STORAGE_EVICT) != 0;
+    _gen_bits = _evict || (options & STORAGE_SWAP) ? GENERATION_BITS : 0;
+    _generation = 0;
+    _epoch = 0;
+    _evictions = 0;
+    _evicted_traces = 0;
+    _survivors = 0;
 }
 
-u32 CallTraceStorage::capacity() {
+u32 CallTraceStorage::capacity(CallTraceShard& shard) {
     // As capacity of each subsequent table doubles,
     // total capacity is a sum of geometric series: 64K + 128K + 256K...
-    return _current_table->capacity() * 2 - INITIAL_CAPACITY;
+    return shard.table->capacity() * 2 - _initial_capacity;
+}
+
+u32 CallTraceStorage::capacity() {
+    u32 total = 0;
+    for (u32 i = 0; i <= _shard_mask; i++) {
+        total += capacity(_shards[i]);
+    }
+    return total;
 }
 
 size_t CallTraceStorage::usedMemory() {
-    return _used_memory + _allocator.usedMemory();
+    size_t total = _node_memory;
+    for (u32 i = 0; i <= _shard_mask; i++) {
+        total += _shards[i].used_memory + _shards[i].allocator->usedMemory();
+    }
+    return total;
 }
 
 void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
-        CallTraceSample* values = table->values();
-        u32 capacity = table->capacity();
-
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0 && loadAcquire(values[slot].samples) != 0) {
-                // Reset samples to avoid duplication of call traces between JFR chunks
-                values[slot].samples = 0;
-                CallTrace* trace = values[slot].acquireTrace();
-                if (trace != NULL) {
-                    map[capacity - (INITIAL_CAPACITY - 1) + slot] = trace;
+    for (u32 i = 0; i <= _shard_mask; i++) {
+        for (LongHashTable* table = _shards[i].table; table != NULL; table = table->prev()) {
+            CallTraceSample* values = table->values();
+            u32 capacity = table->capacity();
+            u64* dirty = table->dirtyBits();
+            u32 words = table->bitmapWords();
+
+            // Only slots hit since the previous call are visited; the bits are claimed atomically,
+            // so that a concurrent put() sets them again for the next collection
+            for (u32 w = 0; w < words; w++) {
+                if (dirty[w] == 0) continue;
+                u64 bits = __atomic_exchange_n(&dirty[w], 0, __ATOMIC_ACQ_REL);
+                for (; bits != 0; bits &= bits - 1) {
+                    u32 slot = w * 64 + __builtin_ctzll(bits);
+                    if (loadAcquire(values[slot].samples) != 0) {
+                        // Reset samples to avoid duplication of call traces between JFR chunks
+                        values[slot].samples = 0;
+                        CallTrace* trace = values[slot].acquireTrace();
+                        if (trace != NULL) {
+                            map[encodeId(i, capacity - (_initial_capacity - 1) + slot)] = trace;
+                        }
+                    }
                 }
             }
         }
@@ -140,36 +443,78 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
     }
 }
 
+// With multiple shards, the same stack trace may appear more than once in the list
 void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
-        CallTraceSample* values = table->values();
-        u32 capacity = table->capacity();
-
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
+    for (u32 i = 0; i <= _shard_mask; i++) {
+        for (LongHashTable* table = _shards[i].table; table != NULL; table = table->prev()) {
+            CallTraceSample* values = table->values();
+            forEachBit(table->usedBits(), table->bitmapWords(), [&] (u32 slot) {
                 samples.push_back(&values[slot]);
-            }
+            });
         }
     }
 }
 
-void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
-        CallTraceSample* values = table->values();
-        u32 capacity = table->capacity();
+// Checks that the stored stack trace, either flat or a tree path, matches the given frames
+static bool sameFrames(CallTrace* trace, int num_frames, ASGCT_CallFrame* frames) {
+    if (trace == NULL) {
+        // Not yet published by a concurrent writer; trust the hash
+        return true;
+    }
 
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0 && values[slot].acquireTrace() != NULL) {
-                map[keys[slot]] += values[slot];
+    if (trace->num_frames >= 0) {
+        if (trace->num_frames != num_frames) return false;
+        for (int i = 0; i < num_frames; i++) {
+            if (trace->frames[i].bci != frames[i].bci || trace->frames[i].method_id != frames[i].method_id) {
+                return false;
             }
         }
+        return true;
+    }
+
+    TraceNode* node = (TraceNode*)trace;
+    if (-node->num_frames != num_frames) return false;
+    for (int i = 0; i < num_frames; i++, node = node->parent) {
+        if (node->frame.bci != frames[i].bci || node->frame.method_id != frames[i].method_id) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Merges slots of the same stack trace, whether migrated between tables of a shard
+// or stored by several shards. Keyed by hash; traces with colliding hashes stay apart.
+void CallTraceStorage::collectSamples(std::multimap<u64, CallTraceSample>& map) {
+    CallTraceUnpacker unpacker;
+    for (u32 i = 0; i <= _shard_mask; i++) {
+        for (LongHashTable* table = _shards[i].table; table != NULL; table = table->prev()) {
+            u64* keys = table->keys();
+            CallTraceSample* values = table->values();
+            forEachBit(table->usedBits(), table->bitmapWords(), [&] (u32 slot) {
+                CallTrace* trace = values[slot].acquireTrace();
+                if (trace == NULL) {
+                    return;
+                }
+
+                std::pair<std::multimap<u64, CallTraceSample>::iterator,
+                          std::multimap<u64, CallTraceSample>::iterator> range = map.equal_range(keys[slot]);
+                if (range.first != range.second) {
+                    CallTrace* frames = unpacker.unpack(trace);
+                    for (std::multimap<u64, CallTraceSample>::iterator it = range.first; it != range.second; ++it) {
+                        if (it->second.trace == trace || sameFrames(it->second.trace, frames->num_frames, frames->frames)) {
+                            it->second += values[slot];
+                            return;
+                        }
+                    }
+                }
+                map.insert(std::make_pair(keys[slot], values[slot]));
+            });
+        }
     }
 }
 
 // Adaptation of MurmurHash64A by Austin Appleby
-u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
+u64 CallTraceStorage::murmurHash(int num_frames, ASGCT_CallFrame* frames) {
     const u64 M = 0xc6a4a7935bd1e995ULL;
     const int R = 47;
 
@@ -200,26 +545,178 @@ u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
     return h;
 }
 
-CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
+#if defined(__x86_64__) || defined(__aarch64__)
+
+#if defined(__x86_64__)
+
+bool CallTraceStorage::hasCrc32c() {
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2) != 0;
+}
+
+__attribute__((target("sse4.2")))
+static inline u64 crc32c(u64 crc, u64 data) {
+    return __builtin_ia32_crc32di(crc, data);
+}
+
+#else
+
+bool CallTraceStorage::hasCrc32c() {
+#ifdef __linux__
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+    // CRC32 instructions are mandatory since ARMv8.1, and all Apple CPUs have them
+    return true;
+#endif
+}
+
+static inline u64 crc32c(u64 crc, u64 data) {
+    u32 result = (u32)crc;
+    asm(".arch_extension crc\n\tcrc32cx %w0, %w0, %x1" : "+r"(result) : "r"(data));
+    return result;
+}
+
+#endif
+
+// Two independent CRC32C lanes produce a 64-bit hash. Each lane consumes one mixed word per frame,
+// so the dependency chain is just one CRC instruction per frame.
+// Multiplication is what makes the lanes differ, since CRC itself is linear.
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+#endif
+u64 CallTraceStorage::crc32cHash(int num_frames, ASGCT_CallFrame* frames) {
+    const u64 K1 = 0x9e3779b97f4a7c15ULL;
+    const u64 K2 = 0xc6a4a7935bd1e995ULL;
+
+    u64 a = num_frames;
+    u64 b = ~(u64)num_frames;
+
+    const u64* data = (const u64*)frames;
+    const u64* end = data + num_frames * 2;
+
+    for (; data != end; data += 2) {
+        a = crc32c(a, data[1] * K1 + data[0]);
+        b = crc32c(b, data[0] * K2 + data[1]);
+    }
+
+    return a << 32 | b;
+}
+
+#else
+
+bool CallTraceStorage::hasCrc32c() {
+    return false;
+}
+
+u64 CallTraceStorage::crc32cHash(int num_frames, ASGCT_CallFrame* frames) {
+    return murmurHash(num_frames, frames);
+}
+
+#endif
+
+// Hash function is chosen once depending on CPU capabilities
+u64 (*CallTraceStorage::_calc_hash)(int num_frames, ASGCT_CallFrame* frames) =
+    CallTraceStorage::hasCrc32c() ? CallTraceStorage::crc32cHash : CallTraceStorage::murmurHash;
+
+CallTrace* CallTraceStorage::storeCallTrace(CallTraceShard& shard, int num_frames, ASGCT_CallFrame* frames) {
     const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
-    CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
+    CallTrace* buf = (CallTrace*)shard.allocator->alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
     if (buf != NULL) {
         buf->num_frames = num_frames;
         // Do not use memcpy inside signal handler
         for (int i = 0; i < num_frames; i++) {
             buf->frames[i] = frames[i];
         }
+        atomicInc(_trace_bytes, (u64)(header_size + num_frames * sizeof(ASGCT_CallFrame)));
     }
     return buf;
 }
 
-CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
+TraceNode* CallTraceStorage::allocateNode(CallTraceShard& shard, TraceNode* parent, const ASGCT_CallFrame& frame) {
+    TraceNode* node = (TraceNode*)shard.allocator->alloc(sizeof(TraceNode));
+    if (node != NULL) {
+        node->num_frames = parent == NULL ? -1 : parent->num_frames - 1;
+        node->parent = parent;
+        node->frame = frame;
+        atomicInc(_trace_bytes, (u64)sizeof(TraceNode));
+    }
+    return node;
+}
+
+TraceNode* CallTraceStorage::internNode(CallTraceShard& shard, TraceNode* parent, const ASGCT_CallFrame& frame) {
+    u64 hash = nodeHash(parent, frame);
+
+    TraceNodeTable* table = loadAcquire(_node_table);
+    u64* keys = table->keys();
+    TraceNode** values = table->values();
+    u32 capacity = table->capacity();
+    u32 slot = hash & (capacity - 1);
+    u32 step = 0;
+
+    while (true) {
+        u64 key = keys[slot];
+        if (key == hash) {
+            TraceNode* node = loadAcquire(values[slot]);
+            for (int spins = 0; node == NULL && spins < NODE_PUBLISH_SPINS; spins++) {
+                spinPause();
+                node = loadAcquire(values[slot]);
+            }
+            if (node == NULL) {
+                // The concurrent writer is too slow: keep the path correct at the cost of sharing
+                return allocateNode(shard, parent, frame);
+            } else if (nodeEquals(node, parent, frame)) {
+                return node;
+            }
+        } else if (key == 0) {
+            if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
+                continue;
+            }
+
+            if (table->incSize() == capacity * 3 / 4) {
+                TraceNodeTable* new_table = TraceNodeTable::allocate(table, capacity * 2);
+                if (new_table != NULL) {
+                    atomicInc(_node_memory, new_table->usedMemory());
+                    storeRelease(_node_table, new_table);
+                }
+            }
+
+            TraceNode* node = NULL;
+            for (TraceNodeTable* prev = table->prev(); prev != NULL && node == NULL; prev = prev->prev()) {
+                node = findNode(prev, hash, parent, frame);
+            }
+            if (node == NULL) {
+                node = allocateNode(shard, parent, frame);
+            }
+            storeRelease(values[slot], node);
+            return node;
+        }
+
+        if (++step >= capacity) {
+            return allocateNode(shard, parent, frame);
+        }
+        slot = (slot + step) & (capacity - 1);
+    }
+}
+
+// The root frame is the last one, so the path is built from the end of the array
+CallTrace* CallTraceStorage::storeTreePath(CallTraceShard& shard, int num_frames, ASGCT_CallFrame* frames) {
+    TraceNode* node = NULL;
+    for (int i = num_frames - 1; i >= 0; i--) {
+        node = internNode(shard, node, frames[i]);
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+    return (CallTrace*)node;
+}
+
+CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash, int num_frames, ASGCT_CallFrame* frames) {
     u64* keys = table->keys();
     u32 capacity = table->capacity();
     u32 slot = hash & (capacity - 1);
     u32 step = 0;
 
-    while (keys[slot] != hash) {
+    while (keys[slot] != hash || (_verify && !sameFrames(table->values()[slot].acquireTrace(), num_frames, frames))) {
         if (keys[slot] == 0) {
             return NULL;
         }
@@ -232,41 +729,52 @@ CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
     return table->values()[slot].trace;
 }
 
-u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
-    u64 hash = calcHash(num_frames, frames);
+CallTraceSample* CallTraceStorage::findOrInsert(u32 shard_index, u64 hash, int num_frames, ASGCT_CallFrame* frames,
+                                                u32& call_trace_id, LongHashTable*& owner) {
+    CallTraceShard& shard = _shards[shard_index];
 
-    LongHashTable* table = _current_table;
+    LongHashTable* table = shard.table;
     u64* keys = table->keys();
     u32 capacity = table->capacity();
     u32 slot = hash & (capacity - 1);
     u32 step = 0;
 
-    while (keys[slot] != hash) {
-        if (keys[slot] == 0) {
-            if (usedMemory() > _mem_limit) {
+    while (keys[slot] != hash || (_verify && !sameFrames(table->values()[slot].acquireTrace(), num_frames, frames))) {
+        if (keys[slot] == hash) {
+            // Different stack trace with the same hash takes another slot
+            atomicInc(_collisions);
+        } else if (keys[slot] == 0) {
+            // Migrate from a previous table to save space
+            CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash, num_frames, frames);
+            if (trace == NULL && usedMemory() > _mem_limit) {
                 // Stop adding new stack traces once memory limit is exceeded
                 atomicInc(_overflow);
-                return OVERFLOW_TRACE_ID;
+                return NULL;
             }
 
             if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
                 continue;
             }
+            table->markUsed(slot);
 
             // Increment the table size, and if the load factor exceeds 0.75, reserve a new table.
             // This condition can be hit only once per table, so the below allocation is race-free.
-            if (table->incSize() == capacity * 3 / 4) {
+            // IDs of the new table must still fit in 32 bits together with the shard and generation.
+            if (table->incSize() == capacity * 3 / 4 &&
+                (u64)capacity * 4 - _initial_capacity <= 1ULL << (32 - _shard_bits - _gen_bits)) {
                 LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
                 if (new_table != NULL) {
-                    atomicInc(_used_memory, new_table->usedMemory());
-                    storeRelease(_current_table, new_table);
+                    atomicInc(shard.used_memory, new_table->usedMemory());
+                    storeRelease(shard.table, new_table);
                 }
             }
 
-            // Migrate from a previous table to save space
-            CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
             if (trace == NULL) {
-                trace = storeCallTrace(num_frames, frames);
+                trace = _node_table != NULL && num_frames > 0 ? storeTreePath(shard, num_frames, frames)
+                                                              : storeCallTrace(shard, num_frames, frames);
+                if (trace != NULL) {
+                    atomicInc(_trace_count);
+                }
             }
             table->values()[slot].setTrace(trace);
             break;
@@ -275,49 +783,194 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
         if (++step >= capacity) {
             // Very unlikely case of a table overflow
             atomicInc(_overflow);
-            return OVERFLOW_TRACE_ID;
+            return NULL;
         }
         // Improved version of linear probing
         slot = (slot + step) & (capacity - 1);
     }
 
+    call_trace_id = encodeId(shard_index, capacity - (_initial_capacity - 1) + slot);
+    owner = table;
+    return &table->values()[slot];
+}
+
+// Must follow the update of samples, so that collectTraces never clears the bit without seeing it
+void CallTraceStorage::markDirty(LongHashTable* table, CallTraceSample* s) {
+    table->markDirty(s - table->values());
+}
+
+u32 CallTraceStorage::currentShard() {
+    if (_shard_mask == 0) {
+        return 0;
+    }
+    int cpu = OS::getCurrentCpu();
+    return (cpu >= 0 ? cpu : OS::threadId()) & _shard_mask;
+}
+
+void CallTraceStorage::prefetch(u64 hash) {
+    LongHashTable* table = _shards[currentShard()].table;
+    __builtin_prefetch(&table->keys()[hash & (table->capacity() - 1)]);
+}
+
+u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+    return put(num_frames, frames, counter, _calc_hash(num_frames, frames));
+}
+
+u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u64 hash) {
+    u32 call_trace_id;
+    LongHashTable* table;
+    CallTraceSample* s = findOrInsert(currentShard(), hash, num_frames, frames, call_trace_id, table);
+    if (s == NULL) {
+        return OVERFLOW_TRACE_ID;
+    }
+
     if (counter != 0) {
-        CallTraceSample& s = table->values()[slot];
-        atomicInc(s.samples);
-        atomicInc(s.counter, counter);
+        atomicInc(s->samples);
+        atomicInc(s->counter, counter);
+        markDirty(table, s);
+    }
+    if (s->epoch != _epoch) {
+        s->epoch = _epoch;
     }
 
-    return capacity - (INITIAL_CAPACITY - 1) + slot;
+    return call_trace_id;
 }
 
 void CallTraceStorage::add(u32 call_trace_id, u64 samples, u64 counter) {
-    if (call_trace_id > capacity()) {  // this also covers call_trace_id == OVERFLOW_TRACE_ID
+    if (call_trace_id == 0 || call_trace_id == OVERFLOW_TRACE_ID) {
+        return;
+    }
+
+    u32 index = call_trace_id - 1;
+    u32 gen_mask = (1 << _gen_bits) - 1;
+    if ((index & gen_mask) != (_generation & gen_mask)) {
+        // The stack trace belongs to an evicted generation of the storage
+        return;
+    }
+    index >>= _gen_bits;
+
+    CallTraceShard& shard = _shards[index & _shard_mask];
+    u32 local_id = (index >> _shard_bits) + 1;
+    if (local_id > capacity(shard)) {
         return;
     }
 
-    call_trace_id += (INITIAL_CAPACITY - 1);
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        if (call_trace_id >= table->capacity()) {
-            CallTraceSample& s = table->values()[call_trace_id - table->capacity()];
+    local_id += (_initial_capacity - 1);
+    for (LongHashTable* table = shard.table; table != NULL; table = table->prev()) {
+        if (local_id >= table->capacity()) {
+            CallTraceSample& s = table->values()[local_id - table->capacity()];
+            if (s.acquireTrace() == NULL) {
+                // Not an ID handed out by this generation
+                break;
+            }
             atomicInc(s.samples, samples);
             atomicInc(s.counter, counter);
+            s.epoch = _epoch;
+            markDirty(table, &s);
             break;
         }
     }
 }
 
 void CallTraceStorage::resetCounters() {
-     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
-        CallTraceSample* values = table->values();
-        u32 capacity = table->capacity();
-
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
+    for (u32 i = 0; i <= _shard_mask; i++) {
+        for (LongHashTable* table = _shards[i].table; table != NULL; table = table->prev()) {
+            CallTraceSample* values = table->values();
+            forEachBit(table->usedBits(), table->bitmapWords(), [&] (u32 slot) {
                 CallTraceSample& s = values[slot];
                 storeRelease(s.samples, 0);
                 storeRelease(s.counter, 0);
+            });
+        }
+    }
+}
+
+bool CallTraceStorage::needsEviction() {
+    // Only the timer thread advances the epoch; a sample racing with it is aged by one tick at most
+    _epoch++;
+
+    // Start eviction at 7/8 of the limit, unless nothing new has been stored since the last one
+    return _evict && usedMemory() > _mem_limit - (_mem_limit >> 3) && _trace_count > _survivors;
+}
+
+void CallTraceStorage::evict() {
+    std::vector<CallTraceSample> traces;
+    {
+        std::multimap<u64, CallTraceSample> map;
+        collectSamples(map);
+        traces.reserve(map.size());
+        for (std::multimap<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
+            traces.push_back(it->second);
+        }
+    }
+
+    std::sort(traces.begin(), traces.end(), hotterFirst);
+
+    // Start a new generation; survivors are copied from the old one, which is freed afterwards.
+    // The caller holds all sample slots, so no put() or add() can still be using it.
+    CallTraceShard old_shards[MAX_TRACE_SHARDS];
+    u32 old_shard_count = _shard_mask + 1;
+    for (u32 i = 0; i < old_shard_count; i++) {
+        old_shards[i] = _shards[i];
+    }
+    TraceNodeTable* old_node_table = _node_table;
+
+    initShards(_shard_bits);
+    _node_table = NULL;
+    _node_memory = 0;
+    if (old_node_table != NULL) {
+        _node_table = TraceNodeTable::allocate(NULL, INITIAL_NODE_CAPACITY);
+        _node_memory = _node_table->usedMemory();
+    }
+    _generation++;
+    _trace_count = 0;
+    _trace_bytes = 0;
+
+    // Keep recently hit stack traces that fit in half of the free memory, leaving space for new ones
+    size_t base_memory = usedMemory();
+    size_t budget = _mem_limit > base_memory ? (_mem_limit - base_memory) / 2 : 0;
+    size_t used = 0;
+    size_t keep = 0;
+
+    CallTraceUnpacker unpacker;
+    for (; keep < traces.size(); keep++) {
+        const CallTraceSample& old = traces[keep];
+        used += sizeof(CallTrace) + abs(old.trace->num_frames) * sizeof(ASGCT_CallFrame) + EVICTION_SLOT_COST;
+        if (used > budget) break;
+
+        CallTrace* trace = unpacker.unpack(old.trace);
+        u64 hash = _calc_hash(trace->num_frames, trace->frames);
+        u32 call_trace_id;
+        LongHashTable* table;
+        CallTraceSample* s = findOrInsert(hash & _shard_mask, hash, trace->num_frames, trace->frames,
+                                          call_trace_id, table);
+        if (s != NULL) {
+            s->samples += old.samples;
+            s->counter += old.counter;
+            if (old.epoch > s->epoch) s->epoch = old.epoch;
+            if (s->samples != 0) {
+                markDirty(table, s);
             }
         }
     }
+
+    destroyShards(old_shards, old_shard_count);
+    destroyNodeTables(old_node_table);
+
+    _survivors = _trace_count;
+    _evictions++;
+    _evicted_traces += traces.size() - keep;
+}
+
+void CallTraceStorage::prepareSuccessor(CallTraceStorage& next) {
+    next.clear(_mem_limit, shards(), _options);
+
+    // IDs handed out by this storage must not be mistaken for IDs of the next one
+    next._generation = _generation + 1;
+
+    // Keep cumulative statistics monotonic
+    next._overflow = _overflow;
+    next._collisions = _collisions;
+    next._evictions = _evictions;
+    next._evicted_traces = _evicted_traces;
 }
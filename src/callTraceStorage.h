@@ -9,21 +9,51 @@
 #include <map>
 #include <vector>
 #include "arch.h"
+#include "arguments.h"
 #include "linearAllocator.h"
 #include "vmEntry.h"
 
 
+const int MAX_TRACE_SHARDS = 64;
+
 class LongHashTable;
+class TraceNodeTable;
 
 struct CallTrace {
     int num_frames;
     ASGCT_CallFrame frames[1];
 };
 
+// A node of the frame prefix tree. Stack traces sharing the same root frames
+// also share the nodes for these frames. A trace is identified by its top frame node,
+// and can be used in place of CallTrace, since negative num_frames tells them apart.
+struct TraceNode {
+    int num_frames;  // -depth
+    TraceNode* parent;
+    ASGCT_CallFrame frame;
+};
+
+// Scratch space for walking stack traces: flat traces are returned as is,
+// and prefix tree paths are unfolded into a reusable frame buffer.
+class CallTraceUnpacker {
+  private:
+    CallTrace* _buf;
+    int _capacity;
+
+  public:
+    CallTraceUnpacker() : _buf(NULL), _capacity(0) {
+    }
+
+    ~CallTraceUnpacker();
+
+    CallTrace* unpack(CallTrace* trace);
+};
+
 struct CallTraceSample {
     CallTrace* trace;
     u64 samples;
     u64 counter;
+    u32 epoch;  // last time the trace was hit, used for eviction
 
     CallTrace* acquireTrace() {
         return loadAcquire(trace);
@@ -37,38 +67,117 @@ struct CallTraceSample {
         trace = s.trace;
         samples += s.samples;
         counter += s.counter;
+        if (s.epoch > epoch) epoch = s.epoch;
         return *this;
     }
 };
 
+// A part of CallTraceStorage with its own hash table chain and memory chunks.
+// Samples taken on different CPUs go to different shards and thus do not contend
+// for the same hash table slots and allocator offsets.
+struct CallTraceShard {
+    LinearAllocator* allocator;
+    LongHashTable* table;
+    size_t used_memory;
+    // To avoid false sharing
+    char _padding[40];
+};
+
 class CallTraceStorage {
   private:
     static CallTrace _overflow_trace;
-
-    LinearAllocator _allocator;
-    LongHashTable* _current_table;
-    size_t _used_memory;
+    static u64 (*_calc_hash)(int num_frames, ASGCT_CallFrame* frames);
+
+    CallTraceShard _shards[MAX_TRACE_SHARDS];
+    u32 _shard_bits;
+    u32 _shard_mask;
+    u32 _initial_capacity;
+    TraceNodeTable* _node_table;
+    size_t _node_memory;
     size_t _mem_limit;
+    int _options;
     u64 _overflow;
+    u64 _trace_count;
+    u64 _trace_bytes;
+    bool _verify;
+    u64 _collisions;
+
+    // Eviction state. The storage is rebuilt from scratch on each eviction
+    bool _evict;
+    u32 _gen_bits;
+    u32 _generation;
+    volatile u32 _epoch;
+    u64 _evictions;
+    u64 _evicted_traces;
+    u64 _survivors;
+
+    void initShards(u32 shard_bits);
+    void destroyShards(CallTraceShard* shards, u32 count);
+    u32 capacity(CallTraceShard& shard);
+
+    // Trace IDs of all shards are interleaved, so that a single shard gives the same IDs as before.
+    // With eviction or swapping, the lowest bits hold the storage generation to recognize stale IDs.
+    u32 encodeId(u32 shard_index, u32 local_id) {
+        u32 gen_mask = (1 << _gen_bits) - 1;
+        return (((local_id - 1) << _shard_bits | shard_index) << _gen_bits | (_generation & gen_mask)) + 1;
+    }
 
-    u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
-    CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames);
-    CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+    CallTrace* storeCallTrace(CallTraceShard& shard, int num_frames, ASGCT_CallFrame* frames);
+    CallTrace* storeTreePath(CallTraceShard& shard, int num_frames, ASGCT_CallFrame* frames);
+    CallTrace* findCallTrace(LongHashTable* table, u64 hash, int num_frames, ASGCT_CallFrame* frames);
+    CallTraceSample* findOrInsert(u32 shard_index, u64 hash, int num_frames, ASGCT_CallFrame* frames,
+                                  u32& call_trace_id, LongHashTable*& owner);
+    void markDirty(LongHashTable* table, CallTraceSample* s);
+    u32 currentShard();
+    TraceNode* internNode(CallTraceShard& shard, TraceNode* parent, const ASGCT_CallFrame& frame);
+    TraceNode* allocateNode(CallTraceShard& shard, TraceNode* parent, const ASGCT_CallFrame& frame);
+    void destroyNodeTables(TraceNodeTable* table);
 
   public:
     CallTraceStorage();
     ~CallTraceStorage();
 
-    void clear(size_t mem_limit);
+    void clear(size_t mem_limit, int shards = 1, int options = 0);
     u32 capacity();
     size_t usedMemory();
     u64 overflow() { return _overflow; }
+    int shards() { return _shard_mask + 1; }
+    u64 traceCount() { return _trace_count; }
+
+    u64 bytesPerTrace() {
+        return _trace_count == 0 ? 0 : _trace_bytes / _trace_count;
+    }
+
+    bool evictionEnabled() { return _evict; }
+    bool swapEnabled() { return (_options & STORAGE_SWAP) != 0; }
+    u64 evictions() { return _evictions; }
+    u64 evictedTraces() { return _evicted_traces; }
+
+    // Called once per timer tick: ages stack traces and tells if memory is running out
+    bool needsEviction();
+    // Drops cold stack traces and compacts the storage. Requires that no put() or add() runs
+    // concurrently, i.e. all sample slots are locked; the previous generation is freed right away.
+    void evict();
+
+    // Clears the standby storage to take over from this one; must not be called on the storage in use
+    void prepareSuccessor(CallTraceStorage& next);
+
+    u64 collisions() { return _collisions; }
+
+    static u64 murmurHash(int num_frames, ASGCT_CallFrame* frames);
+    static u64 crc32cHash(int num_frames, ASGCT_CallFrame* frames);
+    static bool hasCrc32c();
+    static const char* hashName() { return _calc_hash == murmurHash ? "murmur" : "crc32c"; }
+    static u64 hash(int num_frames, ASGCT_CallFrame* frames) { return _calc_hash(num_frames, frames); }
 
     void collectTraces(std::map<u32, CallTrace*>& map);
     void collectSamples(std::vector<CallTraceSample*>& samples);
-    void collectSamples(std::map<u64, CallTraceSample>& map);
+    void collectSamples(std::multimap<u64, CallTraceSample>& map);
 
     u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter);
+    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u64 hash);
+    // Starts loading the hash table slot that put() with the given hash will probe first
+    void prefetch(u64 hash);
     void add(u32 call_trace_id, u64 samples, u64 counter);
     void resetCounters();
 };
@@ -29,6 +29,102 @@ size_t NativeFunc::usedMemory(const char* name) {
 }
 
 
+NameArena::NameArena() : _chunk(-1), _offset(0), _used_memory(0), _intern(NULL), _intern_capacity(0), _intern_count(0) {
+    memset(_chunks, 0, sizeof(_chunks));
+}
+
+NameArena::~NameArena() {
+    for (int i = 0; i < MAX_NAME_CHUNKS; i++) {
+        free(_chunks[i]);
+    }
+    free(_intern);
+}
+
+static u32 nameHash(const char* name) {
+    u32 h = 2166136261U;
+    for (; *name != 0; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619U;
+    }
+    return h;
+}
+
+// Returns the reference of an equal name stored before, or stores the new one
+u32 NameArena::intern(u32 ref) {
+    if (_intern_count * 2 >= _intern_capacity) {
+        u32 capacity = _intern_capacity == 0 ? 1024 : _intern_capacity * 2;
+        u32* table = (u32*)calloc(capacity, sizeof(u32));
+        if (table == NULL) {
+            return ref;
+        }
+        for (u32 i = 0; i < _intern_capacity; i++) {
+            if (_intern[i] != 0) {
+                u32 slot = nameHash(get(_intern[i])) & (capacity - 1);
+                while (table[slot] != 0) slot = (slot + 1) & (capacity - 1);
+                table[slot] = _intern[i];
+            }
+        }
+        free(_intern);
+        _intern = table;
+        _intern_capacity = capacity;
+    }
+
+    const char* name = get(ref);
+    u32 slot = nameHash(name) & (_intern_capacity - 1);
+    for (; _intern[slot] != 0; slot = (slot + 1) & (_intern_capacity - 1)) {
+        if (strcmp(get(_intern[slot]), name) == 0) {
+            return _intern[slot];
+        }
+    }
+    _intern[slot] = ref;
+    _intern_count++;
+    return ref;
+}
+
+u32 NameArena::add(const char* name, short lib_index) {
+    size_t len = strnlen(name, chunkSize(MAX_NAME_CHUNKS - 1) - sizeof(NativeFunc) - 2);
+    // Keep NativeFunc headers aligned
+    u32 size = (sizeof(NativeFunc) + len + 2) & ~1U;
+
+    if (_chunk < 0 || _offset + size > chunkSize(_chunk)) {
+        int chunk = _chunk + 1;
+        while (chunkSize(chunk) < size) chunk++;
+        if (chunk >= MAX_NAME_CHUNKS) {
+            // Gigabytes of distinct names: refer to the first one
+            return sizeof(NativeFunc);
+        }
+        _chunks[chunk] = (char*)malloc(chunkSize(chunk));
+        _used_memory += chunkSize(chunk);
+        _chunk = chunk;
+        _offset = 0;
+    }
+
+    NativeFunc* f = (NativeFunc*)(_chunks[_chunk] + _offset);
+    f->_lib_index = lib_index;
+    f->_mark = 0;
+    memcpy(f->_name, name, len);
+    f->_name[len] = 0;
+
+    // Replace non-printable characters
+    for (char* s = f->_name; *s != 0; s++) {
+        if (*s < ' ') *s = '?';
+    }
+
+    u32 ref = (u32)_chunk << NAME_OFFSET_BITS | (_offset + sizeof(NativeFunc));
+    u32 interned = intern(ref);
+    if (interned == ref) {
+        _offset += size;
+    }
+    return interned;
+}
+
+void NameArena::finish() {
+    free(_intern);
+    _intern = NULL;
+    _intern_capacity = 0;
+    _intern_count = 0;
+}
+
+
 CodeCache::CodeCache(const char* name, short lib_index,
                      const void* min_address, const void* max_address,
                      const char* image_base) {
@@ -46,50 +142,65 @@ CodeCache::CodeCache(const char* name, short lib_index,
     memset(_imports, 0, sizeof(_imports));
     _imports_patchable = false;
     _debug_symbols = false;
+    _parse_state = PARSE_DONE;
 
+    _compact_dwarf_table = NULL;
     _dwarf_table = NULL;
     _dwarf_table_length = 0;
 
     _capacity = INITIAL_CODE_CACHE_CAPACITY;
     _count = 0;
     _blobs = new CodeBlob[_capacity];
+
+    _search_tree = NULL;
+    _search_index = NULL;
+
+    _marks = NULL;
 }
 
 CodeCache::~CodeCache() {
-    for (int i = 0; i < _count; i++) {
-        NativeFunc::destroy(_blobs[i]._name);
-    }
     NativeFunc::destroy(_name);
     delete[] _blobs;
+    freeSearchTree();
+
+    while (_marks != NULL) {
+        MarkTable* prev = _marks->prev;
+        free(_marks);
+        _marks = prev;
+    }
+    delete _compact_dwarf_table;
     free(_dwarf_table);
 }
 
-void CodeCache::expand() {
+void CodeCache::expand(int capacity) {
     CodeBlob* old_blobs = _blobs;
-    CodeBlob* new_blobs = new CodeBlob[_capacity * 2];
+    CodeBlob* new_blobs = new CodeBlob[capacity];
 
     memcpy(new_blobs, old_blobs, _count * sizeof(CodeBlob));
 
-    _capacity *= 2;
+    _capacity = capacity;
     _blobs = new_blobs;
     delete[] old_blobs;
 }
 
-void CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
-    char* name_copy = NativeFunc::create(name, _lib_index);
-    // Replace non-printable characters
-    for (char* s = name_copy; *s != 0; s++) {
-        if (*s < ' ') *s = '?';
+void CodeCache::reserve(int count) {
+    if (_count + count > _capacity) {
+        expand(_count + count);
     }
+}
 
+void CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
     if (_count >= _capacity) {
-        expand();
+        expand(_capacity * 2);
     }
 
+    // The new blob is not in the tree; binarySearch works without it until the next sort
+    freeSearchTree();
+
     const void* end = (const char*)start + length;
     _blobs[_count]._start = start;
-    _blobs[_count]._end = end;
-    _blobs[_count]._name = name_copy;
+    _blobs[_count]._size = length;
+    _blobs[_count]._name = _names.add(name, _lib_index);
     _count++;
 
     if (update_bounds) {
@@ -108,13 +219,59 @@ void CodeCache::sort() {
     qsort(_blobs, _count, sizeof(CodeBlob), CodeBlob::comparator);
 
     if (_min_address == NO_MIN_ADDRESS) _min_address = _blobs[0]._start;
-    if (_max_address == NO_MAX_ADDRESS) _max_address = _blobs[_count - 1]._end;
+    if (_max_address == NO_MAX_ADDRESS) _max_address = _blobs[_count - 1].end();
+
+    // The library is complete: release the spare capacity and the interning table
+    if (_capacity > _count) {
+        expand(_count);
+    }
+    _names.finish();
+
+    buildSearchTree();
+}
+
+// In-order traversal of the implicit tree assigns sorted blobs to nodes
+static int fillSearchTree(const CodeBlob* blobs, const void** tree, int* index, int node, int count, int next) {
+    if (node <= count) {
+        next = fillSearchTree(blobs, tree, index, node * 2, count, next);
+        tree[node] = blobs[next]._start;
+        index[node] = next++;
+        next = fillSearchTree(blobs, tree, index, node * 2 + 1, count, next);
+    }
+    return next;
+}
+
+void CodeCache::buildSearchTree() {
+    freeSearchTree();
+    if (_count < MIN_SEARCH_TREE_SIZE) {
+        return;
+    }
+
+    // Cache line aligned, so that the 8 nodes three levels below any node share one line
+    void* tree;
+    if (posix_memalign(&tree, 64, (_count + 1) * sizeof(void*)) != 0) {
+        return;
+    }
+    _search_tree = (const void**)tree;
+    _search_index = (int*)malloc((_count + 1) * sizeof(int));
+    if (_search_index == NULL) {
+        freeSearchTree();
+        return;
+    }
+
+    fillSearchTree(_blobs, _search_tree, _search_index, 1, _count, 0);
+}
+
+void CodeCache::freeSearchTree() {
+    free(_search_tree);
+    free(_search_index);
+    _search_tree = NULL;
+    _search_index = NULL;
 }
 
 CodeBlob* CodeCache::findBlob(const char* name) {
     for (int i = 0; i < _count; i++) {
-        const char* blob_name = _blobs[i]._name;
-        if (blob_name != NULL && strcmp(blob_name, name) == 0) {
+        if (strcmp(_names.get(_blobs[i]._name), name) == 0) {
             return &_blobs[i];
         }
     }
@@ -123,7 +280,7 @@ CodeBlob* CodeCache::findBlob(const char* name) {
 
 CodeBlob* CodeCache::findBlobByAddress(const void* address) {
     for (int i = 0; i < _count; i++) {
-        if (address >= _blobs[i]._start && address < _blobs[i]._end) {
+        if (_blobs[i].contains(address)) {
             return &_blobs[i];
         }
     }
@@ -131,28 +288,73 @@ CodeBlob* CodeCache::findBlobByAddress(const void* address) {
 }
 
 const char* CodeCache::binarySearch(const void* address) {
+    if (_search_tree != NULL) {
+        // Branchless descent: every step goes right past starts at or below the address
+        const void** tree = _search_tree;
+        unsigned int count = _count;
+        unsigned int node = 1;
+        while (node <= count) {
+            __builtin_prefetch(tree + node * 8);
+            node = node * 2 + (tree[node] <= address);
+        }
+
+        // Undo the trailing right turns to get the first start above the address; 0 if there is none
+        node >>= __builtin_ffs(~node);
+        int last = node != 0 ? _search_index[node] - 1 : _count - 1;
+        if (last >= 0 && _blobs[last].contains(address)) {
+            return _names.get(_blobs[last]._name);
+        }
+        // Gaps, zero-sized and nested symbols are resolved by the regular search below
+    }
+
     int low = 0;
     int high = _count - 1;
 
     while (low <= high) {
         int mid = (unsigned int)(low + high) >> 1;
-        if (_blobs[mid]._end <= address) {
+        if (_blobs[mid].end() <= address) {
             low = mid + 1;
         } else if (_blobs[mid]._start > address) {
             high = mid - 1;
         } else {
-            return _blobs[mid]._name;
+            return _names.get(_blobs[mid]._name);
         }
     }
 
     // Symbols with zero size can be valid functions: e.g. ASM entry points or kernel code.
     // Also, in some cases (endless loop) the return address may point beyond the function.
-    if (low > 0 && (_blobs[low - 1]._start == _blobs[low - 1]._end || _blobs[low - 1]._end == address)) {
-        return _blobs[low - 1]._name;
+    if (low > 0 && (_blobs[low - 1]._size == 0 || _blobs[low - 1].end() == address)) {
+        return _names.get(_blobs[low - 1]._name);
     }
     return _name;
 }
 
+void CodeCache::binarySearch(const void** addresses, int count, const char** names) {
+    int next = 0;
+    for (int i = 0; i < count; i++) {
+        const void* address = addresses[i];
+
+        // Gallop to the first blob that starts above the address
+        int step = 1;
+        while (next + step <= _count && _blobs[next + step - 1]._start <= address) {
+            next += step;
+            step *= 2;
+        }
+        while (step > 1) {
+            step /= 2;
+            if (next + step <= _count && _blobs[next + step - 1]._start <= address) {
+                next += step;
+            }
+        }
+
+        if (next > 0 && _blobs[next - 1].contains(address)) {
+            names[i] = _names.get(_blobs[next - 1]._name);
+        } else {
+            names[i] = binarySearch(address);
+        }
+    }
+}
+
 const void* CodeCache::findSymbol(const char* name) {
     CodeBlob* blob = findBlob(name);
     return blob == NULL ? NULL : blob->_start;
@@ -165,8 +367,8 @@ const void* CodeCache::findSymbolByPrefix(const char* prefix) {
 const void* CodeCache::findSymbolByPrefix(const char* prefix, int prefix_len) {
     const void* result = NULL;
     for (int i = 0; i < _count; i++) {
-        const char* blob_name = _blobs[i]._name;
-        if (blob_name != NULL && strncmp(blob_name, prefix, prefix_len) == 0) {
+        const char* blob_name = _names.get(_blobs[i]._name);
+        if (strncmp(blob_name, prefix, prefix_len) == 0) {
             result = _blobs[i]._start;
             // Symbols which contain a dot are only patched if no alternative is found,
             // see #1247
@@ -187,6 +389,54 @@ void CodeCache::saveImport(ImportId id, void** entry) {
     }
 }
 
+void CodeCache::updateMarks() {
+    int count = 0;
+    for (int i = 0; i < _count; i++) {
+        if (_blobs[i]._size > 0 && NativeFunc::mark(_names.get(_blobs[i]._name)) != 0) {
+            count++;
+        }
+    }
+
+    MarkTable* table = (MarkTable*)malloc(sizeof(MarkTable) + count * sizeof(table->ranges[0]));
+    if (table == NULL) {
+        return;
+    }
+    table->prev = _marks;
+    table->count = 0;
+
+    // Blobs are sorted, hence the ranges are too
+    for (int i = 0; i < _count; i++) {
+        if (_blobs[i]._size > 0 && NativeFunc::mark(_names.get(_blobs[i]._name)) != 0) {
+            table->ranges[table->count].start = _blobs[i]._start;
+            table->ranges[table->count].end = _blobs[i].end();
+            table->ranges[table->count].mark = NativeFunc::mark(_names.get(_blobs[i]._name));
+            table->count++;
+        }
+    }
+    storeRelease(_marks, table);
+}
+
+char CodeCache::findMark(const void* address) {
+    MarkTable* table = loadAcquire(_marks);
+    if (table == NULL) {
+        return 0;
+    }
+
+    int low = 0;
+    int high = table->count - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (table->ranges[mid].end <= address) {
+            low = mid + 1;
+        } else if (table->ranges[mid].start > address) {
+            high = mid - 1;
+        } else {
+            return table->ranges[mid].mark;
+        }
+    }
+    return 0;
+}
+
 void CodeCache::addImport(void** entry, const char* name) {
     switch (name[0]) {
         case 'a':
@@ -289,6 +539,10 @@ bool CodeCache::makeImportsPatchable() {
 void CodeCache::setDwarfTable(FrameDesc* table, int length) {
     // CodeCache captures ownership of the table and becomes responsible for its cleanup
     if (length > 0) {
+        _compact_dwarf_table = CompactDwarfTable::create(table, length);
+    }
+
+    if (length > 0 && _compact_dwarf_table == NULL) {
         _dwarf_table = table;
         _dwarf_table_length = length;
     } else {
@@ -298,6 +552,18 @@ void CodeCache::setDwarfTable(FrameDesc* table, int length) {
 
 FrameDesc* CodeCache::findFrameDesc(const void* pc) {
     u32 target_loc = (const char*)pc - _text_base;
+
+    if (_compact_dwarf_table != NULL) {
+        FrameDesc* f = _compact_dwarf_table->find(target_loc);
+        if (f != NULL) {
+            return f;
+        } else if (target_loc - _plt_offset < _plt_size) {
+            return &FrameDesc::empty_frame;
+        } else {
+            return &FrameDesc::default_frame;
+        }
+    }
+
     int low = 0;
     int high = _dwarf_table_length - 1;
 
@@ -323,10 +589,90 @@ FrameDesc* CodeCache::findFrameDesc(const void* pc) {
 
 size_t CodeCache::usedMemory() {
     size_t bytes = _capacity * sizeof(CodeBlob);
+    if (_search_tree != NULL) {
+        bytes += (_count + 1) * (sizeof(void*) + sizeof(int));
+    }
     bytes += _dwarf_table_length * sizeof(FrameDesc);
-    bytes += NativeFunc::usedMemory(_name);
-    for (int i = 0; i < _count; i++) {
-        bytes += NativeFunc::usedMemory(_blobs[i]._name);
+    if (_compact_dwarf_table != NULL) {
+        bytes += _compact_dwarf_table->usedMemory();
     }
+    bytes += NativeFunc::usedMemory(_name);
+    bytes += _names.usedMemory();
     return bytes + sizeof(CodeCache);
 }
+
+void CodeCacheArray::updateIndex() {
+    LibraryIndex* index = _index == &_indices[0] ? &_indices[1] : &_indices[0];
+    atomicInc(index->version);
+
+    int lib_count = count();
+    int length = 0;
+    for (int i = 0; i < lib_count; i++) {
+        CodeCache* lib = _libs[i];
+        if (lib->minAddress() < lib->maxAddress()) {
+            LibraryRange* range = &index->ranges[length++];
+            range->start = lib->minAddress();
+            range->end = lib->maxAddress();
+            range->lib = lib;
+        }
+    }
+    qsort(index->ranges, length, sizeof(LibraryRange), LibraryRange::comparator);
+
+    bool usable = true;
+    for (int i = 1; i < length; i++) {
+        if (index->ranges[i].start < index->ranges[i - 1].end) {
+            usable = false;
+            break;
+        }
+    }
+
+    index->lib_count = lib_count;
+    index->length = length;
+    index->usable = usable;
+    atomicInc(index->version);
+    storeRelease(_index, index);
+}
+
+CodeCache* CodeCacheArray::findByAddress(const void* address) {
+    int scanned = 0;
+
+    LibraryIndex* index = loadAcquire(_index);
+    if (index != NULL) {
+        u32 version = loadAcquire(index->version);
+        if ((version & 1) == 0 && index->usable) {
+            int lib_count = index->lib_count;
+            int length = index->length;
+            if (length > MAX_NATIVE_LIBS) length = MAX_NATIVE_LIBS;
+
+            // Find the last range starting at or below the address
+            int low = 0;
+            int high = length - 1;
+            while (low <= high) {
+                int mid = (unsigned int)(low + high) >> 1;
+                if (index->ranges[mid].start <= address) {
+                    low = mid + 1;
+                } else {
+                    high = mid - 1;
+                }
+            }
+            CodeCache* lib = low > 0 && address < index->ranges[low - 1].end ? index->ranges[low - 1].lib : NULL;
+
+            rmb();
+            if (index->version == version) {
+                if (lib != NULL) {
+                    return lib;
+                }
+                scanned = lib_count;
+            }
+        }
+    }
+
+    // Libraries added after the index was built, or all of them if the index cannot be used
+    const int lib_count = count();
+    for (int i = scanned; i < lib_count; i++) {
+        if (_libs[i]->contains(address)) {
+            return _libs[i];
+        }
+    }
+    return NULL;
+}
@@ -8,12 +8,17 @@
 
 #include <jvmti.h>
 #include "arch.h"
+#include "demangleCache.h"
 
 
 #define NO_MIN_ADDRESS  ((const void*)-1)
 #define NO_MAX_ADDRESS  ((const void*)0)
 
 const int INITIAL_CODE_CACHE_CAPACITY = 1000;
+const int MIN_SEARCH_TREE_SIZE = 64;
+const int MIN_NAME_CHUNK_SIZE = 256;
+const int NAME_OFFSET_BITS = 27;
+const int MAX_NAME_CHUNKS = 32;
 const int MAX_NATIVE_LIBS = 2048;
 
 
@@ -48,6 +53,13 @@ enum Mark {
     MARK_ASYNC_PROFILER = 4, // async-profiler internals such as native hooks.
 };
 
+// Symbols and unwinding tables of a library may be parsed on first use
+enum ParseState {
+    PARSE_DONE,
+    PARSE_PENDING,    // only the address range and imports are known
+    PARSE_REQUESTED   // a PC in the library has been seen, parsing is due
+};
+
 
 class NativeFunc {
   private:
@@ -64,6 +76,8 @@ class NativeFunc {
     static char* create(const char* name, short lib_index);
     static void destroy(char* name);
 
+    friend class NameArena;
+
     static size_t usedMemory(const char* name);
 
     static short libIndex(const char* name) {
@@ -80,11 +94,59 @@ class NativeFunc {
 };
 
 
+// NativeFunc names of one library. Chunks grow geometrically and never move, so that names
+// can be handed out as plain pointers, and the chunk table has a fixed size. A name is referred
+// to by 32 bits: the chunk number and the offset in the chunk. Identical names are stored once.
+class NameArena {
+  private:
+    char* _chunks[MAX_NAME_CHUNKS];
+    int _chunk;
+    u32 _offset;
+    size_t _used_memory;
+
+    // Open addressing hash set of references to all names, while the library is being built
+    u32* _intern;
+    u32 _intern_capacity;
+    u32 _intern_count;
+
+    static u32 chunkSize(int chunk) {
+        return chunk < NAME_OFFSET_BITS - 8 ? MIN_NAME_CHUNK_SIZE << chunk : 1 << NAME_OFFSET_BITS;
+    }
+
+    u32 intern(u32 ref);
+
+  public:
+    NameArena();
+    ~NameArena();
+
+    u32 add(const char* name, short lib_index);
+
+    char* get(u32 ref) const {
+        return _chunks[ref >> NAME_OFFSET_BITS] + (ref & ((1 << NAME_OFFSET_BITS) - 1));
+    }
+
+    // Drops the interning table when no more names are expected
+    void finish();
+
+    size_t usedMemory() const {
+        return _used_memory + _intern_capacity * sizeof(u32);
+    }
+};
+
+
 class CodeBlob {
   public:
     const void* _start;
-    const void* _end;
-    char* _name;
+    u32 _size;
+    u32 _name;  // in the NameArena of the CodeCache
+
+    const void* end() const {
+        return (const char*)_start + _size;
+    }
+
+    bool contains(const void* address) const {
+        return (uintptr_t)address - (uintptr_t)_start < _size;
+    }
 
     static int comparator(const void* c1, const void* c2) {
         CodeBlob* cb1 = (CodeBlob*)c1;
@@ -93,15 +155,28 @@ class CodeBlob {
             return -1;
         } else if (cb1->_start > cb2->_start) {
             return 1;
-        } else if (cb1->_end == cb2->_end) {
+        } else if (cb1->_size == cb2->_size) {
             return 0;
         } else {
-            return cb1->_end > cb2->_end ? -1 : 1;
+            return cb1->_size > cb2->_size ? -1 : 1;
         }
     }
 };
 
 
+// Address ranges of marked symbols sorted by start address. A table is replaced
+// as a whole when more symbols get marked; old tables are kept for signal handlers.
+struct MarkTable {
+    MarkTable* prev;
+    int count;
+    struct {
+        const void* start;
+        const void* end;
+        char mark;
+    } ranges[0];
+};
+
+class CompactDwarfTable;
 class FrameDesc;
 
 class CodeCache {
@@ -119,15 +194,30 @@ class CodeCache {
     void** _imports[NUM_IMPORTS][NUM_IMPORT_TYPES];
     bool _imports_patchable;
     bool _debug_symbols;
+    volatile int _parse_state;
 
+    // Unwinding rules are kept in the compact form unless they do not fit
+    CompactDwarfTable* _compact_dwarf_table;
     FrameDesc* _dwarf_table;
     int _dwarf_table_length;
 
     int _capacity;
     int _count;
     CodeBlob* _blobs;
+    NameArena _names;
 
-    void expand();
+    // Start addresses of sorted blobs in the Eytzinger (BFS) order, 1-based, and their blob indices.
+    // Top levels of the tree share a few cache lines, and the next levels are prefetched during descent.
+    const void** _search_tree;
+    int* _search_index;
+
+    MarkTable* _marks;
+    DemangleCache _demangle_cache;
+
+    void expand(int capacity);
+    void buildSearchTree();
+    void freeSearchTree();
+    void updateMarks();
     bool makeImportsPatchable();
     void saveImport(ImportId id, void** entry);
 
@@ -144,6 +234,15 @@ class CodeCache {
         return _name;
     }
 
+    short libIndex() const {
+        return _lib_index;
+    }
+
+    // Demangled names of this library's symbols, kept for later dumps
+    DemangleCache* demangleCache() {
+        return &_demangle_cache;
+    }
+
     const void* minAddress() const {
         return _min_address;
     }
@@ -177,10 +276,29 @@ class CodeCache {
         _debug_symbols = debug_symbols;
     }
 
+    ParseState parseState() {
+        return (ParseState)loadAcquire(_parse_state);
+    }
+
+    void setParseState(ParseState state) {
+        storeRelease(_parse_state, state);
+    }
+
+    // Signal safe. Returns true only for the caller that made the request
+    bool markRequested() {
+        return __sync_bool_compare_and_swap(&_parse_state, PARSE_PENDING, PARSE_REQUESTED);
+    }
+
     bool hasDwarfTable() const {
-        return _dwarf_table != NULL;
+        return _compact_dwarf_table != NULL || _dwarf_table != NULL;
+    }
+
+    const char* blobName(const CodeBlob* blob) const {
+        return _names.get(blob->_name);
     }
 
+    // Makes room for the given number of blobs to be added
+    void reserve(int count);
     void add(const void* start, int length, const char* name, bool update_bounds = false);
     void updateBounds(const void* start, const void* end);
     void sort();
@@ -188,8 +306,8 @@ class CodeCache {
     template <typename NamePredicate>
     inline void mark(NamePredicate predicate, char value) {
         for (int i = 0; i < _count; i++) {
-            const char* blob_name = _blobs[i]._name;
-            if (blob_name != NULL && predicate(blob_name)) {
+            const char* blob_name = _names.get(_blobs[i]._name);
+            if (predicate(blob_name)) {
                 NativeFunc::mark(blob_name, value);
             }
         }
@@ -198,8 +316,13 @@ class CodeCache {
             // In case a library has no debug symbols
             NativeFunc::mark(_name, value);
         }
+
+        updateMarks();
     }
 
+    // Signal safe. Mark of the symbol containing the address; the mark of the library itself is not considered
+    char findMark(const void* address);
+
     void addImport(void** entry, const char* name);
     void** findImport(ImportId id);
     void patchImport(ImportId id, void* hook_func);
@@ -207,6 +330,8 @@ class CodeCache {
     CodeBlob* findBlob(const char* name);
     CodeBlob* findBlobByAddress(const void* address);
     const char* binarySearch(const void* address);
+    // Same as binarySearch for each of the sorted addresses, but in one pass merging them with symbols
+    void binarySearch(const void** addresses, int count, const char** names);
     const void* findSymbol(const char* name);
     const void* findSymbolByPrefix(const char* prefix);
     const void* findSymbolByPrefix(const char* prefix, int prefix_len);
@@ -216,18 +341,44 @@ class CodeCache {
 
     size_t usedMemory();
 
+    friend class SymbolCache;
     friend class UnloadProtection;
 };
 
 
+struct LibraryRange {
+    const void* start;
+    const void* end;
+    CodeCache* lib;
+
+    static int comparator(const void* p1, const void* p2) {
+        const void* s1 = ((LibraryRange*)p1)->start;
+        const void* s2 = ((LibraryRange*)p2)->start;
+        return s1 < s2 ? -1 : s1 > s2 ? 1 : 0;
+    }
+};
+
+// Address ranges of the first lib_count libraries sorted by start address
+struct LibraryIndex {
+    volatile u32 version;  // odd while the index is being rebuilt
+    int lib_count;
+    int length;
+    bool usable;           // false if ranges overlap, and the order of libraries matters
+    LibraryRange ranges[MAX_NATIVE_LIBS];
+};
+
 class CodeCacheArray {
   private:
     CodeCache* _libs[MAX_NATIVE_LIBS];
     int _count;
     size_t _used_memory;
 
+    // Two indices take turns: lookups use the published one while the other is rebuilt
+    LibraryIndex _indices[2];
+    LibraryIndex* _index;
+
   public:
-    CodeCacheArray() : _count(0) {
+    CodeCacheArray() : _count(0), _index(NULL) {
     }
 
     CodeCache* operator[](int index) {
@@ -248,6 +399,20 @@ class CodeCacheArray {
         _used_memory += lib->usedMemory();
         storeRelease(_count, index + 1);
     }
+
+    // Puts a parsed library in place of its pending placeholder. The placeholder is never freed,
+    // since a signal handler may still be using it. Call updateIndex() afterwards.
+    void replace(int index, CodeCache* lib) {
+        _used_memory += lib->usedMemory();
+        storeRelease(_libs[index], lib);
+    }
+
+    // Publishes the index of all libraries added so far. Not thread safe: called under the parse lock
+    void updateIndex();
+
+    // Same as a linear scan for the first library containing the address, but in O(log n).
+    // Safe to call from a signal handler concurrently with add() and updateIndex().
+    CodeCache* findByAddress(const void* address);
 };
 
 #endif // _CODECACHE_H
@@ -26,6 +26,8 @@ class CTimer : public CpuEngine {
     Error start(Arguments& args);
     void stop();
 
+    bool setInterval(long interval);
+
     static bool supported() {
         return true;
     }
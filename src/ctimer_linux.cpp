@@ -28,6 +28,14 @@ static inline clockid_t thread_cpu_clock(unsigned int tid) {
 int CTimer::_max_timers = 0;
 int* CTimer::_timers = NULL;
 
+static void setTimer(int timer, long interval) {
+    struct itimerspec ts;
+    ts.it_interval.tv_sec = (time_t)(interval / 1000000000);
+    ts.it_interval.tv_nsec = interval % 1000000000;
+    ts.it_value = ts.it_interval;
+    syscall(__NR_timer_settime, timer, 0, &ts, NULL);
+}
+
 int CTimer::createForThread(int tid) {
     if (tid >= _max_timers) {
         Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_timers);
@@ -54,11 +62,7 @@ int CTimer::createForThread(int tid) {
         return -1;
     }
 
-    struct itimerspec ts;
-    ts.it_interval.tv_sec = (time_t)(_interval / 1000000000);
-    ts.it_interval.tv_nsec = _interval % 1000000000;
-    ts.it_value = ts.it_interval;
-    syscall(__NR_timer_settime, timer, 0, &ts, NULL);
+    setTimer(timer, _interval);
     return 0;
 }
 
@@ -111,6 +115,18 @@ Error CTimer::start(Arguments& args) {
     return Error::OK;
 }
 
+bool CTimer::setInterval(long interval) {
+    // New threads pick up the interval from the pthread hook
+    _interval = interval;
+    for (int i = 0; i < _max_timers; i++) {
+        int timer = _timers[i];
+        if (timer != 0) {
+            setTimer(timer - 1, interval);
+        }
+    }
+    return true;
+}
+
 void CTimer::stop() {
     disableThreadEvents();
     for (int i = 0; i < _max_timers; i++) {
@@ -0,0 +1,114 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "demangleCache.h"
+#include "demangle.h"
+
+
+static const u32 INITIAL_DEMANGLE_CACHE_CAPACITY = 256;
+
+// Remembers names that cannot be demangled, so that they are not tried again
+static char NOT_DEMANGLED[] = "";
+
+static u32 hashName(const char* name) {
+    u64 h = (uintptr_t)name * 0x9e3779b97f4a7c15ULL;
+    return (u32)(h >> 32);
+}
+
+DemangleCache::Entry* DemangleCache::find(const char* name) {
+    u32 mask = _capacity - 1;
+    for (u32 i = hashName(name) & mask; ; i = (i + 1) & mask) {
+        if (_table[i].name == name || _table[i].name == NULL) {
+            return &_table[i];
+        }
+    }
+}
+
+void DemangleCache::grow() {
+    Entry* old_table = _table;
+    u32 old_capacity = _capacity;
+
+    _capacity = old_capacity == 0 ? INITIAL_DEMANGLE_CACHE_CAPACITY : old_capacity * 2;
+    _table = (Entry*)calloc(_capacity, sizeof(Entry));
+    _used_memory += (_capacity - old_capacity) * sizeof(Entry);
+
+    for (u32 i = 0; i < old_capacity; i++) {
+        if (old_table[i].name != NULL) {
+            *find(old_table[i].name) = old_table[i];
+        }
+    }
+    free(old_table);
+}
+
+void DemangleCache::clear() {
+    for (u32 i = 0; i < _capacity; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (_table[i].demangled[j] != NOT_DEMANGLED) {
+                free(_table[i].demangled[j]);
+            }
+        }
+    }
+    free(_table);
+    _table = NULL;
+    _capacity = 0;
+    _size = 0;
+    _used_memory = 0;
+}
+
+bool DemangleCache::demangle(const char* name, bool full_signature, std::string& result) {
+    MutexLocker ml(_lock);
+
+    Entry* e = _table != NULL ? find(name) : NULL;
+    char* demangled = e != NULL && e->name != NULL ? e->demangled[full_signature] : NULL;
+
+    if (demangled != NULL) {
+        _hits++;
+    } else {
+        _misses++;
+        if (_used_memory >= MAX_DEMANGLE_CACHE_MEMORY) {
+            clear();
+        }
+        if (_size >= _capacity * 3 / 4) {
+            grow();
+        }
+
+        e = find(name);
+        if (e->name == NULL) {
+            e->name = name;
+            _size++;
+        }
+
+        demangled = Demangle::demangle(name, full_signature);
+        if (demangled != NULL) {
+            _used_memory += strlen(demangled) + 1;
+        } else {
+            demangled = NOT_DEMANGLED;
+        }
+        e->demangled[full_signature] = demangled;
+    }
+
+    if (demangled == NOT_DEMANGLED) {
+        return false;
+    }
+    result.assign(demangled);
+    return true;
+}
+
+size_t DemangleCache::usedMemory() {
+    MutexLocker ml(_lock);
+    return _used_memory;
+}
+
+u64 DemangleCache::hits() {
+    MutexLocker ml(_lock);
+    return _hits;
+}
+
+u64 DemangleCache::misses() {
+    MutexLocker ml(_lock);
+    return _misses;
+}
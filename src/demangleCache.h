@@ -0,0 +1,56 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _DEMANGLECACHE_H
+#define _DEMANGLECACHE_H
+
+#include <string>
+#include "arch.h"
+#include "mutex.h"
+
+
+// Memory limit of one library's cache; a full cache starts over
+const size_t MAX_DEMANGLE_CACHE_MEMORY = 4 * 1024 * 1024;
+
+// Demangled names of the symbols of one library. Symbol names are interned per library,
+// so a name pointer is the key. The cache lives as long as the library's CodeCache:
+// the same symbols are not demangled again on every dump or JFR chunk.
+class DemangleCache {
+  private:
+    struct Entry {
+        const char* name;
+        char* demangled[2];  // without and with the full signature; NULL if not demangled yet
+    };
+
+    Mutex _lock;
+    Entry* _table;
+    u32 _capacity;
+    u32 _size;
+    size_t _used_memory;
+    u64 _hits;
+    u64 _misses;
+
+    Entry* find(const char* name);
+    void grow();
+    void clear();
+
+  public:
+    DemangleCache() : _table(NULL), _capacity(0), _size(0), _used_memory(0), _hits(0), _misses(0) {
+    }
+
+    ~DemangleCache() {
+        clear();
+    }
+
+    // Same as Demangle::demangle, but copies the result to a string.
+    // Returns false if the name cannot be demangled.
+    bool demangle(const char* name, bool full_signature, std::string& result);
+
+    size_t usedMemory();
+    u64 hits();
+    u64 misses();
+};
+
+#endif // _DEMANGLECACHE_H
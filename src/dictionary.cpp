@@ -3,66 +3,168 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
-#include <stdlib.h>
 #include <string.h>
 #include "dictionary.h"
 #include "arch.h"
+#include "os.h"
 
 
-static inline char* allocateKey(const char* key, size_t length) {
-    char* result = (char*)malloc(length + 1);
-    memcpy(result, key, length);
-    result[length] = 0;
-    return result;
+static const unsigned int INITIAL_DICT_CAPACITY = 1024;
+static const size_t ARENA_CHUNK_SIZE = 64 * 1024;
+// Longer keys get a mapping of their own rather than wasting the rest of an arena chunk
+static const size_t MAX_ARENA_KEY = ARENA_CHUNK_SIZE / 8;
+
+struct LargeKey {
+    LargeKey* next;
+    size_t size;
+    DictKey key;
+};
+
+// A power-of-two array of key pointers. When a table is 3/4 full, a twice larger one
+// replaces it; keys are moved lazily on lookup, and keep their IDs in the new table.
+class DictTable {
+  private:
+    DictTable* _prev;
+    unsigned int _capacity;
+    volatile unsigned int _size;
+
+    static size_t getSize(unsigned int capacity) {
+        size_t size = sizeof(DictTable) + sizeof(DictKey*) * capacity;
+        return (size + OS::page_mask) & ~OS::page_mask;
+    }
+
+  public:
+    static DictTable* allocate(DictTable* prev, unsigned int capacity) {
+        DictTable* table = (DictTable*)OS::safeAlloc(getSize(capacity));
+        if (table != NULL) {
+            table->_prev = prev;
+            table->_capacity = capacity;
+            table->_size = 0;
+        }
+        return table;
+    }
+
+    DictTable* destroy() {
+        DictTable* prev = _prev;
+        OS::safeFree(this, getSize(_capacity));
+        return prev;
+    }
+
+    size_t usedMemory() {
+        return getSize(_capacity);
+    }
+
+    DictTable* prev() {
+        return _prev;
+    }
+
+    unsigned int capacity() {
+        return _capacity;
+    }
+
+    unsigned int incSize() {
+        return __sync_add_and_fetch(&_size, 1);
+    }
+
+    DictKey** keys() {
+        return (DictKey**)(this + 1);
+    }
+};
+
+
+static inline bool keyEquals(DictKey* candidate, unsigned int h, const char* key, size_t length) {
+    return candidate->hash == h && candidate->length == length && memcmp(candidate->body, key, length) == 0;
 }
 
-static inline bool keyEquals(const char* candidate, const char* key, size_t length) {
-    return strncmp(candidate, key, length) == 0 && candidate[length] == 0;
+// Keys and tables are published in a total order, so that a thread that sees a new table
+// also sees all keys that were visible in the old one before the switch
+static inline DictKey* loadKey(DictKey** slot) {
+    return __atomic_load_n(slot, __ATOMIC_SEQ_CST);
 }
 
+static DictKey* findKey(DictTable* table, unsigned int h, const char* key, size_t length) {
+    DictKey** keys = table->keys();
+    unsigned int mask = table->capacity() - 1;
 
-Dictionary::Dictionary() {
-    _table = (DictTable*)calloc(1, sizeof(DictTable));
-    _base_index = _table->base_index = 1;
+    for (unsigned int slot = h & mask, step = 0; step <= mask; slot = (slot + ++step) & mask) {
+        DictKey* k = loadKey(&keys[slot]);
+        if (k == NULL) {
+            return NULL;
+        } else if (keyEquals(k, h, key, length)) {
+            return k;
+        }
+    }
+    return NULL;
+}
+
+
+Dictionary::Dictionary() : _next_id(1), _arena(ARENA_CHUNK_SIZE), _large_keys(NULL) {
+    _table = DictTable::allocate(NULL, INITIAL_DICT_CAPACITY);
 }
 
 Dictionary::~Dictionary() {
-    clear(_table);
-    free(_table);
+    for (DictTable* table = _table; table != NULL; ) {
+        table = table->destroy();
+    }
+    freeLargeKeys();
 }
 
 void Dictionary::clear() {
-    clear(_table);
-    memset(_table, 0, sizeof(DictTable));
-    _base_index = _table->base_index = 1;
+    for (DictTable* table = _table->prev(); table != NULL; ) {
+        table = table->destroy();
+    }
+    _table->destroy();
+    _table = DictTable::allocate(NULL, INITIAL_DICT_CAPACITY);
+
+    _arena.clear();
+    freeLargeKeys();
+    _next_id = 1;
 }
 
-void Dictionary::clear(DictTable* table) {
-    for (int i = 0; i < ROWS; i++) {
-        DictRow* row = &table->rows[i];
-        for (int j = 0; j < CELLS; j++) {
-            free(row->keys[j]);
-        }
-        if (row->next != NULL) {
-            clear(row->next);
-            free(row->next);
-        }
+size_t Dictionary::usedMemory() {
+    size_t bytes = _arena.usedMemory();
+    for (DictTable* table = _table; table != NULL; table = table->prev()) {
+        bytes += table->usedMemory();
+    }
+    for (LargeKey* lk = _large_keys; lk != NULL; lk = lk->next) {
+        bytes += lk->size;
     }
+    return bytes;
 }
 
-size_t Dictionary::usedMemory() {
-    return _table != NULL ? usedMemory(_table) : 0;
+DictKey* Dictionary::allocateKey(unsigned int h, const char* key, size_t length) {
+    DictKey* result;
+    size_t size = (sizeof(DictKey) + length + 7) & ~(size_t)7;
+
+    if (size <= MAX_ARENA_KEY) {
+        result = (DictKey*)_arena.alloc(size);
+        if (result == NULL) return NULL;
+    } else {
+        size_t lk_size = (sizeof(LargeKey) + length + OS::page_mask) & ~OS::page_mask;
+        LargeKey* lk = (LargeKey*)OS::safeAlloc(lk_size);
+        if (lk == NULL) return NULL;
+        lk->size = lk_size;
+        do {
+            lk->next = _large_keys;
+        } while (!__sync_bool_compare_and_swap(&_large_keys, lk->next, lk));
+        result = &lk->key;
+    }
+
+    result->hash = h;
+    result->id = __sync_fetch_and_add(&_next_id, 1);
+    result->length = length;
+    memcpy(result->body, key, length);
+    result->body[length] = 0;
+    return result;
 }
 
-size_t Dictionary::usedMemory(DictTable* table) {
-    size_t bytes = sizeof(DictTable);
-    for (int i = 0; i < ROWS; i++) {
-        DictRow* row = &table->rows[i];
-        if (row->next != NULL) {
-            bytes += usedMemory(row->next);
-        }
+void Dictionary::freeLargeKeys() {
+    for (LargeKey* lk = _large_keys; lk != NULL; ) {
+        LargeKey* next = lk->next;
+        OS::safeFree(lk, lk->size);
+        lk = next;
     }
-    return bytes;
+    _large_keys = NULL;
 }
 
 // Many popular symbols are quite short, e.g. "[B", "()V" etc.
@@ -72,7 +174,8 @@ unsigned int Dictionary::hash(const char* key, size_t length) {
     for (size_t i = 0; i < length; i++) {
         h = (h ^ key[i]) * 16777619;
     }
-    return h;
+    // Zero is reserved for free slots
+    return h != 0 ? h : 1;
 }
 
 unsigned int Dictionary::lookup(const char* key) {
@@ -80,51 +183,88 @@ unsigned int Dictionary::lookup(const char* key) {
 }
 
 unsigned int Dictionary::lookup(const char* key, size_t length) {
-    DictTable* table = _table;
     unsigned int h = hash(key, length);
+    DictKey* new_key = NULL;
 
     while (true) {
-        DictRow* row = &table->rows[h % ROWS];
-        for (int c = 0; c < CELLS; c++) {
-            if (row->keys[c] == NULL) {
-                char* new_key = allocateKey(key, length);
-                if (__sync_bool_compare_and_swap(&row->keys[c], NULL, new_key)) {
-                    return table->index(h % ROWS, c);
+        DictTable* table = __atomic_load_n(&_table, __ATOMIC_SEQ_CST);
+        DictKey* k = lookup(table, h, key, length, new_key);
+
+        // If the table has been replaced meanwhile, a concurrent insert into the new one
+        // might have missed our key, or the old one overflowed. The new table holds the canonical ID then.
+        if (table == __atomic_load_n(&_table, __ATOMIC_SEQ_CST)) {
+            return k != NULL ? k->id : 0;
+        }
+    }
+}
+
+// A key is published with a single CAS, so every slot is either free or complete.
+// new_key carries a key allocated on a lost race over to the next attempt.
+DictKey* Dictionary::lookup(DictTable* table, unsigned int h, const char* key, size_t length, DictKey*& new_key) {
+    DictKey** keys = table->keys();
+    unsigned int capacity = table->capacity();
+    unsigned int slot = h & (capacity - 1);
+    unsigned int step = 0;
+
+    while (true) {
+        DictKey* k = loadKey(&keys[slot]);
+        if (k == NULL) {
+            // Keep the ID of a key inserted in a previous table
+            for (DictTable* prev = table->prev(); prev != NULL && k == NULL; prev = prev->prev()) {
+                k = findKey(prev, h, key, length);
+            }
+            if (k == NULL) {
+                if (new_key == NULL && (new_key = allocateKey(h, key, length)) == NULL) {
+                    return NULL;
                 }
-                free(new_key);
+                k = new_key;
             }
-            if (keyEquals(row->keys[c], key, length)) {
-                return table->index(h % ROWS, c);
+
+            if (!__sync_bool_compare_and_swap(&keys[slot], NULL, k)) {
+                continue;
+            }
+            if (k == new_key) {
+                new_key = NULL;
             }
-        }
 
-        if (row->next == NULL) {
-            DictTable* new_table = (DictTable*)calloc(1, sizeof(DictTable));
-            new_table->base_index = __sync_add_and_fetch(&_base_index, TABLE_CAPACITY);
-            if (!__sync_bool_compare_and_swap(&row->next, NULL, new_table)) {
-                free(new_table);
+            if (table->incSize() >= capacity * 3 / 4) {
+                grow(table);
             }
+            return k;
+        } else if (keyEquals(k, h, key, length)) {
+            return k;
         }
 
-        table = row->next;
-        h = (h >> ROW_BITS) | (h << (32 - ROW_BITS));
+        if (++step >= capacity) {
+            // Table overflow: other threads kept inserting while the next table was being allocated
+            grow(table);
+            return NULL;
+        }
+        slot = (slot + step) & (capacity - 1);
     }
 }
 
-void Dictionary::collect(std::map<unsigned int, const char*>& map) {
-    collect(map, _table);
+// Every thread that inserts past the load factor competes to allocate the next table,
+// so that the current one does not overflow while a single thread is preempted in mmap
+void Dictionary::grow(DictTable* table) {
+    if (__atomic_load_n(&_table, __ATOMIC_SEQ_CST) != table) {
+        return;
+    }
+    DictTable* new_table = DictTable::allocate(table, table->capacity() * 2);
+    if (new_table != NULL && !__sync_bool_compare_and_swap(&_table, table, new_table)) {
+        new_table->destroy();
+    }
 }
 
-void Dictionary::collect(std::map<unsigned int, const char*>& map, DictTable* table) {
-    for (int i = 0; i < ROWS; i++) {
-        DictRow* row = &table->rows[i];
-        for (int j = 0; j < CELLS; j++) {
-            if (row->keys[j] != NULL) {
-                map[table->index(i, j)] = row->keys[j];
+void Dictionary::collect(std::map<unsigned int, const char*>& map) {
+    for (DictTable* table = _table; table != NULL; table = table->prev()) {
+        DictKey** keys = table->keys();
+        unsigned int capacity = table->capacity();
+        for (unsigned int slot = 0; slot < capacity; slot++) {
+            DictKey* k = loadKey(&keys[slot]);
+            if (k != NULL) {
+                map[k->id] = k->body;
             }
         }
-        if (row->next != NULL) {
-            collect(map, row->next);
-        }
     }
 }
@@ -8,43 +8,37 @@
 
 #include <map>
 #include <stddef.h>
+#include "linearAllocator.h"
 
 
-#define ROW_BITS        7
-#define ROWS            (1 << ROW_BITS)
-#define CELLS           3
-#define TABLE_CAPACITY  (ROWS * CELLS)
+class DictTable;
+struct LargeKey;
 
-
-struct DictTable;
-
-struct DictRow {
-    char* keys[CELLS];
-    DictTable* next;
-};
-
-struct DictTable {
-    DictRow rows[ROWS];
-    unsigned int base_index;
-
-    unsigned int index(int row, int col) {
-        return base_index + (col << ROW_BITS) + row;
-    }
+// Key bytes live in the arena together with their hash and ID
+struct DictKey {
+    unsigned int hash;
+    unsigned int id;
+    unsigned int length;
+    char body[1];
 };
 
-// Append-only concurrent hash table based on multi-level arrays
+// Append-only concurrent hash table: a flat open-addressed index over keys
+// copied into a bump-pointer arena. Neither lookup nor insert calls malloc,
+// so a Dictionary can be used in a signal handler.
 class Dictionary {
   private:
-    DictTable* _table;
-    volatile unsigned int _base_index;
+    DictTable* volatile _table;
+    volatile unsigned int _next_id;
+    LinearAllocator _arena;
+    LargeKey* volatile _large_keys;
 
-    static void clear(DictTable* table);
-    static size_t usedMemory(DictTable* table);
+    DictKey* lookup(DictTable* table, unsigned int h, const char* key, size_t length, DictKey*& new_key);
+    void grow(DictTable* table);
+    DictKey* allocateKey(unsigned int h, const char* key, size_t length);
+    void freeLargeKeys();
 
     static unsigned int hash(const char* key, size_t length);
 
-    static void collect(std::map<unsigned int, const char*>& map, DictTable* table);
-
   public:
     Dictionary();
     ~Dictionary();
@@ -4,6 +4,8 @@
  */
 
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <unordered_map>
 #include "dwarf.h"
 #include "log.h"
 
@@ -416,3 +418,94 @@ FrameDesc* DwarfParser::addRecordRaw(u32 loc, int cfa, int fp_off, int pc_off) {
     f->pc_off = pc_off;
     return f;
 }
+
+
+// Page size in bytes is at least 4 KB, and grows for sparse tables so that the page index
+// does not outweigh the rows. Offsets within a page must fit in 16 bits.
+static const int MIN_PAGE_SHIFT = 12;
+static const int MAX_PAGE_SHIFT = 16;
+static const int MAX_COMPACT_RULES = 65536;
+
+struct RuleHash {
+    size_t operator()(const FrameDesc& f) const {
+        return (size_t)f.cfa * 31 * 31 + (size_t)f.fp_off * 31 + (size_t)f.pc_off;
+    }
+};
+
+struct RuleEquals {
+    bool operator()(const FrameDesc& f1, const FrameDesc& f2) const {
+        return f1.cfa == f2.cfa && f1.fp_off == f2.fp_off && f1.pc_off == f2.pc_off;
+    }
+};
+
+CompactDwarfTable::~CompactDwarfTable() {
+    if (_mapping != NULL) {
+        munmap(_mapping, _mapping_size);
+    } else {
+        free(_rules);
+        free(_rows);
+        free(_pages);
+    }
+}
+
+CompactDwarfTable* CompactDwarfTable::create(const FrameDesc* table, int length) {
+    if (length <= 0) {
+        return NULL;
+    }
+    for (int i = 1; i < length; i++) {
+        if (table[i].loc < table[i - 1].loc) {
+            return NULL;
+        }
+    }
+
+    u32 max_loc = table[length - 1].loc;
+    int page_shift = MIN_PAGE_SHIFT;
+    while (page_shift < MAX_PAGE_SHIFT && (max_loc >> page_shift) > (u32)length) {
+        page_shift++;
+    }
+    u32 page_count = (max_loc >> page_shift) + 1;
+    if (page_count > (u32)length * 2 + 1024) {
+        return NULL;
+    }
+
+    CompactDwarfTable* compact = new CompactDwarfTable();
+    compact->_page_shift = page_shift;
+    compact->_page_count = page_count;
+    compact->_row_count = length;
+    compact->_rows = (CompactDwarfRow*)malloc(length * sizeof(CompactDwarfRow));
+    compact->_pages = (u32*)malloc((page_count + 1) * sizeof(u32));
+
+    std::unordered_map<FrameDesc, u16, RuleHash, RuleEquals> rules;
+    u32 page = 0;
+    compact->_pages[0] = 0;
+    for (int i = 0; i < length; i++) {
+        u32 loc = table[i].loc;
+        while (page < loc >> page_shift) {
+            compact->_pages[++page] = i;
+        }
+
+        auto it = rules.find(table[i]);
+        if (it == rules.end()) {
+            if (rules.size() >= (size_t)MAX_COMPACT_RULES) {
+                delete compact;
+                return NULL;
+            }
+            it = rules.insert(std::make_pair(table[i], (u16)rules.size())).first;
+        }
+
+        compact->_rows[i].offset = loc & ((1 << page_shift) - 1);
+        compact->_rows[i].rule = it->second;
+    }
+    while (page < page_count) {
+        compact->_pages[++page] = length;
+    }
+
+    compact->_rule_count = rules.size();
+    compact->_rules = (FrameDesc*)malloc(rules.size() * sizeof(FrameDesc));
+    for (auto& it : rules) {
+        FrameDesc* rule = &compact->_rules[it.second];
+        *rule = it.first;
+        rule->loc = 0;
+    }
+    return compact;
+}
@@ -83,6 +83,79 @@ struct FrameDesc {
 };
 
 
+// Location of a row relative to its page, and the index of its unwinding rule
+struct CompactDwarfRow {
+    u16 offset;
+    u16 rule;
+};
+
+// Read-only encoding of a sorted FrameDesc table in 4 bytes per row instead of 16.
+// Distinct (cfa, fp_off, pc_off) tuples are stored once: a library typically has
+// hundreds of them for hundreds of thousands of rows. Rows are grouped by pages of code;
+// a page index points to the first row of each page, so a lookup starts with a direct jump
+// and ends with a binary search over a few neighbouring rows.
+class CompactDwarfTable {
+  private:
+    FrameDesc* _rules;
+    CompactDwarfRow* _rows;
+    u32* _pages;  // the first row of every page, and the total number of rows at the end
+    int _rule_count;
+    int _row_count;
+    int _page_count;
+    int _page_shift;
+    // If the arrays point into a mapped file rather than to separate allocations
+    void* _mapping;
+    size_t _mapping_size;
+
+    CompactDwarfTable() : _rules(NULL), _rows(NULL), _pages(NULL), _mapping(NULL), _mapping_size(0) {
+    }
+
+  public:
+    ~CompactDwarfTable();
+
+    // Returns NULL if the table does not fit into the compact encoding
+    static CompactDwarfTable* create(const FrameDesc* table, int length);
+
+    // The rule for the last row at or below the location, or NULL if there is none
+    FrameDesc* find(u32 loc) const {
+        u32 page = loc >> _page_shift;
+        if (page >= (u32)_page_count) {
+            return &_rules[_rows[_row_count - 1].rule];
+        }
+
+        u16 offset = loc & ((1 << _page_shift) - 1);
+        int low = _pages[page];
+        int high = _pages[page + 1] - 1;
+        while (low <= high) {
+            int mid = (unsigned int)(low + high) >> 1;
+            if (_rows[mid].offset <= offset) {
+                low = mid + 1;
+            } else {
+                high = mid - 1;
+            }
+        }
+
+        // Rows of the preceding pages are all below the location
+        return low > 0 ? &_rules[_rows[low - 1].rule] : NULL;
+    }
+
+    int rowCount() const {
+        return _row_count;
+    }
+
+    int ruleCount() const {
+        return _rule_count;
+    }
+
+    size_t usedMemory() const {
+        return sizeof(CompactDwarfTable) + _rule_count * sizeof(FrameDesc) +
+               _row_count * sizeof(CompactDwarfRow) + (_page_count + 1) * sizeof(u32);
+    }
+
+    friend class SymbolCache;
+};
+
+
 class DwarfParser {
   private:
     const char* _name;
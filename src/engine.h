@@ -50,6 +50,11 @@ class Engine {
         return 1;
     }
 
+    // Changes the sampling interval of a running engine. Returns false if not supported
+    virtual bool setInterval(long interval) {
+        return false;
+    }
+
     virtual Error start(Arguments& args);
     virtual void stop();
 
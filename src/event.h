@@ -100,6 +100,19 @@ class SpanEvent : public Event {
     const char* _tag;
 };
 
+// Periodic summary of the profiler's own cost per sample, in nanoseconds
+class OverheadEvent : public Event {
+  public:
+    const char* _engine;
+    u64 _samples;
+    u64 _handler_avg;
+    u64 _handler_p50;
+    u64 _handler_p99;
+    u64 _stack_walk_avg;
+    u64 _put_avg;
+    u64 _jfr_avg;
+};
+
 class UserEvent : public Event {
   public:
     asprof_jfr_event_key _type;
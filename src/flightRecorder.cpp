@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <map>
+#include <new>
 #include <string>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -44,6 +45,10 @@ const int SMALL_BUFFER_SIZE = 1024;
 const int SMALL_BUFFER_LIMIT = SMALL_BUFFER_SIZE - 128;
 const int RECORDING_BUFFER_SIZE = 65536;
 const int RECORDING_BUFFER_LIMIT = RECORDING_BUFFER_SIZE - 4096;
+// Sample slots scale with CPUs, so their buffers shrink to keep the total within this budget,
+// down to the minimum size that still leaves room for the largest event
+const size_t SLOT_BUFFERS_MEMORY = 4 * 1024 * 1024;
+const int MIN_SLOT_BUFFER_SIZE = 8192;
 const int MAX_STRING_LENGTH = 8191;
 const u64 MAX_JLONG = 0x7fffffffffffffffULL;
 const u64 MIN_JLONG = 0x8000000000000000ULL;
@@ -233,6 +238,13 @@ class RecordingBuffer : public Buffer {
     }
 };
 
+// Data area of the size chosen at runtime follows the header
+class SlotBuffer : public Buffer {
+  public:
+    SlotBuffer() : Buffer() {
+    }
+};
+
 
 class Recording {
   private:
@@ -241,7 +253,12 @@ class Recording {
     static char* _jvm_flags;
     static char* _java_command;
 
-    RecordingBuffer _buf[CONCURRENCY_LEVEL];
+    // Chunk headers, metadata and constant pools
+    RecordingBuffer* _buf;
+    // One buffer per sample slot and one for the deferred sample worker, see SampleLocks
+    char* _slot_bufs;
+    int _slot_buf_count;
+    int _slot_buf_size;
     int _fd;
     int _memfd;
     char* _master_recording_file;
@@ -278,6 +295,16 @@ class Recording {
 
   public:
     Recording(int fd, const char* master_recording_file, Arguments& args) : _fd(fd) {
+        _buf = new RecordingBuffer();
+        _slot_buf_count = Profiler::instance()->concurrencyLevel() + 1;
+        _slot_buf_size = RECORDING_BUFFER_SIZE;
+        while (_slot_buf_size > MIN_SLOT_BUFFER_SIZE && (size_t)_slot_buf_size * _slot_buf_count > SLOT_BUFFERS_MEMORY) {
+            _slot_buf_size /= 2;
+        }
+        _slot_bufs = (char*)malloc((size_t)_slot_buf_size * _slot_buf_count);
+        for (int i = 0; i < _slot_buf_count; i++) {
+            new(_slot_bufs + (size_t)i * _slot_buf_size) SlotBuffer();
+        }
         _master_recording_file = master_recording_file == NULL ? NULL : strdup(master_recording_file);
         _chunk_start = lseek(_fd, 0, SEEK_END);
         _start_time = OS::micros();
@@ -342,6 +369,8 @@ class Recording {
         }
 
         close(_fd);
+        free(_slot_bufs);
+        delete _buf;
     }
 
     off_t finishChunk() {
@@ -350,8 +379,8 @@ class Recording {
 
         writeNativeLibraries(_buf);
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            flush(&_buf[i]);
+        for (int i = 0; i < _slot_buf_count; i++) {
+            flush(buffer(i));
         }
 
         _stop_time = OS::micros();
@@ -501,7 +530,12 @@ class Recording {
     }
 
     Buffer* buffer(int lock_index) {
-        return &_buf[lock_index];
+        return (Buffer*)(_slot_bufs + (size_t)lock_index * _slot_buf_size);
+    }
+
+    // Same headroom for the last event as in a full-size buffer
+    int slotBufferLimit() {
+        return _slot_buf_size - (RECORDING_BUFFER_SIZE - RECORDING_BUFFER_LIMIT);
     }
 
     bool parseAgentProperties() {
@@ -659,6 +693,11 @@ class Recording {
         writeIntSetting(buf, T_ACTIVE_RECORDING, "chunksize", args._chunk_size);
         writeIntSetting(buf, T_ACTIVE_RECORDING, "chunktime", args._chunk_time);
         writeIntSetting(buf, T_ACTIVE_RECORDING, "memlimit", args._mem_limit);
+        if (args._overhead > 0) {
+            char overhead[32];
+            snprintf(overhead, sizeof(overhead), "%g%%", args._overhead * 100);
+            writeStringSetting(buf, T_ACTIVE_RECORDING, "overhead", overhead);
+        }
 
         for (int i = 0; i < EC_CATEGORIES; i++) {
             if (args._rate_limit[i] >= 0) {
@@ -960,12 +999,21 @@ class Recording {
     }
 
     void writeStackTraces(Buffer* buf, Lookup* lookup) {
+        Profiler* profiler = Profiler::instance();
         std::map<u32, CallTrace*> traces;
-        Profiler::instance()->_call_trace_storage.collectTraces(traces);
+        profiler->_call_trace_storage->collectTraces(traces);
+
+        CallTraceUnpacker unpacker;
+        if (profiler->_native_pc) {
+            for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
+                profiler->_native_symbolizer.add(unpacker.unpack(it->second));
+            }
+            profiler->symbolizeNativeFrames();
+        }
 
         writePoolHeader(buf, T_STACK_TRACE, traces.size());
         for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
-            CallTrace* trace = it->second;
+            CallTrace* trace = unpacker.unpack(it->second);
             buf->putVar32(it->first);
             buf->putVar32(0);  // truncated
             buf->putVar32(trace->num_frames);
@@ -1470,16 +1518,20 @@ void FlightRecorder::stopMasterRecording() {
     env->ExceptionClear();
 }
 
+// Update per-thread monotonic counter with the last event timestamp
+void FlightRecorder::updateThreadCounter(EventType event_type, Event* event) {
+    if (_rec != NULL && event_type < PROFILING_WINDOW) {
+        asprof_thread_local_data* tld = ThreadLocalData::getIfPresent();
+        if (tld != nullptr && event->_start_time > tld->sample_counter) {
+            tld->sample_counter = event->_start_time;
+        }
+    }
+}
+
 void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
                                  EventType event_type, Event* event) {
     if (_rec != NULL) {
-        // Update per-thread monotonic counter with the last event timestamp
-        if (event_type < PROFILING_WINDOW) {
-            asprof_thread_local_data* tld = ThreadLocalData::getIfPresent();
-            if (tld != nullptr && event->_start_time > tld->sample_counter) {
-                tld->sample_counter = event->_start_time;
-            }
-        }
+        updateThreadCounter(event_type, event);
 
         Buffer* buf = _rec->buffer(lock_index);
         switch (event_type) {
@@ -1527,7 +1579,7 @@ void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
             default:
                 assert(false);  // should not reach here
         }
-        _rec->flushIfNeeded(buf);
+        _rec->flushIfNeeded(buf, _rec->slotBufferLimit());
         _rec->addThread(tid);
     }
 }
@@ -1553,6 +1605,57 @@ void FlightRecorder::recordLog(LogLevel level, const char* message, size_t len)
     _rec_lock.unlockShared();
 }
 
+void FlightRecorder::recordOverhead(OverheadEvent* event) {
+    if (!_rec_lock.tryLockShared()) {
+        // No active recording
+        return;
+    }
+
+    size_t len = strlen(event->_engine);
+    Buffer* buf = (Buffer*)alloca(len + 96);
+    buf->reset();
+
+    int start = buf->skip(5);
+    buf->put8(T_OVERHEAD);
+    buf->putVar64(event->_start_time);
+    buf->putUtf8(event->_engine, len);
+    buf->putVar64(event->_samples);
+    buf->putVar64(event->_handler_avg);
+    buf->putVar64(event->_handler_p50);
+    buf->putVar64(event->_handler_p99);
+    buf->putVar64(event->_stack_walk_avg);
+    buf->putVar64(event->_put_avg);
+    buf->putVar64(event->_jfr_avg);
+    buf->putVar32(start, buf->offset() - start);
+    _rec->flush(buf);
+
+    _rec_lock.unlockShared();
+}
+
+void FlightRecorder::recordIntervalChange(const char* engine, long prev_interval, long interval, float overhead) {
+    if (!_rec_lock.tryLockShared()) {
+        // No active recording
+        return;
+    }
+
+    size_t len = strlen(engine);
+    if (len > MAX_STRING_LENGTH) len = MAX_STRING_LENGTH;
+    Buffer* buf = (Buffer*)alloca(len + 64);
+    buf->reset();
+
+    int start = buf->skip(5);
+    buf->put8(T_SAMPLING_INTERVAL);
+    buf->putVar64(TSC::ticks());
+    buf->putUtf8(engine, len);
+    buf->putVar64(interval);
+    buf->putVar64(prev_interval);
+    buf->putFloat(overhead);
+    buf->putVar32(start, buf->offset() - start);
+    _rec->flush(buf);
+
+    _rec_lock.unlockShared();
+}
+
 bool FlightRecorder::isJfrStarting() {
     return loadAcquire(_jfr_starting);
 }
@@ -36,10 +36,13 @@ class FlightRecorder {
         return _rec != NULL;
     }
 
+    void updateThreadCounter(EventType event_type, Event* event);
     void recordEvent(int lock_index, int tid, u32 call_trace_id,
                      EventType event_type, Event* event);
 
     void recordLog(LogLevel level, const char* message, size_t len);
+    void recordOverhead(OverheadEvent* event);
+    void recordIntervalChange(const char* engine, long prev_interval, long interval, float overhead);
 
     static bool isJfrStarting();
 };
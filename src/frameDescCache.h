@@ -0,0 +1,90 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _FRAMEDESCCACHE_H
+#define _FRAMEDESCCACHE_H
+
+#include <string.h>
+#include "arch.h"
+#include "dwarf.h"
+
+
+class CodeCache;
+
+const int FRAME_DESC_CACHE_BITS = 11;
+const int FRAME_DESC_CACHE_SIZE = 1 << FRAME_DESC_CACHE_BITS;
+
+struct FrameDescCacheEntry {
+    volatile u32 version;  // odd while the entry is being written
+    u32 epoch;
+    const void* pc;
+    CodeCache* lib;
+    FrameDesc* frame;
+};
+
+// Direct-mapped cache of PC -> (library, unwinding rule) lookups shared by all threads.
+// Every entry is guarded by its own sequence counter, so that a reader never sees a torn entry,
+// and a writer never waits: if an entry is busy, the result is simply not cached.
+// Both are safe in a signal handler. All entries become stale when the epoch changes.
+class FrameDescCache {
+  private:
+    FrameDescCacheEntry _entries[FRAME_DESC_CACHE_SIZE];
+    volatile u32 _epoch;
+
+    static FrameDescCacheEntry* slot(FrameDescCacheEntry* entries, const void* pc) {
+        return &entries[(u32)(((u64)(uintptr_t)pc * 0x9e3779b97f4a7c15ULL) >> (64 - FRAME_DESC_CACHE_BITS))];
+    }
+
+  public:
+    FrameDescCache() : _epoch(1) {
+        memset(_entries, 0, sizeof(_entries));
+    }
+
+    u32 epoch() {
+        return loadAcquire(_epoch);
+    }
+
+    // Called when libraries are loaded or their unwinding information changes
+    void invalidate() {
+        atomicInc(_epoch);
+    }
+
+    bool lookup(const void* pc, CodeCache*& lib, FrameDesc*& frame) {
+        FrameDescCacheEntry* e = slot(_entries, pc);
+        u32 version = loadAcquire(e->version);
+        if (version & 1) {
+            return false;
+        }
+
+        bool hit = e->pc == pc && e->epoch == loadAcquire(_epoch);
+        CodeCache* cached_lib = e->lib;
+        FrameDesc* cached_frame = e->frame;
+        rmb();
+        if (!hit || e->version != version) {
+            return false;
+        }
+
+        lib = cached_lib;
+        frame = cached_frame;
+        return true;
+    }
+
+    // epoch is the value read before the lookup that produced the result
+    void insert(const void* pc, CodeCache* lib, FrameDesc* frame, u32 epoch) {
+        FrameDescCacheEntry* e = slot(_entries, pc);
+        u32 version = e->version;
+        if ((version & 1) || !__sync_bool_compare_and_swap(&e->version, version, version + 1)) {
+            return;
+        }
+
+        e->pc = pc;
+        e->lib = lib;
+        e->frame = frame;
+        e->epoch = epoch;
+        storeRelease(e->version, version + 2);
+    }
+};
+
+#endif // _FRAMEDESCCACHE_H
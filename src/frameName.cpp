@@ -115,17 +115,11 @@ FrameName::~FrameName() {
 const char* FrameName::decodeNativeSymbol(const char* name) {
     const char* lib_name = (_style & STYLE_LIB_NAMES) ? Profiler::instance()->getLibraryName(name) : NULL;
 
-    if (Demangle::needsDemangling(name)) {
-        char* demangled = Demangle::demangle(name, _style & STYLE_SIGNATURES);
-        if (demangled != NULL) {
-            if (lib_name != NULL) {
-                _str.assign(lib_name).append("`").append(demangled);
-            } else {
-                _str.assign(demangled);
-            }
-            free(demangled);
-            return _str.c_str();
+    if (Demangle::needsDemangling(name) && Profiler::instance()->demangle(name, _style & STYLE_SIGNATURES, _str)) {
+        if (lib_name != NULL) {
+            _str.insert(0, "`").insert(0, lib_name);
         }
+        return _str.c_str();
     }
 
     if (lib_name != NULL) {
@@ -257,6 +251,11 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
         case BCI_NATIVE_FRAME:
             return decodeNativeSymbol((const char*)frame.method_id);
 
+        case BCI_NATIVE_PC: {
+            ASGCT_CallFrame resolved = Profiler::instance()->resolveNativeFrame(frame);
+            return name(resolved, for_matching);
+        }
+
         case BCI_ALLOC:
         case BCI_ALLOC_OUTSIDE_TLAB:
         case BCI_LOCK:
@@ -331,6 +330,11 @@ FrameTypeId FrameName::type(ASGCT_CallFrame& frame) {
     }
 
     switch (frame.bci) {
+        case BCI_NATIVE_PC: {
+            ASGCT_CallFrame resolved = Profiler::instance()->resolveNativeFrame(frame);
+            return type(resolved);
+        }
+
         case BCI_NATIVE_FRAME: {
             const char* name = (const char*)frame.method_id;
             if ((name[0] == '_' && name[1] == 'Z') ||
@@ -29,17 +29,22 @@ Error ITimer::start(Arguments& args) {
         OS::installSignalHandler(SIGPROF, signalHandler);
     }
 
-    time_t sec = _interval / 1000000000;
-    suseconds_t usec = (_interval % 1000000000) / 1000;
-    struct itimerval tv = {{sec, usec}, {sec, usec}};
-
-    if (setitimer(ITIMER_PROF, &tv, NULL) != 0) {
+    if (!setInterval(_interval)) {
         return Error("ITIMER_PROF is not supported on this system");
     }
 
     return Error::OK;
 }
 
+bool ITimer::setInterval(long interval) {
+    time_t sec = interval / 1000000000;
+    suseconds_t usec = (interval % 1000000000) / 1000;
+    struct itimerval tv = {{sec, usec}, {sec, usec}};
+
+    _interval = interval;
+    return setitimer(ITIMER_PROF, &tv, NULL) == 0;
+}
+
 void ITimer::stop() {
     struct itimerval tv = {{0, 0}, {0, 0}};
     setitimer(ITIMER_PROF, &tv, NULL);
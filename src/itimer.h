@@ -17,6 +17,8 @@ class ITimer : public CpuEngine {
 
     Error start(Arguments& args);
     void stop();
+
+    bool setInterval(long interval);
 };
 
 #endif // _ITIMER_H
@@ -304,6 +304,26 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("ioRead", T_LONG, "I/O Read Bytes", F_BYTES)
                 << field("ioWrite", T_LONG, "I/O Write Bytes", F_BYTES))
 
+            << (type("profiler.SamplingInterval", T_SAMPLING_INTERVAL, "Sampling Interval Change")
+                << category("Profiler")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("engine", T_STRING, "Engine")
+                << field("interval", T_LONG, "Interval")
+                << field("previousInterval", T_LONG, "Previous Interval")
+                << field("overhead", T_FLOAT, "Measured Overhead", F_PERCENTAGE))
+
+            << (type("profiler.Overhead", T_OVERHEAD, "Profiler Overhead")
+                << category("Profiler")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("engine", T_STRING, "Engine")
+                << field("samples", T_LONG, "Samples", F_UNSIGNED)
+                << field("handlerAvg", T_LONG, "Handler Average", F_DURATION_NANOS)
+                << field("handlerP50", T_LONG, "Handler Median", F_DURATION_NANOS)
+                << field("handlerP99", T_LONG, "Handler 99th Percentile", F_DURATION_NANOS)
+                << field("stackWalkAvg", T_LONG, "Stack Walk Average", F_DURATION_NANOS)
+                << field("putAvg", T_LONG, "Storage Put Average", F_DURATION_NANOS)
+                << field("jfrAvg", T_LONG, "JFR Encoding Average", F_DURATION_NANOS))
+
             << (type("jdk.jfr.Label", T_LABEL, NULL)
                 << field("value", T_STRING))
 
@@ -0,0 +1,132 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _LATENCYHISTOGRAM_H
+#define _LATENCYHISTOGRAM_H
+
+#include <string.h>
+#include "arch.h"
+
+
+// Phases of recording a sample that are timed separately
+enum LatencyPhase {
+    LP_HANDLER,     // from Profiler::recordSample entry to exit
+    LP_STACK_WALK,
+    LP_PUT,         // CallTraceStorage::put
+    LP_JFR,         // JFR event encoding
+    LATENCY_PHASES
+};
+
+// Each power of two range is split into 4 linear sub-buckets, which bounds
+// the relative error to 25%. 160 buckets cover values up to 2^41 ns (36 minutes).
+const int HISTOGRAM_SUB_BITS = 2;
+const int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+const int HISTOGRAM_BUCKETS = 160;
+
+// Log-bucketed histogram of nanosecond durations in the style of HdrHistogram.
+// Recording is a couple of atomic increments and may be done in a signal handler.
+// A histogram with a single writer records without atomic read-modify-write.
+class LatencyHistogram {
+  private:
+    u64 _counts[HISTOGRAM_BUCKETS];
+    u64 _sum;
+
+  public:
+    static int bucketOf(u64 value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            return (int)value;
+        }
+        int exp = 63 - __builtin_clzll(value);
+        int sub = (int)(value >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+        int bucket = (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+        return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+    }
+
+    // Exclusive upper bound of the values in a bucket
+    static u64 upperBound(int bucket) {
+        if (bucket < HISTOGRAM_SUB_BUCKETS) {
+            return bucket + 1;
+        }
+        int exp = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+        int sub = bucket % HISTOGRAM_SUB_BUCKETS;
+        return (u64)(HISTOGRAM_SUB_BUCKETS + sub + 1) << (exp - HISTOGRAM_SUB_BITS);
+    }
+
+    void record(u64 value) {
+        atomicInc(_counts[bucketOf(value)]);
+        atomicInc(_sum, value);
+    }
+
+    // Only for a histogram that no other thread records to
+    void recordExclusive(u64 value) {
+        int bucket = bucketOf(value);
+        storeRelease(_counts[bucket], _counts[bucket] + 1);
+        storeRelease(_sum, _sum + value);
+    }
+
+    void add(const LatencyHistogram& other) {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            _counts[i] += other.count(i);
+        }
+        _sum += other.sum();
+    }
+
+    void clear() {
+        memset(this, 0, sizeof(LatencyHistogram));
+    }
+
+    u64 count(int bucket) const {
+        return loadAcquire(_counts[bucket]);
+    }
+
+    u64 sum() const {
+        return loadAcquire(_sum);
+    }
+
+    u64 totalCount() const {
+        u64 total = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            total += count(i);
+        }
+        return total;
+    }
+
+    // Number of values below the given bound, exact for powers of two
+    u64 countBelow(u64 bound) const {
+        u64 total = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS && upperBound(i) <= bound; i++) {
+            total += count(i);
+        }
+        return total;
+    }
+
+    // Upper bound of the bucket where the given fraction of values is reached
+    u64 percentile(double fraction) const {
+        u64 total = totalCount();
+        u64 threshold = (u64)(total * fraction);
+        u64 seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += count(i);
+            if (seen > threshold || (seen == total && seen > 0)) {
+                return upperBound(i);
+            }
+        }
+        return 0;
+    }
+
+    // Keeps the values recorded since the given snapshot, and updates the snapshot to the current state
+    void deltaFrom(LatencyHistogram& snapshot, LatencyHistogram& delta) const {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            u64 current = count(i);
+            delta._counts[i] = current - snapshot._counts[i];
+            snapshot._counts[i] = current;
+        }
+        u64 current_sum = sum();
+        delta._sum = current_sum - snapshot._sum;
+        snapshot._sum = current_sum;
+    }
+};
+
+#endif // _LATENCYHISTOGRAM_H
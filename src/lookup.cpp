@@ -43,6 +43,12 @@ size_t MethodMap::usedMemory() {
 }
 
 MethodInfo* Lookup::resolveMethod(ASGCT_CallFrame& frame) {
+    if (frame.bci == BCI_NATIVE_PC) {
+        // Share MethodInfo with native frames of the same symbol
+        ASGCT_CallFrame resolved = Profiler::instance()->resolveNativeFrame(frame);
+        return resolveMethod(resolved);
+    }
+
     jmethodID method = frame.method_id;
     MethodInfo* mi = &(*_method_map)[method];
 
@@ -109,15 +115,12 @@ void Lookup::fillNativeMethodInfo(MethodInfo* mi, const char* name, const char*
 
     mi->_modifiers = 0x100;
 
-    if (Demangle::needsDemangling(name)) {
-        char* demangled = Demangle::demangle(name, false);
-        if (demangled != NULL) {
-            mi->_name = _symbols->indexOf(demangled);
-            mi->_sig = _symbols->indexOf("()L;");
-            mi->_type = FRAME_CPP;
-            free(demangled);
-            return;
-        }
+    std::string demangled;
+    if (Demangle::needsDemangling(name) && Profiler::instance()->demangle(name, false, demangled)) {
+        mi->_name = _symbols->indexOf(demangled.c_str());
+        mi->_sig = _symbols->indexOf("()L;");
+        mi->_type = FRAME_CPP;
+        return;
     }
 
     size_t len = strlen(name);
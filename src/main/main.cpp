@@ -59,7 +59,7 @@ static const char USAGE_STRING[] =
     "  -I include          output only stack traces containing the specified pattern\n"
     "  -X exclude          exclude stack traces with the specified pattern\n"
     "  -L level            log level: debug|info|warn|error|none\n"
-    "  -F features         advanced stack trace features: mixed, vtable, comptask, pcaddr\n"
+    "  -F features         advanced stack trace features: mixed, vtable, comptask, pcaddr, stackcache\n"
     "  -v, --version       display version string\n"
     "\n"
     "  --title string      FlameGraph title\n"
@@ -86,6 +86,11 @@ static const char USAGE_STRING[] =
     "  --all-user          only include user-mode events\n"
     "  --sched             group threads by scheduling policy\n"
     "  --cstack mode       how to traverse C stack: fp|dwarf|vm|no\n"
+    "  --userstack bytes   unwind native frames from a copy of user stack made by perf_events\n"
+    "  --lazysymbols       parse native libraries on first use\n"
+    "  --nativepc          record native frames as PCs, symbolize them on dump\n"
+    "  --parsethreads N    number of threads parsing native libraries\n"
+    "  --symcache dir      cache parsed native libraries in the directory\n"
     "  --signal num        use alternative signal for cpu or wall clock profiling\n"
     "  --clock source      clock source for JFR timestamps: tsc|monotonic\n"
     "  --begin function    begin profiling when function is executed\n"
@@ -93,6 +98,11 @@ static const char USAGE_STRING[] =
     "  --ttsp              only time-to-safepoint profiling \n"
     "  --nostop            do not stop profiling outside --begin/--end window\n"
     "  --memlimit bytes    limit size of the stack trace storage\n"
+    "  --shards N          split the stack trace storage into N per-CPU shards\n"
+    "  --storage opts      stack trace storage options: trie, evict, verify, swap\n"
+    "  --memory opts       profiler memory backing: thp, hugetlb, interleave, nodeN\n"
+    "  --deferred          record CPU samples in a worker thread\n"
+    "  --overhead pct      adapt sampling intervals to keep profiler CPU overhead\n"
     "  --ratelimit limits  limit the number of JFR events emitted per second\n"
     "  --jfropts opts      JFR recording options: mem\n"
     "  --jfrsync config    synchronize profiler with JFR recording\n"
@@ -511,16 +521,24 @@ int main(int argc, const char** argv) {
         } else if (arg == "--alloc" || arg == "--nativemem" || arg == "--nativelock" || arg == "--lock" ||
                    arg == "--wall" || arg == "--trace" || arg == "--chunksize" || arg == "--chunktime" ||
                    arg == "--cstack" || arg == "--signal" || arg == "--clock" || arg == "--begin" || arg == "--end" ||
-                   arg == "--target-cpu" || arg == "--proc" || arg == "--memlimit") {
+                   arg == "--target-cpu" || arg == "--proc" || arg == "--memlimit" || arg == "--shards" || arg == "--overhead" ||
+                   arg == "--parsethreads" || arg == "--symcache" || arg == "--userstack") {
             params << "," << (arg.str() + 2) << "=" << args.next();
 
         } else if (arg == "--all" || arg == "--live" || arg == "--nobatch" || arg == "--nofree" || arg == "--nostop" ||
-                   arg == "--record-cpu" || arg == "--sched" || arg == "--tlab" || arg == "--ttsp") {
+                   arg == "--record-cpu" || arg == "--sched" || arg == "--tlab" || arg == "--ttsp" || arg == "--deferred" ||
+                   arg == "--lazysymbols" || arg == "--nativepc") {
             params << "," << (arg.str() + 2);
 
         } else if (arg == "--all-user") {
             params << ",alluser";
 
+        } else if (arg == "--storage") {
+            params << ",storage=" << String(args.next()).replace(',', "+");
+
+        } else if (arg == "--memory") {
+            params << ",memory=" << String(args.next()).replace(',', "+");
+
         } else if (arg == "--ratelimit") {
             params << ",ratelimit=" << String(args.next()).replace(',', ";");
 
@@ -43,6 +43,11 @@ class MallocTracer : public Engine {
         return _interval;
     }
 
+    bool setInterval(long interval) {
+        _interval = interval;
+        return true;
+    }
+
     Error start(Arguments& args);
     void stop();
 
@@ -0,0 +1,83 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <algorithm>
+#include "nativeSymbolizer.h"
+
+
+ResolvedPC* NativeSymbolizer::find(const void* pc) {
+    ResolvedPC key = {pc, NULL, false};
+    std::vector<ResolvedPC>::iterator it = std::lower_bound(_resolved.begin(), _resolved.end(), key);
+    return it != _resolved.end() && it->pc == pc ? &*it : NULL;
+}
+
+void NativeSymbolizer::add(CallTrace* trace) {
+    MutexLocker ml(_lock);
+    for (int i = 0; i < trace->num_frames; i++) {
+        if (trace->frames[i].bci == BCI_NATIVE_PC) {
+            _pending.push_back((const void*)trace->frames[i].method_id);
+        }
+    }
+}
+
+void NativeSymbolizer::resolve(CodeCacheArray* libs) {
+    MutexLocker ml(_lock);
+
+    std::sort(_pending.begin(), _pending.end());
+    _pending.erase(std::unique(_pending.begin(), _pending.end()), _pending.end());
+
+    size_t count = 0;
+    for (size_t i = 0; i < _pending.size(); i++) {
+        ResolvedPC* r = find(_pending[i]);
+        if (r == NULL || !r->final) {
+            _pending[count++] = _pending[i];
+        }
+    }
+    _pending.resize(count);
+
+    // PCs of the same library come in a row
+    std::vector<const char*> names(count);
+    std::vector<ResolvedPC> added;
+    for (size_t i = 0; i < count; ) {
+        CodeCache* lib = libs->findByAddress(_pending[i]);
+        size_t next = i + 1;
+        while (next < count && libs->findByAddress(_pending[next]) == lib) {
+            next++;
+        }
+
+        bool final = false;
+        if (lib != NULL) {
+            lib->binarySearch(&_pending[i], next - i, &names[i]);
+            final = lib->parseState() == PARSE_DONE;
+        }
+
+        for (; i < next; i++) {
+            ResolvedPC* r = find(_pending[i]);
+            if (r != NULL) {
+                r->name = names[i];
+                r->final = final;
+            } else {
+                ResolvedPC resolved = {_pending[i], names[i], final};
+                added.push_back(resolved);
+            }
+        }
+    }
+    _pending.clear();
+
+    size_t old_size = _resolved.size();
+    _resolved.insert(_resolved.end(), added.begin(), added.end());
+    std::inplace_merge(_resolved.begin(), _resolved.begin() + old_size, _resolved.end());
+}
+
+const char* NativeSymbolizer::lookup(const void* pc) {
+    MutexLocker ml(_lock);
+    ResolvedPC* r = find(pc);
+    return r != NULL ? r->name : NULL;
+}
+
+size_t NativeSymbolizer::usedMemory() {
+    MutexLocker ml(_lock);
+    return _pending.capacity() * sizeof(const void*) + _resolved.capacity() * sizeof(ResolvedPC);
+}
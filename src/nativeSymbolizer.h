@@ -0,0 +1,47 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _NATIVESYMBOLIZER_H
+#define _NATIVESYMBOLIZER_H
+
+#include <vector>
+#include "callTraceStorage.h"
+#include "codeCache.h"
+#include "mutex.h"
+
+
+struct ResolvedPC {
+    const void* pc;
+    const char* name;
+    bool final;  // false if the library was not parsed yet, or there was no library at all
+
+    bool operator<(const ResolvedPC& other) const {
+        return pc < other.pc;
+    }
+};
+
+// Symbolizes native frames stored as raw PCs (BCI_NATIVE_PC). PCs of call traces are collected
+// and resolved in a batch once per dump or JFR chunk: sorted PCs of each library are merged
+// with its sorted symbols. Resolved names are cached for the rest of the profiling session.
+class NativeSymbolizer {
+  private:
+    Mutex _lock;
+    std::vector<const void*> _pending;
+    std::vector<ResolvedPC> _resolved;  // sorted by PC
+
+    ResolvedPC* find(const void* pc);
+
+  public:
+    // Collects PCs of a flat (unpacked) call trace
+    void add(CallTrace* trace);
+    // Resolves all PCs collected so far
+    void resolve(CodeCacheArray* libs);
+    // NULL if the PC is not in any known library
+    const char* lookup(const void* pc);
+
+    size_t usedMemory();
+};
+
+#endif // _NATIVESYMBOLIZER_H
@@ -182,6 +182,11 @@ Error ObjectSampler::start(Arguments& args) {
     return Error::OK;
 }
 
+bool ObjectSampler::setInterval(long interval) {
+    _interval = interval;
+    return VM::jvmti()->SetHeapSamplingInterval(interval) == 0;
+}
+
 void ObjectSampler::stop() {
     jvmtiEnv* jvmti = VM::jvmti();
     jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL);
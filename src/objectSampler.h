@@ -44,6 +44,8 @@ class ObjectSampler : public Engine {
     Error start(Arguments& args);
     void stop();
 
+    bool setInterval(long interval);
+
     static void JNICALL SampledObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                            jobject object, jclass object_klass, jlong size);
 
@@ -19,6 +19,22 @@ typedef void (*TimerCallback)(void*);
 // Interrupt threads with this signal. The same signal is used inside JDK to interrupt I/O operations.
 const int WAKEUP_SIGNAL = SIGIO;
 
+// Backing of memory returned by OS::safeAlloc
+enum AllocPolicy {
+    ALLOC_THP        = 0x1,  // advise transparent huge pages for large regions
+    ALLOC_HUGETLB    = 0x2,  // map explicit huge pages, falling back to THP when none are reserved
+    ALLOC_INTERLEAVE = 0x4,  // spread pages across all online NUMA nodes
+    ALLOC_BIND       = 0x8   // place pages on the given NUMA node
+};
+
+struct AllocStats {
+    u64 huge_bytes;      // memory mapped with huge pages or advised to use them
+    u64 huge_fallbacks;  // huge page mappings that failed and fell back to regular pages
+    u64 numa_bytes;      // memory with a NUMA policy applied
+    u64 anon_huge_kb;    // process-wide anonymous memory actually backed by huge pages
+    u64 minor_faults;    // process-wide minor page faults
+};
+
 enum ThreadState {
     THREAD_UNKNOWN,
     THREAD_RUNNING,
@@ -127,9 +143,12 @@ class OS {
 
     static void* safeAlloc(size_t size);
     static void safeFree(void* addr, size_t size);
+    static bool setAllocPolicy(int policy, int numa_node);
+    static void getAllocStats(AllocStats* stats);
 
     static bool getCpuDescription(char* buf, size_t size);
     static int getCpuCount();
+    static int getCurrentCpu();
     static u64 getProcessCpuTime(u64* utime, u64* stime);
     static u64 getTotalCpuTime(u64* utime, u64* stime);
 
@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
@@ -36,6 +37,26 @@
 
 #define COMM_LEN 16
 
+#ifndef MPOL_BIND
+#  define MPOL_BIND       2
+#  define MPOL_INTERLEAVE 3
+#endif
+
+#ifndef MAP_HUGETLB
+#  define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MADV_HUGEPAGE
+#  define MADV_HUGEPAGE 14
+#endif
+
+const int MAX_NUMA_NODES = 64;
+
+static int _alloc_policy = 0;
+static size_t _huge_page_size = 2 * 1024 * 1024;
+static unsigned long _numa_mask = 0;
+static AllocStats _alloc_stats;
+
 class LinuxThreadList : public ThreadList {
   private:
     DIR* _dir;
@@ -320,20 +341,151 @@ bool OS::sendSignalToThread(int thread_id, int signo) {
     return syscall(__NR_tgkill, processId(), thread_id, signo) == 0;
 }
 
-void* OS::safeAlloc(size_t size) {
+static void* mapAnonymous(size_t size, int flags) {
     // Naked syscall can be used inside a signal handler.
     // Also, we don't want to catch our own calls when profiling mmap.
-    intptr_t result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    intptr_t result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
     if (result < 0 && result > -4096) {
         return NULL;
     }
     return (void*)result;
 }
 
+// THP can back only aligned 2 MB ranges; trim the excess of a larger mapping to align the result
+static void* mapHugeAligned(size_t size) {
+    size_t align = _huge_page_size;
+    char* base = (char*)mapAnonymous(size + align, 0);
+    if (base == NULL) {
+        return NULL;
+    }
+
+    char* start = (char*)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+    if (start > base) {
+        syscall(__NR_munmap, base, start - base);
+    }
+    if (base + align > start) {
+        syscall(__NR_munmap, start + size, base + align - start);
+    }
+
+    syscall(__NR_madvise, start, size, MADV_HUGEPAGE);
+    return start;
+}
+
+void* OS::safeAlloc(size_t size) {
+    int policy = _alloc_policy;
+    if (policy == 0) {
+        return mapAnonymous(size, 0);
+    }
+
+    void* result = NULL;
+    if ((policy & ALLOC_HUGETLB) && (size & (_huge_page_size - 1)) == 0) {
+        if ((result = mapAnonymous(size, MAP_HUGETLB)) != NULL) {
+            atomicInc(_alloc_stats.huge_bytes, (u64)size);
+        } else {
+            atomicInc(_alloc_stats.huge_fallbacks);
+        }
+    }
+
+    if (result == NULL) {
+        if ((policy & (ALLOC_THP | ALLOC_HUGETLB)) && size >= _huge_page_size) {
+            if ((result = mapHugeAligned(size)) != NULL) {
+                atomicInc(_alloc_stats.huge_bytes, (u64)size);
+            }
+        } else {
+            result = mapAnonymous(size, 0);
+        }
+    }
+
+    if (result != NULL && (policy & (ALLOC_INTERLEAVE | ALLOC_BIND))) {
+        // Applies to pages not faulted yet, which are all pages of a fresh mapping
+        int mode = (policy & ALLOC_BIND) ? MPOL_BIND : MPOL_INTERLEAVE;
+        if (syscall(__NR_mbind, result, size, mode, &_numa_mask, MAX_NUMA_NODES, 0) == 0) {
+            atomicInc(_alloc_stats.numa_bytes, (u64)size);
+        }
+    }
+    return result;
+}
+
 void OS::safeFree(void* addr, size_t size) {
     syscall(__NR_munmap, addr, size);
 }
 
+// Parses a node list like "0-1,4" as found in /sys/devices/system/node/online
+static unsigned long parseNodeList(const char* s) {
+    unsigned long mask = 0;
+    while (*s >= '0' && *s <= '9') {
+        char* end;
+        int from = strtol(s, &end, 10);
+        int to = *end == '-' ? strtol(end + 1, &end, 10) : from;
+        for (int node = from; node <= to && node < MAX_NUMA_NODES; node++) {
+            mask |= 1UL << node;
+        }
+        s = *end == ',' ? end + 1 : end;
+    }
+    return mask;
+}
+
+static unsigned long onlineNumaNodes() {
+    char buf[256] = "0";
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd != -1) {
+        ssize_t r = read(fd, buf, sizeof(buf) - 1);
+        buf[r > 0 ? r : 0] = 0;
+        close(fd);
+    }
+    return parseNodeList(buf);
+}
+
+bool OS::setAllocPolicy(int policy, int numa_node) {
+    if (policy & (ALLOC_INTERLEAVE | ALLOC_BIND)) {
+        unsigned long online = onlineNumaNodes();
+        if (policy & ALLOC_BIND) {
+            if (numa_node < 0 || numa_node >= MAX_NUMA_NODES || !(online & (1UL << numa_node))) {
+                return false;
+            }
+            online = 1UL << numa_node;
+        }
+        _numa_mask = online;
+    }
+
+    if (policy & (ALLOC_THP | ALLOC_HUGETLB)) {
+        int fd = open("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", O_RDONLY);
+        if (fd != -1) {
+            char buf[32];
+            ssize_t r = read(fd, buf, sizeof(buf) - 1);
+            if (r > 0) {
+                buf[r] = 0;
+                size_t size = strtoull(buf, NULL, 10);
+                if (size >= page_size && (size & (size - 1)) == 0) _huge_page_size = size;
+            }
+            close(fd);
+        }
+    }
+
+    _alloc_policy = policy;
+    return true;
+}
+
+void OS::getAllocStats(AllocStats* stats) {
+    *stats = _alloc_stats;
+    stats->anon_huge_kb = 0;
+
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (file != NULL) {
+        char line[256];
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "AnonHugePages:", 14) == 0) {
+                stats->anon_huge_kb = strtoull(line + 14, NULL, 10);
+                break;
+            }
+        }
+        fclose(file);
+    }
+
+    struct rusage usage;
+    stats->minor_faults = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_minflt : 0;
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     int fd = open("/proc/cpuinfo", O_RDONLY);
     if (fd == -1) {
@@ -360,6 +512,11 @@ int OS::getCpuCount() {
     return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+int OS::getCurrentCpu() {
+    // Served by vDSO or rseq area, does not enter the kernel
+    return sched_getcpu();
+}
+
 u64 OS::getProcessCpuTime(u64* utime, u64* stime) {
     struct tms buf;
     clock_t real = times(&buf);
@@ -17,7 +17,9 @@
 #include <mach-o/dyld.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/sysctl.h>
 #include <sys/time.h>
 #include <sys/times.h>
@@ -322,6 +324,20 @@ void OS::safeFree(void* addr, size_t size) {
     munmap(addr, size);
 }
 
+bool OS::setAllocPolicy(int policy, int numa_node) {
+    // Neither huge pages nor NUMA placement can be requested for anonymous memory on macOS
+    return (policy & ALLOC_BIND) == 0 || numa_node == 0;
+}
+
+void OS::getAllocStats(AllocStats* stats) {
+    memset(stats, 0, sizeof(AllocStats));
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        stats->minor_faults = usage.ru_minflt;
+    }
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     return sysctlbyname("machdep.cpu.brand_string", buf, &size, NULL, 0) == 0;
 }
@@ -332,6 +348,11 @@ int OS::getCpuCount() {
     return sysctlbyname("hw.logicalcpu", &cpu_count, &size, NULL, 0) == 0 ? cpu_count : 1;
 }
 
+int OS::getCurrentCpu() {
+    // No public API to find the current CPU
+    return -1;
+}
+
 u64 OS::getProcessCpuTime(u64* utime, u64* stime) {
     struct tms buf;
     clock_t real = times(&buf);
@@ -76,9 +76,10 @@ void Recorder::recordStacks(const std::vector<CallTraceSample*>& call_trace_samp
         _otlp_buffer.commitMessage(stack_mark);
     }
 
+    CallTraceUnpacker unpacker;
     for (const auto& cts : call_trace_samples) {
         CallTrace* trace = cts->acquireTrace();
-        if (trace == NULL || _fn.excludeTrace(trace) || cts->samples == 0) continue;
+        if (trace == NULL || _fn.excludeTrace(trace = unpacker.unpack(trace)) || cts->samples == 0) continue;
 
         protobuf_mark_t stack_mark = _otlp_buffer.startMessage(ProfilesDictionary::stack_table);
         protobuf_mark_t location_indices_mark = _otlp_buffer.startMessage(Stack::location_indices);
@@ -0,0 +1,94 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <math.h>
+#include "overheadController.h"
+
+
+// Intervals stay within these bounds relative to the configured ones
+static const double MIN_SCALE = 1.0 / 8;
+static const double MAX_SCALE = 64;
+
+// Do not retune if the overhead is that close to the target
+static const double DEAD_BAND = 1.25;
+
+// Process CPU time is accounted in clock ticks; shorter periods are too noisy to judge
+static const u64 MIN_CPU_TIME = 20000000;
+
+static u64 delta(u64 current, u64 previous) {
+    // Counters start over when the profiler is restarted
+    return current >= previous ? current - previous : current;
+}
+
+void OverheadController::reset(double target) {
+    _target = target;
+    _scale = 1;
+    _overhead = 0;
+    _engine_count = 0;
+    _profiler_time = 0;
+    _signals = 0;
+    _cpu_time = 0;
+}
+
+void OverheadController::addEngine(Engine* engine) {
+    for (int i = 0; i < _engine_count; i++) {
+        if (_engines[i].engine == engine) return;
+    }
+
+    long interval = engine->interval();
+    // Sampling every event cannot be made any more frequent, and there is no base to scale
+    if (_engine_count < MAX_TUNED_ENGINES && interval > 1) {
+        TunedEngine* t = &_engines[_engine_count++];
+        t->engine = engine;
+        t->base_interval = interval;
+        t->interval = interval;
+    }
+}
+
+bool OverheadController::update(u64 profiler_time, u64 signals, u64 cpu_time) {
+    if (_cpu_time == 0) {
+        // The first call only takes the baseline
+        _profiler_time = profiler_time;
+        _signals = signals;
+        _cpu_time = cpu_time;
+        return false;
+    }
+
+    u64 cpu = delta(cpu_time, _cpu_time);
+    if (cpu < MIN_CPU_TIME) {
+        // Accumulate until there is enough process activity
+        return false;
+    }
+
+    u64 cost = estimateCost(delta(profiler_time, _profiler_time), delta(signals, _signals));
+    _profiler_time = profiler_time;
+    _signals = signals;
+    _cpu_time = cpu_time;
+
+    _overhead = (double)cost / cpu;
+    double ratio = _overhead / _target;
+    if (ratio < DEAD_BAND && ratio > 1 / DEAD_BAND) {
+        return false;
+    }
+
+    // Cost is inversely proportional to the interval. Take half of the step in log scale
+    // to damp oscillations caused by bursty load, but at most 2x per update.
+    double step = sqrt(ratio);
+    step = step < 0.5 ? 0.5 : step > 2 ? 2 : step;
+
+    double scale = _scale * step;
+    scale = scale < MIN_SCALE ? MIN_SCALE : scale > MAX_SCALE ? MAX_SCALE : scale;
+    if (scale == _scale) {
+        return false;
+    }
+
+    _scale = scale;
+    return true;
+}
+
+long OverheadController::scaledInterval(long base_interval) const {
+    long interval = (long)(base_interval * _scale);
+    return interval > 1 ? interval : 1;
+}
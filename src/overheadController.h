@@ -0,0 +1,83 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _OVERHEADCONTROLLER_H
+#define _OVERHEADCONTROLLER_H
+
+#include "arch.h"
+#include "engine.h"
+
+
+const int MAX_TUNED_ENGINES = 4;
+
+// Kernel time to deliver a profiling signal and return from the handler, which cannot be
+// timed from the handler itself. A typical figure for x86-64 and aarch64 servers.
+const u64 SIGNAL_DELIVERY_NS = 1500;
+
+struct TunedEngine {
+    Engine* engine;
+    long base_interval;
+    long interval;
+};
+
+// Retunes sampling intervals of running engines, so that the profiler takes
+// the requested fraction of the process CPU time. All intervals are scaled
+// by the same factor, which keeps the ratio between engines as configured.
+class OverheadController {
+  private:
+    double _target;
+    double _scale;
+    double _overhead;
+    TunedEngine _engines[MAX_TUNED_ENGINES];
+    int _engine_count;
+
+    // Cumulative counters as of the previous update
+    u64 _profiler_time;
+    u64 _signals;
+    u64 _cpu_time;
+
+  public:
+    OverheadController() : _target(0), _scale(1), _overhead(0), _engine_count(0) {
+    }
+
+    void reset(double target);
+    void addEngine(Engine* engine);
+
+    bool enabled() const {
+        return _target > 0;
+    }
+
+    double scale() const {
+        return _scale;
+    }
+
+    // Profiler CPU time relative to the process CPU time, as of the last update
+    double overhead() const {
+        return _overhead;
+    }
+
+    int engineCount() const {
+        return _engine_count;
+    }
+
+    TunedEngine* engine(int index) {
+        return &_engines[index];
+    }
+
+    // profiler_time is measured; events recorded without a signal are charged for one too,
+    // which errs on the side of a lower overhead
+    static u64 estimateCost(u64 profiler_time, u64 signals) {
+        return profiler_time + signals * SIGNAL_DELIVERY_NS;
+    }
+
+    // Takes cumulative time spent processing samples, number of samples,
+    // and process CPU time, all times in nanoseconds.
+    // Returns true if the interval scale has changed.
+    bool update(u64 profiler_time, u64 signals, u64 cpu_time);
+
+    long scaledInterval(long base_interval) const;
+};
+
+#endif // _OVERHEADCONTROLLER_H
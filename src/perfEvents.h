@@ -14,6 +14,7 @@
 class PerfEvent;
 class PerfEventType;
 class StackContext;
+struct UserStack;
 
 class PerfEvents : public CpuEngine {
   private:
@@ -26,6 +27,8 @@ class PerfEvents : public CpuEngine {
     static bool _use_perf_mmap;
     static bool _record_cpu;
     static int _target_cpu;
+    static u32 _user_stack;
+    static size_t _mmap_size;
 
     static u64 readCounter(siginfo_t* siginfo, void* ucontext);
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
@@ -38,6 +41,8 @@ class PerfEvents : public CpuEngine {
     Error start(Arguments& args);
     void stop();
 
+    bool setInterval(long interval);
+
     const char* type() {
         return "perf_events";
     }
@@ -45,9 +50,16 @@ class PerfEvents : public CpuEngine {
     const char* title();
     const char* units();
 
-    static int walk(int tid, void* ucontext, const void** callchain, int max_depth, u64* cpu);
+    // If copy is given, a sampled user stack is moved to the buffer at copy->data of userStackSize() bytes
+    // rather than unwound; copy->size is 0 if there was none
+    static int walk(int tid, void* ucontext, const void** callchain, int max_depth, u64* cpu,
+                    UserStack* copy = NULL);
     static void resetBuffer(int tid);
 
+    static u32 userStackSize() {
+        return _user_stack;
+    }
+
     static bool supported();
     static const char* getEventName(int event_id);
 };
@@ -55,6 +67,7 @@ class PerfEvents : public CpuEngine {
 #else
 
 class StackContext;
+struct UserStack;
 
 class PerfEvents : public CpuEngine {
   public:
@@ -62,13 +75,18 @@ class PerfEvents : public CpuEngine {
         return Error("PerfEvents are not supported on this platform");
     }
 
-    static int walk(int tid, void* ucontext, const void** callchain, int max_depth, u64* cpu) {
+    static int walk(int tid, void* ucontext, const void** callchain, int max_depth, u64* cpu,
+                    UserStack* copy = NULL) {
         return 0;
     }
 
     static void resetBuffer(int tid) {
     }
 
+    static u32 userStackSize() {
+        return 0;
+    }
+
     static bool supported() {
         return false;
     }
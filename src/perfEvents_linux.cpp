@@ -22,6 +22,7 @@
 #include <sys/utsname.h>
 #include <linux/perf_event.h>
 #include "arch.h"
+#include "dwarf.h"
 #include "fdtransferClient.h"
 #include "j9StackTraces.h"
 #include "log.h"
@@ -51,6 +52,21 @@ struct f_owner_ex {
 #define PERF_FLAG_FD_CLOEXEC  8
 #endif // PERF_FLAG_FD_CLOEXEC
 
+// Registers sampled along with a copy of the user stack, in addition to PERF_REG_PC
+#if defined(__x86_64__) || defined(__i386__)
+const int PERF_REG_FP = 6;   // PERF_REG_X86_BP
+const int PERF_REG_SP = 7;   // PERF_REG_X86_SP
+const int PERF_REG_LR = -1;
+#elif defined(__aarch64__)
+const int PERF_REG_FP = 29;  // PERF_REG_ARM64_X29
+const int PERF_REG_LR = 30;  // PERF_REG_ARM64_LR
+const int PERF_REG_SP = 31;  // PERF_REG_ARM64_SP
+#else
+const int PERF_REG_FP = -1;
+const int PERF_REG_LR = -1;
+const int PERF_REG_SP = -1;
+#endif
+
 enum {
     HW_BREAKPOINT_R  = 1,
     HW_BREAKPOINT_W  = 2,
@@ -527,28 +543,98 @@ class RingBuffer {
   private:
     const char* _start;
     unsigned long _offset;
+    unsigned long _mask;
 
   public:
-    RingBuffer(struct perf_event_mmap_page* page) {
+    RingBuffer(struct perf_event_mmap_page* page, size_t mmap_size) {
         _start = (const char*)page + OS::page_size;
+        _mask = mmap_size - OS::page_size - 1;
     }
 
     struct perf_event_header* seek(u64 offset) {
-        _offset = (unsigned long)offset & OS::page_mask;
+        _offset = (unsigned long)offset & _mask;
         return (struct perf_event_header*)(_start + _offset);
     }
 
     u64 next() {
-        _offset = (_offset + sizeof(u64)) & OS::page_mask;
+        _offset = (_offset + sizeof(u64)) & _mask;
         return *(u64*)(_start + _offset);
     }
 
     u64 peek(unsigned long words) {
-        unsigned long peek_offset = (_offset + words * sizeof(u64)) & OS::page_mask;
+        unsigned long peek_offset = (_offset + words * sizeof(u64)) & _mask;
         return *(u64*)(_start + peek_offset);
     }
+
+    // Points the stack at a PERF_SAMPLE_STACK_USER copy that begins after the current word
+    void userStack(UserStack* stack, u32 size) {
+        stack->data = _start;
+        stack->offset = (_offset + sizeof(u64)) & _mask;
+        stack->mask = _mask;
+        stack->size = size;
+    }
 };
 
+static u64 userRegsMask() {
+    u64 mask = 1ULL << PERF_REG_PC | 1ULL << PERF_REG_SP | 1ULL << PERF_REG_FP;
+    return PERF_REG_LR >= 0 ? mask | 1ULL << PERF_REG_LR : mask;
+}
+
+// Parses PERF_SAMPLE_REGS_USER and PERF_SAMPLE_STACK_USER parts of a sample.
+// Returns false if the sample was taken in a kernel thread or the stack could not be copied.
+static bool readUserStack(RingBuffer& ring, UserStack* stack) {
+    stack->lr = 0;
+    u64 abi = ring.next();
+    if (abi == PERF_SAMPLE_REGS_ABI_NONE) {
+        return false;
+    }
+
+    // Registers are written in the order of their numbers
+    u64 mask = userRegsMask();
+    for (int reg = 0; reg < 64; reg++) {
+        if (mask & (1ULL << reg)) {
+            uintptr_t value = (uintptr_t)ring.next();
+            if (reg == PERF_REG_PC) {
+                stack->pc = (const void*)value;
+            } else if (reg == PERF_REG_SP) {
+                stack->sp = value;
+            } else if (reg == PERF_REG_FP) {
+                stack->fp = value;
+            } else {
+                stack->lr = value;
+            }
+        }
+    }
+
+    // The copy is followed by the number of bytes actually copied
+    u64 size = ring.next();
+    if (size == 0) {
+        return false;
+    }
+    u64 dyn_size = ring.peek(size / sizeof(u64) + 1);
+    // Unwinding reads whole words only, so a partially copied last word is of no use
+    ring.userStack(stack, (u32)(dyn_size < size ? dyn_size : size) & ~(u32)(sizeof(u64) - 1));
+    return stack->size > 0;
+}
+
+// Moves the stack out of the ring buffer to the caller's buffer at copy->data.
+// Both the offset and the size are multiples of 8, so the copy goes word by word.
+static void copyUserStack(const UserStack& stack, UserStack* copy) {
+    // Do not use memcpy inside signal handler
+    u64* dst = (u64*)copy->data;
+    for (u32 i = 0; i < stack.size; i += sizeof(u64)) {
+        *dst++ = *(const u64*)(stack.data + ((stack.offset + i) & stack.mask));
+    }
+
+    copy->pc = stack.pc;
+    copy->sp = stack.sp;
+    copy->fp = stack.fp;
+    copy->lr = stack.lr;
+    copy->size = stack.size;
+    copy->offset = 0;
+    copy->mask = (u32)-1;
+}
+
 
 class PerfEvent : public SpinLock {
   private:
@@ -568,6 +654,8 @@ bool PerfEvents::_kernel_stack;
 bool PerfEvents::_use_perf_mmap;
 bool PerfEvents::_record_cpu;
 int PerfEvents::_target_cpu;
+u32 PerfEvents::_user_stack;
+size_t PerfEvents::_mmap_size;
 
 int PerfEvents::createForThread(int tid) {
     if (tid >= _max_events) {
@@ -615,10 +703,17 @@ int PerfEvents::createForThread(int tid) {
         attr.exclude_callchain_kernel = 1;
     }
 
-    if (_cstack >= CSTACK_FP) {
+    if (_cstack >= CSTACK_FP || _user_stack != 0) {
         attr.exclude_callchain_user = 1;
     }
 
+    if (_user_stack != 0) {
+        // Native frames are unwound from the copy of registers and stack
+        attr.sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+        attr.sample_regs_user = userRegsMask();
+        attr.sample_stack_user = _user_stack;
+    }
+
     if (_record_cpu) {
         attr.sample_type |= PERF_SAMPLE_CPU;
     }
@@ -647,9 +742,14 @@ int PerfEvents::createForThread(int tid) {
 
     void* page = NULL;
     if (_use_perf_mmap) {
-        page = mmap(NULL, 2 * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        page = mmap(NULL, _mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
         if (page == MAP_FAILED) {
-            Log::warn("perf_event mmap failed: %s", strerror(errno));
+            if (errno == EPERM && _user_stack != 0) {
+                Log::warn("perf_event mmap of %d KB failed: locked memory limit exceeded. Reduce userstack, "
+                          "or raise 'ulimit -l' and 'sysctl kernel.perf_event_mlock_kb'", (int)(_mmap_size / 1024));
+            } else {
+                Log::warn("perf_event mmap failed: %s", strerror(errno));
+            }
             page = NULL;
         }
     }
@@ -680,7 +780,7 @@ int PerfEvents::createForThread(int tid) {
 
     // Failed to setup perf_event - rollback changes
     if (page != NULL) {
-        munmap(page, 2 * OS::page_size);
+        munmap(page, _mmap_size);
         _events[tid]._page = NULL;
     }
     close(fd);
@@ -702,7 +802,7 @@ void PerfEvents::destroyForThread(int tid) {
     }
     if (event->_page != NULL) {
         event->lock();
-        munmap(event->_page, 2 * OS::page_size);
+        munmap(event->_page, _mmap_size);
         event->_page = NULL;
         event->unlock();
     }
@@ -838,7 +938,31 @@ Error PerfEvents::start(Arguments& args) {
         // Automatically switch on alluser for non-CPU events, if kernel profiling is unavailable
         _alluser = strcmp(args._event, EVENT_CPU) != 0 && !supported();
     }
-    _use_perf_mmap = _kernel_stack || _cstack == CSTACK_DEFAULT || _record_cpu;
+
+    _user_stack = 0;
+    if (args._user_stack > 0 && _cstack != CSTACK_NO) {
+        if (!DWARF_SUPPORTED || PERF_REG_SP < 0) {
+            return Error("userstack is not supported on this architecture");
+        } else if (_cstack == CSTACK_VM) {
+            Log::warn("userstack is ignored with cstack=vm");
+        } else {
+            _user_stack = args._user_stack;
+        }
+    }
+
+    _use_perf_mmap = _kernel_stack || _cstack == CSTACK_DEFAULT || _record_cpu || _user_stack != 0;
+
+    // One metadata page and one data page, as long as samples are small
+    _mmap_size = 2 * OS::page_size;
+    if (_user_stack != 0) {
+        // The data area is a power of 2 pages and must hold at least one sample with a stack copy.
+        // Ring buffers count against RLIMIT_MEMLOCK and kernel.perf_event_mlock_kb.
+        size_t data_size = OS::page_size;
+        while (data_size < _user_stack + OS::page_size) {
+            data_size *= 2;
+        }
+        _mmap_size = data_size + OS::page_size;
+    }
 
     if (strcmp(_event_type->name, "cpu-clock") == 0 && hasPerfEventRefreshBug()) {
         Log::debug("Enable workaround for PERF_EVENT_IOC_REFRESH bug");
@@ -892,13 +1016,28 @@ void PerfEvents::stop() {
     J9StackTraces::stop();
 }
 
-int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_depth, u64* cpu) {
+bool PerfEvents::setInterval(long interval) {
+    u64 period = interval;
+    _interval = interval;
+    for (int i = 0; i < _max_events; i++) {
+        int fd = _events[i]._fd;
+        if (fd > 0) {
+            ioctl(fd, PERF_EVENT_IOC_PERIOD, &period);
+        }
+    }
+    return true;
+}
+
+int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_depth, u64* cpu, UserStack* copy) {
     PerfEvent* event = &_events[tid];
     if (!event->tryLock()) {
         return 0;  // the event is being destroyed
     }
 
     int depth = 0;
+    if (copy != NULL) {
+        copy->size = 0;
+    }
 
     struct perf_event_mmap_page* page = event->_page;
     if (page != NULL) {
@@ -906,7 +1045,7 @@ int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_de
         u64 head = page->data_head;
         rmb();
 
-        RingBuffer ring(page);
+        RingBuffer ring(page, _mmap_size);
 
         while (tail < head) {
             struct perf_event_header* hdr = ring.seek(tail);
@@ -929,6 +1068,16 @@ int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_de
                     }
                 }
 
+                UserStack stack;
+                if (_user_stack != 0 && readUserStack(ring, &stack)) {
+                    if (copy != NULL) {
+                        // The caller unwinds the copy later, possibly in another thread
+                        copyUserStack(stack, copy);
+                    } else {
+                        depth += StackWalker::walkUserStack(stack, callchain + depth, max_depth - depth);
+                    }
+                }
+
                 break;
             }
             tail += hdr->size;
@@ -940,6 +1089,11 @@ stack_complete:
 
     event->unlock();
 
+    if (_user_stack != 0) {
+        // Native frames come from the stack copy, if there was any
+        return depth;
+    }
+
     if (_cstack == CSTACK_FP) {
         depth += StackWalker::walkFP(ucontext, callchain + depth, max_depth - depth);
     } else if (_cstack == CSTACK_DWARF) {
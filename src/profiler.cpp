@@ -27,6 +27,7 @@
 #include "j9WallClock.h"
 #include "instrument.h"
 #include "itimer.h"
+#include "demangle.h"
 #include "dwarf.h"
 #include "flameGraph.h"
 #include "flightRecorder.h"
@@ -36,6 +37,7 @@
 #include "otlp.h"
 #include "rateLimit.h"
 #include "safeAccess.h"
+#include "stackCache.h"
 #include "stackFrame.h"
 #include "stackWalker.h"
 #include "symbols.h"
@@ -69,6 +71,20 @@ static Instrument instrument;
 
 static SpanEvent profiling_window;
 
+static const char* const LATENCY_ENGINES[EC_CATEGORIES] = {
+    "cpu", "alloc", "lock", "wall", "nativemem", "nativelock", "trace", "span"
+};
+static const char* const LATENCY_PHASE_NAMES[LATENCY_PHASES] = {
+    "handler", "stackwalk", "put", "jfr"
+};
+
+// Bucket bounds of exported histograms: powers of two from 64 ns to 1 s
+static const int MIN_LATENCY_BOUND_LOG = 6;
+static const int MAX_LATENCY_BOUND_LOG = 30;
+
+static const int DRAIN_BATCH = 16;
+static const u64 DRAIN_IDLE_SLEEP = 1000000;  // 1 ms
+
 struct MethodSample {
     u64 samples;
     u64 counter;
@@ -182,24 +198,54 @@ const char* Profiler::asgctError(int code) {
     }
 }
 
-inline int Profiler::tryLock(int tid) {
-    u32 lock_index = tid;
-    lock_index ^= lock_index >> 8;
-    lock_index ^= lock_index >> 4;
-    if (_locks[lock_index %= CONCURRENCY_LEVEL].tryLock() ||
-        _locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() ||
-        _locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock()) {
-        return lock_index;
+// Must be called by the holder of the sample slot
+inline void Profiler::recordLatency(int lock_index, EventType event_type, LatencyPhase phase, u64 begin_ticks, u64 end_ticks) {
+    u64 nanos = end_ticks > begin_ticks ? (u64)((end_ticks - begin_ticks) * _nanos_per_tick) : 0;
+    int category = EVENT_TO_CATEGORY(event_type);
+    if (category < EC_CATEGORIES) {
+        _slot_latency[lock_index]->phases[category][phase].recordExclusive(nanos);
+    }
+}
+
+void Profiler::mergeLatency(int category, int phase, LatencyHistogram& result) {
+    result.clear();
+    for (int i = 0; i <= _locks.count(); i++) {
+        if (_slot_latency[i] != NULL) {
+            result.add(_slot_latency[i]->phases[category][phase]);
+        }
+    }
+}
+
+// Nanoseconds spent in the given phase by all engines
+u64 Profiler::totalLatency(LatencyPhase phase) {
+    u64 total = 0;
+    for (int i = 0; i <= _locks.count(); i++) {
+        if (_slot_latency[i] != NULL) {
+            for (int c = 0; c < EC_CATEGORIES; c++) {
+                total += _slot_latency[i]->phases[c][phase].sum();
+            }
+        }
     }
-    return -1;
+    return total;
+}
+
+inline int Profiler::tryLock(int tid) {
+    return _locks.tryLock(tid);
 }
 
 inline void Profiler::unlock(int lock_index) {
-    _locks[lock_index].unlock();
+    _locks.unlock(lock_index);
 }
 
 void Profiler::updateSymbols(bool kernel_symbols) {
     Symbols::parseLibraries(&_native_libs, kernel_symbols);
+    invalidateSymbolCaches();
+}
+
+void Profiler::invalidateSymbolCaches() {
+    _frame_desc_cache.invalidate();
+    // New unwinding information may change how cached stacks would be walked now
+    StackCache::invalidateAll();
 }
 
 void Profiler::mangle(const char* name, char* buf, size_t size) {
@@ -228,6 +274,16 @@ const void* Profiler::resolveSymbol(const char* name) {
         name = mangled_name;
     }
 
+    const void* address = findSymbol(name);
+    if (address == NULL && Symbols::parsePendingLibraries(&_native_libs, true) > 0) {
+        // The symbol may belong to a library whose parsing has been deferred
+        invalidateSymbolCaches();
+        address = findSymbol(name);
+    }
+    return address;
+}
+
+const void* Profiler::findSymbol(const char* name) {
     size_t len = strlen(name);
     int native_lib_count = _native_libs.count();
     if (len > 0 && name[len - 1] == '*') {
@@ -262,6 +318,22 @@ const char* Profiler::getLibraryName(const char* native_symbol) {
     return NULL;
 }
 
+// Demangled names are cached by the library that owns the symbol
+bool Profiler::demangle(const char* native_symbol, bool full_signature, std::string& result) {
+    short lib_index = NativeFunc::libIndex(native_symbol);
+    if (lib_index >= 0 && lib_index < _native_libs.count()) {
+        return _native_libs[lib_index]->demangleCache()->demangle(native_symbol, full_signature, result);
+    }
+
+    char* demangled = Demangle::demangle(native_symbol, full_signature);
+    if (demangled == NULL) {
+        return false;
+    }
+    result.assign(demangled);
+    free(demangled);
+    return true;
+}
+
 CodeCache* Profiler::findJvmLibrary(const char* lib_name) {
     return VM::isOpenJ9() ? findLibraryByName(lib_name) : VMStructs::libjvm();
 }
@@ -282,13 +354,25 @@ CodeCache* Profiler::findLibraryByName(const char* lib_name) {
 }
 
 CodeCache* Profiler::findLibraryByAddress(const void* address) {
-    const int native_lib_count = _native_libs.count();
-    for (int i = 0; i < native_lib_count; i++) {
-        if (_native_libs[i]->contains(address)) {
-            return _native_libs[i];
-        }
+    CodeCache* lib = _native_libs.findByAddress(address);
+    if (lib != NULL && lib->parseState() == PARSE_PENDING) {
+        Symbols::requestParse(lib);
     }
-    return NULL;
+    return lib;
+}
+
+// Both lookups are costly: a linear scan over libraries and a binary search over the DWARF table
+FrameDesc* Profiler::findFrameDesc(const void* pc, CodeCache*& lib) {
+    FrameDesc* frame;
+    if (_frame_desc_cache.lookup(pc, lib, frame)) {
+        return frame;
+    }
+
+    u32 epoch = _frame_desc_cache.epoch();
+    lib = findLibraryByAddress(pc);
+    frame = lib != NULL ? lib->findFrameDesc(pc) : &FrameDesc::default_frame;
+    _frame_desc_cache.insert(pc, lib, frame, epoch);
+    return frame;
 }
 
 const char* Profiler::findNativeMethod(const void* address) {
@@ -296,17 +380,57 @@ const char* Profiler::findNativeMethod(const void* address) {
     return lib == NULL ? NULL : lib->binarySearch(address);
 }
 
+// Marks decide which frames to keep, so they are still found in the signal handler
+char Profiler::findNativeMark(const void* address, EventType event_type) {
+    CodeCache* lib = findLibraryByAddress(address);
+    if (lib == NULL) {
+        return 0;
+    } else if (event_type >= ALLOC_SAMPLE) {
+        // VM runtime mark of a library also applies to its code without symbols
+        return NativeFunc::mark(lib->binarySearch(address));
+    }
+    return lib->findMark(address);
+}
+
+ASGCT_CallFrame Profiler::resolveNativeFrame(const ASGCT_CallFrame& frame) {
+    ASGCT_CallFrame resolved = frame;
+    resolved.bci = BCI_NATIVE_FRAME;
+    resolved.method_id = (jmethodID)_native_symbolizer.lookup((const void*)frame.method_id);
+    return resolved;
+}
+
+// Resolves PCs added to the symbolizer. Libraries hit by samples are parsed first
+void Profiler::symbolizeNativeFrames() {
+    Symbols::parsePendingLibraries(&_native_libs, false);
+    _native_symbolizer.resolve(&_native_libs);
+}
+
+void Profiler::symbolizeNativeFrames(CallTraceStorage* storage) {
+    std::vector<CallTraceSample*> samples;
+    storage->collectSamples(samples);
+    CallTraceUnpacker unpacker;
+
+    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        CallTrace* trace = (*it)->acquireTrace();
+        if (trace != NULL) {
+            _native_symbolizer.add(unpacker.unpack(trace));
+        }
+    }
+    symbolizeNativeFrames();
+}
+
 CodeBlob* Profiler::findRuntimeStub(const void* address) {
     return _runtime_stubs.findBlobByAddress(address);
 }
 
-int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType event_type, int tid, u64* cpu) {
+int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType event_type, int tid, u64* cpu,
+                             UserStack* user_stack) {
     const void* callchain[MAX_NATIVE_FRAMES];
     int native_frames;
 
     // Use PerfEvents stack walker for execution samples, or basic stack walker for other events
     if (event_type == PERF_SAMPLE) {
-        native_frames = PerfEvents::walk(tid, ucontext, callchain, MAX_NATIVE_FRAMES, cpu);
+        native_frames = PerfEvents::walk(tid, ucontext, callchain, MAX_NATIVE_FRAMES, cpu, user_stack);
     } else if (_cstack == CSTACK_VM) {
         return 0;
     } else if (_cstack == CSTACK_DWARF) {
@@ -322,9 +446,16 @@ int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGC
     int depth = 0;
 
     for (int i = 0; i < native_frames; i++) {
-        const char* current_method_name = findNativeMethod(callchain[i]);
+        const char* current_method_name = NULL;
         char mark;
-        if (current_method_name != NULL && (mark = NativeFunc::mark(current_method_name)) != 0) {
+        if (_native_pc) {
+            mark = findNativeMark(callchain[i], event_type);
+        } else {
+            current_method_name = findNativeMethod(callchain[i]);
+            mark = current_method_name != NULL ? NativeFunc::mark(current_method_name) : 0;
+        }
+
+        if (mark != 0) {
             if (mark == MARK_VM_RUNTIME && event_type >= ALLOC_SAMPLE) {
                 // Skip all internal frames above VM runtime entry for allocation samples
                 depth = 0;
@@ -339,14 +470,62 @@ int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGC
             }
         }
 
-        frames[depth].bci = BCI_NATIVE_FRAME;
-        frames[depth].method_id = (jmethodID)current_method_name;
+        if (_native_pc) {
+            frames[depth].bci = BCI_NATIVE_PC;
+            frames[depth].method_id = (jmethodID)callchain[i];
+        } else {
+            frames[depth].bci = BCI_NATIVE_FRAME;
+            frames[depth].method_id = (jmethodID)current_method_name;
+        }
         depth++;
     }
 
     return depth;
 }
 
+// Unwinds a user stack copied by perf_events and inserts the frames at the given index
+int Profiler::insertUserFrames(const UserStack& stack, ASGCT_CallFrame* frames, int num_frames, int index, int max_depth) {
+    const void* callchain[MAX_NATIVE_FRAMES];
+    int native_frames = StackWalker::walkUserStack(stack, callchain, max_depth);
+
+    // Conversion may drop some frames; close the gap afterwards
+    ASGCT_CallFrame* tail = frames + index;
+    size_t tail_size = (num_frames - index) * sizeof(ASGCT_CallFrame);
+    memmove(tail + native_frames, tail, tail_size);
+    int depth = convertNativeTrace(native_frames, callchain, tail, PERF_SAMPLE);
+    if (depth < native_frames) {
+        memmove(tail + depth, tail + native_frames, tail_size);
+    }
+
+    num_frames += depth;
+    if (num_frames == 0) {
+        num_frames = makeFrame(frames, BCI_ERROR, "no_Java_frame");
+    }
+    return num_frames;
+}
+
+// Cuts a trace deeper than max_stack_depth and marks it as truncated.
+// The last tail_frames synthetic frames (thread, scheduling policy, CPU) are kept.
+int Profiler::truncateTrace(ASGCT_CallFrame* frames, int num_frames, int tail_frames) {
+    int depth = num_frames - tail_frames;
+    if (depth < _max_stack_depth || _truncated_stack_depth >= _max_stack_depth) {
+        return num_frames;
+    }
+
+    num_frames = _truncated_stack_depth;
+    num_frames += makeFrame(frames + num_frames, BCI_ERROR, "truncated");
+    for (int i = 0; i < tail_frames; i++) {
+        frames[num_frames++] = frames[depth + i];
+    }
+    return num_frames;
+}
+
+// Number of synthetic frames recordSample appends after the stack trace
+int Profiler::tailFrames(EventType event_type) {
+    return (_add_thread_frame ? 1 : 0) + (_add_sched_frame ? 1 : 0) +
+           (_add_cpu_frame && event_type == PERF_SAMPLE ? 1 : 0);
+}
+
 int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth) {
     // Workaround for JDK-8132510: it's not safe to call GetEnv() inside a signal handler
     // since JDK 9, so we do it only for threads already registered in ThreadLocalStorage
@@ -400,6 +579,7 @@ int Profiler::getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* f
 }
 
 u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Event* event) {
+    u64 handler_begin = _record_latency ? TSC::ticks() : 0;
     atomicInc(_total_samples);
 
     int tid = OS::threadId();
@@ -416,7 +596,7 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
         return 0;
     }
 
-    u64 stack_walk_begin = _features.stats ? OS::nanotime() : 0;
+    u64 stack_walk_begin = _record_latency ? TSC::ticks() : 0;
 
     ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
     jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames;
@@ -432,12 +612,27 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
     }
 
     u64 cpu = 0;
+    UserStack user_stack_copy;
+    UserStack* user_stack = NULL;
+    int user_index = 0;
+    int user_depth = 0;
     if (hasNativeStack(event_type)) {
         if (_features.pc_addr && event_type <= WALL_CLOCK_SAMPLE) {
             num_frames += makeFrame(frames + num_frames, BCI_ADDRESS, StackFrame(ucontext).pc());
         }
         if (_cstack != CSTACK_NO) {
-            num_frames += getNativeTrace(ucontext, frames + num_frames, event_type, tid, &cpu);
+            // In deferred mode, the drain thread unwinds the user stack copied by perf_events
+            if (_deferred && event_type == PERF_SAMPLE && PerfEvents::userStackSize() != 0) {
+                user_stack_copy.data = _sample_queue.stackBuffer(lock_index);
+                user_stack = &user_stack_copy;
+            }
+            int native_frames = getNativeTrace(ucontext, frames + num_frames, event_type, tid, &cpu, user_stack);
+            num_frames += native_frames;
+            if (user_stack != NULL && user_stack->size == 0) {
+                user_stack = NULL;
+            }
+            user_index = num_frames;
+            user_depth = MAX_NATIVE_FRAMES - native_frames;
         }
     }
 
@@ -463,11 +658,11 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
         num_frames += getJavaTraceJvmti(jvmti_frames + num_frames, frames + num_frames, start_depth, _max_stack_depth);
     }
 
-    if (num_frames == 0) {
+    if (num_frames == 0 && user_stack == NULL) {
         num_frames += makeFrame(frames + num_frames, BCI_ERROR, "no_Java_frame");
-    } else if (num_frames >= _max_stack_depth && _truncated_stack_depth < _max_stack_depth) {
-        num_frames = _truncated_stack_depth;
-        num_frames += makeFrame(frames + num_frames, BCI_ERROR, "truncated");
+    } else if (user_stack == NULL) {
+        // Otherwise, the trace is truncated once the user stack frames are inserted
+        num_frames = truncateTrace(frames, num_frames, 0);
     }
 
     if (_add_thread_frame) {
@@ -480,14 +675,41 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
         num_frames += makeFrame(frames + num_frames, BCI_CPU, cpu | 0x8000);
     }
 
-    if (stack_walk_begin != 0) {
-        u64 stack_walk_end = OS::nanotime();
-        atomicInc(_total_stack_walk_time, stack_walk_end - stack_walk_begin);
+    u64 stack_walk_end = 0;
+    if (_record_latency) {
+        stack_walk_end = TSC::ticks();
+        recordLatency(lock_index, event_type, LP_STACK_WALK, stack_walk_begin, stack_walk_end);
+    }
+
+    if (_deferred && SampleQueue::isDeferrable(event_type) &&
+        _sample_queue.push(lock_index, tid, counter, event_type, event, num_frames, frames,
+                           user_stack, user_index, user_depth)) {
+        // The drain thread will hash and record the sample; the trace ID is not known yet
+        _jfr.updateThreadCounter(event_type, event);
+        if (_record_latency) {
+            recordLatency(lock_index, event_type, LP_HANDLER, handler_begin, TSC::ticks());
+        }
+        unlock(lock_index);
+        return 0;
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
+    if (user_stack != NULL) {
+        // The queue is full, so the copy has to be unwound right here
+        num_frames = insertUserFrames(*user_stack, frames, num_frames, user_index, user_depth);
+        num_frames = truncateTrace(frames, num_frames, tailFrames(event_type));
+    }
+
+    u32 call_trace_id = _call_trace_storage->put(num_frames, frames, counter);
+    u64 put_end = _record_latency ? TSC::ticks() : 0;
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
 
+    if (_record_latency) {
+        u64 jfr_end = TSC::ticks();
+        recordLatency(lock_index, event_type, LP_PUT, stack_walk_end, put_end);
+        recordLatency(lock_index, event_type, LP_JFR, put_end, jfr_end);
+        recordLatency(lock_index, event_type, LP_HANDLER, handler_begin, jfr_end);
+    }
+
     unlock(lock_index);
     return (u64)tid << 32 | call_trace_id;
 }
@@ -507,8 +729,7 @@ void Profiler::recordExternalSample(u64 counter, int tid, EventType event_type,
         num_frames += makeFrame(frames + num_frames, BCI_ERROR, OS::schedPolicy(tid));
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
-
+    // The slot keeps the storage from being swapped or evicted under put()
     int lock_index = tryLock(tid);
     if (lock_index < 0) {
         // Too many concurrent signals already
@@ -516,6 +737,7 @@ void Profiler::recordExternalSample(u64 counter, int tid, EventType event_type,
         return;
     }
 
+    u32 call_trace_id = _call_trace_storage->put(num_frames, frames, counter);
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
 
     unlock(lock_index);
@@ -526,13 +748,15 @@ void Profiler::recordExternalSamples(u64 samples, u64 counter, int tid, u32 call
         return;
     }
 
-    _call_trace_storage.add(call_trace_id, samples, counter);
-
     int lock_index = tryLock(tid);
-    if (lock_index >= 0) {
-        _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
-        unlock(lock_index);
+    if (lock_index < 0) {
+        atomicInc(_failures[-ticks_skipped]);
+        return;
     }
+
+    _call_trace_storage->add(call_trace_id, samples, counter);
+    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
+    unlock(lock_index);
 }
 
 void Profiler::recordEventOnly(EventType event_type, Event* event) {
@@ -553,7 +777,7 @@ void Profiler::tryResetCounters() {
     // allocation events and skewed incorrect number of samples.
     // In JFR recording, each sample is recorded individually, so accumulated counters are not actually used.
     if (!_jfr.active()) {
-        _call_trace_storage.resetCounters();
+        _call_trace_storage->resetCounters();
     }
 }
 
@@ -894,6 +1118,12 @@ Error Profiler::start(Arguments& args, bool reset) {
         return Error("jfrsync is not supported with non-Java processes");
     }
 
+    if ((args._storage & STORAGE_EVICT) && args._mem_limit == 0) {
+        return Error("storage=evict requires memlimit");
+    } else if ((args._storage & STORAGE_SWAP) && args._output == OUTPUT_JFR) {
+        return Error("storage=swap is not compatible with JFR output");
+    }
+
     if (args._fdtransfer) {
         if (!FdTransferClient::connectToServer(args._fdtransfer_path)) {
             return Error("Failed to initialize FdTransferClient");
@@ -908,20 +1138,31 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    // Storage tables, chunks and bitmaps allocated from now on follow the new policy
+    if (!OS::setAllocPolicy(args._memory, args._numa_node)) {
+        return Error("Requested NUMA node is not online");
+    }
+
     // Save the arguments for shutdown or restart
     args.save();
 
     if (reset || _start_time == 0) {
         // Reset counters
         _total_samples = 0;
-        _total_stack_walk_time = 0;
         memset(_failures, 0, sizeof(_failures));
+        for (int i = 0; i <= _locks.count(); i++) {
+            if (_slot_latency[i] != NULL) {
+                memset(_slot_latency[i], 0, sizeof(SlotLatency));
+            }
+        }
+        memset(_reported_latency, 0, sizeof(_reported_latency));
+        _drain_time = 0;
 
         // Reset dictionaries and bitmaps
         lockAll();
         _class_map.clear();
         _thread_filter.clear();
-        _call_trace_storage.clear(args._mem_limit);
+        _call_trace_storage->clear(args._mem_limit, args._shards, args._storage);
         // Make sure frame structure is consistent throughout the entire recording
         _add_event_frame = args._output != OUTPUT_JFR;
         _add_thread_frame = args._threads && args._output != OUTPUT_JFR;
@@ -940,7 +1181,7 @@ Error Profiler::start(Arguments& args, bool reset) {
         _max_stack_depth = args._jstackdepth;
         size_t nelem = _max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES;
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        for (int i = 0; i < _locks.count(); i++) {
             free(_calltrace_buffer[i]);
             _calltrace_buffer[i] = (CallTraceBuffer*)calloc(nelem, sizeof(CallTraceBuffer));
             if (_calltrace_buffer[i] == NULL) {
@@ -951,6 +1192,38 @@ Error Profiler::start(Arguments& args, bool reset) {
     }
     _truncated_stack_depth = std::min(std::max(args._truncated_stack_depth, 0), _max_stack_depth);
 
+    if (args._features.stack_cache && _stack_cache_depth != _max_stack_depth) {
+        for (int i = 0; i < _locks.count(); i++) {
+            StackCache::destroy(_stack_cache[i]);
+            _stack_cache[i] = StackCache::create(_max_stack_depth);
+            if (_stack_cache[i] == NULL) {
+                _stack_cache_depth = 0;
+                return Error("Not enough memory to allocate stack caches (try smaller jstackdepth)");
+            }
+        }
+        _stack_cache_depth = _max_stack_depth;
+    }
+
+    if (args._deferred && !_sample_queue.allocated() && !_sample_queue.allocate(_locks.count())) {
+        return Error("Not enough memory to allocate deferred sample queues");
+    } else if (args._deferred && args._user_stack > 0 && !_sample_queue.allocateStacks(args._user_stack)) {
+        return Error("Not enough memory to allocate user stack buffers");
+    }
+    if (_sample_queue.allocated()) {
+        _sample_queue.reset();
+    }
+    _deferred = args._deferred;
+    _native_pc = args._native_pc;
+
+    // The overhead controller needs the handler time
+    _record_latency = args._features.stats || args._overhead > 0;
+    for (int i = 0; _record_latency && i <= _locks.count(); i++) {
+        if (_slot_latency[i] == NULL && (_slot_latency[i] = (SlotLatency*)calloc(1, sizeof(SlotLatency))) == NULL) {
+            _record_latency = false;
+            return Error("Not enough memory to allocate latency histograms");
+        }
+    }
+
     _features = args._features;
     if (!VMStructs::hasClassNames()) {
         _features.vtable_target = 0;
@@ -960,6 +1233,7 @@ Error Profiler::start(Arguments& args, bool reset) {
     }
 
     _update_thread_names = args._threads || args._output == OUTPUT_JFR;
+    _overhead.reset(args._overhead);
     _thread_filter.init(args._filter);
 
     _engine = selectEngine(args);
@@ -969,6 +1243,8 @@ Error Profiler::start(Arguments& args, bool reset) {
         return Error("target-cpu is only supported with perf_events");
     } else if (_engine != &perf_events && args._record_cpu) {
         return Error("record-cpu is only supported with perf_events");
+    } else if (_engine != &perf_events && args._user_stack > 0) {
+        return Error("userstack is only supported with perf_events");
     } else if (_engine == &instrument && !args._trace.empty()) {
         return Error("Running method tracing and Java method sampling in parallel is not supported");
     }
@@ -980,8 +1256,9 @@ Error Profiler::start(Arguments& args, bool reset) {
         return Error("VMStructs stack walking is not supported on this JVM/platform");
     }
 
-    if ((_cstack == CSTACK_DEFAULT || _cstack == CSTACK_DWARF) && VMStructs::hasStackStructs() && !_features.agct) {
-        // Use VMStructs by default when possible
+    if ((_cstack == CSTACK_DEFAULT || _cstack == CSTACK_DWARF) && VMStructs::hasStackStructs() && !_features.agct &&
+        args._user_stack == 0) {
+        // Use VMStructs by default when possible, unless native frames come from perf_events stack copies
         _cstack = args._cstack = CSTACK_VM;
     } else if (_cstack == CSTACK_DEFAULT && VM::isOpenJ9() && DWARF_SUPPORTED) {
         // OpenJ9 libs are compiled with frame pointers omitted
@@ -995,6 +1272,9 @@ Error Profiler::start(Arguments& args, bool reset) {
     }
 
     // Kernel symbols are useful only for perf_events without --all-user
+    Symbols::setLazyParsing(args._lazy_symbols);
+    Symbols::setParseThreads(args._parse_threads);
+    Symbols::setCacheDir(args._symcache);
     updateSymbols(_engine == &perf_events && !args._alluser);
 
     error = installTraps(args._begin, args._end, args._nostop);
@@ -1012,6 +1292,9 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    // TSC may have been switched on or off by the recording
+    _nanos_per_tick = (double)NANOTIME_FREQ / TSC::frequency();
+
     error = _engine->start(args);
     if (error) {
         goto error1;
@@ -1057,11 +1340,23 @@ Error Profiler::start(Arguments& args, bool reset) {
 
     switchThreadEvents(JVMTI_ENABLE);
 
+    if (_deferred) {
+        startDrainThread();
+    }
+
+    if (_overhead.enabled()) {
+        _overhead.addEngine(_engine);
+        if (hasEvent(EC_WALL)) _overhead.addEngine(&wall_clock);
+        if (hasEvent(EC_ALLOC)) _overhead.addEngine(_alloc_engine);
+        if (hasEvent(EC_NATIVEMEM)) _overhead.addEngine(&malloc_tracer);
+    }
+
     _state = RUNNING;
     _start_time = OS::micros();
     _epoch++;
 
-    if (args._timeout != 0 || args._loop != 0 || args._output == OUTPUT_JFR) {
+    if (args._timeout != 0 || args._loop != 0 || args._output == OUTPUT_JFR || (args._storage & STORAGE_EVICT) ||
+        _overhead.enabled()) {
         _loop_time = addTimeout(_start_time, args._loop);
         if (args._file_num == 0) {
             _stop_time = addTimeout(_start_time, args._timeout);
@@ -1120,6 +1415,9 @@ Error Profiler::stop(bool restart) {
 
     switchLibcHooks(false);
     switchThreadEvents(JVMTI_DISABLE);
+
+    stopDrainThread();
+
     updateJavaThreadNames();
     updateNativeThreadNames();
 
@@ -1129,8 +1427,10 @@ Error Profiler::stop(bool restart) {
     // Log before stopping JFR to include stats in the recording
     logStats();
 
-    // Acquire all spinlocks to avoid race with remaining signals
+    // Acquire all spinlocks to avoid race with remaining signals.
+    // Once all handlers are out, samples left in the queues are recorded synchronously.
     lockAll();
+    drainSamples(true);
     _jfr.stop();
     unlockAll();
 
@@ -1151,11 +1451,36 @@ Error Profiler::flushJfr() {
     updateJavaThreadNames();
     updateNativeThreadNames();
     if (hasEvent(EC_WALL)) wall_clock.flush();
+    drainSamples();
+
+    lockAll();
+    _jfr.flush();
+    unlockAll();
+
+    return Error::OK;
+}
+
+Error Profiler::evictCallTraces() {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return Error("Profiler is not active");
+    }
+
+    // Pending wall clock samples refer to trace IDs that are about to become invalid
+    if (hasEvent(EC_WALL)) wall_clock.flush();
+    if (_jfr.active()) {
+        updateJavaThreadNames();
+        updateNativeThreadNames();
+    }
+    drainSamples();
 
+    // Finish JFR chunk, so that all recorded events are resolved against the current generation of stack traces
     lockAll();
     _jfr.flush();
+    _call_trace_storage->evict();
     unlockAll();
 
+    Log::debug("Evicted cold stack traces, %llu in total", _call_trace_storage->evictedTraces());
     return Error::OK;
 }
 
@@ -1171,18 +1496,30 @@ Error Profiler::dump(Writer& out, Arguments& args) {
         updateJavaThreadNames();
         updateNativeThreadNames();
         if (hasEvent(EC_WALL)) wall_clock.flush();
+        drainSamples();
+    }
+
+    // With storage=swap, new samples go to the standby storage,
+    // while the retired one is dumped without blocking signal handlers
+    CallTraceStorage* storage = _call_trace_storage;
+    if (_state == RUNNING && args._output != OUTPUT_JFR && storage->swapEnabled()) {
+        storage = swapCallTraceStorage();
+    }
+
+    if (_native_pc && args._output != OUTPUT_JFR) {
+        symbolizeNativeFrames(storage);
     }
 
     switch (args._output) {
         case OUTPUT_COLLAPSED:
-            dumpCollapsed(out, args);
+            dumpCollapsed(out, args, storage);
             break;
         case OUTPUT_FLAMEGRAPH:
         case OUTPUT_TREE:
-            dumpFlameGraph(out, args);
+            dumpFlameGraph(out, args, storage);
             break;
         case OUTPUT_TEXT:
-            dumpText(out, args);
+            dumpText(out, args, storage);
             break;
         case OUTPUT_JFR:
             if (_state == RUNNING) {
@@ -1192,7 +1529,7 @@ Error Profiler::dump(Writer& out, Arguments& args) {
             }
             break;
         case OUTPUT_OTLP:
-            dumpOtlp(out, args);
+            dumpOtlp(out, args, storage);
             break;
         default:
             return Error("No output format selected");
@@ -1203,21 +1540,121 @@ Error Profiler::dump(Writer& out, Arguments& args) {
 
 void Profiler::writeMetrics(Writer& out) {
     constexpr size_t KB = 1024;
-    out << "mem_calltracestorage_kb " << (u64) _call_trace_storage.usedMemory() / KB << '\n';
+    size_t storage_memory = _call_trace_storages[0].usedMemory();
+    if (_call_trace_storage->swapEnabled()) storage_memory += _call_trace_storages[1].usedMemory();
+    out << "mem_calltracestorage_kb " << (u64) storage_memory / KB << '\n';
     out << "mem_flightrecorder_kb " << (u64) _jfr.usedMemory() / KB << '\n';
     out << "mem_classmap_kb " << (u64) _class_map.usedMemory() / KB << '\n';
     out << "mem_threadfilter_kb " << (u64) _thread_filter.usedMemory() / KB << '\n';
     out << "mem_runtimestubs_kb " << (u64) _runtime_stubs.usedMemory() / KB << '\n';
     out << "mem_nativelibs_kb " << (u64) _native_libs.usedMemory() / KB << '\n';
+    out << "mem_nativesymbolizer_kb " << (u64) _native_symbolizer.usedMemory() / KB << '\n';
+
+    size_t demangle_memory = 0;
+    u64 demangle_hits = 0;
+    u64 demangle_misses = 0;
+    for (int i = 0; i < _native_libs.count(); i++) {
+        DemangleCache* cache = _native_libs[i]->demangleCache();
+        demangle_memory += cache->usedMemory();
+        demangle_hits += cache->hits();
+        demangle_misses += cache->misses();
+    }
+    out << "mem_demanglecache_kb " << (u64) demangle_memory / KB << '\n';
+    out << "demanglecache_hits_total " << demangle_hits << '\n';
+    out << "demanglecache_misses_total " << demangle_misses << '\n';
 
     out << "samples_total " << _total_samples << '\n';
     out << "samples_skipped_total " << _failures[-ticks_skipped] << '\n';
-    out << "calltracestorage_overflows_total " << _call_trace_storage.overflow() << '\n';
-
-    if (_total_stack_walk_time != 0) {
-        out << "stackwalk_ns_total " << _total_stack_walk_time << '\n';
+    out << "calltracestorage_overflows_total " << _call_trace_storage->overflow() << '\n';
+    out << "calltracestorage_traces_total " << _call_trace_storage->traceCount() << '\n';
+    out << "calltracestorage_bytes_per_trace " << _call_trace_storage->bytesPerTrace() << '\n';
+    out << "calltracestorage_evictions_total " << _call_trace_storage->evictions() << '\n';
+    out << "calltracestorage_evicted_traces_total " << _call_trace_storage->evictedTraces() << '\n';
+    out << "calltracestorage_hash_collisions_total " << _call_trace_storage->collisions() << '\n';
+
+    AllocStats alloc_stats;
+    OS::getAllocStats(&alloc_stats);
+    out << "mem_hugepages_kb " << alloc_stats.huge_bytes / KB << '\n';
+    out << "mem_hugepage_fallbacks_total " << alloc_stats.huge_fallbacks << '\n';
+    out << "mem_numa_policy_kb " << alloc_stats.numa_bytes / KB << '\n';
+    out << "process_anon_hugepages_kb " << alloc_stats.anon_huge_kb << '\n';
+    out << "process_minor_faults_total " << alloc_stats.minor_faults << '\n';
+
+    u64 stack_walk_time = totalLatency(LP_STACK_WALK);
+    if (stack_walk_time != 0) {
+        out << "stackwalk_ns_total " << stack_walk_time << '\n';
         u64 stacks = _total_samples - _failures[-ticks_skipped];
-        out << "stackwalk_ns_avg " << (_total_stack_walk_time / stacks) << '\n';
+        out << "stackwalk_ns_avg " << (stack_walk_time / stacks) << '\n';
+    }
+
+    if (_features.stack_cache) {
+        u64 hits = 0, reused_frames = 0;
+        for (int i = 0; i < _locks.count(); i++) {
+            if (_stack_cache[i] != NULL) {
+                hits += _stack_cache[i]->hits();
+                reused_frames += _stack_cache[i]->reusedFrames();
+            }
+        }
+        out << "stackcache_hits_total " << hits << '\n';
+        out << "stackcache_reused_frames_total " << reused_frames << '\n';
+    }
+
+    writeLatencyMetrics(out);
+}
+
+// Prometheus histograms with engine and phase labels, e.g.
+// sample_latency_ns_bucket{engine="cpu",phase="handler",le="4096"} 1234
+void Profiler::writeLatencyMetrics(Writer& out) {
+    LatencyHistogram h;
+    for (int c = 0; c < EC_CATEGORIES; c++) {
+        for (int p = 0; p < LATENCY_PHASES; p++) {
+            mergeLatency(c, p, h);
+            u64 count = h.totalCount();
+            if (count == 0) continue;
+
+            char labels[64];
+            snprintf(labels, sizeof(labels), "engine=\"%s\",phase=\"%s\"", LATENCY_ENGINES[c], LATENCY_PHASE_NAMES[p]);
+
+            for (int b = MIN_LATENCY_BOUND_LOG; b <= MAX_LATENCY_BOUND_LOG; b++) {
+                out << "sample_latency_ns_bucket{" << labels << ",le=\"" << (u64)1 << b << "\"} ";
+                out << h.countBelow((u64)1 << b) << '\n';
+            }
+            out << "sample_latency_ns_bucket{" << labels << ",le=\"+Inf\"} " << count << '\n';
+            out << "sample_latency_ns_sum{" << labels << "} " << h.sum() << '\n';
+            out << "sample_latency_ns_count{" << labels << "} " << count << '\n';
+        }
+    }
+}
+
+// Summarizes the samples of each engine since the previous event
+void Profiler::recordOverhead() {
+    LatencyHistogram current;
+    LatencyHistogram delta;
+    for (int c = 0; c < EC_CATEGORIES; c++) {
+        OverheadEvent event;
+        event._start_time = TSC::ticks();
+        event._engine = LATENCY_ENGINES[c];
+
+        u64 avg[LATENCY_PHASES];
+        for (int p = 0; p < LATENCY_PHASES; p++) {
+            mergeLatency(c, p, current);
+            current.deltaFrom(_reported_latency[c][p], delta);
+            u64 count = delta.totalCount();
+            avg[p] = count == 0 ? 0 : delta.sum() / count;
+            if (p == LP_HANDLER) {
+                event._samples = count;
+                event._handler_p50 = delta.percentile(0.5);
+                event._handler_p99 = delta.percentile(0.99);
+            }
+        }
+
+        if (event._samples != 0) {
+            event._handler_avg = avg[LP_HANDLER];
+            event._stack_walk_avg = avg[LP_STACK_WALK];
+            event._put_avg = avg[LP_PUT];
+            event._jfr_avg = avg[LP_JFR];
+            _jfr.recordOverhead(&event);
+        }
     }
 }
 
@@ -1225,16 +1662,115 @@ void Profiler::logStats() {
     if (!_features.stats) return;
 
     u64 stacks = _total_samples - _failures[-ticks_skipped];
-    u64 avg_time = stacks == 0 ? 0 : _total_stack_walk_time / stacks;
+    u64 avg_time = stacks == 0 ? 0 : totalLatency(LP_STACK_WALK) / stacks;
     Log::info("Collected %llu stacks, avg time = %llu ns", stacks, avg_time);
 }
 
+CallTraceStorage* Profiler::swapCallTraceStorage() {
+    CallTraceStorage* current = _call_trace_storage;
+    CallTraceStorage* next = current == &_call_trace_storages[0] ? &_call_trace_storages[1] : &_call_trace_storages[0];
+
+    // Nobody has accessed the standby storage since the previous dump, so it's safe to clear it without locks
+    current->prepareSuccessor(*next);
+
+    lockAll();
+    _call_trace_storage = next;
+    unlockAll();
+
+    return current;
+}
+
 void Profiler::lockAll() {
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].lock();
+    _locks.lockAll();
+}
+
+// Processes samples queued by signal handlers in deferred mode.
+// Hashing a batch first lets the hash table slots of all its traces load in parallel.
+// With all_locked, the caller already holds all sample slots including the worker one.
+bool Profiler::drainSamples(bool all_locked) {
+    if (!_sample_queue.allocated()) {
+        return false;
+    }
+
+    MutexLocker ml(_drain_lock);
+    int slot = _locks.workerSlot();
+    SampleRecord* records[DRAIN_BATCH];
+    u64 hashes[DRAIN_BATCH];
+    bool drained = false;
+
+    for (int i = 0; i < _sample_queue.count(); i++) {
+        SampleRing* ring = _sample_queue.ring(i);
+        int count;
+        while ((count = ring->poll(records, DRAIN_BATCH)) > 0) {
+            u64 batch_begin = _record_latency ? TSC::ticks() : 0;
+            for (int j = 0; j < count; j++) {
+                SampleRecord* r = records[j];
+                if (r->stack_size != 0) {
+                    UserStack stack = r->userStack();
+                    r->num_frames = insertUserFrames(stack, r->frames(), r->num_frames, r->user_index, r->user_depth);
+                    r->num_frames = truncateTrace(r->frames(), r->num_frames, tailFrames(r->event_type));
+                    r->stack_size = 0;
+                }
+                hashes[j] = CallTraceStorage::hash(r->num_frames, r->frames());
+            }
+
+            // The worker slot keeps the storage from being swapped or evicted under the batch
+            if (!all_locked) _locks.lock(slot);
+            for (int j = 0; j < count; j++) {
+                _call_trace_storage->prefetch(hashes[j]);
+            }
+            u64 put_begin = _record_latency ? TSC::ticks() : 0;
+            for (int j = 0; j < count; j++) {
+                SampleRecord* r = records[j];
+                u32 call_trace_id = _call_trace_storage->put(r->num_frames, r->frames(), r->counter, hashes[j]);
+                u64 put_end = _record_latency ? TSC::ticks() : 0;
+                _jfr.recordEvent(slot, r->tid, call_trace_id, r->event_type, r->getEvent());
+
+                if (_record_latency) {
+                    u64 jfr_end = TSC::ticks();
+                    recordLatency(slot, r->event_type, LP_PUT, put_begin, put_end);
+                    recordLatency(slot, r->event_type, LP_JFR, put_end, jfr_end);
+                    put_begin = jfr_end;
+                }
+            }
+            if (!all_locked) _locks.unlock(slot);
+
+            if (_record_latency) {
+                storeRelease(_drain_time, _drain_time + (u64)((TSC::ticks() - batch_begin) * _nanos_per_tick));
+            }
+            ring->release();
+            drained = true;
+        }
+    }
+    return drained;
+}
+
+void Profiler::startDrainThread() {
+    _drain_running = true;
+    if (pthread_create(&_drain_thread, NULL, drainThreadEntry, NULL) != 0) {
+        // Queued samples are still recorded on flush, and handlers fall back to inline processing when full
+        Log::warn("Unable to start deferred sample thread");
+        _drain_running = false;
+    }
+}
+
+void Profiler::stopDrainThread() {
+    if (_drain_running) {
+        storeRelease(_drain_running, false);
+        pthread_join(_drain_thread, NULL);
+    }
+}
+
+void Profiler::drainLoop() {
+    while (loadAcquire(_drain_running)) {
+        if (!drainSamples()) {
+            OS::sleep(DRAIN_IDLE_SLEEP);
+        }
+    }
 }
 
 void Profiler::unlockAll() {
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].unlock();
+    _locks.unlockAll();
 }
 
 void Profiler::switchThreadEvents(jvmtiEventMode mode) {
@@ -1251,17 +1787,18 @@ void Profiler::switchThreadEvents(jvmtiEventMode mode) {
  *
  * <frame>;<frame>;...;<topmost frame> <count>
  */
-void Profiler::dumpCollapsed(Writer& out, Arguments& args) {
+void Profiler::dumpCollapsed(Writer& out, Arguments& args, CallTraceStorage* storage) {
     FrameName fn(args, args._style | STYLE_NO_SEMICOLON, _epoch, _thread_names_lock, _thread_names);
     char buf[32];
     u64 printed_sample_count = 0;
 
     std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+    storage->collectSamples(samples);
+    CallTraceUnpacker unpacker;
 
     for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
         CallTrace* trace = (*it)->acquireTrace();
-        if (trace == NULL || fn.excludeTrace(trace)) continue;
+        if (trace == NULL || fn.excludeTrace(trace = unpacker.unpack(trace))) continue;
 
         u64 counter = args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter;
         if (counter == 0) continue;
@@ -1277,7 +1814,7 @@ void Profiler::dumpCollapsed(Writer& out, Arguments& args) {
     logEmptyOutput(args, printed_sample_count, out);
 }
 
-void Profiler::dumpFlameGraph(Writer& out, Arguments& args) {
+void Profiler::dumpFlameGraph(Writer& out, Arguments& args, CallTraceStorage* storage) {
     Engine* active_engine = activeEngine();
 
     char title[64];
@@ -1298,11 +1835,12 @@ void Profiler::dumpFlameGraph(Writer& out, Arguments& args) {
         FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names);
 
         std::vector<CallTraceSample*> samples;
-        _call_trace_storage.collectSamples(samples);
+        storage->collectSamples(samples);
+        CallTraceUnpacker unpacker;
 
         for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
             CallTrace* trace = (*it)->acquireTrace();
-            if (trace == NULL || fn.excludeTrace(trace)) continue;
+            if (trace == NULL || fn.excludeTrace(trace = unpacker.unpack(trace))) continue;
 
             u64 counter = args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter;
             if (counter == 0) continue;
@@ -1347,24 +1885,25 @@ void Profiler::dumpFlameGraph(Writer& out, Arguments& args) {
     logEmptyOutput(args, printed_sample_count, out);
 }
 
-void Profiler::dumpText(Writer& out, Arguments& args) {
+void Profiler::dumpText(Writer& out, Arguments& args, CallTraceStorage* storage) {
     FrameName fn(args, args._style | STYLE_DOTTED, _epoch, _thread_names_lock, _thread_names);
     char buf[1024] = {0};
 
     std::vector<CallTraceSample> samples;
+    CallTraceUnpacker unpacker;
     u64 total_counter = 0;
     {
-        std::map<u64, CallTraceSample> map;
-        _call_trace_storage.collectSamples(map);
+        std::multimap<u64, CallTraceSample> map;
+        storage->collectSamples(map);
         samples.reserve(map.size());
 
-        for (std::map<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        for (std::multimap<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
             CallTrace* trace = it->second.trace;
             u64 counter = it->second.counter;
             if (trace == NULL || counter == 0) continue;
 
             total_counter += counter;
-            if (trace->num_frames == 0 || fn.excludeTrace(trace)) continue;
+            if (trace->num_frames == 0 || fn.excludeTrace(unpacker.unpack(trace))) continue;
             samples.push_back(it->second);
         }
     }
@@ -1402,7 +1941,7 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
                      it->samples, it->samples == 1 ? "" : "s");
             out << buf;
 
-            CallTrace* trace = it->trace;
+            CallTrace* trace = unpacker.unpack(it->trace);
             for (int j = 0; j < trace->num_frames; j++) {
                 const char* frame_name = fn.name(trace->frames[j]);
                 snprintf(buf, sizeof(buf) - 1, "  [%2d] %s\n", j, frame_name);
@@ -1416,7 +1955,7 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
     if (args._dump_flat > 0) {
         std::map<std::string, MethodSample> histogram;
         for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-            const char* frame_name = fn.name(it->trace->frames[0]);
+            const char* frame_name = fn.name(unpacker.unpack(it->trace)->frames[0]);
             histogram[frame_name].add(it->samples, it->counter);
         }
 
@@ -1436,11 +1975,11 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
     }
 }
 
-void Profiler::dumpOtlp(Writer& out, Arguments& args) {
+void Profiler::dumpOtlp(Writer& out, Arguments& args, CallTraceStorage* storage) {
     FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names);
     Otlp::Recorder recorder(activeEngine(), fn, _start_time * 1000ULL, (OS::micros() - _start_time) * 1000ULL);
     std::vector<CallTraceSample*> call_trace_samples;
-    _call_trace_storage.collectSamples(call_trace_samples);
+    storage->collectSamples(call_trace_samples);
     recorder.record(call_trace_samples, args._counter == COUNTER_SAMPLES);
     recorder.write(out);
 }
@@ -1522,7 +2061,8 @@ void Profiler::stopTimer() {
 void Profiler::timerLoop(void* timer_id) {
     u64 current_micros = OS::micros();
     u64 loop_limit = std::min(_stop_time, _loop_time);
-    u64 sleep_until = _jfr.active() ? current_micros + 1000000 : loop_limit;
+    u64 sleep_until = _jfr.active() || _call_trace_storage->evictionEnabled() || _overhead.enabled()
+                      ? current_micros + 1000000 : loop_limit;
 
     while (true) {
         {
@@ -1535,12 +2075,28 @@ void Profiler::timerLoop(void* timer_id) {
         }
 
         if ((current_micros = OS::micros()) >= loop_limit) {
-            expire(_global_args, current_micros < _stop_time);
-            return;
+            if (current_micros < _stop_time && _call_trace_storage->swapEnabled() && _global_args._file != NULL) {
+                // Dump the finished loop iteration while profiling goes on
+                rotate(_global_args);
+                _loop_time = addTimeout(current_micros, _global_args._loop);
+                loop_limit = std::min(_stop_time, _loop_time);
+            } else {
+                expire(_global_args, current_micros < _stop_time);
+                return;
+            }
         }
 
         bool need_switch_chunk = _jfr.timerTick(current_micros, _gc_id);
-        if (need_switch_chunk) {
+        if (_jfr.active() && _record_latency) {
+            recordOverhead();
+        }
+        if (_overhead.enabled()) {
+            tuneIntervals();
+        }
+        if (_call_trace_storage->needsEviction()) {
+            // Eviction starts a new JFR chunk anyway
+            evictCallTraces();
+        } else if (need_switch_chunk) {
             // Flush under profiler state lock
             flushJfr();
         }
@@ -1549,6 +2105,34 @@ void Profiler::timerLoop(void* timer_id) {
     }
 }
 
+void Profiler::tuneIntervals() {
+    // Engines must not be retuned after they are stopped
+    if (!_state_lock.tryLock()) {
+        return;
+    }
+
+    u64 utime, stime;
+    OS::getProcessCpuTime(&utime, &stime);
+    u64 cpu_time = (utime + stime) * (1000000000 / OS::clock_ticks_per_sec);
+
+    // Everything the profiler does per sample: the signal handler, and the drain thread in deferred mode
+    u64 profiler_time = totalLatency(LP_HANDLER) + loadAcquire(_drain_time);
+    if (_state == RUNNING && _overhead.update(profiler_time, _total_samples, cpu_time)) {
+        float overhead = (float)_overhead.overhead();
+        for (int i = 0; i < _overhead.engineCount(); i++) {
+            TunedEngine* t = _overhead.engine(i);
+            long interval = _overhead.scaledInterval(t->base_interval);
+            if (interval != t->interval && t->engine->setInterval(interval)) {
+                Log::debug("%s interval %ld -> %ld at %.2f%% overhead", t->engine->type(), t->interval, interval, overhead * 100);
+                _jfr.recordIntervalChange(t->engine->type(), t->interval, interval, overhead);
+                t->interval = interval;
+            }
+        }
+    }
+
+    _state_lock.unlock();
+}
+
 void Profiler::logEmptyOutput(Arguments& args, u64 printed_samples_count, Writer& out) {
     if (!out.good()) {
         Log::warn("Output file may be incomplete");
@@ -1664,6 +2248,22 @@ Error Profiler::run(Arguments& args) {
     }
 }
 
+Error Profiler::rotate(Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return Error("Profiler is not active");
+    }
+
+    FileWriter out(args.file());
+    if (!out.is_open()) {
+        return Error("Could not open output file");
+    }
+
+    Error error = dump(out, args);
+    args._file_num++;
+    return error;
+}
+
 Error Profiler::expire(Arguments& args, bool restart) {
     MutexLocker ml(_state_lock);
 
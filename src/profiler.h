@@ -16,8 +16,14 @@
 #include "engine.h"
 #include "event.h"
 #include "flightRecorder.h"
+#include "frameDescCache.h"
+#include "latencyHistogram.h"
 #include "log.h"
 #include "mutex.h"
+#include "nativeSymbolizer.h"
+#include "overheadController.h"
+#include "sampleLocks.h"
+#include "sampleQueue.h"
 #include "spinLock.h"
 #include "threadFilter.h"
 #include "trap.h"
@@ -27,7 +33,6 @@
 
 const int MAX_NATIVE_FRAMES = 128;
 const int RESERVED_FRAMES   = 10;  // for synthetic frames
-const int CONCURRENCY_LEVEL = 16;
 
 
 union CallTraceBuffer {
@@ -35,8 +40,15 @@ union CallTraceBuffer {
     jvmtiFrameInfo _jvmti_frames[1];
 };
 
+// Latency histograms of one sample slot, per event category. Only the holder
+// of the slot records to them, so handlers on different CPUs share no cache lines.
+struct SlotLatency {
+    LatencyHistogram phases[EC_CATEGORIES][LATENCY_PHASES];
+};
+
 
 class NMethod;
+class StackCache;
 class StackContext;
 
 enum State {
@@ -59,7 +71,9 @@ class Profiler {
     std::map<int, jlong> _thread_ids;
     Dictionary _class_map;
     ThreadFilter _thread_filter;
-    CallTraceStorage _call_trace_storage;
+    // The second storage is a standby for storage=swap
+    CallTraceStorage _call_trace_storages[2];
+    CallTraceStorage* _call_trace_storage;
     FlightRecorder _jfr;
     Engine* _engine;
     Engine* _alloc_engine;
@@ -74,15 +88,32 @@ class Profiler {
     void* _timer_id;
 
     u64 _total_samples;
-    u64 _total_stack_walk_time;
     u64 _failures[ASGCT_FAILURE_TYPES];
-
-    SpinLock _locks[CONCURRENCY_LEVEL];
-    CallTraceBuffer* _calltrace_buffer[CONCURRENCY_LEVEL];
+    OverheadController _overhead;
+    // Samples are timed only with features=stats or overhead=; one set per sample slot.
+    // The reported copy holds the merged state as of the last profiler.Overhead event.
+    bool _record_latency;
+    SlotLatency* _slot_latency[MAX_CONCURRENCY_LEVEL + 1];
+    LatencyHistogram _reported_latency[EC_CATEGORIES][LATENCY_PHASES];
+    double _nanos_per_tick;
+
+    SampleLocks _locks;
+    CallTraceBuffer* _calltrace_buffer[MAX_CONCURRENCY_LEVEL];
+    StackCache* _stack_cache[MAX_CONCURRENCY_LEVEL];
+    int _stack_cache_depth;
+    // Raw samples waiting for the drain thread in deferred mode
+    SampleQueue _sample_queue;
+    Mutex _drain_lock;
+    // Nanoseconds the drain thread spent on samples, timed along with the latency histograms
+    u64 _drain_time;
+    bool _deferred;
+    volatile bool _drain_running;
+    pthread_t _drain_thread;
     int _max_stack_depth;
     int _truncated_stack_depth;
     StackWalkFeatures _features;
     CStack _cstack;
+    bool _native_pc;
     bool _add_event_frame;
     bool _add_thread_frame;
     bool _add_sched_frame;
@@ -93,6 +124,8 @@ class Profiler {
     SpinLock _stubs_lock;
     CodeCache _runtime_stubs;
     CodeCacheArray _native_libs;
+    FrameDescCache _frame_desc_cache;
+    NativeSymbolizer _native_symbolizer;
 
     // dlopen() hook support
     void** _dlopen_entry;
@@ -113,9 +146,21 @@ class Profiler {
     void onGarbageCollectionFinish();
 
     const char* asgctError(int code);
+    void recordLatency(int lock_index, EventType event_type, LatencyPhase phase, u64 begin_ticks, u64 end_ticks);
+    void mergeLatency(int category, int phase, LatencyHistogram& result);
+    u64 totalLatency(LatencyPhase phase);
+    void recordOverhead();
+    void writeLatencyMetrics(Writer& out);
     int tryLock(int tid);
     void unlock(int lock_index);
-    int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType event_type, int tid, u64* cpu);
+    int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType event_type, int tid, u64* cpu,
+                       UserStack* user_stack);
+    int insertUserFrames(const UserStack& stack, ASGCT_CallFrame* frames, int num_frames, int index, int max_depth);
+    int truncateTrace(ASGCT_CallFrame* frames, int num_frames, int tail_frames);
+    int tailFrames(EventType event_type);
+    char findNativeMark(const void* address, EventType event_type);
+    void symbolizeNativeFrames();
+    void symbolizeNativeFrames(CallTraceStorage* storage);
     int getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth);
     int getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int start_depth, int max_depth);
     void setThreadInfo(int tid, const char* name, jlong java_thread_id);
@@ -123,6 +168,7 @@ class Profiler {
     void updateJavaThreadNames();
     void updateNativeThreadNames();
     void mangle(const char* name, char* buf, size_t size);
+    const void* findSymbol(const char* name);
     Engine* selectEngine(Arguments& args);
     Engine* selectAllocEngine(bool tlab);
     Engine* activeEngine();
@@ -132,6 +178,12 @@ class Profiler {
     void startTimer();
     void stopTimer();
     void timerLoop(void* timer_id);
+    void tuneIntervals();
+
+    bool drainSamples(bool all_locked = false);
+    void startDrainThread();
+    void stopDrainThread();
+    void drainLoop();
 
     void logEmptyOutput(Arguments& args, u64 printed_samples_count, Writer& out);
 
@@ -148,13 +200,21 @@ class Profiler {
         return NULL;
     }
 
+    static void* drainThreadEntry(void* arg) {
+        instance()->drainLoop();
+        return NULL;
+    }
+
     void lockAll();
     void unlockAll();
 
-    void dumpCollapsed(Writer& out, Arguments& args);
-    void dumpFlameGraph(Writer& out, Arguments& args);
-    void dumpText(Writer& out, Arguments& args);
-    void dumpOtlp(Writer& out, Arguments& args);
+    CallTraceStorage* swapCallTraceStorage();
+    Error rotate(Arguments& args);
+
+    void dumpCollapsed(Writer& out, Arguments& args, CallTraceStorage* storage);
+    void dumpFlameGraph(Writer& out, Arguments& args, CallTraceStorage* storage);
+    void dumpText(Writer& out, Arguments& args, CallTraceStorage* storage);
+    void dumpOtlp(Writer& out, Arguments& args, CallTraceStorage* storage);
 
     static Profiler* const _instance;
 
@@ -164,14 +224,22 @@ class Profiler {
         _begin_trap(2),
         _end_trap(3),
         _thread_filter(),
-        _call_trace_storage(),
+        _call_trace_storages(),
+        _call_trace_storage(&_call_trace_storages[0]),
         _jfr(),
         _start_time(0),
         _epoch(0),
         _gc_id(0),
         _timer_id(NULL),
+        _record_latency(false),
+        _nanos_per_tick(1),
+        _stack_cache_depth(0),
+        _drain_time(0),
+        _deferred(false),
+        _drain_running(false),
         _max_stack_depth(0),
         _truncated_stack_depth(0),
+        _native_pc(false),
         _thread_events_state(JVMTI_DISABLE),
         _stubs_lock(),
         _runtime_stubs("[stubs]"),
@@ -179,8 +247,12 @@ class Profiler {
         _dlopen_entry(NULL),
         _pthread_setspecific_entry(NULL) {
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        for (int i = 0; i < MAX_CONCURRENCY_LEVEL; i++) {
             _calltrace_buffer[i] = NULL;
+            _stack_cache[i] = NULL;
+        }
+        for (int i = 0; i <= MAX_CONCURRENCY_LEVEL; i++) {
+            _slot_latency[i] = NULL;
         }
     }
 
@@ -192,6 +264,8 @@ class Profiler {
     long uptime()       { return (OS::micros() - _start_time) / 1000000ULL; }
 
     Dictionary* classMap() { return &_class_map; }
+    int concurrencyLevel() { return _locks.count(); }
+    StackCache* stackCache(int lock_index) { return _stack_cache[lock_index]; }
     ThreadFilter* threadFilter() { return &_thread_filter; }
     CodeCacheArray* nativeLibs() { return &_native_libs; }
     FlightRecorder* jfr() { return &_jfr; }
@@ -203,6 +277,7 @@ class Profiler {
     Error start(Arguments& args, bool reset);
     Error stop(bool restart = false);
     Error flushJfr();
+    Error evictCallTraces();
     Error dump(Writer& out, Arguments& args);
     void logStats();
     void writeMetrics(Writer& out);
@@ -215,14 +290,22 @@ class Profiler {
     void tryResetCounters();
 
     void updateSymbols(bool kernel_symbols);
+    void invalidateSymbolCaches();
     const void* resolveSymbol(const char* name);
     const char* getLibraryName(const char* native_symbol);
+    bool demangle(const char* native_symbol, bool full_signature, std::string& result);
     CodeCache* findJvmLibrary(const char* lib_name);
     CodeCache* findLibraryByName(const char* lib_name);
     CodeCache* findLibraryByAddress(const void* address);
+    FrameDesc* findFrameDesc(const void* pc, CodeCache*& lib);
     const char* findNativeMethod(const void* address);
+    ASGCT_CallFrame resolveNativeFrame(const ASGCT_CallFrame& frame);
     CodeBlob* findRuntimeStub(const void* address);
 
+    const char* runtimeStubName(const CodeBlob* stub) {
+        return _runtime_stubs.blobName(stub);
+    }
+
     void trapHandler(int signo, siginfo_t* siginfo, void* ucontext);
     static void crashHandler(int signo, siginfo_t* siginfo, void* ucontext);
     static void wakeupHandler(int signo);
@@ -0,0 +1,84 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SAMPLELOCKS_H
+#define _SAMPLELOCKS_H
+
+#include "os.h"
+#include "spinLock.h"
+
+
+const int MIN_CONCURRENCY_LEVEL = 16;
+const int MAX_CONCURRENCY_LEVEL = 1024;
+const int SPARE_PROBES = 4;
+
+// While recording a sample, a signal handler owns a slot with its own stack trace buffer
+// and JFR buffer. The slot is chosen by the current CPU: a CPU runs one handler at a time,
+// unless the handler is preempted or interrupted by another signal, so threads compete
+// for a slot only in these rare cases. Spare slots picked by thread ID serve them.
+// One extra slot past the signal slots belongs to the deferred sample worker.
+class SampleLocks {
+  private:
+    struct Slot {
+        SpinLock lock;
+        // To avoid false sharing between neighbour CPUs
+        char _padding[64 - sizeof(SpinLock)];
+    };
+
+    Slot _slots[MAX_CONCURRENCY_LEVEL + 1];
+    int _count;
+
+  public:
+    // Twice as many slots as CPUs leave room for spares
+    SampleLocks(int cpu_count = OS::getCpuCount()) : _count(MIN_CONCURRENCY_LEVEL) {
+        while (_count < cpu_count * 2 && _count < MAX_CONCURRENCY_LEVEL) {
+            _count *= 2;
+        }
+    }
+
+    int count() const {
+        return _count;
+    }
+
+    int workerSlot() const {
+        return _count;
+    }
+
+    int tryLock(int tid) {
+        int mask = _count - 1;
+        int cpu = OS::getCurrentCpu();
+        if (cpu >= 0 && _slots[cpu & mask].lock.tryLock()) {
+            return cpu & mask;
+        }
+
+        u32 index = (u32)tid * 0x9e3779b9U;
+        index ^= index >> 16;
+        for (int i = 0; i < SPARE_PROBES; i++) {
+            int slot = (index + i) & mask;
+            if (_slots[slot].lock.tryLock()) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+    void lock(int slot) {
+        _slots[slot].lock.lock();
+    }
+
+    void unlock(int slot) {
+        _slots[slot].lock.unlock();
+    }
+
+    void lockAll() {
+        for (int i = 0; i <= _count; i++) _slots[i].lock.lock();
+    }
+
+    void unlockAll() {
+        for (int i = 0; i <= _count; i++) _slots[i].lock.unlock();
+    }
+};
+
+#endif // _SAMPLELOCKS_H
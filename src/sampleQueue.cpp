@@ -0,0 +1,58 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "sampleQueue.h"
+#include "os.h"
+
+
+SampleQueue::~SampleQueue() {
+    if (_memory != NULL) {
+        OS::safeFree(_memory, _count * _ring_size);
+        delete[] _rings;
+    }
+    if (_stacks != NULL) {
+        OS::safeFree(_stacks, (size_t)_count * _stack_size);
+    }
+}
+
+bool SampleQueue::allocate(int count, size_t ring_size) {
+    char* memory = (char*)OS::safeAlloc(count * ring_size);
+    if (memory == NULL) {
+        return false;
+    }
+
+    _rings = new SampleRing[count];
+    for (int i = 0; i < count; i++) {
+        _rings[i].init(memory + i * ring_size, ring_size);
+    }
+    _memory = memory;
+    _ring_size = ring_size;
+    _count = count;
+    return true;
+}
+
+void SampleQueue::reset() {
+    for (int i = 0; i < _count; i++) {
+        _rings[i].reset();
+    }
+}
+
+bool SampleQueue::allocateStacks(u32 stack_size) {
+    if (_stack_size >= stack_size) {
+        return true;
+    }
+
+    char* stacks = (char*)OS::safeAlloc((size_t)_count * stack_size);
+    if (stacks == NULL) {
+        return false;
+    }
+
+    if (_stacks != NULL) {
+        OS::safeFree(_stacks, (size_t)_count * _stack_size);
+    }
+    _stacks = stacks;
+    _stack_size = stack_size;
+    return true;
+}
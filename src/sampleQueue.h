@@ -0,0 +1,251 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SAMPLEQUEUE_H
+#define _SAMPLEQUEUE_H
+
+#include "arch.h"
+#include "event.h"
+#include "stackWalker.h"
+#include "vmEntry.h"
+
+
+const size_t SAMPLE_RING_SIZE = 256 * 1024;
+const size_t MAX_DEFERRED_EVENT = 32;
+
+// A raw sample as collected by a signal handler, followed by num_frames frames.
+// A sample with a user stack copy also has room for user_depth more frames,
+// then the registers and stack_size bytes of the stack.
+// Records are 8-byte aligned; size 0 marks the unused end of the ring before wrap-around.
+struct SampleRecord {
+    u32 size;
+    int tid;
+    int num_frames;
+    EventType event_type;
+    u64 counter;
+    u32 stack_size;
+    u16 user_index;  // where frames unwound from the stack copy belong
+    u16 user_depth;
+    u64 event[MAX_DEFERRED_EVENT / sizeof(u64)];
+
+    ASGCT_CallFrame* frames() {
+        return (ASGCT_CallFrame*)(this + 1);
+    }
+
+    Event* getEvent() {
+        return (Event*)event;
+    }
+
+    // Valid until the frames from the stack copy have been inserted
+    UserStack userStack() {
+        const uintptr_t* regs = (const uintptr_t*)(frames() + num_frames + user_depth);
+        UserStack stack;
+        stack.pc = (const void*)regs[0];
+        stack.sp = regs[1];
+        stack.fp = regs[2];
+        stack.lr = regs[3];
+        stack.data = (const char*)(regs + 4);
+        stack.size = stack_size;
+        stack.offset = 0;
+        stack.mask = (u32)-1;
+        return stack;
+    }
+};
+
+// Single-producer single-consumer byte ring of variable-size records.
+// The producer is a signal handler owning the corresponding sample slot,
+// the consumer is whoever holds the drain lock of the profiler.
+class SampleRing {
+  private:
+    char* _data;
+    u32 _capacity;
+    // Producer and consumer positions are monotonic and never wrap themselves
+    volatile u64 _tail;
+    u64 _reserved;
+    char _padding1[64 - 2 * sizeof(u64)];
+    volatile u64 _head;
+    u64 _polled;
+    char _padding2[64 - 2 * sizeof(u64)];
+
+  public:
+    SampleRing() : _data(NULL), _capacity(0), _tail(0), _reserved(0), _head(0), _polled(0) {
+    }
+
+    void init(char* data, u32 capacity) {
+        _data = data;
+        _capacity = capacity;
+        _tail = _reserved = _head = _polled = 0;
+    }
+
+    // Drops all records; neither a producer nor a consumer may be active
+    void reset() {
+        _tail = _reserved = _head = _polled = 0;
+    }
+
+    // Returns NULL if the record does not fit into the free space
+    SampleRecord* reserve(u32 size) {
+        u64 tail = _tail;
+        u32 pos = tail & (_capacity - 1);
+        u32 skip = pos + size > _capacity ? _capacity - pos : 0;
+        if (tail + skip + size - loadAcquire(_head) > _capacity) {
+            return NULL;
+        }
+
+        if (skip != 0) {
+            ((SampleRecord*)(_data + pos))->size = 0;
+            pos = 0;
+        }
+        _reserved = tail + skip + size;
+
+        SampleRecord* record = (SampleRecord*)(_data + pos);
+        record->size = size;
+        return record;
+    }
+
+    void commit() {
+        storeRelease(_tail, _reserved);
+    }
+
+    // Collects up to max records published so far. They remain valid until release()
+    int poll(SampleRecord** records, int max) {
+        u64 tail = loadAcquire(_tail);
+        int count = 0;
+        while (count < max && _polled != tail) {
+            u32 pos = _polled & (_capacity - 1);
+            SampleRecord* record = (SampleRecord*)(_data + pos);
+            if (record->size == 0) {
+                _polled += _capacity - pos;
+            } else {
+                records[count++] = record;
+                _polled += record->size;
+            }
+        }
+        return count;
+    }
+
+    void release() {
+        storeRelease(_head, _polled);
+    }
+
+    bool isEmpty() {
+        return _head == loadAcquire(_tail);
+    }
+};
+
+// One ring per sample slot: a slot is owned by one signal handler at a time,
+// so every ring has exactly one producer despite any number of threads
+class SampleQueue {
+  private:
+    SampleRing* _rings;
+    int _count;
+    char* _memory;
+    size_t _ring_size;
+    char* _stacks;
+    u32 _stack_size;
+
+  public:
+    SampleQueue() : _rings(NULL), _count(0), _memory(NULL), _ring_size(0), _stacks(NULL), _stack_size(0) {
+    }
+
+    ~SampleQueue();
+
+    bool allocate(int count, size_t ring_size = SAMPLE_RING_SIZE);
+
+    // Per-slot buffers where signal handlers put user stack copies before pushing them
+    bool allocateStacks(u32 stack_size);
+
+    // Forgets records left from the previous profiling session
+    void reset();
+
+    char* stackBuffer(int slot) {
+        return _stacks + (size_t)slot * _stack_size;
+    }
+
+    bool allocated() const {
+        return _rings != NULL;
+    }
+
+    int count() const {
+        return _count;
+    }
+
+    SampleRing* ring(int index) {
+        return &_rings[index];
+    }
+
+    static bool isDeferrable(EventType event_type) {
+        // Other events either need the trace ID in the caller, or are not frequent enough to matter
+        return event_type == PERF_SAMPLE || event_type == EXECUTION_SAMPLE ||
+               event_type == NATIVE_LOCK_SAMPLE || event_type == MALLOC_SAMPLE;
+    }
+
+    // Every event type accepted by isDeferrable() must fit in SampleRecord::event
+    static_assert(sizeof(ExecutionEvent) <= MAX_DEFERRED_EVENT, "ExecutionEvent does not fit in a deferred sample");
+    static_assert(sizeof(NativeLockEvent) <= MAX_DEFERRED_EVENT, "NativeLockEvent does not fit in a deferred sample");
+    static_assert(sizeof(MallocEvent) <= MAX_DEFERRED_EVENT, "MallocEvent does not fit in a deferred sample");
+
+    static size_t eventSize(EventType event_type) {
+        switch (event_type) {
+            case NATIVE_LOCK_SAMPLE:
+                return sizeof(NativeLockEvent);
+            case MALLOC_SAMPLE:
+                return sizeof(MallocEvent);
+            default:
+                return sizeof(ExecutionEvent);
+        }
+    }
+
+    // Called in a signal handler that holds the given slot.
+    // The consumer unwinds the stack copy, if any, and inserts up to user_depth frames at user_index.
+    bool push(int slot, int tid, u64 counter, EventType event_type, Event* event,
+              int num_frames, ASGCT_CallFrame* frames,
+              const UserStack* stack = NULL, int user_index = 0, int user_depth = 0) {
+        u32 size = sizeof(SampleRecord) + num_frames * sizeof(ASGCT_CallFrame);
+        if (stack != NULL) {
+            size += user_depth * sizeof(ASGCT_CallFrame) + 4 * sizeof(uintptr_t) + ((stack->size + 7) & ~7U);
+        }
+        SampleRecord* record = _rings[slot].reserve(size);
+        if (record == NULL) {
+            return false;
+        }
+
+        record->tid = tid;
+        record->num_frames = num_frames;
+        record->event_type = event_type;
+        record->counter = counter;
+        // Do not use memcpy inside signal handler
+        const char* src = (const char*)event;
+        char* dst = (char*)record->event;
+        for (size_t i = 0; i < eventSize(event_type); i++) {
+            dst[i] = src[i];
+        }
+        ASGCT_CallFrame* record_frames = record->frames();
+        for (int i = 0; i < num_frames; i++) {
+            record_frames[i] = frames[i];
+        }
+
+        if (stack != NULL) {
+            record->stack_size = stack->size;
+            record->user_index = user_index;
+            record->user_depth = user_depth;
+            uintptr_t* regs = (uintptr_t*)(record->frames() + num_frames + user_depth);
+            regs[0] = (uintptr_t)stack->pc;
+            regs[1] = stack->sp;
+            regs[2] = stack->fp;
+            regs[3] = stack->lr;
+            const uintptr_t* stack_words = (const uintptr_t*)stack->data;
+            for (u32 i = 0; i < stack->size / sizeof(uintptr_t); i++) {
+                regs[4 + i] = stack_words[i];
+            }
+        } else {
+            record->stack_size = 0;
+        }
+
+        _rings[slot].commit();
+        return true;
+    }
+};
+
+#endif // _SAMPLEQUEUE_H
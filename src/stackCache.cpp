@@ -0,0 +1,40 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <new>
+#include <stdlib.h>
+#include "stackCache.h"
+
+
+volatile u32 StackCache::_epoch = 0;
+
+StackCache* StackCache::create(int max_depth) {
+    size_t walk_size = max_depth * (sizeof(CachedFrame) + sizeof(ASGCT_CallFrame) +
+                                    STACK_CACHE_GUARDS_PER_FRAME * sizeof(StackGuard));
+    char* memory = (char*)calloc(1, sizeof(StackCache) + 2 * walk_size);
+    if (memory == NULL) {
+        return NULL;
+    }
+
+    StackCache* cache = new(memory) StackCache();
+    char* data = memory + sizeof(StackCache);
+    for (int i = 0; i < 2; i++) {
+        CachedWalk* walk = &cache->_walks[i];
+        walk->frames = (ASGCT_CallFrame*)data;
+        data += max_depth * sizeof(ASGCT_CallFrame);
+        walk->entries = (CachedFrame*)data;
+        data += max_depth * sizeof(CachedFrame);
+        walk->guards = (StackGuard*)data;
+        data += max_depth * STACK_CACHE_GUARDS_PER_FRAME * sizeof(StackGuard);
+    }
+    cache->_prev = &cache->_walks[0];
+    cache->_curr = &cache->_walks[1];
+    cache->_capacity = max_depth;
+    return cache;
+}
+
+void StackCache::destroy(StackCache* cache) {
+    free(cache);
+}
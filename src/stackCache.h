@@ -0,0 +1,230 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _STACKCACHE_H
+#define _STACKCACHE_H
+
+#include <stdint.h>
+#include "arch.h"
+#include "vmEntry.h"
+
+
+// Room for stack words the walk depends on: compiled and native frames take 2, interpreted take 5
+const int STACK_CACHE_GUARDS_PER_FRAME = 3;
+
+// A stack word that was read while unwinding a frame
+struct StackGuard {
+    const uintptr_t* addr;
+    uintptr_t value;
+};
+
+// Unwinding state at a frame boundary of a walk
+struct CachedFrame {
+    const void* pc;
+    uintptr_t sp;
+    uintptr_t fp;
+    int depth;  // number of frames produced above this one
+    int guard;  // index of the first guard read while unwinding this and outer frames
+};
+
+struct CachedWalk {
+    u64 key;
+    u32 epoch;
+    int depth;
+    bool truncated;
+    int entry_count;
+    int guard_count;
+    CachedFrame* entries;
+    StackGuard* guards;
+    ASGCT_CallFrame* frames;
+};
+
+// Remembers the previous walk of a sample slot. When the current walk of the same thread
+// reaches a frame with the same pc, sp and fp, and none of the stack words the rest of
+// the previous walk was built from have changed, the remaining frames are copied instead of
+// being unwound again. Consecutive samples of a thread usually share most of the outer frames.
+//
+// Owned by the holder of a sample slot lock, so no synchronization is needed.
+class StackCache {
+  private:
+    static volatile u32 _epoch;
+
+    CachedWalk _walks[2];
+    CachedWalk* _prev;
+    CachedWalk* _curr;
+    int _capacity;
+    int _cursor;
+    // Guards of the previous walk from _valid_from on are known to hold; one below _invalid_below does not
+    int _valid_from;
+    int _invalid_below;
+    bool _recording;
+    u64 _hits;
+    u64 _reused_frames;
+
+    StackCache() {
+    }
+
+  public:
+    static StackCache* create(int max_depth);
+    static void destroy(StackCache* cache);
+
+    // Makes all cached walks stale, e.g. when unwinding information has changed
+    static void invalidateAll() {
+        atomicInc(_epoch);
+    }
+
+    // Walks of the same thread are comparable only if done with the same options
+    static u64 makeKey(int tid, u32 mode) {
+        return (u64)(u32)tid << 32 | mode;
+    }
+
+    u64 hits() const {
+        return _hits;
+    }
+
+    u64 reusedFrames() const {
+        return _reused_frames;
+    }
+
+    void begin(u64 key) {
+        u32 epoch = loadAcquire(_epoch);
+        _curr->key = key;
+        _curr->epoch = epoch;
+        _curr->entry_count = 0;
+        _curr->guard_count = 0;
+        _cursor = _prev->key == key && _prev->epoch == epoch ? 0 : _prev->entry_count;
+        _valid_from = _prev->guard_count;
+        _invalid_below = 0;
+        _recording = true;
+    }
+
+    // The walk has done something the cache cannot reproduce: frames recorded so far
+    // may not be spliced into later walks
+    void barrier() {
+        _curr->entry_count = 0;
+        _curr->guard_count = 0;
+    }
+
+    void guard(const void* addr) {
+        if (_curr->entry_count == 0) {
+            return;
+        }
+        if (_curr->guard_count >= _capacity * STACK_CACHE_GUARDS_PER_FRAME) {
+            _recording = false;
+            return;
+        }
+        StackGuard* g = &_curr->guards[_curr->guard_count++];
+        g->addr = (const uintptr_t*)addr;
+        g->value = *(const uintptr_t*)addr;
+    }
+
+    void record(const void* pc, uintptr_t sp, uintptr_t fp, int depth) {
+        if (_curr->entry_count >= _capacity) {
+            _recording = false;
+            return;
+        }
+        CachedFrame* e = &_curr->entries[_curr->entry_count++];
+        e->pc = pc;
+        e->sp = sp;
+        e->fp = fp;
+        e->depth = depth;
+        e->guard = _curr->guard_count;
+    }
+
+    // Returns the entry of the previous walk with the same unwinding state, or -1.
+    // The stack pointer never decreases during a walk, so the search resumes where it stopped.
+    int find(const void* pc, uintptr_t sp, uintptr_t fp) {
+        CachedFrame* entries = _prev->entries;
+        int count = _prev->entry_count;
+        while (_cursor < count && entries[_cursor].sp < sp) {
+            _cursor++;
+        }
+        for (int i = _cursor; i < count && entries[i].sp == sp; i++) {
+            if (entries[i].pc == pc && entries[i].fp == fp) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Copies frames of the previous walk starting from the given entry if they are still valid.
+    // Returns the new depth, or -1 if the rest of the stack must be walked.
+    int splice(int index, ASGCT_CallFrame* frames, int depth, int max_depth) {
+        CachedFrame* e = &_prev->entries[index];
+        int count = _prev->depth - e->depth;
+        bool clipped = depth + count > max_depth;
+        if (clipped) {
+            count = max_depth - depth;
+        } else if (_prev->truncated) {
+            // The previous walk stopped early, this one would have continued
+            return -1;
+        }
+
+        // Each guard is checked at most once per walk, even if several entries match
+        if (e->guard < _invalid_below) {
+            return -1;
+        }
+        for (int i = _valid_from - 1; i >= e->guard; i--) {
+            if (*_prev->guards[i].addr != _prev->guards[i].value) {
+                _valid_from = _invalid_below = i + 1;
+                return -1;
+            }
+        }
+        _valid_from = e->guard;
+
+        // Do not use memcpy inside signal handler
+        for (int i = 0; i < count; i++) {
+            frames[depth + i] = _prev->frames[e->depth + i];
+        }
+
+        // Keep the reused part in the cache, so that the next walk can splice it too
+        int entries = _prev->entry_count - index;
+        int guards = _prev->guard_count - e->guard;
+        if (_recording && !clipped && _curr->entry_count + entries <= _capacity &&
+            _curr->guard_count + guards <= _capacity * STACK_CACHE_GUARDS_PER_FRAME) {
+            CachedFrame* dst = &_curr->entries[_curr->entry_count];
+            for (int i = 0; i < entries; i++) {
+                dst[i] = e[i];
+                dst[i].depth += depth - e->depth;
+                dst[i].guard += _curr->guard_count - e->guard;
+            }
+            for (int i = 0; i < guards; i++) {
+                _curr->guards[_curr->guard_count + i] = _prev->guards[e->guard + i];
+            }
+            _curr->entry_count += entries;
+            _curr->guard_count += guards;
+        } else {
+            _recording = false;
+        }
+
+        _hits++;
+        _reused_frames += count;
+        return depth + count;
+    }
+
+    // Completes the walk: it becomes the reference for the next one
+    void end(ASGCT_CallFrame* frames, int depth, int max_depth) {
+        if (!_recording) {
+            _curr->entry_count = 0;
+        }
+        for (int i = 0; i < depth; i++) {
+            _curr->frames[i] = frames[i];
+        }
+        _curr->depth = depth;
+        _curr->truncated = depth >= max_depth;
+
+        CachedWalk* prev = _prev;
+        _prev = _curr;
+        _curr = prev;
+    }
+
+    // The walk was interrupted; forget everything
+    void abort() {
+        _prev->entry_count = 0;
+        _curr->entry_count = 0;
+    }
+};
+
+#endif // _STACKCACHE_H
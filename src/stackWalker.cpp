@@ -8,6 +8,7 @@
 #include "dwarf.h"
 #include "profiler.h"
 #include "safeAccess.h"
+#include "stackCache.h"
 #include "stackFrame.h"
 #include "vmStructs.h"
 
@@ -18,7 +19,7 @@ const intptr_t MAX_INTERPRETER_FRAME_SIZE = 0x1000;
 const intptr_t DEAD_ZONE = 0x1000;
 
 static ucontext_t empty_ucontext{};
-static jmp_buf* crash_protection_ctx[CONCURRENCY_LEVEL];
+static jmp_buf* crash_protection_ctx[MAX_CONCURRENCY_LEVEL];
 
 
 static inline bool aligned(uintptr_t ptr) {
@@ -148,8 +149,8 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
         callchain[depth++] = pc;
 
         uintptr_t prev_sp = sp;
-        CodeCache* cc = profiler->findLibraryByAddress(pc);
-        FrameDesc* f = cc != NULL ? cc->findFrameDesc(pc) : &FrameDesc::default_frame;
+        CodeCache* cc;
+        FrameDesc* f = profiler->findFrameDesc(pc, cc);
 
         retry_unwind_frame:
         u8 cfa_reg = (u8)f->cfa;
@@ -211,6 +212,82 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
     return depth;
 }
 
+int StackWalker::walkUserStack(const UserStack& stack, const void** callchain, int max_depth) {
+    const void* pc = stack.pc;
+    uintptr_t fp = stack.fp;
+    uintptr_t sp = stack.sp;
+
+    int depth = 0;
+    Profiler* profiler = Profiler::instance();
+
+    // Walk until the end of the copy or until the first Java frame.
+    // Words outside the copy read as zero, which stops the walk.
+    while (depth < max_depth) {
+        if (CodeHeap::contains(pc)) {
+            break;
+        }
+
+        callchain[depth++] = pc;
+
+        uintptr_t prev_sp = sp;
+        CodeCache* cc;
+        FrameDesc* f = profiler->findFrameDesc(pc, cc);
+
+        retry_unwind_frame:
+        u8 cfa_reg = (u8)f->cfa;
+        int cfa_off = f->cfa >> 8;
+        if (cfa_reg == DW_REG_SP) {
+            sp = sp + cfa_off;
+        } else if (cfa_reg == DW_REG_FP) {
+            sp = fp + cfa_off;
+        } else if (cfa_reg == DW_REG_PLT) {
+            sp += ((uintptr_t)pc & 15) >= 11 ? cfa_off * 2 : cfa_off;
+        } else {
+            break;
+        }
+
+        // Check if the next frame is below on the same stack
+        if (sp < prev_sp || sp >= prev_sp + MAX_FRAME_SIZE || !aligned(sp)) {
+            break;
+        }
+
+        const void* prev_pc = pc;
+        if (f->fp_off & DW_PC_OFFSET) {
+            pc = (const char*)pc + (f->fp_off >> 1);
+        } else {
+            if (f->fp_off != DW_SAME_FP && f->fp_off < MAX_FRAME_SIZE && f->fp_off > -MAX_FRAME_SIZE) {
+                fp = stack.load(sp + f->fp_off);
+            }
+
+            if (EMPTY_FRAME_SIZE > 0 || f->pc_off != DW_LINK_REGISTER) {
+                pc = stripPointer((const void*)stack.load(sp + f->pc_off));
+            } else if (depth > 1 || (pc = stripPointer((const void*)stack.lr)) == prev_pc) {
+                // Failed to unwind using link register
+                if (f->cfa == DW_REG_SP && fp == sp) {
+                    // Special case for vDSO: if an empty frame did not work, try the default frame
+                    f = &FrameDesc::default_frame;
+                    goto retry_unwind_frame;
+                }
+                break;
+            }
+
+            if (EMPTY_FRAME_SIZE == 0 && cfa_off == 0 && f->fp_off != DW_SAME_FP) {
+                // AArch64 default_frame
+                sp = defaultSenderSP(sp, fp);
+                if (sp < prev_sp || !aligned(sp)) {
+                    break;
+                }
+            }
+        }
+
+        if (inDeadZone(pc) || (pc == prev_pc && sp == prev_sp)) {
+            break;
+        }
+    }
+
+    return depth;
+}
+
 int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, int lock_index,
                         StackWalkFeatures features, EventType event_type) {
     const void* pc;
@@ -231,6 +308,7 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
 
     Profiler* profiler = Profiler::instance();
     int bcp_offset = InterpreterFrame::bcp_offset();
+    StackCache* cache = features.stack_cache ? profiler->stackCache(lock_index) : NULL;
 
     jmp_buf current_ctx;
     crash_protection_ctx[lock_index] = &current_ctx;
@@ -240,6 +318,9 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
 
     if (setjmp(current_ctx) != 0) {
         crash_protection_ctx[lock_index] = NULL;
+        if (cache != NULL) {
+            cache->abort();
+        }
         if (depth < max_depth) {
             fillFrame(frames[depth++], BCI_ERROR, "break_not_walkable");
         }
@@ -261,6 +342,19 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
         }
     }
 
+    // Frames unwound during deoptimization are not reproducible
+    bool caching = false;
+    if (cache != NULL) {
+        if (vm_thread != NULL && vm_thread->inDeopt()) {
+            cache->abort();
+        } else {
+            // Do not use memcpy inside signal handler
+            union { StackWalkFeatures features; u16 bits; } key = {features};
+            cache->begin(StackCache::makeKey(OS::threadId(), (u32)event_type << 16 | key.bits));
+            caching = true;
+        }
+    }
+
     unwind_loop:
     uintptr_t prev_sp = sp;
     while (depth < max_depth) {
@@ -271,7 +365,21 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
         }
         prev_sp = sp;
 
+        // Top frames depend on the signal context; the rest depends only on pc, sp, fp and stack contents
+        if (caching && anchor == NULL && depth >= 2) {
+            int cached = cache->find(pc, sp, fp);
+            if (cached >= 0) {
+                int spliced_depth = cache->splice(cached, frames, depth, max_depth);
+                if (spliced_depth >= 0) {
+                    depth = spliced_depth;
+                    break;
+                }
+            }
+            cache->record(pc, sp, fp, depth);
+        }
+
         CodeCache* native_lib = NULL;
+        FrameDesc* f = &FrameDesc::default_frame;
         if (CodeHeap::contains(pc)) {
             NMethod* nm = CodeHeap::findNMethod(pc);
             if (nm == NULL) {
@@ -304,6 +412,13 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
                     && sp < fp + bcp_offset * sizeof(void*);
 
                 if (is_plausible_interpreter_frame) {
+                    if (caching) {
+                        cache->guard((void**)fp + InterpreterFrame::method_offset);
+                        cache->guard((void**)fp + bcp_offset);
+                        cache->guard((void**)fp + InterpreterFrame::sender_sp_offset);
+                        cache->guard((void**)fp + FRAME_PC_SLOT);
+                        cache->guard((void**)fp);
+                    }
                     VMMethod* method = ((VMMethod**)fp)[InterpreterFrame::method_offset];
                     jmethodID method_id = getMethodId(method);
                     if (method_id != NULL) {
@@ -367,10 +482,15 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
                     frame.adjustSP(nm->entry(), pc, sp);
 
                     sp += nm->frameSize() * sizeof(void*);
+                    if (caching) {
+                        cache->guard((void**)sp - FRAME_PC_SLOT - 1);
+                        cache->guard((void**)sp - FRAME_PC_SLOT);
+                    }
                     fp = ((uintptr_t*)sp)[-FRAME_PC_SLOT - 1];
                     pc = ((const void**)sp)[-FRAME_PC_SLOT];
                     continue;
                 } else if (frame.unwindPrologue(nm, (uintptr_t&)pc, sp, fp)) {
+                    if (caching) cache->barrier();
                     continue;
                 }
 
@@ -386,6 +506,7 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
                     // End of Java stack
                     break;
                 }
+                if (caching) cache->barrier();
                 continue;
             } else {
                 if (features.vtable_target && nm->isVTableStub() && depth == 0) {
@@ -399,7 +520,7 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
 
                 CodeBlob* stub = profiler->findRuntimeStub(pc);
                 const void* start = stub != NULL ? stub->_start : nm->code();
-                const char* name = stub != NULL ? stub->_name : nm->name();
+                const char* name = stub != NULL ? profiler->runtimeStubName(stub) : nm->name();
 
                 if (details) {
                     fillFrame(frames[depth++], BCI_NATIVE_FRAME, name);
@@ -411,11 +532,16 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
                 }
 
                 if (frame.unwindStub((instruction_t*)start, name, (uintptr_t&)pc, sp, fp)) {
+                    if (caching) cache->barrier();
                     continue;
                 }
 
                 if (nm->frameSize() > 0) {
                     sp += nm->frameSize() * sizeof(void*);
+                    if (caching) {
+                        cache->guard((void**)sp - FRAME_PC_SLOT - 1);
+                        cache->guard((void**)sp - FRAME_PC_SLOT);
+                    }
                     fp = ((uintptr_t*)sp)[-FRAME_PC_SLOT - 1];
                     pc = ((const void**)sp)[-FRAME_PC_SLOT];
                     if (inDeadZone(pc)) {
@@ -426,15 +552,17 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
                 }
             }
         } else {
-            native_lib = profiler->findLibraryByAddress(pc);
+            f = profiler->findFrameDesc(pc, native_lib);
             const char* method_name = native_lib != NULL ? native_lib->binarySearch(pc) : NULL;
             char mark;
             if (method_name != NULL && (mark = NativeFunc::mark(method_name)) != 0) {
                 if (mark == MARK_ASYNC_PROFILER && (event_type == MALLOC_SAMPLE || event_type == NATIVE_LOCK_SAMPLE)) {
                     // Skip all internal frames above hook functions, leave the hook itself
                     depth = 0;
+                    if (caching) cache->barrier();
                 } else if (mark == MARK_COMPILER_ENTRY && features.comp_task && vm_thread != NULL) {
                     // Insert current compile task as a pseudo Java frame
+                    if (caching) cache->barrier();
                     VMMethod* method = vm_thread->compiledMethod();
                     jmethodID method_id = method != NULL ? method->id() : NULL;
                     if (method_id != NULL) {
@@ -445,8 +573,6 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
             fillFrame(frames[depth++], BCI_NATIVE_FRAME, method_name);
         }
 
-        FrameDesc* f = native_lib != NULL ? native_lib->findFrameDesc(pc) : &FrameDesc::default_frame;
-
         retry_unwind_frame:
         u8 cfa_reg = (u8)f->cfa;
         int cfa_off = f->cfa >> 8;
@@ -475,10 +601,12 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
             pc = (const char*)pc + (f->fp_off >> 1);
         } else {
             if (f->fp_off != DW_SAME_FP && f->fp_off < MAX_FRAME_SIZE && f->fp_off > -MAX_FRAME_SIZE) {
+                if (caching) cache->guard((void*)(sp + f->fp_off));
                 fp = *(uintptr_t*)(sp + f->fp_off);
             }
 
             if (EMPTY_FRAME_SIZE > 0 || f->pc_off != DW_LINK_REGISTER) {
+                if (caching) cache->guard((void*)(sp + f->pc_off));
                 pc = stripPointer(*(void**)(sp + f->pc_off));
             } else if (depth > 1 || (pc = (const void*)frame.link()) == prev_pc) {
                 // Failed to unwind using link register
@@ -509,6 +637,10 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
         goto unwind_loop;
     }
 
+    if (caching) {
+        cache->end(frames, depth, max_depth);
+    }
+
     crash_protection_ctx[lock_index] = NULL;
 
     return depth;
@@ -522,7 +654,7 @@ void StackWalker::checkFault() {
     uintptr_t stack_distance = 32768;  // maximum allowed stack distance
     const uintptr_t current_sp = (uintptr_t)&nearest_ctx;
 
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+    for (int i = 0; i < MAX_CONCURRENCY_LEVEL; i++) {
         jmp_buf* ctx = crash_protection_ctx[i];
         if ((uintptr_t)ctx - current_sp < stack_distance) {
             nearest_ctx = ctx;
@@ -13,10 +13,35 @@
 
 class JavaFrameAnchor;
 
+// Registers of an interrupted thread and a copy of the top of its stack starting at sp,
+// as made by the kernel for a perf_events sample. The copy may wrap around the end
+// of a ring buffer: byte i of the stack is at data[(offset + i) & mask].
+struct UserStack {
+    const void* pc;
+    uintptr_t sp;
+    uintptr_t fp;
+    uintptr_t lr;
+    const char* data;
+    u32 size;
+    u32 offset;
+    u32 mask;
+
+    // Returns 0 for words outside the copy, like SafeAccess::load for unreadable memory
+    uintptr_t load(uintptr_t addr) const {
+        uintptr_t index = addr - sp;
+        if (index >= size || size - index < sizeof(uintptr_t)) {
+            return 0;
+        }
+        u64 pos = (offset + index) & mask;
+        return pos + sizeof(uintptr_t) <= (u64)mask + 1 ? *(const uintptr_t*)(data + pos) : 0;
+    }
+};
+
 class StackWalker {
   public:
     static int walkFP(void* ucontext, const void** callchain, int max_depth);
     static int walkDwarf(void* ucontext, const void** callchain, int max_depth);
+    static int walkUserStack(const UserStack& stack, const void** callchain, int max_depth);
     static int walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, int lock_index,
                       StackWalkFeatures features, EventType event_type);
 
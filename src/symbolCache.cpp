@@ -0,0 +1,213 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "symbolCache.h"
+#include "dwarf.h"
+#include "log.h"
+#include "os.h"
+
+
+static const u32 SYMBOL_CACHE_MAGIC = 0x43535041;  // "APSC"
+static const u32 SYMBOL_CACHE_VERSION = 1;
+
+enum {
+    CACHE_DEBUG_SYMBOLS = 1
+};
+
+// File layout: header, blobs, rules, pages, rows, names
+struct CacheHeader {
+    u32 magic;
+    u32 version;
+    u32 pointer_size;
+    u32 flags;
+    u32 blob_count;
+    u32 names_size;
+    u32 rule_count;
+    u32 row_count;
+    u32 page_count;
+    u32 page_shift;
+    u32 plt_offset;
+    u32 plt_size;
+    intptr_t text_base;  // relative to the image base
+};
+
+struct CachedBlob {
+    intptr_t start;  // relative to the image base
+    intptr_t end;
+    u32 name;        // offset in the names section
+    u32 reserved;
+};
+
+
+bool SymbolCache::path(char* buf, size_t size, const char* dir, const char* build_id, int build_id_len) {
+    size_t len = snprintf(buf, size, "%s/", dir);
+    for (int i = 0; i < build_id_len && len < size; i++) {
+        len += snprintf(buf + len, size - len, "%02hhx", build_id[i]);
+    }
+    return len < size && (len += snprintf(buf + len, size - len, ".sym")) < size;
+}
+
+bool SymbolCache::load(CodeCache* cc, const char* dir, const char* build_id, int build_id_len) {
+    char file[PATH_MAX];
+    if (cc->imageBase() == NULL || !path(file, sizeof(file), dir, build_id, build_id_len)) {
+        return false;
+    }
+
+    int fd = open(file, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    const CacheHeader* h = (const CacheHeader*)addr;
+    u64 expected_size = sizeof(CacheHeader) + (u64)h->blob_count * sizeof(CachedBlob) +
+                        (u64)h->rule_count * sizeof(FrameDesc) + (u64)h->row_count * sizeof(CompactDwarfRow) +
+                        (h->row_count > 0 ? ((u64)h->page_count + 1) * sizeof(u32) : 0) + h->names_size;
+    if (h->magic != SYMBOL_CACHE_MAGIC || h->version != SYMBOL_CACHE_VERSION || h->pointer_size != sizeof(void*) ||
+        expected_size != size || (h->names_size > 0 && ((const char*)addr)[size - 1] != 0)) {
+        Log::debug("Invalid symbol cache file %s", file);
+        munmap(addr, size);
+        return false;
+    }
+
+    const CachedBlob* blobs = (const CachedBlob*)(h + 1);
+    const FrameDesc* rules = (const FrameDesc*)(blobs + h->blob_count);
+    const u32* pages = (const u32*)(rules + h->rule_count);
+    const CompactDwarfRow* rows = (const CompactDwarfRow*)(pages + (h->row_count > 0 ? h->page_count + 1 : 0));
+    const char* names = (const char*)(rows + h->row_count);
+
+    // Unwinding tables are read in a signal handler: every index must be in bounds
+    bool valid = h->row_count == 0 || (h->page_count > 0 && h->page_shift > 0 && h->page_shift <= 16 &&
+                                       h->rule_count > 0 && pages[0] == 0 && pages[h->page_count] == h->row_count);
+    for (u32 i = 0; valid && h->row_count > 0 && i < h->page_count; i++) {
+        valid = pages[i] <= pages[i + 1];
+    }
+    for (u32 i = 0; valid && i < h->row_count; i++) {
+        valid = rows[i].rule < h->rule_count;
+    }
+    for (u32 i = 0; valid && i < h->blob_count; i++) {
+        valid = blobs[i].name < h->names_size && blobs[i].end >= blobs[i].start;
+    }
+    if (!valid) {
+        Log::debug("Invalid symbol cache file %s", file);
+        munmap(addr, size);
+        return false;
+    }
+
+    const char* image_base = cc->imageBase();
+    cc->reserve(h->blob_count);
+    for (u32 i = 0; i < h->blob_count; i++) {
+        cc->add(image_base + blobs[i].start, (int)(blobs[i].end - blobs[i].start), names + blobs[i].name);
+    }
+    cc->setTextBase(image_base + h->text_base);
+    cc->setPlt(h->plt_offset, h->plt_size);
+    cc->setDebugSymbols((h->flags & CACHE_DEBUG_SYMBOLS) != 0);
+
+    if (h->row_count == 0) {
+        munmap(addr, size);
+        return true;
+    }
+
+    CompactDwarfTable* table = new CompactDwarfTable();
+    table->_rules = (FrameDesc*)rules;
+    table->_rows = (CompactDwarfRow*)rows;
+    table->_pages = (u32*)pages;
+    table->_rule_count = h->rule_count;
+    table->_row_count = h->row_count;
+    table->_page_count = h->page_count;
+    table->_page_shift = h->page_shift;
+    table->_mapping = addr;
+    table->_mapping_size = size;
+    cc->_compact_dwarf_table = table;
+    return true;
+}
+
+bool SymbolCache::save(CodeCache* cc, const char* dir, const char* build_id, int build_id_len) {
+    char file[PATH_MAX];
+    char tmp[PATH_MAX];
+    if (cc->imageBase() == NULL || cc->_dwarf_table != NULL || !path(file, sizeof(file), dir, build_id, build_id_len) ||
+        snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, OS::threadId()) >= (int)sizeof(tmp)) {
+        return false;
+    }
+
+    FILE* f = fopen(tmp, "wb");
+    if (f == NULL) {
+        Log::debug("Could not write symbol cache %s: %s", tmp, strerror(errno));
+        return false;
+    }
+
+    const char* image_base = cc->imageBase();
+    const CompactDwarfTable* table = cc->_compact_dwarf_table;
+
+    CacheHeader h = {0};
+    h.magic = SYMBOL_CACHE_MAGIC;
+    h.version = SYMBOL_CACHE_VERSION;
+    h.pointer_size = sizeof(void*);
+    h.flags = cc->hasDebugSymbols() ? CACHE_DEBUG_SYMBOLS : 0;
+    h.blob_count = cc->_count;
+    for (int i = 0; i < cc->_count; i++) {
+        h.names_size += strlen(cc->blobName(&cc->_blobs[i])) + 1;
+    }
+    if (table != NULL) {
+        h.rule_count = table->_rule_count;
+        h.row_count = table->_row_count;
+        h.page_count = table->_page_count;
+        h.page_shift = table->_page_shift;
+    }
+    h.plt_offset = cc->_plt_offset;
+    h.plt_size = cc->_plt_size;
+    h.text_base = cc->_text_base - image_base;
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    u32 name = 0;
+    for (int i = 0; ok && i < cc->_count; i++) {
+        CachedBlob blob = {0};
+        blob.start = (const char*)cc->_blobs[i]._start - image_base;
+        blob.end = (const char*)cc->_blobs[i].end() - image_base;
+        blob.name = name;
+        name += strlen(cc->blobName(&cc->_blobs[i])) + 1;
+        ok = fwrite(&blob, sizeof(blob), 1, f) == 1;
+    }
+
+    if (ok && table != NULL) {
+        ok = fwrite(table->_rules, sizeof(FrameDesc), h.rule_count, f) == h.rule_count &&
+             fwrite(table->_pages, sizeof(u32), h.page_count + 1, f) == h.page_count + 1 &&
+             fwrite(table->_rows, sizeof(CompactDwarfRow), h.row_count, f) == h.row_count;
+    }
+
+    for (int i = 0; ok && i < cc->_count; i++) {
+        const char* s = cc->blobName(&cc->_blobs[i]);
+        ok = fwrite(s, strlen(s) + 1, 1, f) == 1;
+    }
+
+    if (fclose(f) != 0 || !ok || rename(tmp, file) != 0) {
+        Log::debug("Could not write symbol cache %s: %s", file, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SYMBOLCACHE_H
+#define _SYMBOLCACHE_H
+
+#include "codeCache.h"
+
+
+// On-disk cache of parsed libraries keyed by ELF build-id. A cache file holds symbols
+// relative to the image base, their names, and the compact unwinding table, which is used
+// right from the mapped file. Files are written under a temporary name and renamed,
+// so a file is never modified once it is visible.
+class SymbolCache {
+  private:
+    static bool path(char* buf, size_t size, const char* dir, const char* build_id, int build_id_len);
+
+  public:
+    // Fills an empty CodeCache from the cache. Returns false if there is no valid entry.
+    static bool load(CodeCache* cc, const char* dir, const char* build_id, int build_id_len);
+
+    // Stores a parsed library. Libraries with an unwinding table in the raw form are not cached.
+    static bool save(CodeCache* cc, const char* dir, const char* build_id, int build_id_len);
+};
+
+#endif // _SYMBOLCACHE_H
@@ -10,16 +10,49 @@
 #include "mutex.h"
 
 
+enum KallsymsPart {
+    KALLSYMS_ALL,
+    KALLSYMS_CORE,     // symbols of the kernel image, without modules
+    KALLSYMS_MODULES   // symbols of loaded kernel modules only
+};
+
 class Symbols {
   private:
     static Mutex _parse_lock;
     static bool _have_kernel_symbols;
     static bool _libs_limit_reported;
+    static bool _lazy_parsing;
+    static int _parse_threads;
 
   public:
-    static void parseKernelSymbols(CodeCache* cc);
+    static void parseKernelSymbols(CodeCache* cc, KallsymsPart part = KALLSYMS_ALL, CodeCache* modules = NULL);
+
+    // Reads text symbols from a kallsyms file and closes it. When module symbols are skipped,
+    // their address range is added to the bounds of modules, if given.
+    static void parseKallsyms(int fd, CodeCache* cc, KallsymsPart part, CodeCache* modules = NULL);
     static void parseLibraries(CodeCacheArray* array, bool kernel_symbols, bool essential_only = false);
 
+    // Parses libraries whose parsing was deferred: all of them, or only those with a PC seen.
+    // Returns the number of libraries replaced in the array.
+    static int parsePendingLibraries(CodeCacheArray* array, bool all);
+
+    // Asks the background parser to parse a pending library. Safe to call from a signal handler.
+    static void requestParse(CodeCache* lib);
+
+    // In lazy mode, libraries other than essential ones are registered with their address range
+    // and imports only. Symbols and unwinding tables are parsed the first time a PC is seen.
+    static void setLazyParsing(bool lazy_parsing) {
+        _lazy_parsing = lazy_parsing;
+    }
+
+    // Directory of the on-disk cache of parsed libraries, or NULL to disable it
+    static void setCacheDir(const char* dir);
+
+    // Number of threads parsing libraries at once; 0 picks a default based on the CPU count
+    static void setParseThreads(int parse_threads) {
+        _parse_threads = parse_threads;
+    }
+
     static bool haveKernelSymbols() {
         return _have_kernel_symbols;
     }
@@ -6,8 +6,10 @@
 #ifdef __linux__
 
 #include <dlfcn.h>
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,12 +22,16 @@
 #include <fcntl.h>
 #include <link.h>
 #include <linux/limits.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <sys/auxv.h>
 #include "symbols.h"
 #include "dwarf.h"
+#include "symbolCache.h"
 #include "fdtransferClient.h"
 #include "log.h"
 #include "os.h"
+#include "profiler.h"
 
 
 #ifdef __x86_64__
@@ -264,7 +270,7 @@ class ElfParser {
     ElfProgramHeader* findProgramHeader(uint32_t type);
 
     void calcVirtualLoadAddress();
-    void parseDynamicSection();
+    void parseDynamicSection(bool load_symbols);
     void parseUnwindInfo();
     void parseDebugFrameSection();
     uint32_t getSymbolCount(uint32_t* gnu_hash);
@@ -275,10 +281,14 @@ class ElfParser {
     bool loadSymbolsUsingDebugLink();
     void loadSymbolTable(const char* symbols, size_t total_size, size_t ent_size, const char* strings);
     void addRelocationSymbols(ElfSection* reltab, const char* plt);
-    const char* getDebuginfodCache();
 
   public:
+    // Resolved once before parsing in parallel
+    static const char* getDebuginfodCache();
+
     static void parseProgramHeaders(CodeCache* cc, const char* base, const char* end, bool relocate_dyn);
+    static void parseImports(CodeCache* cc, const char* base, const char* end, bool relocate_dyn);
+    static int readBuildId(const char* base, const char* end, const char** build_id);
     static bool parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug);
 };
 
@@ -343,11 +353,57 @@ void ElfParser::parseProgramHeaders(CodeCache* cc, const char* base, const char*
     if (elf.validHeader() && base + elf._header->e_phoff < end) {
         cc->setTextBase(base);
         elf.calcVirtualLoadAddress();
-        elf.parseDynamicSection();
+        elf.parseDynamicSection(true);
         elf.parseUnwindInfo();
     }
 }
 
+// Imports are needed up front, since hooks are installed by patching them
+void ElfParser::parseImports(CodeCache* cc, const char* base, const char* end, bool relocate_dyn) {
+    ElfParser elf(cc, base, base, NULL, relocate_dyn);
+    if (elf.validHeader() && base + elf._header->e_phoff < end) {
+        cc->setTextBase(base);
+        elf.calcVirtualLoadAddress();
+        elf.parseDynamicSection(false);
+    }
+}
+
+// Build-id of a loaded image from its PT_NOTE segments. Returns the length, or 0 if there is none.
+int ElfParser::readBuildId(const char* base, const char* end, const char** build_id) {
+    ElfParser elf(NULL, base, base, NULL, false);
+    if (!elf.validHeader() || base + elf._header->e_phoff >= end) {
+        return 0;
+    }
+    elf.calcVirtualLoadAddress();
+
+    const char* pheaders = (const char*)elf._header + elf._header->e_phoff;
+    for (int i = 0; i < elf._header->e_phnum; i++) {
+        ElfProgramHeader* pheader = (ElfProgramHeader*)(pheaders + i * elf._header->e_phentsize);
+        if (pheader->p_type != PT_NOTE) {
+            continue;
+        }
+
+        const char* note = elf.at(pheader);
+        const char* notes_end = note + pheader->p_memsz;
+        if (note < base || notes_end > end) {
+            continue;
+        }
+
+        while (note + sizeof(ElfNote) <= notes_end) {
+            ElfNote* n = (ElfNote*)note;
+            const char* name = note + sizeof(ElfNote);
+            const char* desc = name + ((n->n_namesz + 3) & ~3);
+            if (n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4 && memcmp(name, "GNU", 4) == 0 &&
+                n->n_descsz >= 2 && n->n_descsz <= 64 && desc + n->n_descsz <= notes_end) {
+                *build_id = desc;
+                return n->n_descsz;
+            }
+            note = desc + ((n->n_descsz + 3) & ~3);
+        }
+    }
+    return 0;
+}
+
 void ElfParser::calcVirtualLoadAddress() {
     // Find a difference between the virtual load address (often zero) and the actual DSO base
     const char* pheaders = (const char*)_header + _header->e_phoff;
@@ -361,7 +417,7 @@ void ElfParser::calcVirtualLoadAddress() {
     _vaddr_diff = _base;
 }
 
-void ElfParser::parseDynamicSection() {
+void ElfParser::parseDynamicSection(bool load_symbols) {
     ElfProgramHeader* dynamic = findProgramHeader(PT_DYNAMIC);
     if (dynamic != NULL) {
         const char* symtab = NULL;
@@ -425,7 +481,7 @@ void ElfParser::parseDynamicSection() {
             return;
         }
 
-        if (!_cc->hasDebugSymbols() && nsyms > 0) {
+        if (load_symbols && !_cc->hasDebugSymbols() && nsyms > 0) {
             loadSymbolTable(symtab, syment * nsyms, syment, strtab);
         }
 
@@ -650,6 +706,7 @@ bool ElfParser::loadSymbolsUsingDebugLink() {
 
 void ElfParser::loadSymbolTable(const char* symbols, size_t total_size, size_t ent_size, const char* strings) {
     const char* base = this->base();
+    _cc->reserve(total_size / ent_size);
     for (const char* symbols_end = symbols + total_size; symbols < symbols_end; symbols += ent_size) {
         ElfSymbol* sym = (ElfSymbol*)symbols;
         if (sym->st_name != 0 && sym->st_value != 0) {
@@ -692,22 +749,35 @@ void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
 Mutex Symbols::_parse_lock;
 bool Symbols::_have_kernel_symbols = false;
 bool Symbols::_libs_limit_reported = false;
+bool Symbols::_lazy_parsing = false;
+int Symbols::_parse_threads = 0;
 static std::unordered_set<u64> _parsed_inodes;
 static bool _in_parse_libraries = false;
 
-void Symbols::parseKernelSymbols(CodeCache* cc) {
-    int fd;
-    if (FdTransferClient::hasPeer()) {
-        fd = FdTransferClient::requestKallsymsFd();
-    } else {
-        fd = open("/proc/kallsyms", O_RDONLY);
-    }
+// Posted from signal handlers when a pending library is first seen
+static sem_t _parse_requests;
+static CodeCacheArray* _lazy_libs = NULL;
 
-    if (fd == -1) {
-        Log::warn("open(\"/proc/kallsyms\"): %s", strerror(errno));
-        return;
-    }
+static char* _cache_dir = NULL;
+
+// Libraries are independent of each other, so a few threads can parse them at once
+static const int DEFAULT_PARSE_THREADS = 4;
+static const int MAX_PARSE_THREADS = 16;
+
+struct ParseJob {
+    CodeCache* cc;
+    bool deferred;
+};
 
+struct ParseQueue {
+    std::vector<ParseJob> jobs;
+    volatile int next;
+};
+
+// Placeholder for module symbols, which are parsed the first time a PC hits a module
+static const char KERNEL_MODULES[] = "[kernel modules]";
+
+void Symbols::parseKallsyms(int fd, CodeCache* cc, KallsymsPart part, CodeCache* modules) {
     FILE* f = fdopen(fd, "r");
     if (f == NULL) {
         Log::warn("fdopen(): %s", strerror(errno));
@@ -725,6 +795,17 @@ void Symbols::parseKernelSymbols(CodeCache* cc) {
         if (type == 'T' || type == 't' || type == 'W' || type == 'w') {
             const char* addr = symbol.addr();
             if (addr != NULL) {
+                // Module symbols look like "<name>\t[<module>]"
+                bool module = strchr(symbol.name(), '\t') != NULL;
+                if (module && part == KALLSYMS_CORE) {
+                    if (modules != NULL) {
+                        modules->updateBounds(addr, addr + 1);
+                    }
+                    continue;
+                } else if (!module && part == KALLSYMS_MODULES) {
+                    continue;
+                }
+
                 if (!_have_kernel_symbols) {
                     if (strncmp(symbol.name(), "__LOAD_PHYSICAL_ADDR", 20) == 0 ||
                         strncmp(symbol.name(), "phys_startup", 12) == 0) {
@@ -740,6 +821,22 @@ void Symbols::parseKernelSymbols(CodeCache* cc) {
     fclose(f);
 }
 
+void Symbols::parseKernelSymbols(CodeCache* cc, KallsymsPart part, CodeCache* modules) {
+    int fd;
+    if (FdTransferClient::hasPeer()) {
+        fd = FdTransferClient::requestKallsymsFd();
+    } else {
+        fd = open("/proc/kallsyms", O_RDONLY);
+    }
+
+    if (fd == -1) {
+        Log::warn("open(\"/proc/kallsyms\"): %s", strerror(errno));
+        return;
+    }
+
+    parseKallsyms(fd, cc, part, modules);
+}
+
 static bool isEssentialLibrary(const char* file, const char* map_start, const char* map_end) {
     const void* this_lib = (const void*)isEssentialLibrary;
     if (this_lib >= map_start && this_lib < map_end) {
@@ -811,6 +908,144 @@ static void collectSharedLibraries(std::unordered_map<u64, SharedLibrary>& libs,
     fclose(f);
 }
 
+// The range of a library is taken from its memory mappings
+static void parseLibrary(CodeCache* cc) {
+    const char* file = cc->name();
+    const char* map_start = (const char*)cc->minAddress();
+    const char* map_end = (const char*)cc->maxAddress();
+    const char* image_base = cc->imageBase();
+
+    if (strchr(file, ':') != NULL) {
+        // Do not try to parse pseudofiles like anon_inode:name, /memfd:name
+    } else if (strcmp(file, "[vdso]") == 0) {
+        ElfParser::parseProgramHeaders(cc, map_start, map_end, true);
+    } else if (strcmp(file, KERNEL_MODULES) == 0) {
+        Symbols::parseKernelSymbols(cc, KALLSYMS_MODULES);
+    } else if (image_base == NULL) {
+        // Unlikely case when image base has not been found: not safe to access program headers.
+        // Be careful: executable file is not always ELF, e.g. classes.jsa
+        ElfParser::parseFile(cc, map_start, file, true);
+    } else {
+        UnloadProtection handle(cc);
+
+        const char* build_id = NULL;
+        int build_id_len = 0;
+        if (_cache_dir != NULL && handle.isValid()) {
+            build_id_len = ElfParser::readBuildId(image_base, map_end, &build_id);
+            if (build_id_len > 0 && SymbolCache::load(cc, _cache_dir, build_id, build_id_len)) {
+                ElfParser::parseImports(cc, image_base, map_end, OS::isMusl());
+                return;
+            }
+        }
+
+        // Parse debug symbols first
+        ElfParser::parseFile(cc, image_base, file, true);
+
+        if (handle.isValid()) {
+            ElfParser::parseProgramHeaders(cc, image_base, map_end, OS::isMusl());
+        }
+
+        if (build_id_len > 0) {
+            cc->sort();
+            SymbolCache::save(cc, _cache_dir, build_id, build_id_len);
+        }
+    }
+}
+
+// Essential libraries are needed right away, and tiny or unparsable mappings are not worth deferring
+static bool isDeferrable(const SharedLibrary& lib) {
+    return lib.image_base != NULL && strchr(lib.file, ':') == NULL && strcmp(lib.file, "[vdso]") != 0 &&
+           !isEssentialLibrary(lib.file, lib.map_start, lib.map_end);
+}
+
+static void* lazyParserLoop(void* arg) {
+    CodeCacheArray* array = (CodeCacheArray*)arg;
+    while (true) {
+        if (sem_wait(&_parse_requests) != 0) {
+            continue;  // EINTR
+        }
+        if (Symbols::parsePendingLibraries(array, false) > 0) {
+            Profiler::instance()->invalidateSymbolCaches();
+        }
+    }
+    return NULL;
+}
+
+// Called under the parse lock. The parser thread lives as long as the process.
+static bool startLazyParser(CodeCacheArray* array) {
+    if (_lazy_libs != NULL) {
+        return _lazy_libs == array;
+    }
+
+    if (sem_init(&_parse_requests, 0, 0) != 0) {
+        return false;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int result = pthread_create(&thread, &attr, lazyParserLoop, array);
+    pthread_attr_destroy(&attr);
+    if (result != 0) {
+        Log::warn("Unable to start symbol parser thread: %s", strerror(result));
+        sem_destroy(&_parse_requests);
+        return false;
+    }
+
+    _lazy_libs = array;
+    return true;
+}
+
+static void* parseWorker(void* arg) {
+    ParseQueue* queue = (ParseQueue*)arg;
+    int count = (int)queue->jobs.size();
+
+    int i;
+    while ((i = atomicInc(queue->next)) < count) {
+        ParseJob* job = &queue->jobs[i];
+        CodeCache* cc = job->cc;
+        if (job->deferred) {
+            UnloadProtection handle(cc);
+            if (handle.isValid()) {
+                ElfParser::parseImports(cc, cc->imageBase(), (const char*)cc->maxAddress(), OS::isMusl());
+            }
+            cc->setParseState(PARSE_PENDING);
+        } else {
+            parseLibrary(cc);
+        }
+        cc->sort();
+    }
+    return NULL;
+}
+
+// The calling thread takes part in parsing; if a worker cannot be started, the others do its share
+static void parseInParallel(ParseQueue* queue, int threads) {
+    int count = (int)queue->jobs.size();
+    if (threads > count) threads = count;
+    if (threads > MAX_PARSE_THREADS) threads = MAX_PARSE_THREADS;
+
+    queue->next = 0;
+    ElfParser::getDebuginfodCache();
+
+    pthread_t workers[MAX_PARSE_THREADS];
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, parseWorker, queue) == 0) {
+        started++;
+    }
+
+    parseWorker(queue);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+static bool compareByAddress(const SharedLibrary& a, const SharedLibrary& b) {
+    return a.map_start < b.map_start;
+}
+
 void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols, bool essential_only) {
     MutexLocker ml(_parse_lock);
 
@@ -821,47 +1056,52 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols, bool es
 
     if (kernel_symbols && !haveKernelSymbols()) {
         CodeCache* cc = new CodeCache("[kernel]");
-        parseKernelSymbols(cc);
+        CodeCache* modules = _lazy_parsing && startLazyParser(array) ? new CodeCache(KERNEL_MODULES) : NULL;
+        parseKernelSymbols(cc, modules != NULL ? KALLSYMS_CORE : KALLSYMS_ALL, modules);
 
         if (haveKernelSymbols()) {
             cc->sort();
             array->add(cc);
+            if (modules != NULL && modules->minAddress() < modules->maxAddress()) {
+                modules->setParseState(PARSE_PENDING);
+                array->add(modules);
+                modules = NULL;
+            }
         } else {
             delete cc;
         }
+        delete modules;
     }
 
     std::unordered_map<u64, SharedLibrary> libs;
     collectSharedLibraries(libs, MAX_NATIVE_LIBS - array->count(), essential_only);
 
+    // Library indices must not depend on the hash order
+    std::vector<SharedLibrary> sorted;
+    sorted.reserve(libs.size());
     for (auto& it : libs) {
-        u64 inode = it.first;
-        _parsed_inodes.insert(inode);
-
-        SharedLibrary& lib = it.second;
-        CodeCache* cc = new CodeCache(lib.file, array->count(), lib.map_start, lib.map_end, lib.image_base);
-
-        if (strchr(lib.file, ':') != NULL) {
-            // Do not try to parse pseudofiles like anon_inode:name, /memfd:name
-        } else if (strcmp(lib.file, "[vdso]") == 0) {
-            ElfParser::parseProgramHeaders(cc, lib.map_start, lib.map_end, true);
-        } else if (lib.image_base == NULL) {
-            // Unlikely case when image base has not been found: not safe to access program headers.
-            // Be careful: executable file is not always ELF, e.g. classes.jsa
-            ElfParser::parseFile(cc, lib.map_start, lib.file, true);
-        } else {
-            // Parse debug symbols first
-            ElfParser::parseFile(cc, lib.image_base, lib.file, true);
-
-            UnloadProtection handle(cc);
-            if (handle.isValid()) {
-                ElfParser::parseProgramHeaders(cc, lib.image_base, lib.map_end, OS::isMusl());
-            }
-        }
-
+        _parsed_inodes.insert(it.first);
+        sorted.push_back(it.second);
+    }
+    std::sort(sorted.begin(), sorted.end(), compareByAddress);
+
+    ParseQueue queue;
+    queue.jobs.reserve(sorted.size());
+    for (size_t i = 0; i < sorted.size(); i++) {
+        SharedLibrary& lib = sorted[i];
+        ParseJob job;
+        job.cc = new CodeCache(lib.file, array->count() + i, lib.map_start, lib.map_end, lib.image_base);
+        job.deferred = _lazy_parsing && isDeferrable(lib) && startLazyParser(array);
+        queue.jobs.push_back(job);
         free(lib.file);
+    }
 
-        cc->sort();
+    if (!queue.jobs.empty()) {
+        parseInParallel(&queue, _parse_threads > 0 ? _parse_threads : std::min(DEFAULT_PARSE_THREADS, OS::getCpuCount()));
+    }
+
+    for (size_t i = 0; i < queue.jobs.size(); i++) {
+        CodeCache* cc = queue.jobs[i].cc;
         applyPatch(cc);
         array->add(cc);
     }
@@ -871,9 +1111,47 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols, bool es
         _libs_limit_reported = true;
     }
 
+    array->updateIndex();
     _in_parse_libraries = false;
 }
 
+void Symbols::setCacheDir(const char* dir) {
+    MutexLocker ml(_parse_lock);
+    free(_cache_dir);
+    _cache_dir = dir != NULL ? strdup(dir) : NULL;
+}
+
+int Symbols::parsePendingLibraries(CodeCacheArray* array, bool all) {
+    MutexLocker ml(_parse_lock);
+
+    int parsed = 0;
+    int count = array->count();
+    for (int i = 0; i < count; i++) {
+        CodeCache* pending = (*array)[i];
+        ParseState state = pending->parseState();
+        if (state == PARSE_REQUESTED || (all && state == PARSE_PENDING)) {
+            // Kernel modules, like the kernel itself, do not belong to a library index
+            CodeCache* cc = new CodeCache(pending->name(), pending->libIndex(), pending->minAddress(),
+                                          pending->maxAddress(), pending->imageBase());
+            parseLibrary(cc);
+            cc->sort();
+
+            // Imports of the placeholder have been patched already, and point to the same GOT entries
+            array->replace(i, cc);
+            array->updateIndex();
+            pending->setParseState(PARSE_DONE);
+            parsed++;
+        }
+    }
+    return parsed;
+}
+
+void Symbols::requestParse(CodeCache* lib) {
+    if (lib->markRequested()) {
+        sem_post(&_parse_requests);
+    }
+}
+
 // Check that the base address of the shared object has not changed
 static bool verifyBaseAddress(const CodeCache* cc, void* lib_handle) {
     Dl_info dl_info;
@@ -176,6 +176,8 @@ class MachOParser {
 Mutex Symbols::_parse_lock;
 bool Symbols::_have_kernel_symbols = false;
 bool Symbols::_libs_limit_reported = false;
+bool Symbols::_lazy_parsing = false;
+int Symbols::_parse_threads = 0;
 static std::unordered_set<const void*> _parsed_libraries;
 
 static const void* getProfilerImageBase() {
@@ -199,7 +201,10 @@ static bool isEssentialLibrary(const char* path, const mach_header* image_base)
 }
 
 
-void Symbols::parseKernelSymbols(CodeCache* cc) {
+void Symbols::parseKernelSymbols(CodeCache* cc, KallsymsPart part, CodeCache* modules) {
+}
+
+void Symbols::parseKallsyms(int fd, CodeCache* cc, KallsymsPart part, CodeCache* modules) {
 }
 
 void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols, bool essential_only) {
@@ -242,6 +247,20 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols, bool es
             delete cc;
         }
     }
+
+    array->updateIndex();
+}
+
+// Parsed Mach-O images are not cached
+void Symbols::setCacheDir(const char* dir) {
+}
+
+// Mach-O images are always parsed eagerly
+int Symbols::parsePendingLibraries(CodeCacheArray* array, bool all) {
+    return 0;
+}
+
+void Symbols::requestParse(CodeCache* lib) {
 }
 
 #endif // __APPLE__
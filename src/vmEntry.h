@@ -50,6 +50,7 @@ enum ASGCT_CallFrameType {
     BCI_ADDRESS             = -17,  // method_id is a PC address
     BCI_ERROR               = -18,  // method_id is an error string
     BCI_CPU                 = -19,  // method_id is the cpu the sample was taken on
+    BCI_NATIVE_PC           = -20,  // method_id is a native PC, symbolized at dump time
 };
 
 // See hotspot/src/share/vm/prims/forte.cpp
@@ -59,6 +59,12 @@ class WallClock : public Engine {
         return _interval;
     }
 
+    // The sampling thread picks up the new interval on the next cycle
+    bool setInterval(long interval) {
+        _interval = interval;
+        return true;
+    }
+
     Error start(Arguments& args);
     void stop();
     void flush();
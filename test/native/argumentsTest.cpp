@@ -137,3 +137,28 @@ TEST_CASE(Parse_ratelimit_invalid) {
         ASSERT_EQ(strcmp(error.message(), "Invalid ratelimit"), 0);
     }
 }
+
+TEST_CASE(Parse_memory) {
+    Arguments args;
+    char argument[] = "start,memory=thp+node1,file=%f.jfr";
+    Error error = args.parse(argument);
+    ASSERT_EQ(error.message(), NULL);
+    ASSERT_EQ(args._memory, ALLOC_THP | ALLOC_BIND);
+    ASSERT_EQ(args._numa_node, 1);
+
+    Arguments invalid;
+    char invalid_argument[] = "start,memory=interleave+node0";
+    ASSERT_NE(invalid.parse(invalid_argument).message(), NULL);
+}
+
+TEST_CASE(Parse_overhead) {
+    Arguments args;
+    char argument[] = "start,event=cpu,overhead=1.5%,file=%f.jfr";
+    Error error = args.parse(argument);
+    ASSERT_EQ(error.message(), NULL);
+    CHECK_EQ(args._overhead, 0.015);
+
+    Arguments invalid;
+    char invalid_argument[] = "start,overhead=0";
+    ASSERT_NE(invalid.parse(invalid_argument).message(), NULL);
+}
@@ -0,0 +1,529 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include "callTraceStorage.h"
+#include "os.h"
+#include "testRunner.hpp"
+#include "tsc.h"
+
+static const int HOT_TRACES = 16;
+static const int TRACE_DEPTH = 32;
+
+struct PutWorker {
+    CallTraceStorage* storage;
+    int iterations;
+};
+
+static void fillTrace(ASGCT_CallFrame* frames, int depth, int seed) {
+    for (int i = 0; i < depth; i++) {
+        frames[i].bci = i;
+        frames[i].method_id = (jmethodID)(uintptr_t)(0x1000 + seed * 0x100 + i);
+        LP64_ONLY(frames[i].padding = 0;)
+    }
+}
+
+static void* putLoop(void* arg) {
+    PutWorker* worker = (PutWorker*)arg;
+    ASGCT_CallFrame frames[HOT_TRACES][TRACE_DEPTH];
+    for (int t = 0; t < HOT_TRACES; t++) {
+        fillTrace(frames[t], TRACE_DEPTH, t);
+    }
+
+    for (int i = 0; i < worker->iterations; i++) {
+        worker->storage->put(TRACE_DEPTH, frames[i % HOT_TRACES], 1);
+    }
+    return NULL;
+}
+
+static u64 totalSamples(CallTraceStorage& storage) {
+    std::multimap<u64, CallTraceSample> map;
+    storage.collectSamples(map);
+
+    u64 total = 0;
+    for (std::multimap<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        total += it->second.samples;
+    }
+    return total;
+}
+
+TEST_CASE(CallTraceStorage_sameTraceSameId) {
+    CallTraceStorage storage;
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    fillTrace(frames, TRACE_DEPTH, 1);
+
+    u32 id1 = storage.put(TRACE_DEPTH, frames, 10);
+    u32 id2 = storage.put(TRACE_DEPTH, frames, 20);
+    ASSERT_NE(id1, 0);
+    ASSERT_EQ(id1, id2);
+
+    fillTrace(frames, TRACE_DEPTH, 2);
+    u32 id3 = storage.put(TRACE_DEPTH, frames, 30);
+    ASSERT_NE(id1, id3);
+
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    ASSERT_EQ(traces.size(), 2);
+    ASSERT_EQ(traces[id1]->num_frames, TRACE_DEPTH);
+}
+
+TEST_CASE(CallTraceStorage_shardedAdd) {
+    CallTraceStorage storage;
+    storage.clear(0, 6);
+    ASSERT_EQ(storage.shards(), 8);
+
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    fillTrace(frames, TRACE_DEPTH, 3);
+    u32 id = storage.put(TRACE_DEPTH, frames, 1);
+    storage.add(id, 2, 5);
+
+    std::multimap<u64, CallTraceSample> map;
+    storage.collectSamples(map);
+    ASSERT_EQ(map.size(), 1);
+    CHECK_EQ(map.begin()->second.samples, 3);
+    CHECK_EQ(map.begin()->second.counter, 6);
+
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    ASSERT_EQ(traces.size(), 1);
+    CHECK_EQ(traces.begin()->first, id);
+}
+
+// Eviction moves a trace to the shard chosen by its hash, while put() uses the shard of the current CPU
+TEST_CASE(CallTraceStorage_sameTraceInTwoShards) {
+    CallTraceStorage storage;
+    storage.clear(64 * 1024 * 1024, 2, STORAGE_EVICT);
+
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    int seed = 10;
+    do {
+        fillTrace(frames, TRACE_DEPTH, ++seed);
+    } while ((CallTraceStorage::hash(TRACE_DEPTH, frames) & 1) == (u64)(OS::getCurrentCpu() & 1));
+
+    storage.put(TRACE_DEPTH, frames, 10);
+    storage.evict();
+    storage.put(TRACE_DEPTH, frames, 20);
+
+    std::multimap<u64, CallTraceSample> map;
+    storage.collectSamples(map);
+    ASSERT_EQ(map.size(), 1);
+    CHECK_EQ(map.begin()->second.samples, 2);
+    CHECK_EQ(map.begin()->second.counter, 30);
+}
+
+TEST_CASE(CallTraceStorage_trieSharedPrefix) {
+    CallTraceStorage flat;
+    CallTraceStorage trie;
+    trie.clear(0, 1, STORAGE_TRIE);
+
+    // Traces differ only in the top frame, the rest of the stack is common
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    fillTrace(frames, TRACE_DEPTH, 4);
+    u32 ids[HOT_TRACES];
+    for (int t = 0; t < HOT_TRACES; t++) {
+        frames[0].bci = 1000 + t;
+        ids[t] = trie.put(TRACE_DEPTH, frames, 1);
+        flat.put(TRACE_DEPTH, frames, 1);
+    }
+    ASSERT_EQ(trie.put(TRACE_DEPTH, frames, 1), ids[HOT_TRACES - 1]);
+
+    std::map<u32, CallTrace*> traces;
+    trie.collectTraces(traces);
+    ASSERT_EQ(traces.size(), HOT_TRACES);
+
+    CallTraceUnpacker unpacker;
+    for (int t = 0; t < HOT_TRACES; t++) {
+        CallTrace* trace = unpacker.unpack(traces[ids[t]]);
+        ASSERT_EQ(trace->num_frames, TRACE_DEPTH);
+        CHECK_EQ(trace->frames[0].bci, 1000 + t);
+        for (int i = 1; i < TRACE_DEPTH; i++) {
+            CHECK_EQ(trace->frames[i].bci, frames[i].bci);
+            CHECK_EQ(trace->frames[i].method_id, frames[i].method_id);
+        }
+    }
+
+    CHECK_EQ(trie.traceCount(), HOT_TRACES);
+    CHECK_EQ(flat.traceCount(), HOT_TRACES);
+    CHECK_LT(trie.bytesPerTrace(), flat.bytesPerTrace() / 4);
+}
+
+TEST_CASE(CallTraceStorage_evictColdTraces) {
+    const int hot_traces = 100;
+    const u32 overflow_id = 0x7fffffff;
+
+    CallTraceStorage storage;
+    storage.clear(0, 1, STORAGE_EVICT);
+    size_t mem_limit = storage.usedMemory() + 24 * 1024 * 1024;
+    storage.clear(mem_limit, 1, STORAGE_EVICT);
+
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    for (int t = 0; t < 60000; t++) {
+        fillTrace(frames, TRACE_DEPTH, t);
+        storage.put(TRACE_DEPTH, frames, 1);
+    }
+    ASSERT_GT(storage.overflow(), 0);
+    ASSERT_EQ(storage.needsEviction(), true);
+
+    // Hit a few traces again in the new epoch
+    fillTrace(frames, TRACE_DEPTH, 0);
+    u32 stale_id = storage.put(TRACE_DEPTH, frames, 1);
+    for (int t = 1; t < hot_traces; t++) {
+        fillTrace(frames, TRACE_DEPTH, t);
+        storage.put(TRACE_DEPTH, frames, 1);
+    }
+
+    storage.evict();
+    CHECK_EQ(storage.evictions(), 1);
+    CHECK_GT(storage.evictedTraces(), 0);
+    CHECK_LT(storage.usedMemory(), mem_limit);
+    CHECK_EQ(storage.needsEviction(), false);
+
+    // IDs of the previous generation are ignored
+    storage.add(stale_id, 1000, 1000);
+
+    std::multimap<u64, CallTraceSample> map;
+    storage.collectSamples(map);
+    int survived_hot = 0;
+    for (std::multimap<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        CHECK_LT(it->second.samples, 3);
+        if (it->second.samples == 2) survived_hot++;
+    }
+    CHECK_EQ(survived_hot, hot_traces);
+    CHECK_EQ(map.size(), storage.traceCount());
+
+    fillTrace(frames, TRACE_DEPTH, 0);
+    u32 new_id = storage.put(TRACE_DEPTH, frames, 0);
+    CHECK_NE(new_id, stale_id);
+    fillTrace(frames, TRACE_DEPTH, 100000);
+    CHECK_NE(storage.put(TRACE_DEPTH, frames, 1), overflow_id);
+}
+
+// Survivors of eviction take the same slots again, so only the generation tells their IDs apart
+TEST_CASE(CallTraceStorage_staleGeneration) {
+    CallTraceStorage storage;
+    storage.clear(0, 1, STORAGE_EVICT);
+
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    fillTrace(frames, TRACE_DEPTH, 7);
+    u32 stale_id = storage.put(TRACE_DEPTH, frames, 1);
+
+    for (int i = 0; i < 16; i++) {
+        storage.evict();
+    }
+    storage.add(stale_id, 1000, 1000);
+
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+    ASSERT_EQ(samples.size(), 1);
+    CHECK_EQ(samples[0]->samples, 1);
+}
+
+TEST_CASE(CallTraceStorage_crc32cHash, CallTraceStorage::hasCrc32c()) {
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    fillTrace(frames, TRACE_DEPTH, 5);
+    u64 hash = CallTraceStorage::crc32cHash(TRACE_DEPTH, frames);
+    CHECK_EQ(CallTraceStorage::crc32cHash(TRACE_DEPTH, frames), hash);
+    CHECK_NE(CallTraceStorage::crc32cHash(TRACE_DEPTH - 1, frames), hash);
+    CHECK_NE(CallTraceStorage::crc32cHash(TRACE_DEPTH - 1, frames + 1), hash);
+
+    frames[TRACE_DEPTH - 1].bci++;
+    CHECK_NE(CallTraceStorage::crc32cHash(TRACE_DEPTH, frames), hash);
+    frames[TRACE_DEPTH - 1].bci--;
+    frames[0].method_id = (jmethodID)((uintptr_t)frames[0].method_id ^ 0x80000000);
+    CHECK_NE(CallTraceStorage::crc32cHash(TRACE_DEPTH, frames), hash);
+
+    // Swapping frames changes the hash
+    fillTrace(frames, TRACE_DEPTH, 5);
+    ASGCT_CallFrame tmp = frames[3];
+    frames[3] = frames[4];
+    frames[4] = tmp;
+    CHECK_NE(CallTraceStorage::crc32cHash(TRACE_DEPTH, frames), hash);
+}
+
+TEST_CASE(CallTraceStorage_verifyFrames) {
+    const int options[] = {STORAGE_VERIFY, STORAGE_VERIFY | STORAGE_TRIE};
+
+    for (int i = 0; i < 2; i++) {
+        CallTraceStorage storage;
+        storage.clear(0, 1, options[i]);
+
+        ASGCT_CallFrame frames[TRACE_DEPTH];
+        fillTrace(frames, TRACE_DEPTH, 6);
+        u32 id1 = storage.put(TRACE_DEPTH, frames, 1);
+        CHECK_EQ(storage.put(TRACE_DEPTH, frames, 1), id1);
+
+        fillTrace(frames, TRACE_DEPTH, 7);
+        u32 id2 = storage.put(TRACE_DEPTH, frames, 1);
+        CHECK_NE(id2, id1);
+        CHECK_EQ(storage.put(TRACE_DEPTH, frames, 1), id2);
+        CHECK_EQ(storage.collisions(), 0);
+        CHECK_EQ(totalSamples(storage), 4);
+    }
+}
+
+TEST_CASE(CallTraceStorage_verifyCollisions) {
+    CallTraceStorage storage;
+    storage.clear(0, 1, STORAGE_VERIFY);
+
+    // Different stack traces with the same hash are counted separately
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    fillTrace(frames, TRACE_DEPTH, 6);
+    u32 id1 = storage.put(TRACE_DEPTH, frames, 1, 42);
+    fillTrace(frames, TRACE_DEPTH, 7);
+    u32 id2 = storage.put(TRACE_DEPTH, frames, 2, 42);
+    CHECK_NE(id2, id1);
+    CHECK_EQ(storage.collisions(), 1);
+
+    std::multimap<u64, CallTraceSample> map;
+    storage.collectSamples(map);
+    ASSERT_EQ(map.size(), 2);
+    CHECK_EQ(totalSamples(storage), 2);
+
+    // and both survive eviction
+    storage.evict();
+    map.clear();
+    storage.collectSamples(map);
+    CHECK_EQ(map.size(), 2);
+}
+
+TEST_CASE(CallTraceStorage_swapStandby) {
+    CallTraceStorage storages[2];
+    storages[0].clear(0, 1, STORAGE_SWAP);
+
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    fillTrace(frames, TRACE_DEPTH, 9);
+    u32 old_id = storages[0].put(TRACE_DEPTH, frames, 5);
+
+    // Samples after the swap go to the standby storage only
+    storages[0].prepareSuccessor(storages[1]);
+    ASSERT_EQ(storages[1].swapEnabled(), true);
+    CHECK_EQ(totalSamples(storages[1]), 0);
+
+    u32 new_id = storages[1].put(TRACE_DEPTH, frames, 7);
+    CHECK_NE(new_id, old_id);
+    storages[1].add(old_id, 100, 100);
+    storages[1].put(TRACE_DEPTH, frames, 7);
+
+    CHECK_EQ(totalSamples(storages[0]), 1);
+    CHECK_EQ(totalSamples(storages[1]), 2);
+
+    // And back again
+    storages[1].prepareSuccessor(storages[0]);
+    CHECK_EQ(totalSamples(storages[0]), 0);
+    CHECK_NE(storages[0].put(TRACE_DEPTH, frames, 1), new_id);
+}
+
+TEST_CASE(CallTraceStorage_collectDirtyOnly) {
+    CallTraceStorage storage;
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    u32 ids[100];
+    for (int t = 0; t < 100; t++) {
+        fillTrace(frames, TRACE_DEPTH, t);
+        ids[t] = storage.put(TRACE_DEPTH, frames, 1);
+    }
+
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 100);
+
+    // Only traces hit since the previous collection are reported
+    fillTrace(frames, TRACE_DEPTH, 42);
+    storage.put(TRACE_DEPTH, frames, 1);
+    storage.add(ids[7], 1, 1);
+
+    traces.clear();
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 2);
+    CHECK_EQ(traces.count(ids[42]), 1);
+    CHECK_EQ(traces.count(ids[7]), 1);
+
+    traces.clear();
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 0);
+
+    // A zero counter does not make a trace dirty
+    storage.put(TRACE_DEPTH, frames, 0);
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 0);
+
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+    CHECK_EQ(samples.size(), 100);
+}
+
+// Microbenchmark: collectTraces() after a few hits in a large, mostly idle storage
+BENCHMARK_CASE(CallTraceStorage_collectBenchmark) {
+    CallTraceStorage storage;
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    const int total_traces = 100000;
+    for (int t = 0; t < total_traces; t++) {
+        fillTrace(frames, TRACE_DEPTH, t);
+        storage.put(TRACE_DEPTH, frames, 1);
+    }
+
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+
+    const int hot_counts[] = {0, 16, 1024};
+    for (int h = 0; h < 3; h++) {
+        for (int t = 0; t < hot_counts[h]; t++) {
+            fillTrace(frames, TRACE_DEPTH, t * 97 % total_traces);
+            storage.put(TRACE_DEPTH, frames, 1);
+        }
+
+        traces.clear();
+        u64 start = rdtsc();
+        storage.collectTraces(traces);
+        u64 ticks = rdtsc() - start;
+
+        printf("capacity=%u touched=%d: collectTraces ticks=%llu\n", storage.capacity(), hot_counts[h],
+               (unsigned long long)ticks);
+        CHECK_EQ(traces.size(), (size_t)hot_counts[h]);
+    }
+}
+
+// Microbenchmark: cost of hashing and storing a known stack trace of different depths
+BENCHMARK_CASE(CallTraceStorage_hashBenchmark) {
+    const int depths[] = {16, 128, 2048};
+    const int total_frames = 16 * 1024 * 1024;
+    ASGCT_CallFrame* frames = new ASGCT_CallFrame[2048];
+    fillTrace(frames, 2048, 8);
+
+    printf("Selected hash: %s\n", CallTraceStorage::hashName());
+    for (int d = 0; d < 3; d++) {
+        int depth = depths[d];
+        int iterations = total_frames / depth;
+        volatile u64 sink = 0;
+
+        u64 start = rdtsc();
+        for (int i = 0; i < iterations; i++) {
+            frames[0].bci = i;
+            sink += CallTraceStorage::murmurHash(depth, frames);
+        }
+        u64 murmur = rdtsc() - start;
+
+        u64 crc32c = 0;
+        if (CallTraceStorage::hasCrc32c()) {
+            start = rdtsc();
+            for (int i = 0; i < iterations; i++) {
+                frames[0].bci = i;
+                sink += CallTraceStorage::crc32cHash(depth, frames);
+            }
+            crc32c = rdtsc() - start;
+        }
+
+        frames[0].bci = 0;
+        u64 put_ticks[2];
+        for (int verify = 0; verify < 2; verify++) {
+            CallTraceStorage storage;
+            storage.clear(0, 1, verify ? STORAGE_VERIFY : 0);
+            start = rdtsc();
+            for (int i = 0; i < iterations; i++) {
+                sink += storage.put(depth, frames, 1);
+            }
+            put_ticks[verify] = rdtsc() - start;
+        }
+
+        printf("depth=%-4d ticks/sample: murmur=%.1f crc32c=%.1f put=%.1f put+verify=%.1f\n", depth,
+               (double)murmur / iterations, (double)crc32c / iterations,
+               (double)put_ticks[0] / iterations, (double)put_ticks[1] / iterations);
+    }
+
+    delete[] frames;
+}
+
+// Microbenchmark: put() over a large working set, where TLB misses dominate, with and without huge pages
+BENCHMARK_CASE(CallTraceStorage_hugePageBenchmark) {
+    const int policies[] = {0, ALLOC_THP, ALLOC_HUGETLB};
+    const char* names[] = {"4k", "thp", "hugetlb"};
+    const int distinct = 256 * 1024;
+    const int iterations = 2 * 1024 * 1024;
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+
+    for (int p = 0; p < 3; p++) {
+        ASSERT_EQ(OS::setAllocPolicy(policies[p], -1), true);
+        CallTraceStorage storage;
+        storage.clear(0);
+
+        AllocStats before;
+        OS::getAllocStats(&before);
+
+        u64 start = rdtsc();
+        u32 seed = 1;
+        for (int i = 0; i < iterations; i++) {
+            seed = seed * 1103515245 + 12345;
+            fillTrace(frames, TRACE_DEPTH, (seed >> 8) % distinct);
+            storage.put(TRACE_DEPTH, frames, 1);
+        }
+        u64 ticks = rdtsc() - start;
+
+        AllocStats after;
+        OS::getAllocStats(&after);
+        printf("%-7s ticks/put=%.1f huge=%lluKB fallbacks=%llu minor_faults=%llu\n", names[p],
+               (double)ticks / iterations, (unsigned long long)(after.huge_bytes - before.huge_bytes) / 1024,
+               (unsigned long long)(after.huge_fallbacks - before.huge_fallbacks),
+               (unsigned long long)(after.minor_faults - before.minor_faults));
+        CHECK_EQ(totalSamples(storage), (u64)iterations);
+    }
+
+    OS::setAllocPolicy(0, -1);
+}
+
+// Concurrent put() of the same few traces loses no samples, with one or several shards
+TEST_CASE(CallTraceStorage_concurrentPut) {
+    const int threads = 4;
+    const int iterations = 20000;
+
+    for (int shards = 1; shards <= 4; shards *= 4) {
+        CallTraceStorage storage;
+        storage.clear(0, shards);
+
+        pthread_t tids[threads];
+        PutWorker worker = {&storage, iterations};
+        for (int i = 0; i < threads; i++) {
+            pthread_create(&tids[i], NULL, putLoop, &worker);
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+
+        std::multimap<u64, CallTraceSample> map;
+        storage.collectSamples(map);
+        CHECK_EQ(map.size(), HOT_TRACES);
+        CHECK_EQ(totalSamples(storage), (u64)threads * iterations);
+    }
+}
+
+// Contention benchmark: put() throughput of a few hot traces against the number of threads
+BENCHMARK_CASE(CallTraceStorage_putThroughput) {
+    const int iterations = 200000;
+    const int max_threads = OS::getCpuCount() < 16 ? OS::getCpuCount() : 16;
+    const int shard_counts[] = {1, OS::getCpuCount()};
+
+    for (int s = 0; s < 2; s++) {
+        CallTraceStorage storage;
+        storage.clear(0, shard_counts[s]);
+
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            pthread_t tids[16];
+            PutWorker worker = {&storage, iterations};
+
+            u64 start = OS::nanotime();
+            for (int i = 0; i < threads; i++) {
+                pthread_create(&tids[i], NULL, putLoop, &worker);
+            }
+            for (int i = 0; i < threads; i++) {
+                pthread_join(tids[i], NULL);
+            }
+            u64 elapsed = OS::nanotime() - start;
+
+            printf("shards=%d threads=%d: %.2f M put/s\n", storage.shards(), threads,
+                   (double)threads * iterations * 1000.0 / (elapsed + 1));
+
+            CHECK_EQ(totalSamples(storage), (u64)threads * iterations);
+            storage.resetCounters();
+        }
+    }
+}
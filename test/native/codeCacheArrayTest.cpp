@@ -0,0 +1,113 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include "codeCache.h"
+#include "testRunner.hpp"
+#include "tsc.h"
+
+static const uintptr_t INDEXED_LIB_BASE = 0x7f0000000000;
+static const uintptr_t INDEXED_LIB_SIZE = 0x10000;
+
+// Libraries are added in a shuffled order with gaps between them
+static void addIndexedLibs(CodeCacheArray* libs, int from, int count) {
+    for (int i = from; i < from + count; i++) {
+        uintptr_t slot = (i * 7919) % 4096;
+        const char* start = (const char*)(INDEXED_LIB_BASE + slot * 2 * INDEXED_LIB_SIZE);
+        libs->add(new CodeCache("lib", i, start, start + INDEXED_LIB_SIZE));
+    }
+}
+
+static CodeCache* linearFindLibrary(CodeCacheArray* libs, const void* address) {
+    for (int i = 0; i < libs->count(); i++) {
+        if ((*libs)[i]->contains(address)) {
+            return (*libs)[i];
+        }
+    }
+    return NULL;
+}
+
+static bool indexMatchesLinearScan(CodeCacheArray* libs) {
+    for (uintptr_t offset = 0; offset < 4096 * 2 * INDEXED_LIB_SIZE; offset += INDEXED_LIB_SIZE / 3) {
+        const void* address = (const void*)(INDEXED_LIB_BASE + offset);
+        if (libs->findByAddress(address) != linearFindLibrary(libs, address)) {
+            return false;
+        }
+    }
+    return libs->findByAddress((const void*)0x1000) == NULL;
+}
+
+static void deleteIndexedLibs(CodeCacheArray* libs) {
+    for (int i = 0; i < libs->count(); i++) {
+        delete (*libs)[i];
+    }
+    delete libs;
+}
+
+TEST_CASE(CodeCacheArray_index) {
+    CodeCacheArray* libs = new CodeCacheArray();
+    addIndexedLibs(libs, 0, 300);
+    CHECK_EQ(indexMatchesLinearScan(libs), true);
+
+    libs->updateIndex();
+    CHECK_EQ(indexMatchesLinearScan(libs), true);
+
+    // Libraries added after the index was built are still found
+    addIndexedLibs(libs, 300, 300);
+    CHECK_EQ(indexMatchesLinearScan(libs), true);
+
+    libs->updateIndex();
+    CHECK_EQ(indexMatchesLinearScan(libs), true);
+
+    deleteIndexedLibs(libs);
+}
+
+TEST_CASE(CodeCacheArray_overlap) {
+    CodeCacheArray* libs = new CodeCacheArray();
+    addIndexedLibs(libs, 0, 100);
+
+    // A library mapped over a part of an older one: the older one still wins, as in a linear scan
+    const char* start = (const char*)(*libs)[50]->minAddress() + INDEXED_LIB_SIZE / 2;
+    CodeCache* newer = new CodeCache("newer", 100, start, start + INDEXED_LIB_SIZE);
+    libs->add(newer);
+    libs->updateIndex();
+
+    CHECK_EQ(libs->findByAddress(start), (*libs)[50]);
+    CHECK_EQ(libs->findByAddress(start + INDEXED_LIB_SIZE - 1), newer);
+    CHECK_EQ(indexMatchesLinearScan(libs), true);
+
+    deleteIndexedLibs(libs);
+}
+
+// Microbenchmark: linear scan vs. sorted index with a typical number of libraries
+BENCHMARK_CASE(CodeCacheArray_benchmark) {
+    const int iterations = 200000;
+    CodeCacheArray* libs = new CodeCacheArray();
+    addIndexedLibs(libs, 0, 600);
+    libs->updateIndex();
+
+    const void* addresses[256];
+    for (int i = 0; i < 256; i++) {
+        addresses[i] = (*libs)[(i * 37) % 600]->minAddress();
+    }
+
+    volatile uintptr_t sink = 0;
+    u64 start = rdtsc();
+    for (int i = 0; i < iterations; i++) {
+        sink += (uintptr_t)linearFindLibrary(libs, addresses[i & 255]);
+    }
+    u64 linear_ticks = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < iterations; i++) {
+        sink += (uintptr_t)libs->findByAddress(addresses[i & 255]);
+    }
+    u64 index_ticks = rdtsc() - start;
+
+    printf("libs=600 ticks/lookup: linear=%.1f index=%.1f\n", (double)linear_ticks / iterations,
+           (double)index_ticks / iterations);
+
+    deleteIndexedLibs(libs);
+}
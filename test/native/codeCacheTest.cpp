@@ -0,0 +1,151 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "codeCache.h"
+#include "os.h"
+#include "testRunner.hpp"
+#include "tsc.h"
+
+static const uintptr_t SEARCH_LIB_BASE = 0x7f1000000000;
+
+// Symbols of pseudo-random sizes with gaps, zero-sized labels and nested aliases.
+// Labels never share an address with a sized symbol, where either name is a valid result.
+// A blob appended past the end after sort() leaves a cache without the search tree,
+// which is the reference for the plain binary search.
+static CodeCache* makeSearchLib(const char* name, int count, bool search_tree) {
+    const char* base = (const char*)SEARCH_LIB_BASE;
+    CodeCache* cc = new CodeCache(name, 0, base, base + (uintptr_t)count * 0x400);
+
+    uintptr_t offset = 0;
+    u32 seed = 12345;
+    for (int i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        int size = (seed >> 16) % 0x200 + 1;
+        char sym[32];
+        snprintf(sym, sizeof(sym), "symbol%d", i);
+        if (i % 17 == 0) {
+            cc->add(base + offset, 0, sym);
+        } else if (i % 23 == 0 && size > 0x20) {
+            cc->add(base + offset + 0x10, size - 0x20, sym);
+        } else {
+            cc->add(base + offset, size, sym);
+        }
+        offset += size + ((seed >> 8) % 3 == 0 ? 0x40 : 0);
+    }
+    cc->sort();
+
+    if (!search_tree) {
+        cc->add(base + offset + 0x1000, 0x10, "tail");
+    }
+    return cc;
+}
+
+static const void* searchAddress(u32 i, int count) {
+    return (const char*)SEARCH_LIB_BASE + (u32)(i * 2654435761U) % ((u32)count * 0x100 + 0x1000);
+}
+
+// An address inside a nested alias may resolve to either the alias or the enclosing symbol
+static bool isNestedPair(const char* name1, const char* name2) {
+    int i1, i2;
+    return sscanf(name1, "symbol%d", &i1) == 1 && sscanf(name2, "symbol%d", &i2) == 1 &&
+           (i1 % 23 == 0 || i2 % 23 == 0);
+}
+
+TEST_CASE(CodeCache_searchTree) {
+    const int counts[] = {1, MIN_SEARCH_TREE_SIZE - 1, MIN_SEARCH_TREE_SIZE, 1000, 4097};
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        CodeCache* tree = makeSearchLib("libsearch.so", counts[c], true);
+        CodeCache* plain = makeSearchLib("libsearch.so", counts[c], false);
+
+        int mismatches = 0;
+        for (u32 i = 0; i < 100000; i++) {
+            const void* address = searchAddress(i, counts[c]);
+            const char* expected = plain->binarySearch(address);
+            const char* actual = tree->binarySearch(address);
+            if (strcmp(expected, actual) != 0 && !isNestedPair(expected, actual)) {
+                mismatches++;
+            }
+        }
+        CHECK_EQ(mismatches, 0);
+
+        delete tree;
+        delete plain;
+    }
+}
+
+static void benchmarkSearch(const char* name, int count) {
+    const int iterations = 2000000;
+    CodeCache* tree = makeSearchLib(name, count, true);
+    CodeCache* plain = makeSearchLib(name, count, false);
+
+    volatile uintptr_t sink = 0;
+    u64 start_ns = OS::nanotime();
+    u64 start = rdtsc();
+    for (int i = 0; i < iterations; i++) {
+        sink += (uintptr_t)plain->binarySearch(searchAddress(i, count));
+    }
+    u64 plain_ticks = rdtsc() - start;
+    u64 plain_ns = OS::nanotime() - start_ns;
+
+    start_ns = OS::nanotime();
+    start = rdtsc();
+    for (int i = 0; i < iterations; i++) {
+        sink += (uintptr_t)tree->binarySearch(searchAddress(i, count));
+    }
+    u64 tree_ticks = rdtsc() - start;
+    u64 tree_ns = OS::nanotime() - start_ns;
+
+    printf("%s symbols=%d ticks/lookup: sorted=%.1f eytzinger=%.1f, Mlookups/s: sorted=%.1f eytzinger=%.1f\n",
+           name, count, (double)plain_ticks / iterations, (double)tree_ticks / iterations,
+           iterations * 1000.0 / (plain_ns + 1), iterations * 1000.0 / (tree_ns + 1));
+
+    delete tree;
+    delete plain;
+}
+
+// Microbenchmark: plain binary search vs. Eytzinger layout with symbol counts
+// typical for libjvm.so and [kernel]
+BENCHMARK_CASE(CodeCache_searchBenchmark) {
+    benchmarkSearch("libjvm.so", 60000);
+    benchmarkSearch("[kernel]", 200000);
+}
+
+TEST_CASE(CodeCache_internedNames) {
+    CodeCache* cc = new CodeCache("libnames.so", 7);
+    const char* base = (const char*)SEARCH_LIB_BASE;
+
+    // Long names span several arena chunks
+    char long_name[1000];
+    memset(long_name, 'x', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = 0;
+
+    for (int i = 0; i < 3000; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "func%d", i % 1000);
+        cc->add(base + i * 0x10, 0x10, i % 500 == 499 ? long_name : name);
+    }
+    cc->add(base + 3000 * 0x10, 0x10, "bad\nname");
+    cc->sort();
+
+    const char* name = cc->binarySearch(base + 5 * 0x10);
+    CHECK_EQ(strcmp(name, "func5"), 0);
+    CHECK_EQ(NativeFunc::libIndex(name), 7);
+    CHECK_EQ(strcmp(cc->binarySearch(base + 499 * 0x10 + 8), long_name), 0);
+    CHECK_EQ(strcmp(cc->binarySearch(base + 3000 * 0x10), "bad?name"), 0);
+
+    // Equal names are stored once
+    CHECK_EQ(cc->binarySearch(base + 1005 * 0x10), name);
+    CHECK_EQ(cc->binarySearch(base + 2005 * 0x10), name);
+    CHECK_EQ(cc->findSymbol("func5"), (const void*)(base + 5 * 0x10));
+
+    // Marks are shared by equal names too
+    CHECK_EQ(NativeFunc::mark(name), 0);
+    NativeFunc::mark(cc->binarySearch(base + 2005 * 0x10), MARK_VM_RUNTIME);
+    CHECK_EQ(NativeFunc::mark(name), MARK_VM_RUNTIME);
+
+    delete cc;
+}
@@ -5,7 +5,10 @@
 
 #include "testRunner.hpp"
 #include "demangle.h"
+#include "demangleCache.h"
 #include <stdio.h>
+#include <string>
+#include <vector>
 
 TEST_CASE(Demangle_test_needs_demangling) {
     // Rust legacy-mangled symbol
@@ -158,3 +161,57 @@ TEST_CASE(Demangle_test_demangle_rust_v0_infinite) {
     char *s = Demangle::demangle("_RNvMC0" "TTTTTTTTTTTTTTTT" "p" "Bk_Bk_Bk_Bk_Bk_Bk_Bk_Bk_E" "Bj_E" "Bi_E" "Bh_E" "Bg_E" "Bf_E" "Be_E" "Bd_E" "Bc_E" "Bb_E" "Ba_E" "B9_E" "B8_E" "B7_E" "B6_E" "B5_E" "3run", false);
     CHECK_EQ(s, NULL);
 }
+
+TEST_CASE(DemangleCache_hitsAndMisses) {
+    DemangleCache cache;
+    const char* name = "_ZN3foo3barEi";
+    std::string result;
+
+    CHECK_EQ(cache.demangle(name, false, result), true);
+    CHECK_EQ(result.c_str(), "foo::bar");
+    CHECK_EQ(cache.demangle(name, false, result), true);
+    CHECK_EQ(result.c_str(), "foo::bar");
+    CHECK_EQ(cache.misses(), 1);
+    CHECK_EQ(cache.hits(), 1);
+
+    // Full signatures are cached separately
+    CHECK_EQ(cache.demangle(name, true, result), true);
+    CHECK_EQ(result.c_str(), "foo::bar(int)");
+    CHECK_EQ(cache.misses(), 2);
+
+    // Failures are remembered too
+    const char* invalid = "_Zinvalid";
+    CHECK_EQ(cache.demangle(invalid, false, result), false);
+    CHECK_EQ(cache.demangle(invalid, false, result), false);
+    CHECK_EQ(cache.misses(), 3);
+    CHECK_EQ(cache.hits(), 2);
+    CHECK_EQ(cache.usedMemory() > 0, true);
+}
+
+TEST_CASE(DemangleCache_memoryLimit) {
+    // Equal names at distinct addresses are distinct keys
+    std::string name = "_ZN200" + std::string(200, 'x') + "E";
+    const int count = 30000;
+    std::vector<char> names(count * (name.size() + 1));
+    for (int i = 0; i < count; i++) {
+        memcpy(&names[i * (name.size() + 1)], name.c_str(), name.size() + 1);
+    }
+
+    DemangleCache cache;
+    std::string result;
+    size_t max_memory = 0;
+    for (int i = 0; i < count; i++) {
+        CHECK_EQ(cache.demangle(&names[i * (name.size() + 1)], false, result), true);
+        max_memory = std::max(max_memory, cache.usedMemory());
+    }
+    CHECK_EQ(result.size(), 200);
+    CHECK_EQ(cache.misses(), count);
+    // The limit may be exceeded by one string and the growth of the hash table
+    CHECK_EQ(max_memory <= MAX_DEMANGLE_CACHE_MEMORY + 65536 * 3 * sizeof(void*), true);
+
+    // The first names were dropped when the cache started over, the last ones are still there
+    CHECK_EQ(cache.demangle(&names[(count - 1) * (name.size() + 1)], false, result), true);
+    CHECK_EQ(cache.hits(), 1);
+    CHECK_EQ(cache.demangle(&names[0], false, result), true);
+    CHECK_EQ(cache.misses(), count + 1);
+}
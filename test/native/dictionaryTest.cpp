@@ -0,0 +1,241 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "dictionary.h"
+#include "testRunner.hpp"
+#include "tsc.h"
+
+static const int THREADS = 8;
+static const int KEYS_PER_THREAD = 20000;
+
+struct LookupWorker {
+    Dictionary* dict;
+    unsigned int* ids;
+    int shift;
+};
+
+static void keyName(char* buf, int i) {
+    sprintf(buf, "java/util/concurrent/Class%d", i);
+}
+
+// All workers look up the same keys in a different order
+static void* lookupLoop(void* arg) {
+    LookupWorker* worker = (LookupWorker*)arg;
+    char buf[64];
+    for (int i = 0; i < KEYS_PER_THREAD; i++) {
+        int k = (i * 7919 + worker->shift) % KEYS_PER_THREAD;
+        keyName(buf, k);
+        worker->ids[k] = worker->dict->lookup(buf);
+    }
+    return NULL;
+}
+
+TEST_CASE(Dictionary_stableIds) {
+    Dictionary dict;
+    char buf[64];
+    std::vector<unsigned int> ids;
+
+    // Enough keys to grow the index several times
+    for (int i = 0; i < 10000; i++) {
+        keyName(buf, i);
+        ids.push_back(dict.lookup(buf));
+        ASSERT_NE(ids[i], 0);
+    }
+    for (int i = 0; i < 10000; i++) {
+        keyName(buf, i);
+        CHECK_EQ(dict.lookup(buf, strlen(buf)), ids[i]);
+    }
+
+    std::map<unsigned int, const char*> map;
+    dict.collect(map);
+    CHECK_EQ(map.size(), 10000);
+    keyName(buf, 1234);
+    CHECK_EQ(strcmp(map[ids[1234]], buf), 0);
+
+    // Only the given length of a key matters
+    CHECK_EQ(dict.lookup("java/util/List", 9), dict.lookup("java/util"));
+    CHECK_NE(dict.lookup("java/util/List"), dict.lookup("java/util"));
+    CHECK_NE(dict.lookup(""), 0);
+
+    dict.clear();
+    map.clear();
+    dict.collect(map);
+    CHECK_EQ(map.size(), 0);
+}
+
+TEST_CASE(Dictionary_largeKey) {
+    Dictionary dict;
+    size_t length = 100000;
+    char* key = (char*)malloc(length + 1);
+    memset(key, 'x', length);
+    key[length] = 0;
+
+    unsigned int id = dict.lookup(key);
+    CHECK_EQ(dict.lookup(key, length), id);
+    CHECK_NE(dict.lookup(key, length - 1), id);
+
+    std::map<unsigned int, const char*> map;
+    dict.collect(map);
+    CHECK_EQ(strlen(map[id]), length);
+    CHECK_EQ(dict.usedMemory() > length, true);
+
+    free(key);
+}
+
+TEST_CASE(Dictionary_concurrentLookup) {
+    Dictionary dict;
+    std::vector<unsigned int> ids(THREADS * KEYS_PER_THREAD);
+    pthread_t tids[THREADS];
+    LookupWorker workers[THREADS];
+
+    for (int i = 0; i < THREADS; i++) {
+        workers[i].dict = &dict;
+        workers[i].ids = &ids[i * KEYS_PER_THREAD];
+        workers[i].shift = i * 101;
+        pthread_create(&tids[i], NULL, lookupLoop, &workers[i]);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    // Every key has a single ID, and every ID maps back to its key
+    std::map<unsigned int, const char*> map;
+    dict.collect(map);
+    char buf[64];
+    for (int k = 0; k < KEYS_PER_THREAD; k++) {
+        keyName(buf, k);
+        unsigned int id = dict.lookup(buf);
+        ASSERT_EQ(strcmp(map[id], buf), 0);
+        for (int i = 0; i < THREADS; i++) {
+            CHECK_EQ(ids[i * KEYS_PER_THREAD + k], id);
+        }
+    }
+}
+
+// The multi-level design Dictionary used to have: chained 128x3 tables, malloc per key
+class LegacyDictionary {
+  private:
+    enum { ROW_BITS = 7, ROWS = 1 << ROW_BITS, CELLS = 3, TABLE_CAPACITY = ROWS * CELLS };
+
+    struct Table;
+    struct Row {
+        char* keys[CELLS];
+        Table* next;
+    };
+    struct Table {
+        Row rows[ROWS];
+        unsigned int base_index;
+    };
+
+    Table* _table;
+    volatile unsigned int _base_index;
+
+    static void destroy(Table* table) {
+        for (int i = 0; i < ROWS; i++) {
+            for (int j = 0; j < CELLS; j++) free(table->rows[i].keys[j]);
+            if (table->rows[i].next != NULL) destroy(table->rows[i].next);
+        }
+        free(table);
+    }
+
+  public:
+    LegacyDictionary() {
+        _table = (Table*)calloc(1, sizeof(Table));
+        _base_index = _table->base_index = 1;
+    }
+
+    ~LegacyDictionary() {
+        destroy(_table);
+    }
+
+    unsigned int lookup(const char* key, size_t length) {
+        Table* table = _table;
+        unsigned int h = 2166136261U;
+        for (size_t i = 0; i < length; i++) {
+            h = (h ^ key[i]) * 16777619;
+        }
+
+        while (true) {
+            Row* row = &table->rows[h % ROWS];
+            for (int c = 0; c < CELLS; c++) {
+                if (row->keys[c] == NULL) {
+                    char* new_key = (char*)malloc(length + 1);
+                    memcpy(new_key, key, length);
+                    new_key[length] = 0;
+                    if (__sync_bool_compare_and_swap(&row->keys[c], NULL, new_key)) {
+                        return table->base_index + (c << ROW_BITS) + h % ROWS;
+                    }
+                    free(new_key);
+                }
+                if (strncmp(row->keys[c], key, length) == 0 && row->keys[c][length] == 0) {
+                    return table->base_index + (c << ROW_BITS) + h % ROWS;
+                }
+            }
+
+            if (row->next == NULL) {
+                Table* new_table = (Table*)calloc(1, sizeof(Table));
+                new_table->base_index = __sync_add_and_fetch(&_base_index, TABLE_CAPACITY);
+                if (!__sync_bool_compare_and_swap(&row->next, NULL, new_table)) {
+                    free(new_table);
+                }
+            }
+
+            table = row->next;
+            h = (h >> ROW_BITS) | (h << (32 - ROW_BITS));
+        }
+    }
+};
+
+// Microbenchmark: insertion and repeated lookups of class names, current vs legacy design
+BENCHMARK_CASE(Dictionary_lookupBenchmark) {
+    const int sizes[] = {1000, 100000};
+    const int lookups = 2000000;
+
+    for (int s = 0; s < 2; s++) {
+        int size = sizes[s];
+        std::vector<char*> keys(size);
+        for (int i = 0; i < size; i++) {
+            keys[i] = (char*)malloc(64);
+            keyName(keys[i], i);
+        }
+
+        Dictionary dict;
+        LegacyDictionary legacy;
+        volatile unsigned int sink = 0;
+
+        u64 start = rdtsc();
+        for (int i = 0; i < size; i++) sink += dict.lookup(keys[i], strlen(keys[i]));
+        u64 dict_insert = rdtsc() - start;
+
+        start = rdtsc();
+        for (int i = 0; i < size; i++) sink += legacy.lookup(keys[i], strlen(keys[i]));
+        u64 legacy_insert = rdtsc() - start;
+
+        start = rdtsc();
+        for (int i = 0; i < lookups; i++) {
+            const char* key = keys[(unsigned int)(i * 2654435761U) % size];
+            sink += dict.lookup(key, strlen(key));
+        }
+        u64 dict_lookup = rdtsc() - start;
+
+        start = rdtsc();
+        for (int i = 0; i < lookups; i++) {
+            const char* key = keys[(unsigned int)(i * 2654435761U) % size];
+            sink += legacy.lookup(key, strlen(key));
+        }
+        u64 legacy_lookup = rdtsc() - start;
+
+        printf("keys=%-6d ticks/insert: flat=%.1f legacy=%.1f  ticks/lookup: flat=%.1f legacy=%.1f\n", size,
+               (double)dict_insert / size, (double)legacy_insert / size,
+               (double)dict_lookup / lookups, (double)legacy_lookup / lookups);
+
+        for (int i = 0; i < size; i++) free(keys[i]);
+    }
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "dwarf.h"
+#include "testRunner.hpp"
+#include "tsc.h"
+
+// Rows of a typical library: functions of various size, each with a few rules from a small set
+static FrameDesc* makeDwarfRows(int length, u32 max_gap) {
+    FrameDesc* table = (FrameDesc*)malloc(length * sizeof(FrameDesc));
+    u32 loc = 0x40;
+    for (int i = 0; i < length; i++) {
+        loc += 1 + (i * 2654435761U) % max_gap;
+        table[i].loc = loc;
+        table[i].cfa = DW_REG_SP | (8 + 8 * (i % 7)) << 8;
+        table[i].fp_off = i % 3 == 0 ? DW_SAME_FP : -16;
+        table[i].pc_off = -8;
+    }
+    return table;
+}
+
+// The original lookup over the uncompressed table
+static const FrameDesc* referenceFrameDesc(const FrameDesc* table, int length, u32 loc) {
+    int low = 0;
+    int high = length - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (table[mid].loc <= loc) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low > 0 ? &table[low - 1] : NULL;
+}
+
+static bool sameRule(const FrameDesc* f1, const FrameDesc* f2) {
+    if (f1 == NULL || f2 == NULL) {
+        return f1 == f2;
+    }
+    return f1->cfa == f2->cfa && f1->fp_off == f2->fp_off && f1->pc_off == f2->pc_off;
+}
+
+static bool compactMatchesReference(const FrameDesc* table, int length, u32 max_gap) {
+    CompactDwarfTable* compact = CompactDwarfTable::create(table, length);
+    if (compact == NULL) {
+        return false;
+    }
+
+    bool ok = true;
+    u32 end = table[length - 1].loc + 100000;
+    u32 step = max_gap / 3 + 1;
+    for (u32 loc = 0; loc < end && ok; loc += step) {
+        ok = sameRule(compact->find(loc), referenceFrameDesc(table, length, loc));
+    }
+    for (int i = 0; i < length && ok; i++) {
+        ok = sameRule(compact->find(table[i].loc), &table[i]) &&
+             sameRule(compact->find(table[i].loc - 1), referenceFrameDesc(table, length, table[i].loc - 1));
+    }
+
+    delete compact;
+    return ok;
+}
+
+TEST_CASE(CompactDwarfTable_lookup) {
+    const int length = 100000;
+    const u32 gaps[] = {4, 64, 1000, 20000};
+    for (int i = 0; i < 4; i++) {
+        FrameDesc* table = makeDwarfRows(length, gaps[i]);
+        CHECK_EQ(compactMatchesReference(table, length, gaps[i]), true);
+        free(table);
+    }
+
+    FrameDesc* single = makeDwarfRows(1, 16);
+    CHECK_EQ(compactMatchesReference(single, 1, 16), true);
+    free(single);
+}
+
+TEST_CASE(CompactDwarfTable_memory) {
+    const int length = 200000;
+    FrameDesc* table = makeDwarfRows(length, 64);
+    CompactDwarfTable* compact = CompactDwarfTable::create(table, length);
+    ASSERT_NE(compact, NULL);
+
+    CHECK_EQ(compact->rowCount(), length);
+    CHECK_EQ(compact->ruleCount(), 14);
+    CHECK_LT(compact->usedMemory() * 3, length * sizeof(FrameDesc));
+
+    delete compact;
+    free(table);
+}
+
+TEST_CASE(CompactDwarfTable_unsupported) {
+    // Unsorted rows are kept in the original form
+    FrameDesc* table = makeDwarfRows(100, 64);
+    table[50].loc = 1;
+    CHECK_EQ(CompactDwarfTable::create(table, 100), NULL);
+
+    // So are a few rows spread over a huge address range
+    table[50].loc = table[49].loc + 1;
+    table[99].loc = 0xf0000000;
+    CHECK_EQ(CompactDwarfTable::create(table, 100), NULL);
+    free(table);
+}
+
+// Microbenchmark: lookups over the original and the compact table of a large library
+BENCHMARK_CASE(CompactDwarfTable_benchmark) {
+    const int length = 500000;
+    const int iterations = 1000000;
+    FrameDesc* table = makeDwarfRows(length, 64);
+    CompactDwarfTable* compact = CompactDwarfTable::create(table, length);
+    ASSERT_NE(compact, NULL);
+
+    u32 end = table[length - 1].loc;
+    volatile uintptr_t sink = 0;
+
+    u64 start = rdtsc();
+    for (int i = 0; i < iterations; i++) {
+        sink += (uintptr_t)referenceFrameDesc(table, length, (i * 2654435761U) % end);
+    }
+    u64 original_ticks = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < iterations; i++) {
+        sink += (uintptr_t)compact->find((i * 2654435761U) % end);
+    }
+    u64 compact_ticks = rdtsc() - start;
+
+    printf("rows=%d memory: original=%zu KB compact=%zu KB  ticks/lookup: original=%.1f compact=%.1f\n",
+           length, length * sizeof(FrameDesc) / 1024, compact->usedMemory() / 1024,
+           (double)original_ticks / iterations, (double)compact_ticks / iterations);
+
+    delete compact;
+    free(table);
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "codeCache.h"
+#include "frameDescCache.h"
+#include "testRunner.hpp"
+#include "tsc.h"
+
+static const int CACHED_PC_THREADS = 4;
+static const int CACHED_PC_ITERATIONS = 200000;
+
+static FrameDescCache frame_desc_cache_under_test;
+static FrameDesc fake_frames[64];
+
+// Every pc maps to a well-known (lib, frame) pair, so that a torn entry can be detected
+static CodeCache* fakeLibOf(const void* pc) {
+    return (CodeCache*)((uintptr_t)pc * 7 + 1);
+}
+
+static FrameDesc* fakeFrameOf(const void* pc) {
+    return &fake_frames[(uintptr_t)pc % 64];
+}
+
+static void* frameDescLookupLoop(void* arg) {
+    uintptr_t seed = (uintptr_t)arg;
+    bool* ok = new bool(true);
+    for (int i = 0; i < CACHED_PC_ITERATIONS; i++) {
+        const void* pc = (const void*)(0x10000 + (seed * 131 + i * 17) % 5000);
+        CodeCache* lib;
+        FrameDesc* frame;
+        if (frame_desc_cache_under_test.lookup(pc, lib, frame)) {
+            *ok &= lib == fakeLibOf(pc) && frame == fakeFrameOf(pc);
+        } else {
+            frame_desc_cache_under_test.insert(pc, fakeLibOf(pc), fakeFrameOf(pc), frame_desc_cache_under_test.epoch());
+        }
+    }
+    return ok;
+}
+
+TEST_CASE(FrameDescCache_lookup) {
+    FrameDescCache* cache = new FrameDescCache();
+    CodeCache* lib;
+    FrameDesc* frame;
+    const void* pc = (const void*)0x7f0000001234;
+
+    CHECK_EQ(cache->lookup(pc, lib, frame), false);
+
+    cache->insert(pc, fakeLibOf(pc), fakeFrameOf(pc), cache->epoch());
+    ASSERT_EQ(cache->lookup(pc, lib, frame), true);
+    CHECK_EQ(lib, fakeLibOf(pc));
+    CHECK_EQ(frame, fakeFrameOf(pc));
+
+    // Negative results are cached too
+    const void* unknown_pc = (const void*)0x1000;
+    cache->insert(unknown_pc, NULL, &FrameDesc::default_frame, cache->epoch());
+    ASSERT_EQ(cache->lookup(unknown_pc, lib, frame), true);
+    CHECK_EQ(lib, NULL);
+    CHECK_EQ(frame, &FrameDesc::default_frame);
+
+    cache->invalidate();
+    CHECK_EQ(cache->lookup(pc, lib, frame), false);
+    CHECK_EQ(cache->lookup(unknown_pc, lib, frame), false);
+
+    // A result computed before invalidation is stale immediately
+    u32 old_epoch = cache->epoch();
+    cache->invalidate();
+    cache->insert(pc, fakeLibOf(pc), fakeFrameOf(pc), old_epoch);
+    CHECK_EQ(cache->lookup(pc, lib, frame), false);
+
+    delete cache;
+}
+
+TEST_CASE(FrameDescCache_concurrent) {
+    pthread_t threads[CACHED_PC_THREADS];
+    for (int i = 0; i < CACHED_PC_THREADS; i++) {
+        pthread_create(&threads[i], NULL, frameDescLookupLoop, (void*)(uintptr_t)i);
+    }
+
+    bool all_ok = true;
+    for (int i = 0; i < CACHED_PC_THREADS; i++) {
+        bool* ok;
+        pthread_join(threads[i], (void**)&ok);
+        all_ok &= *ok;
+        delete ok;
+    }
+    CHECK_EQ(all_ok, true);
+}
+
+// Microbenchmark: linear scan over libraries followed by a binary search over the DWARF table,
+// compared to a cache hit
+BENCHMARK_CASE(FrameDescCache_benchmark) {
+    const int lib_count = 500;
+    const int table_length = 20000;
+    const int iterations = 200000;
+    const uintptr_t lib_size = 0x100000;
+    const uintptr_t base = 0x7f0000000000;
+
+    CodeCacheArray* libs = new CodeCacheArray();
+    for (int i = 0; i < lib_count; i++) {
+        const char* start = (const char*)(base + i * lib_size);
+        CodeCache* cc = new CodeCache("lib", i, start, start + lib_size);
+        cc->setTextBase(start);
+        FrameDesc* table = (FrameDesc*)malloc(table_length * sizeof(FrameDesc));
+        for (int j = 0; j < table_length; j++) {
+            table[j] = FrameDesc::default_frame;
+            table[j].loc = j * (lib_size / table_length);
+        }
+        cc->setDwarfTable(table, table_length);
+        libs->add(cc);
+    }
+
+    // A working set of hot return addresses in the libraries loaded last, as in a typical stack
+    const void* pcs[256];
+    for (int i = 0; i < 256; i++) {
+        pcs[i] = (const void*)(base + (lib_count - 1 - i % 50) * lib_size + (i * 2654435761U) % lib_size);
+    }
+
+    FrameDescCache* cache = new FrameDescCache();
+    volatile uintptr_t sink = 0;
+
+    u64 start = rdtsc();
+    for (int i = 0; i < iterations; i++) {
+        const void* pc = pcs[i & 255];
+        for (int j = 0; j < libs->count(); j++) {
+            if ((*libs)[j]->contains(pc)) {
+                sink += (uintptr_t)(*libs)[j]->findFrameDesc(pc);
+                break;
+            }
+        }
+    }
+    u64 scan_ticks = rdtsc() - start;
+
+    int hits = 0;
+    start = rdtsc();
+    for (int i = 0; i < iterations; i++) {
+        const void* pc = pcs[i & 255];
+        CodeCache* lib;
+        FrameDesc* frame;
+        if (cache->lookup(pc, lib, frame)) {
+            hits++;
+        } else {
+            u32 epoch = cache->epoch();
+            lib = NULL;
+            for (int j = 0; j < libs->count(); j++) {
+                if ((*libs)[j]->contains(pc)) {
+                    lib = (*libs)[j];
+                    break;
+                }
+            }
+            frame = lib != NULL ? lib->findFrameDesc(pc) : &FrameDesc::default_frame;
+            cache->insert(pc, lib, frame, epoch);
+        }
+        sink += (uintptr_t)frame;
+    }
+    u64 cached_ticks = rdtsc() - start;
+
+    printf("ticks/lookup: scan=%.1f cached=%.1f (hit rate %.1f%%)\n", (double)scan_ticks / iterations,
+           (double)cached_ticks / iterations, hits * 100.0 / iterations);
+    CHECK_GT(hits, iterations * 9 / 10);
+
+    for (int i = 0; i < lib_count; i++) {
+        delete (*libs)[i];
+    }
+    delete libs;
+    delete cache;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "codeCache.h"
+#include "os.h"
+#include "symbols.h"
+#include "testRunner.hpp"
+#include "tsc.h"
+
+static const uintptr_t KALLSYMS_CORE_BASE = 0xffffffff81000000;
+static const uintptr_t KALLSYMS_MODULE_BASE = 0xffffffffc0000000;
+
+// Core text and data symbols followed by symbols of a few modules, like in /proc/kallsyms.
+// Every 50th name is long enough to be truncated.
+static void writeKallsyms(const char* path, int core_count, int module_count) {
+    FILE* f = fopen(path, "w");
+    fprintf(f, "0000000000000000 A fixed_percpu_data\n");
+    for (int i = 0; i < core_count; i++) {
+        const char* types = "TtWwDdbr";
+        char type = types[i % 8];
+        if (i % 50 == 0) {
+            fprintf(f, "%016lx %c kernel_func%d_%0300d\n", KALLSYMS_CORE_BASE + i * 0x40, type, i, 0);
+        } else {
+            fprintf(f, "%016lx %c kernel_func%d\n", KALLSYMS_CORE_BASE + i * 0x40, type, i);
+        }
+    }
+    for (int i = 0; i < module_count; i++) {
+        fprintf(f, "%016lx %c module_func%d\t[mod%d]\n", KALLSYMS_MODULE_BASE + i * 0x40, i % 2 ? 't' : 'T',
+                i, i / 100);
+    }
+    fclose(f);
+}
+
+static void parseKallsymsFile(const char* path, CodeCache* cc, KallsymsPart part, CodeCache* modules = NULL) {
+    Symbols::parseKallsyms(open(path, O_RDONLY), cc, part, modules);
+}
+
+static const char* kallsymsName(CodeCache* cc, uintptr_t addr) {
+    const char* name = cc->binarySearch((const void*)addr);
+    return name != NULL ? name : "";
+}
+
+TEST_CASE(Kallsyms_parseParts) {
+    char path[] = "/tmp/asprof-kallsyms-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_NE(fd, -1);
+    close(fd);
+    writeKallsyms(path, 1000, 300);
+
+    CodeCache* all = new CodeCache("[kernel]");
+    parseKallsymsFile(path, all, KALLSYMS_ALL);
+    all->sort();
+
+    CodeCache* core = new CodeCache("[kernel]");
+    CodeCache* modules = new CodeCache("[kernel modules]");
+    parseKallsymsFile(path, core, KALLSYMS_CORE, modules);
+    core->sort();
+
+    CHECK_EQ(strcmp(kallsymsName(all, KALLSYMS_CORE_BASE + 9 * 0x40), "kernel_func9_[k]"), 0);
+    CHECK_EQ(strcmp(kallsymsName(core, KALLSYMS_CORE_BASE + 9 * 0x40), "kernel_func9_[k]"), 0);
+    // Module names keep the module in brackets, with the tab replaced
+    CHECK_EQ(strcmp(kallsymsName(all, KALLSYMS_MODULE_BASE + 123 * 0x40), "module_func123?[mod1]_[k]"), 0);
+    CHECK_EQ(strcmp(kallsymsName(all, KALLSYMS_MODULE_BASE + 299 * 0x40), "module_func299?[mod2]_[k]"), 0);
+    // Long names are truncated
+    CHECK_EQ(strncmp(kallsymsName(all, KALLSYMS_CORE_BASE + 50 * 0x40), "kernel_func50_000", 17), 0);
+    CHECK_LT(strlen(kallsymsName(all, KALLSYMS_CORE_BASE + 50 * 0x40)), 256);
+
+    // Core symbols do not cover the modules, whose range is reported instead
+    CHECK_EQ(core->maxAddress() < (const void*)KALLSYMS_MODULE_BASE, true);
+    CHECK_EQ(modules->minAddress(), (const void*)KALLSYMS_MODULE_BASE);
+    CHECK_EQ(modules->maxAddress(), (const void*)(KALLSYMS_MODULE_BASE + 299 * 0x40 + 1));
+    CHECK_EQ(modules->findSymbol("module_func1?[mod0]_[k]"), (const void*)NULL);
+
+    CodeCache* parsed = new CodeCache("[kernel modules]", -1, modules->minAddress(), modules->maxAddress());
+    parseKallsymsFile(path, parsed, KALLSYMS_MODULES);
+    parsed->sort();
+    CHECK_EQ(parsed->findSymbol("module_func1?[mod0]_[k]"), (const void*)(KALLSYMS_MODULE_BASE + 0x40));
+    CHECK_EQ(parsed->findSymbol("kernel_func1_[k]"), (const void*)NULL);
+
+    // Data symbols are skipped
+    CHECK_EQ(all->findSymbol("kernel_func4_[k]"), (const void*)NULL);
+    CHECK_EQ(all->findSymbol("kernel_func3_[k]"), (const void*)(KALLSYMS_CORE_BASE + 3 * 0x40));
+
+    delete all;
+    delete core;
+    delete modules;
+    delete parsed;
+    unlink(path);
+}
+
+static void benchmarkKallsyms(const char* title, const char* path) {
+    const int iterations = 5;
+    u64 all_ticks = 0, all_ns = 0;
+    u64 core_ticks = 0, core_ns = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        CodeCache* cc = new CodeCache("[kernel]");
+        u64 start_ns = OS::nanotime();
+        u64 start = rdtsc();
+        parseKallsymsFile(path, cc, KALLSYMS_ALL);
+        all_ticks += rdtsc() - start;
+        all_ns += OS::nanotime() - start_ns;
+        delete cc;
+
+        cc = new CodeCache("[kernel]");
+        CodeCache* modules = new CodeCache("[kernel modules]");
+        start_ns = OS::nanotime();
+        start = rdtsc();
+        parseKallsymsFile(path, cc, KALLSYMS_CORE, modules);
+        core_ticks += rdtsc() - start;
+        core_ns += OS::nanotime() - start_ns;
+        delete cc;
+        delete modules;
+    }
+
+    printf("%s Mticks: all=%.1f core=%.1f, ms: all=%.2f core=%.2f\n", title,
+           all_ticks / 1e6 / iterations, core_ticks / 1e6 / iterations,
+           all_ns / 1e6 / iterations, core_ns / 1e6 / iterations);
+}
+
+// Microbenchmark: all symbols vs. core symbols only on a kallsyms capture of a typical size,
+// where a third of the symbols belong to modules, and on the live /proc/kallsyms
+BENCHMARK_CASE(Kallsyms_parseBenchmark) {
+    char path[] = "/tmp/asprof-kallsyms-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_NE(fd, -1);
+    close(fd);
+    writeKallsyms(path, 120000, 60000);
+    benchmarkKallsyms("capture", path);
+    unlink(path);
+
+    if (access("/proc/kallsyms", R_OK) == 0) {
+        benchmarkKallsyms("/proc/kallsyms", "/proc/kallsyms");
+    }
+}
+
+#endif // __linux__
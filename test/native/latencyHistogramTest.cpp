@@ -0,0 +1,141 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include "latencyHistogram.h"
+#include "testRunner.hpp"
+#include "tsc.h"
+
+static const int HISTOGRAM_THREADS = 4;
+static const int RECORDS_PER_THREAD = 100000;
+
+static void* recordLoop(void* arg) {
+    LatencyHistogram* h = (LatencyHistogram*)arg;
+    for (int i = 0; i < RECORDS_PER_THREAD; i++) {
+        h->record(i);
+    }
+    return NULL;
+}
+
+TEST_CASE(LatencyHistogram_buckets) {
+    // Every value falls below the upper bound of its bucket and not below the previous one
+    for (u64 value = 0; value < 1000000; value = value * 9 / 8 + 1) {
+        int bucket = LatencyHistogram::bucketOf(value);
+        ASSERT_LT(value, LatencyHistogram::upperBound(bucket));
+        if (bucket > 0) {
+            ASSERT_GTE(value, LatencyHistogram::upperBound(bucket - 1));
+        }
+    }
+
+    for (int i = 1; i < HISTOGRAM_BUCKETS; i++) {
+        ASSERT_GT(LatencyHistogram::upperBound(i), LatencyHistogram::upperBound(i - 1));
+    }
+
+    // Powers of two start a new bucket
+    for (int k = 3; k < 40; k++) {
+        CHECK_EQ(LatencyHistogram::upperBound(LatencyHistogram::bucketOf((1ULL << k) - 1)), 1ULL << k);
+    }
+    CHECK_EQ(LatencyHistogram::bucketOf(~0ULL), HISTOGRAM_BUCKETS - 1);
+}
+
+TEST_CASE(LatencyHistogram_percentile) {
+    LatencyHistogram h;
+    h.clear();
+    CHECK_EQ(h.percentile(0.5), 0);
+
+    for (int i = 0; i < 99; i++) {
+        h.record(1000);
+    }
+    h.record(1000000);
+
+    CHECK_EQ(h.totalCount(), 100);
+    CHECK_EQ(h.sum(), 99 * 1000 + 1000000);
+
+    // Relative error is bounded by the sub-bucket width
+    u64 p50 = h.percentile(0.5);
+    CHECK_GT(p50, 1000);
+    CHECK_LTE(p50, 1250);
+    CHECK_EQ(h.percentile(0.99), LatencyHistogram::upperBound(LatencyHistogram::bucketOf(1000000)));
+
+    CHECK_EQ(h.countBelow(1024), 99);
+    CHECK_EQ(h.countBelow(1 << 20), 100);
+    CHECK_EQ(h.countBelow(512), 0);
+}
+
+TEST_CASE(LatencyHistogram_delta) {
+    LatencyHistogram h, snapshot, delta;
+    h.clear();
+    snapshot.clear();
+
+    h.record(100);
+    h.record(200);
+    h.deltaFrom(snapshot, delta);
+    CHECK_EQ(delta.totalCount(), 2);
+    CHECK_EQ(delta.sum(), 300);
+
+    h.record(5000);
+    h.deltaFrom(snapshot, delta);
+    CHECK_EQ(delta.totalCount(), 1);
+    CHECK_EQ(delta.sum(), 5000);
+    CHECK_EQ(delta.countBelow(4096), 0);
+
+    h.deltaFrom(snapshot, delta);
+    CHECK_EQ(delta.totalCount(), 0);
+    CHECK_EQ(h.totalCount(), 3);
+}
+
+TEST_CASE(LatencyHistogram_concurrent) {
+    LatencyHistogram h;
+    h.clear();
+
+    pthread_t threads[HISTOGRAM_THREADS];
+    for (int i = 0; i < HISTOGRAM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, recordLoop, &h);
+    }
+    for (int i = 0; i < HISTOGRAM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    u64 n = RECORDS_PER_THREAD;
+    CHECK_EQ(h.totalCount(), HISTOGRAM_THREADS * n);
+    CHECK_EQ(h.sum(), HISTOGRAM_THREADS * (n * (n - 1) / 2));
+}
+
+// Histograms of sample slots are recorded without atomics and merged for export
+TEST_CASE(LatencyHistogram_mergeSlots) {
+    LatencyHistogram slots[3];
+    for (int i = 0; i < 3; i++) {
+        slots[i].clear();
+        for (int j = 0; j <= i; j++) {
+            slots[i].recordExclusive(1000 * (i + 1));
+        }
+    }
+
+    LatencyHistogram merged;
+    merged.clear();
+    for (int i = 0; i < 3; i++) {
+        merged.add(slots[i]);
+    }
+    CHECK_EQ(merged.totalCount(), 6);
+    CHECK_EQ(merged.sum(), 1000 + 2 * 2000 + 3 * 3000);
+    CHECK_EQ(merged.countBelow(2048), 3);
+}
+
+// Microbenchmark: cost of recording one value, as added to every sample per phase
+BENCHMARK_CASE(LatencyHistogram_recordBenchmark) {
+    const int iterations = 1000000;
+    LatencyHistogram h;
+    h.clear();
+
+    u64 start = rdtsc();
+    for (int i = 0; i < iterations; i++) {
+        h.record((i * 2654435761U) & 0xfffff);
+    }
+    u64 ticks = rdtsc() - start;
+
+    printf("ticks/record: %.1f\n", (double)ticks / iterations);
+    CHECK_EQ(h.totalCount(), iterations);
+}
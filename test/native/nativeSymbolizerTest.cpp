@@ -0,0 +1,161 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "codeCache.h"
+#include "nativeSymbolizer.h"
+#include "testRunner.hpp"
+
+static const uintptr_t SYMBOLIZED_LIB_BASE = 0x7f2000000000;
+static const uintptr_t SYMBOLIZED_LIB_SIZE = 0x100000;
+
+// Functions are 0x100 bytes apart and 0xc0 long, every 10th is a zero-sized label
+static CodeCache* makeSymbolizedLib(const char* name, int index, int count) {
+    const char* base = (const char*)(SYMBOLIZED_LIB_BASE + index * SYMBOLIZED_LIB_SIZE);
+    CodeCache* cc = new CodeCache(name, index, base, base + SYMBOLIZED_LIB_SIZE);
+    for (int i = 0; i < count; i++) {
+        char sym[32];
+        snprintf(sym, sizeof(sym), "%s_func%d", name, i);
+        cc->add(base + i * 0x100, i % 10 == 0 ? 0 : 0xc0, sym);
+    }
+    cc->sort();
+    return cc;
+}
+
+static void addNativePCs(NativeSymbolizer& symbolizer, const std::vector<const void*>& pcs) {
+    std::vector<char> buf(sizeof(CallTrace) + pcs.size() * sizeof(ASGCT_CallFrame));
+    CallTrace* trace = (CallTrace*)&buf[0];
+    trace->num_frames = pcs.size() + 1;
+    for (size_t i = 0; i < pcs.size(); i++) {
+        trace->frames[i].bci = BCI_NATIVE_PC;
+        trace->frames[i].method_id = (jmethodID)pcs[i];
+    }
+    // Frames of other types are not symbolized
+    trace->frames[pcs.size()].bci = BCI_ADDRESS;
+    trace->frames[pcs.size()].method_id = (jmethodID)(SYMBOLIZED_LIB_BASE + 0x100);
+    symbolizer.add(trace);
+}
+
+TEST_CASE(CodeCache_binarySearchSorted) {
+    const int counts[] = {0, 1, 7, 1000};
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        CodeCache* cc = makeSymbolizedLib("libsorted.so", 0, counts[c]);
+
+        // Dense and sparse runs of addresses, including duplicates
+        std::vector<const void*> addresses;
+        for (u32 i = 0; i < 3000; i++) {
+            uintptr_t offset = i < 2000 ? i * 0x3b : (i * 2654435761U) % (counts[c] * 0x100 + 0x200);
+            addresses.push_back((const char*)SYMBOLIZED_LIB_BASE + offset);
+        }
+        addresses.push_back(addresses.back());
+        std::sort(addresses.begin(), addresses.end());
+
+        std::vector<const char*> names(addresses.size());
+        cc->binarySearch(&addresses[0], addresses.size(), &names[0]);
+
+        int mismatches = 0;
+        for (size_t i = 0; i < addresses.size(); i++) {
+            if (names[i] != cc->binarySearch(addresses[i])) {
+                mismatches++;
+            }
+        }
+        CHECK_EQ(mismatches, 0);
+
+        delete cc;
+    }
+}
+
+TEST_CASE(NativeSymbolizer_resolve) {
+    CodeCacheArray libs;
+    libs.add(makeSymbolizedLib("liba.so", 1, 500));
+    libs.add(makeSymbolizedLib("libb.so", 2, 500));
+    libs.updateIndex();
+
+    const char* base_a = (const char*)(SYMBOLIZED_LIB_BASE + SYMBOLIZED_LIB_SIZE);
+    const char* base_b = base_a + SYMBOLIZED_LIB_SIZE;
+    const void* unknown = (const char*)SYMBOLIZED_LIB_BASE + 0x40;
+
+    std::vector<const void*> pcs;
+    pcs.push_back(base_b + 0x1210);
+    pcs.push_back(base_a + 0x510);
+    pcs.push_back(unknown);
+    pcs.push_back(base_a + 0x510);
+    pcs.push_back(base_a + 0x1ff);
+
+    NativeSymbolizer symbolizer;
+    addNativePCs(symbolizer, pcs);
+    CHECK_EQ(symbolizer.lookup(base_a + 0x510), (const char*)NULL);
+
+    symbolizer.resolve(&libs);
+    CHECK_EQ(strcmp(symbolizer.lookup(base_a + 0x510), "liba.so_func5"), 0);
+    CHECK_EQ(strcmp(symbolizer.lookup(base_b + 0x1210), "libb.so_func18"), 0);
+    // Same as binarySearch: a gap between functions resolves to the library name
+    CHECK_EQ(strcmp(symbolizer.lookup(base_a + 0x1ff), "liba.so"), 0);
+    CHECK_EQ(symbolizer.lookup(unknown), (const char*)NULL);
+    CHECK_EQ(symbolizer.lookup((const void*)(SYMBOLIZED_LIB_BASE + 0x100)), (const char*)NULL);
+
+    // A later batch merges with earlier results
+    pcs.clear();
+    pcs.push_back(base_a + 0x20);
+    pcs.push_back(base_a + 0x510);
+    addNativePCs(symbolizer, pcs);
+    symbolizer.resolve(&libs);
+    CHECK_EQ(strcmp(symbolizer.lookup(base_a + 0x20), "liba.so_func0"), 0);
+    CHECK_EQ(strcmp(symbolizer.lookup(base_a + 0x510), "liba.so_func5"), 0);
+    CHECK_EQ(strcmp(symbolizer.lookup(base_b + 0x1210), "libb.so_func18"), 0);
+
+    delete libs[0];
+    delete libs[1];
+}
+
+TEST_CASE(NativeSymbolizer_pendingLibrary) {
+    CodeCacheArray libs;
+    CodeCache* pending = makeSymbolizedLib("libpending.so", 1, 0);
+    pending->setParseState(PARSE_PENDING);
+    libs.add(pending);
+    libs.updateIndex();
+
+    const void* pc = (const char*)(SYMBOLIZED_LIB_BASE + SYMBOLIZED_LIB_SIZE) + 0x310;
+    std::vector<const void*> pcs(1, pc);
+
+    NativeSymbolizer symbolizer;
+    addNativePCs(symbolizer, pcs);
+    symbolizer.resolve(&libs);
+    CHECK_EQ(strcmp(symbolizer.lookup(pc), "libpending.so"), 0);
+
+    // Names of a placeholder are not final: the PC is resolved again once the library is parsed
+    CodeCache* parsed = makeSymbolizedLib("libpending.so", 1, 10);
+    libs.replace(0, parsed);
+    libs.updateIndex();
+    addNativePCs(symbolizer, pcs);
+    symbolizer.resolve(&libs);
+    CHECK_EQ(strcmp(symbolizer.lookup(pc), "libpending.so_func3"), 0);
+
+    delete pending;
+    delete parsed;
+}
+
+static bool isMarkedFunc(const char* name) {
+    return strcmp(name, "libmarks.so_func3") == 0 || strcmp(name, "libmarks.so_func10") == 0;
+}
+
+TEST_CASE(CodeCache_findMark) {
+    CodeCache* cc = makeSymbolizedLib("libmarks.so", 0, 20);
+    const char* base = (const char*)SYMBOLIZED_LIB_BASE;
+    CHECK_EQ(cc->findMark(base + 0x310), 0);
+
+    cc->mark(isMarkedFunc, MARK_INTERPRETER);
+    CHECK_EQ(cc->findMark(base + 0x300), MARK_INTERPRETER);
+    CHECK_EQ(cc->findMark(base + 0x3bf), MARK_INTERPRETER);
+    CHECK_EQ(cc->findMark(base + 0x3c0), 0);
+    CHECK_EQ(cc->findMark(base + 0x410), 0);
+    // Zero-sized symbols cover no addresses
+    CHECK_EQ(cc->findMark(base + 0xa00), 0);
+
+    delete cc;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "overheadController.h"
+#include "testRunner.hpp"
+
+static const u64 SECOND = 1000000000;
+
+class FixedIntervalEngine : public Engine {
+  private:
+    long _interval;
+
+  public:
+    FixedIntervalEngine(long interval) : _interval(interval) {
+    }
+
+    long interval() {
+        return _interval;
+    }
+};
+
+TEST_CASE(OverheadController_direction) {
+    FixedIntervalEngine cpu(10000000);
+    FixedIntervalEngine every_event(0);
+    OverheadController controller;
+    controller.reset(0.01);
+    controller.addEngine(&cpu);
+    controller.addEngine(&cpu);
+    controller.addEngine(&every_event);
+    ASSERT_EQ(controller.engineCount(), 1);
+
+    // The first update only takes the baseline
+    CHECK_EQ(controller.update(0, 0, SECOND), false);
+
+    // 5% overhead: sample less often
+    CHECK_EQ(controller.update(50000000, 0, 2 * SECOND), true);
+    CHECK_GT(controller.scale(), 1);
+    CHECK_GT(controller.scaledInterval(10000000), 10000000);
+    double scale = controller.scale();
+
+    // Within the dead band around the target: keep intervals
+    CHECK_EQ(controller.update(50000000 + 11000000, 0, 3 * SECOND), false);
+    CHECK_EQ(controller.scale(), scale);
+
+    // Too little process CPU time to judge
+    CHECK_EQ(controller.update(61000000, 0, 3 * SECOND + 1000000), false);
+
+    // Idle profiler: sample more often, but never beyond the bound
+    u64 cpu_time = 3 * SECOND;
+    for (int i = 0; i < 20; i++) {
+        controller.update(61000000, 0, cpu_time += SECOND);
+    }
+    CHECK_EQ(controller.scaledInterval(10000000), 10000000 / 8);
+    CHECK_EQ(controller.overhead(), 0);
+}
+
+// Simulates a day of traffic varying 10x under wall clock sampling: the number of samples
+// depends on the number of threads, while the process CPU time follows the load.
+// The overhead should stay close to the target in every phase.
+TEST_CASE(OverheadController_followsLoad) {
+    const double target = 0.01;
+    const double sample_cost = 20000;  // ns, handler and drain time
+    const double threads = 200;
+    const long base_interval = 50000000;
+    const double loads[] = {1, 10, 4, 0.5};
+
+    FixedIntervalEngine wall(base_interval);
+    OverheadController controller;
+    controller.reset(target);
+    controller.addEngine(&wall);
+
+    u64 profiler_time = 0, cpu_time = SECOND;
+    controller.update(profiler_time, 0, cpu_time);
+
+    for (int phase = 0; phase < 4; phase++) {
+        double overhead = 0;
+        for (int tick = 0; tick < 30; tick++) {
+            double samples = threads * SECOND / controller.scaledInterval(base_interval);
+            u64 cost = (u64)(samples * sample_cost);
+            u64 app_time = (u64)(loads[phase] * SECOND);
+            profiler_time += cost;
+            cpu_time += app_time + cost;
+            controller.update(profiler_time, 0, cpu_time);
+            overhead = (double)cost / (app_time + cost);
+        }
+        CHECK_LT(overhead, target * 1.3);
+        CHECK_GT(overhead, target / 1.3);
+    }
+}
+
+TEST_CASE(OverheadController_signalCost) {
+    FixedIntervalEngine cpu(10000000);
+    OverheadController controller;
+    controller.reset(0.01);
+    controller.addEngine(&cpu);
+
+    // Signal delivery is charged on top of the measured time
+    controller.update(0, 0, SECOND);
+    controller.update(1000000, 10000, 2 * SECOND);
+    CHECK_EQ(controller.overhead(), (1000000 + 10000 * SIGNAL_DELIVERY_NS) / (double)SECOND);
+}
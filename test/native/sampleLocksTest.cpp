@@ -0,0 +1,167 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "arch.h"
+#include "os.h"
+#include "sampleLocks.h"
+#include "testRunner.hpp"
+
+static const int SIGNAL_THREADS = 1000;
+static const int SIGNAL_ROUNDS = 20;
+static const int LEGACY_LOCKS = 16;
+
+static SampleLocks* sample_locks;
+static SpinLock legacy_locks[LEGACY_LOCKS];
+static bool use_legacy;
+static int stop_pipe[2];
+static volatile u64 samples_total;
+static volatile u64 samples_skipped;
+static volatile int slot_owners[MAX_CONCURRENCY_LEVEL + 1];
+static volatile u64 slot_overlaps;
+
+// The previous scheme: thread ID hash into a fixed array of 16 locks
+static int legacyTryLock(int tid) {
+    u32 lock_index = tid;
+    lock_index ^= lock_index >> 8;
+    lock_index ^= lock_index >> 4;
+    if (legacy_locks[lock_index %= LEGACY_LOCKS].tryLock() ||
+        legacy_locks[lock_index = (lock_index + 1) % LEGACY_LOCKS].tryLock() ||
+        legacy_locks[lock_index = (lock_index + 2) % LEGACY_LOCKS].tryLock()) {
+        return lock_index;
+    }
+    return -1;
+}
+
+// Mimics recordSample: take a slot, walk the stack for a few microseconds, release
+static void sampleHandler(int signo) {
+    atomicInc(samples_total);
+
+    int tid = OS::threadId();
+    int slot = use_legacy ? legacyTryLock(tid) : sample_locks->tryLock(tid);
+    if (slot < 0) {
+        atomicInc(samples_skipped);
+        return;
+    }
+
+    if (!__sync_bool_compare_and_swap(&slot_owners[slot], 0, tid)) {
+        atomicInc(slot_overlaps);
+    }
+
+    u64 deadline = OS::nanotime() + 5000;
+    while (OS::nanotime() < deadline) {
+        spinPause();
+    }
+
+    slot_owners[slot] = 0;
+    if (use_legacy) {
+        legacy_locks[slot].unlock();
+    } else {
+        sample_locks->unlock(slot);
+    }
+}
+
+// Blocks until the write end of the pipe is closed; signals restart the read
+static void* idleLoop(void* arg) {
+    char c;
+    while (read(stop_pipe[0], &c, 1) != 0) {
+    }
+    return NULL;
+}
+
+static double skippedRatio(bool legacy) {
+    use_legacy = legacy;
+    samples_total = 0;
+    samples_skipped = 0;
+    slot_overlaps = 0;
+    if (pipe(stop_pipe) != 0) {
+        return 0;
+    }
+
+    pthread_t* threads = new pthread_t[SIGNAL_THREADS];
+    int started = 0;
+    while (started < SIGNAL_THREADS && pthread_create(&threads[started], NULL, idleLoop, NULL) == 0) {
+        started++;
+    }
+
+    for (int round = 0; round < SIGNAL_ROUNDS; round++) {
+        for (int i = 0; i < started; i++) {
+            pthread_kill(threads[i], SIGUSR2);
+        }
+        usleep(10000);
+    }
+
+    close(stop_pipe[1]);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    close(stop_pipe[0]);
+    delete[] threads;
+
+    return samples_total == 0 ? 0 : (double)samples_skipped / samples_total;
+}
+
+TEST_CASE(SampleLocks_scaleWithCpus) {
+    CHECK_EQ(SampleLocks(1).count(), MIN_CONCURRENCY_LEVEL);
+    CHECK_EQ(SampleLocks(24).count(), 64);
+    CHECK_EQ(SampleLocks(100000).count(), MAX_CONCURRENCY_LEVEL);
+
+    // A slot is exclusive until unlocked
+    SampleLocks locks(4);
+    int slot = locks.tryLock(1);
+    ASSERT_GTE(slot, 0);
+    int other = locks.tryLock(1);
+    CHECK_NE(other, slot);
+    locks.unlock(slot);
+    if (other >= 0) locks.unlock(other);
+}
+
+static void installSampleHandler(struct sigaction* old_sa) {
+    struct sigaction sa;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = sampleHandler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, old_sa);
+}
+
+// 1000 threads receive signals at once; each signal handler competes for a sample slot
+TEST_CASE(SampleLocks_simultaneousSignals) {
+    SampleLocks locks;
+    sample_locks = &locks;
+    struct sigaction old_sa;
+    installSampleHandler(&old_sa);
+
+    double skipped = skippedRatio(false);
+
+    sigaction(SIGUSR2, &old_sa, NULL);
+
+    CHECK_GT(samples_total, 0);
+    CHECK_EQ(slot_overlaps, 0);
+    // A handler is skipped only if another one holds its CPU slot and all spare probes hit busy slots.
+    // With twice as many slots as CPUs, that takes handlers preempted in the middle of a sample.
+    CHECK_LT(skipped, (double)OS::getCpuCount() / locks.count());
+}
+
+// The same load against the previous scheme: thread ID hash into 16 locks
+BENCHMARK_CASE(SampleLocks_legacyComparison) {
+    SampleLocks locks;
+    sample_locks = &locks;
+    struct sigaction old_sa;
+    installSampleHandler(&old_sa);
+
+    double legacy = skippedRatio(true);
+    u64 legacy_total = samples_total;
+    double current = skippedRatio(false);
+    u64 current_total = samples_total;
+
+    sigaction(SIGUSR2, &old_sa, NULL);
+
+    printf("cpus=%d slots=%d skipped: legacy=%.3f%% of %llu, per-cpu=%.3f%% of %llu\n", OS::getCpuCount(),
+           locks.count(), legacy * 100, (unsigned long long)legacy_total,
+           current * 100, (unsigned long long)current_total);
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include "callTraceStorage.h"
+#include "sampleQueue.h"
+#include "testRunner.hpp"
+#include "tsc.h"
+
+static const int MAX_SAMPLE_DEPTH = 64;
+static const int PRODUCED_SAMPLES = 200000;
+
+static void fillSample(ASGCT_CallFrame* frames, int depth, int seed) {
+    for (int i = 0; i < depth; i++) {
+        frames[i].bci = i;
+        frames[i].method_id = (jmethodID)(uintptr_t)(0x1000 + seed * 0x100 + i);
+        LP64_ONLY(frames[i].padding = 0;)
+    }
+}
+
+static bool checkRecord(SampleRecord* r, u64 seq) {
+    ASGCT_CallFrame expected[MAX_SAMPLE_DEPTH];
+    fillSample(expected, r->num_frames, (int)seq);
+    return r->counter == seq && r->tid == (int)seq && r->num_frames == (int)(seq % MAX_SAMPLE_DEPTH) + 1 &&
+           r->getEvent()->_start_time == seq * 10 &&
+           memcmp(r->frames(), expected, r->num_frames * sizeof(ASGCT_CallFrame)) == 0;
+}
+
+static bool pushSample(SampleQueue& queue, u64 seq) {
+    ASGCT_CallFrame frames[MAX_SAMPLE_DEPTH];
+    int depth = (int)(seq % MAX_SAMPLE_DEPTH) + 1;
+    fillSample(frames, depth, (int)seq);
+    ExecutionEvent event(seq * 10);
+    return queue.push(0, (int)seq, seq, EXECUTION_SAMPLE, &event, depth, frames);
+}
+
+static void* produceLoop(void* arg) {
+    SampleQueue* queue = (SampleQueue*)arg;
+    for (u64 seq = 0; seq < PRODUCED_SAMPLES; seq++) {
+        while (!pushSample(*queue, seq)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+TEST_CASE(SampleQueue_wrapAround) {
+    SampleQueue queue;
+    ASSERT_EQ(queue.allocate(1, 16384), true);
+    SampleRing* ring = queue.ring(0);
+    SampleRecord* records[8];
+
+    // Records of varying size wrap around the small ring many times
+    u64 pushed = 0, polled = 0;
+    for (int round = 0; round < 1000; round++) {
+        for (int i = 0; i < 5; i++) {
+            ASSERT_EQ(pushSample(queue, pushed++), true);
+        }
+        int count;
+        while ((count = ring->poll(records, 8)) > 0) {
+            for (int i = 0; i < count; i++) {
+                ASSERT_EQ(checkRecord(records[i], polled++), true);
+            }
+            ring->release();
+        }
+    }
+    CHECK_EQ(polled, pushed);
+    CHECK_EQ(ring->isEmpty(), true);
+}
+
+TEST_CASE(SampleQueue_full) {
+    SampleQueue queue;
+    ASSERT_EQ(queue.allocate(2, 16384), true);
+    SampleRing* ring = queue.ring(0);
+    SampleRecord* records[64];
+
+    u64 pushed = 0;
+    while (pushSample(queue, pushed)) {
+        pushed++;
+    }
+    ASSERT_GT(pushed, 0);
+    CHECK_EQ(queue.ring(1)->isEmpty(), true);
+
+    // Nothing is lost or overwritten when the ring overflows
+    u64 polled = 0;
+    int count;
+    while ((count = ring->poll(records, 64)) > 0) {
+        for (int i = 0; i < count; i++) {
+            ASSERT_EQ(checkRecord(records[i], polled++), true);
+        }
+    }
+    CHECK_EQ(polled, pushed);
+
+    // Polled records keep their space until released
+    CHECK_EQ(pushSample(queue, pushed), false);
+    ring->release();
+    CHECK_EQ(pushSample(queue, pushed), true);
+}
+
+TEST_CASE(SampleQueue_reset) {
+    SampleQueue queue;
+    ASSERT_EQ(queue.allocate(1, 16384), true);
+    SampleRing* ring = queue.ring(0);
+    SampleRecord* records[8];
+
+    // Records left from a previous session are not replayed
+    ASSERT_EQ(pushSample(queue, 1), true);
+    ASSERT_EQ(pushSample(queue, 2), true);
+    queue.reset();
+    CHECK_EQ(ring->isEmpty(), true);
+    CHECK_EQ(ring->poll(records, 8), 0);
+
+    ASSERT_EQ(pushSample(queue, 3), true);
+    ASSERT_EQ(ring->poll(records, 8), 1);
+    CHECK_EQ(checkRecord(records[0], 3), true);
+}
+
+TEST_CASE(SampleQueue_producerConsumer) {
+    SampleQueue queue;
+    ASSERT_EQ(queue.allocate(1, 65536), true);
+    SampleRing* ring = queue.ring(0);
+    SampleRecord* records[16];
+
+    pthread_t producer;
+    pthread_create(&producer, NULL, produceLoop, &queue);
+
+    u64 polled = 0;
+    bool ok = true;
+    while (polled < PRODUCED_SAMPLES && ok) {
+        int count = ring->poll(records, 16);
+        if (count == 0) {
+            sched_yield();
+        }
+        for (int i = 0; i < count; i++) {
+            ok &= checkRecord(records[i], polled++);
+        }
+        ring->release();
+    }
+
+    pthread_join(producer, NULL);
+    CHECK_EQ(ok, true);
+    CHECK_EQ(polled, PRODUCED_SAMPLES);
+}
+
+// Microbenchmark: time spent in a signal handler per sample, inline put() vs enqueue,
+// and the cost of draining the queue in batches on the worker side
+BENCHMARK_CASE(SampleQueue_handlerBenchmark) {
+    const int depths[] = {16, 64, 256};
+    const int traces = 4096;
+    const int iterations = 200000;
+    ASGCT_CallFrame* frames = new ASGCT_CallFrame[256];
+    SampleQueue queue;
+    ASSERT_EQ(queue.allocate(1, 8 * 1024 * 1024), true);
+    SampleRing* ring = queue.ring(0);
+    SampleRecord* records[16];
+    u64 hashes[16];
+
+    for (int d = 0; d < 3; d++) {
+        int depth = depths[d];
+        fillSample(frames, depth, 0);
+        ExecutionEvent event(0);
+        volatile u64 sink = 0;
+
+        CallTraceStorage inline_storage;
+        u64 start = rdtsc();
+        for (int i = 0; i < iterations; i++) {
+            frames[0].bci = (unsigned int)(i * 2654435761U) % traces;
+            sink += inline_storage.put(depth, frames, 1);
+        }
+        u64 inline_ticks = rdtsc() - start;
+
+        // Alternate between filling the ring with a chunk of samples and draining it
+        CallTraceStorage deferred_storage;
+        u64 push_ticks = 0;
+        u64 drain_ticks = 0;
+        for (int chunk = 0; chunk < iterations; chunk += 1000) {
+            start = rdtsc();
+            for (int i = chunk; i < chunk + 1000; i++) {
+                frames[0].bci = (unsigned int)(i * 2654435761U) % traces;
+                sink += queue.push(0, 1, 1, EXECUTION_SAMPLE, &event, depth, frames);
+            }
+            push_ticks += rdtsc() - start;
+
+            start = rdtsc();
+            int count;
+            while ((count = ring->poll(records, 16)) > 0) {
+                for (int j = 0; j < count; j++) {
+                    hashes[j] = CallTraceStorage::hash(records[j]->num_frames, records[j]->frames());
+                    deferred_storage.prefetch(hashes[j]);
+                }
+                for (int j = 0; j < count; j++) {
+                    sink += deferred_storage.put(records[j]->num_frames, records[j]->frames(), 1, hashes[j]);
+                }
+                ring->release();
+            }
+            drain_ticks += rdtsc() - start;
+        }
+
+        printf("depth=%-4d ticks/sample in handler: inline=%.1f deferred=%.1f  worker: drain=%.1f\n", depth,
+               (double)inline_ticks / iterations, (double)push_ticks / iterations,
+               (double)drain_ticks / iterations);
+        CHECK_EQ(deferred_storage.traceCount(), inline_storage.traceCount());
+    }
+
+    delete[] frames;
+}
+
+TEST_CASE(SampleQueue_userStack) {
+    SampleQueue queue;
+    ASSERT_EQ(queue.allocate(1, 65536), true);
+    ASSERT_EQ(queue.allocateStacks(1024), true);
+
+    char* buf = queue.stackBuffer(0);
+    for (int i = 0; i < 1000; i++) {
+        buf[i] = (char)i;
+    }
+    UserStack stack = {(const void*)0x1234, 0x7000, 0x7100, 0x5678, buf, 1000, 0, (u32)-1};
+
+    ASGCT_CallFrame frames[8];
+    fillSample(frames, 8, 1);
+    ExecutionEvent event(10);
+    ASSERT_EQ(queue.push(0, 1, 1, PERF_SAMPLE, &event, 8, frames, &stack, 3, 20), true);
+
+    SampleRecord* r;
+    ASSERT_EQ(queue.ring(0)->poll(&r, 1), 1);
+    CHECK_EQ(r->num_frames, 8);
+    CHECK_EQ(r->stack_size, 1000);
+    CHECK_EQ(r->user_index, 3);
+    CHECK_EQ(memcmp(r->frames(), frames, sizeof(frames)), 0);
+
+    // The copy is in the record, not in the reusable buffer
+    memset(buf, 0, 1000);
+    UserStack copy = r->userStack();
+    CHECK_EQ(copy.pc, stack.pc);
+    CHECK_EQ(copy.sp, stack.sp);
+    CHECK_EQ(copy.fp, stack.fp);
+    CHECK_EQ(copy.lr, stack.lr);
+    CHECK_EQ(copy.size, 1000);
+    CHECK_EQ(copy.data[999], (char)999);
+    CHECK_EQ(copy.load(0x7000 + 992), *(const uintptr_t*)(copy.data + 992));
+    queue.ring(0)->release();
+}
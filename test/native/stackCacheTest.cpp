@@ -0,0 +1,147 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "stackCache.h"
+#include "testRunner.hpp"
+
+static const int FAKE_STACK_DEPTH = 100;
+static const int MAX_FAKE_FRAMES = 128;
+
+// Every frame of the fake stack takes two words: its pc and fp. The stack ends with pc == 0.
+static void buildFakeStack(uintptr_t* stack, int depth) {
+    for (int i = 0; i < depth; i++) {
+        stack[i * 2] = 0x1000 + i;
+        stack[i * 2 + 1] = 0x100000 + i;
+    }
+    stack[depth * 2] = 0;
+    stack[depth * 2 + 1] = 0;
+}
+
+// Unwinds the fake stack the same way StackWalker::walkVM uses the cache
+static int walkFakeStack(StackCache* cache, uintptr_t* stack, ASGCT_CallFrame* frames, int max_depth, int* unwound) {
+    cache->begin(StackCache::makeKey(1, 0));
+    *unwound = 0;
+
+    int depth = 0;
+    uintptr_t* sp = stack;
+    while (depth < max_depth && sp[0] != 0) {
+        if (depth >= 2) {
+            int cached = cache->find((const void*)sp[0], (uintptr_t)sp, sp[1]);
+            if (cached >= 0) {
+                int spliced_depth = cache->splice(cached, frames, depth, max_depth);
+                if (spliced_depth >= 0) {
+                    depth = spliced_depth;
+                    break;
+                }
+            }
+            cache->record((const void*)sp[0], (uintptr_t)sp, sp[1], depth);
+        }
+
+        frames[depth].bci = 0;
+        frames[depth].method_id = (jmethodID)sp[0];
+        depth++;
+        (*unwound)++;
+
+        cache->guard(sp + 2);
+        cache->guard(sp + 3);
+        sp += 2;
+    }
+
+    cache->end(frames, depth, max_depth);
+    return depth;
+}
+
+static bool fakeStackMatches(uintptr_t* stack, ASGCT_CallFrame* frames, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (frames[i].method_id != (jmethodID)stack[i * 2]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_CASE(StackCache_reuse) {
+    uintptr_t stack[FAKE_STACK_DEPTH * 2 + 2];
+    ASGCT_CallFrame frames[MAX_FAKE_FRAMES];
+    buildFakeStack(stack, FAKE_STACK_DEPTH);
+    StackCache* cache = StackCache::create(MAX_FAKE_FRAMES);
+    ASSERT_NE(cache, NULL);
+
+    int unwound;
+    CHECK_EQ(walkFakeStack(cache, stack, frames, MAX_FAKE_FRAMES, &unwound), FAKE_STACK_DEPTH);
+    CHECK_EQ(unwound, FAKE_STACK_DEPTH);
+
+    // Unchanged stack: only the top frames are unwound
+    memset(frames, 0, sizeof(frames));
+    CHECK_EQ(walkFakeStack(cache, stack, frames, MAX_FAKE_FRAMES, &unwound), FAKE_STACK_DEPTH);
+    CHECK_EQ(unwound, 2);
+    CHECK_EQ(fakeStackMatches(stack, frames, FAKE_STACK_DEPTH), true);
+
+    // The top frame is not part of the cached state
+    stack[0] = 0x2000;
+    CHECK_EQ(walkFakeStack(cache, stack, frames, MAX_FAKE_FRAMES, &unwound), FAKE_STACK_DEPTH);
+    CHECK_EQ(unwound, 2);
+    CHECK_EQ(fakeStackMatches(stack, frames, FAKE_STACK_DEPTH), true);
+
+    // A changed frame in the middle invalidates everything above it
+    stack[50 * 2] = 0x3000;
+    CHECK_EQ(walkFakeStack(cache, stack, frames, MAX_FAKE_FRAMES, &unwound), FAKE_STACK_DEPTH);
+    CHECK_EQ(unwound, 51);
+    CHECK_EQ(fakeStackMatches(stack, frames, FAKE_STACK_DEPTH), true);
+
+    // The reused part stays cached
+    CHECK_EQ(walkFakeStack(cache, stack, frames, MAX_FAKE_FRAMES, &unwound), FAKE_STACK_DEPTH);
+    CHECK_EQ(unwound, 2);
+    CHECK_EQ(fakeStackMatches(stack, frames, FAKE_STACK_DEPTH), true);
+
+    CHECK_EQ(cache->hits(), 4);
+    StackCache::destroy(cache);
+}
+
+TEST_CASE(StackCache_shallowerStack) {
+    uintptr_t stack[FAKE_STACK_DEPTH * 2 + 2];
+    ASGCT_CallFrame frames[MAX_FAKE_FRAMES];
+    buildFakeStack(stack, FAKE_STACK_DEPTH);
+    StackCache* cache = StackCache::create(MAX_FAKE_FRAMES);
+    ASSERT_NE(cache, NULL);
+
+    int unwound;
+    walkFakeStack(cache, stack, frames, MAX_FAKE_FRAMES, &unwound);
+
+    // The end of the stack is guarded as well
+    buildFakeStack(stack, 60);
+    CHECK_EQ(walkFakeStack(cache, stack, frames, MAX_FAKE_FRAMES, &unwound), 60);
+    CHECK_EQ(unwound, 60);
+    CHECK_EQ(fakeStackMatches(stack, frames, 60), true);
+
+    // Another thread does not reuse frames
+    cache->begin(StackCache::makeKey(2, 0));
+    CHECK_EQ(cache->find((const void*)stack[4], (uintptr_t)&stack[4], stack[5]), -1);
+    cache->abort();
+
+    StackCache::destroy(cache);
+}
+
+TEST_CASE(StackCache_truncated) {
+    uintptr_t stack[FAKE_STACK_DEPTH * 2 + 2];
+    ASGCT_CallFrame frames[MAX_FAKE_FRAMES];
+    buildFakeStack(stack, FAKE_STACK_DEPTH);
+    StackCache* cache = StackCache::create(MAX_FAKE_FRAMES);
+    ASSERT_NE(cache, NULL);
+
+    // The first walk is cut by the depth limit, the second one is not
+    int unwound;
+    CHECK_EQ(walkFakeStack(cache, stack, frames, 40, &unwound), 40);
+    CHECK_EQ(walkFakeStack(cache, stack, frames, MAX_FAKE_FRAMES, &unwound), FAKE_STACK_DEPTH);
+    CHECK_EQ(unwound, FAKE_STACK_DEPTH);
+    CHECK_EQ(fakeStackMatches(stack, frames, FAKE_STACK_DEPTH), true);
+
+    // Spliced frames are cut by the limit too
+    CHECK_EQ(walkFakeStack(cache, stack, frames, 40, &unwound), 40);
+    CHECK_EQ(unwound, 2);
+    CHECK_EQ(fakeStackMatches(stack, frames, 40), true);
+
+    StackCache::destroy(cache);
+}
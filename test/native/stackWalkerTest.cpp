@@ -0,0 +1,91 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifdef __linux__
+
+#include <pthread.h>
+#include <string.h>
+#include "dwarf.h"
+#include "profiler.h"
+#include "stackWalker.h"
+#include "testRunner.hpp"
+
+static const int MAX_WALK_DEPTH = 64;
+static char user_stack_buf[256 * 1024];
+
+// Takes the registers of the caller and copies its stack, like perf_events does for a sample
+__attribute__((noinline))
+static void copyCallerStack(UserStack* stack) {
+    stack->pc = callerPC();
+    stack->fp = (uintptr_t)callerFP();
+    stack->sp = (uintptr_t)callerSP();
+    stack->lr = 0;
+
+    pthread_attr_t attr;
+    void* stack_addr;
+    size_t stack_size;
+    pthread_getattr_np(pthread_self(), &attr);
+    pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+    pthread_attr_destroy(&attr);
+
+    uintptr_t stack_end = (uintptr_t)stack_addr + stack_size;
+    size_t size = stack_end - stack->sp < sizeof(user_stack_buf) ? stack_end - stack->sp : sizeof(user_stack_buf);
+    memcpy(user_stack_buf, (const void*)stack->sp, size);
+
+    stack->data = user_stack_buf;
+    stack->size = size;
+    stack->offset = 0;
+    stack->mask = (u32)-1;
+}
+
+TEST_CASE(UserStack_load) {
+    // 32 bytes of stack that wrap around the end of a 64-byte ring
+    uintptr_t ring[64 / sizeof(uintptr_t)];
+    for (size_t i = 0; i < sizeof(ring) / sizeof(uintptr_t); i++) {
+        ring[i] = 0x100 + i;
+    }
+    UserStack stack = {NULL, 0x7000, 0, 0, (const char*)ring, 32, 48, 63};
+
+    const char* bytes = (const char*)ring;
+    CHECK_EQ(stack.load(0x7000), *(const uintptr_t*)(bytes + 48));
+    CHECK_EQ(stack.load(0x7000 + 16), *(const uintptr_t*)(bytes + 0));
+    CHECK_EQ(stack.load(0x7000 + 24), *(const uintptr_t*)(bytes + 8));
+    CHECK_EQ(stack.load(0x7000 + 32), 0);
+    CHECK_EQ(stack.load(0x7000 - sizeof(uintptr_t)), 0);
+    CHECK_EQ(stack.load(0x7000 + 30), 0);
+}
+
+TEST_CASE(UserStack_walkCopy) {
+    if (!DWARF_SUPPORTED) {
+        return;
+    }
+    Profiler::instance()->updateSymbols(false);
+
+    UserStack stack;
+    copyCallerStack(&stack);
+    const void* copied[MAX_WALK_DEPTH];
+    int copied_depth = StackWalker::walkUserStack(stack, copied, MAX_WALK_DEPTH);
+
+    const void* live[MAX_WALK_DEPTH];
+    int live_depth = StackWalker::walkDwarf(NULL, live, MAX_WALK_DEPTH);
+
+    // Both walks start in this function, at different call sites. walkDwarf may be inlined here,
+    // in which case its walk starts from the caller.
+    int outer_frames = live_depth - 1;
+    ASSERT_GT(outer_frames, 0);
+    ASSERT_GTE(copied_depth - live_depth, 0);
+    ASSERT_LTE(copied_depth - live_depth, 1);
+    CHECK_EQ(memcmp(copied + copied_depth - outer_frames, live + 1, outer_frames * sizeof(void*)), 0);
+
+    // A shorter copy ends the walk early, but without garbage frames
+    stack.size = 512;
+    const void* truncated[MAX_WALK_DEPTH];
+    int truncated_depth = StackWalker::walkUserStack(stack, truncated, MAX_WALK_DEPTH);
+    ASSERT_GT(truncated_depth, 0);
+    CHECK_LTE(truncated_depth, copied_depth);
+    CHECK_EQ(memcmp(truncated, copied, truncated_depth * sizeof(void*)), 0);
+}
+
+#endif // __linux__
@@ -0,0 +1,112 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "codeCache.h"
+#include "dwarf.h"
+#include "symbolCache.h"
+#include "testRunner.hpp"
+
+static const char CACHED_BUILD_ID[] = {0x12, 0x34, 0x56, 0x78, (char)0x9a, (char)0xbc};
+static const int CACHED_SYMBOLS = 1000;
+static const int CACHED_ROWS = 5000;
+
+// Symbols are 0x40 bytes apart, unwinding rows 16 bytes apart with a few distinct rules
+static CodeCache* makeCachedLib(const char* image_base) {
+    CodeCache* cc = new CodeCache("libcached.so", 0, image_base, image_base + 0x100000, image_base);
+    cc->setTextBase(image_base);
+    cc->setPlt(0x10, 0x20);
+    for (int i = 0; i < CACHED_SYMBOLS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "function%d", i);
+        cc->add(image_base + 0x1000 + i * 0x40, 0x30, name);
+    }
+    cc->sort();
+
+    FrameDesc* table = (FrameDesc*)malloc(CACHED_ROWS * sizeof(FrameDesc));
+    for (int i = 0; i < CACHED_ROWS; i++) {
+        table[i].loc = 0x1000 + i * 16;
+        table[i].cfa = i % 5;
+        table[i].fp_off = i % 3;
+        table[i].pc_off = -8;
+    }
+    cc->setDwarfTable(table, CACHED_ROWS);
+    return cc;
+}
+
+static bool sameLibrary(CodeCache* expected, CodeCache* actual) {
+    const char* expected_base = expected->imageBase();
+    const char* actual_base = actual->imageBase();
+    for (uintptr_t offset = 0; offset < 0x1000 + CACHED_SYMBOLS * 0x40 + 0x100; offset += 7) {
+        const char* expected_name = expected->binarySearch(expected_base + offset);
+        const char* actual_name = actual->binarySearch(actual_base + offset);
+        if (strcmp(expected_name, actual_name) != 0) {
+            return false;
+        }
+
+        FrameDesc* f1 = expected->findFrameDesc(expected_base + offset);
+        FrameDesc* f2 = actual->findFrameDesc(actual_base + offset);
+        if (f1->cfa != f2->cfa || f1->fp_off != f2->fp_off || f1->pc_off != f2->pc_off) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_CASE(SymbolCache_roundTrip) {
+    char dir[] = "/tmp/asprof-symcache-XXXXXX";
+    ASSERT(mkdtemp(dir));
+
+    static char image1[16];
+    static char image2[16];
+    CodeCache* original = makeCachedLib(image1);
+    ASSERT_EQ(SymbolCache::save(original, dir, CACHED_BUILD_ID, sizeof(CACHED_BUILD_ID)), true);
+
+    // The same library loaded at another address
+    CodeCache* restored = new CodeCache("libcached.so", 0, image2, image2 + 0x100000, image2);
+    ASSERT_EQ(SymbolCache::load(restored, dir, CACHED_BUILD_ID, sizeof(CACHED_BUILD_ID)), true);
+    CHECK_EQ(restored->hasDwarfTable(), true);
+    CHECK_EQ(restored->findSymbol("function123"), (const void*)(image2 + 0x1000 + 123 * 0x40));
+    CHECK_EQ(sameLibrary(original, restored), true);
+
+    // Other build-ids miss
+    CodeCache* other = new CodeCache("libother.so", 0, image2, image2 + 0x100000, image2);
+    CHECK_EQ(SymbolCache::load(other, dir, CACHED_BUILD_ID, 4), false);
+
+    delete original;
+    delete restored;
+    delete other;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/123456789abc.sym", dir);
+    CHECK_EQ(unlink(path), 0);
+    rmdir(dir);
+}
+
+TEST_CASE(SymbolCache_corruptFile) {
+    char dir[] = "/tmp/asprof-symcache-XXXXXX";
+    ASSERT(mkdtemp(dir));
+
+    static char image[16];
+    CodeCache* original = makeCachedLib(image);
+    ASSERT_EQ(SymbolCache::save(original, dir, CACHED_BUILD_ID, sizeof(CACHED_BUILD_ID)), true);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/123456789abc.sym", dir);
+    ASSERT_EQ(truncate(path, 4096), 0);
+
+    CodeCache* restored = new CodeCache("libcached.so", 0, image, image + 0x100000, image);
+    CHECK_EQ(SymbolCache::load(restored, dir, CACHED_BUILD_ID, sizeof(CACHED_BUILD_ID)), false);
+    CHECK_EQ(restored->hasDwarfTable(), false);
+
+    delete original;
+    delete restored;
+    unlink(path);
+    rmdir(dir);
+}
@@ -11,8 +11,17 @@
 
 #include "codeCache.h"
 #include "profiler.h"
+#include "symbols.h"
 #include "testRunner.hpp"
+#include <dirent.h>
 #include <dlfcn.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "os.h"
 
 const void* resolveSymbol(const char* lib, const char* name) {
     void* result = dlopen(lib, RTLD_NOW);
@@ -77,4 +86,179 @@ TEST_CASE(MultipleMatchingSymbols) {
     ASSERT_NE(sym, sym_cold);
 }
 
+TEST_CASE(LazyParsingOnResolve) {
+    Symbols::setLazyParsing(true);
+    void* handle = dlopen("libjnimalloc" EXT, RTLD_NOW);
+    ASSERT(handle);
+    Profiler::instance()->updateSymbols(false);
+    Symbols::setLazyParsing(false);
+
+    CodeCache* lib = Profiler::instance()->findLibraryByName("libjnimalloc");
+    ASSERT(lib);
+    CHECK_EQ(lib->parseState(), PARSE_PENDING);
+    // Imports are parsed up front, symbols are not
+    CHECK(lib->findImport(im_malloc));
+    CHECK_EQ(lib->findSymbol("Java_test_nativemem_Native_malloc"), (const void*)NULL);
+
+    const void* sym = Profiler::instance()->resolveSymbol("Java_test_nativemem_Native_malloc");
+    CHECK_EQ(sym, dlsym(handle, "Java_test_nativemem_Native_malloc"));
+    lib = Profiler::instance()->findLibraryByName("libjnimalloc");
+    CHECK_EQ(lib->parseState(), PARSE_DONE);
+}
+
+TEST_CASE(LazyParsingOnFirstPc) {
+    Symbols::setLazyParsing(true);
+    void* handle = dlopen("libcallsmalloc" EXT, RTLD_NOW);
+    ASSERT(handle);
+    Profiler::instance()->updateSymbols(false);
+    Symbols::setLazyParsing(false);
+
+    const void* call_malloc = dlsym(handle, "call_malloc");
+    ASSERT(call_malloc);
+    CodeCache* lib = Profiler::instance()->findLibraryByAddress(call_malloc);
+    ASSERT(lib);
+    CHECK_NE(lib->parseState(), PARSE_PENDING);
+
+    // The background thread replaces the library with a parsed one
+    for (int i = 0; i < 5000 && lib->parseState() != PARSE_DONE; i++) {
+        usleep(1000);
+    }
+    lib = Profiler::instance()->findLibraryByAddress(call_malloc);
+    CHECK_EQ(lib->parseState(), PARSE_DONE);
+    CHECK_EQ(lib->findSymbol("call_malloc"), call_malloc);
+    CHECK_EQ(strcmp(lib->binarySearch(call_malloc), "call_malloc"), 0);
+}
+
+static const int BENCHMARK_LIBS = 320;
+
+// Distinct files make distinct libraries, even though their contents are the same
+static bool loadLibraryCopies(const char* original, const char* dir, const char* prefix, int count) {
+    FILE* in = fopen(original, "rb");
+    if (in == NULL) return false;
+    std::vector<char> data;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(in);
+
+    for (int i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s%d" EXT, dir, prefix, i);
+        FILE* out = fopen(path, "wb");
+        if (out == NULL) return false;
+        fwrite(data.data(), 1, data.size(), out);
+        fclose(out);
+        if (dlopen(path, RTLD_NOW | RTLD_LOCAL) == NULL) return false;
+    }
+    return true;
+}
+
+static void removeLibraryCopies(const char* dir, const char* prefix, int count) {
+    for (int i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s%d" EXT, dir, prefix, i);
+        unlink(path);
+    }
+}
+
+// Copies of a library share the build-id: the second one is restored from the cache written for the first
+TEST_CASE(SymbolCacheOnDisk) {
+    void* handle = dlopen("libcallsmalloc" EXT, RTLD_NOW);
+    ASSERT(handle);
+    Dl_info info;
+    ASSERT_NE(dladdr(dlsym(handle, "call_malloc"), &info), 0);
+
+    char dir[] = "/tmp/asprof-symcache-XXXXXX";
+    ASSERT(mkdtemp(dir));
+    Symbols::setCacheDir(dir);
+
+    for (int i = 0; i < 2; i++) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "libsymcache%d_", i);
+        ASSERT_EQ(loadLibraryCopies(info.dli_fname, dir, prefix, 1), true);
+        Profiler::instance()->updateSymbols(false);
+
+        char name[64];
+        snprintf(name, sizeof(name), "%s0", prefix);
+        CodeCache* lib = Profiler::instance()->findLibraryByName(name);
+        ASSERT(lib);
+        CHECK(lib->findSymbol("call_malloc"));
+        CHECK(lib->findImport(im_malloc));
+        removeLibraryCopies(dir, prefix, 1);
+    }
+    Symbols::setCacheDir(NULL);
+
+    // Exactly one cache file has been written
+    int files = 0;
+    DIR* d = opendir(dir);
+    ASSERT(d);
+    for (struct dirent* entry; (entry = readdir(d)) != NULL; ) {
+        if (entry->d_name[0] != '.') {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            CHECK_EQ(unlink(path), 0);
+            files++;
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+    CHECK_EQ(files, 1);
+}
+
+// Loads count copies of a library and parses them with 1 and 4 threads
+static void parseLibraryCopies(TestCase& test_case, const char* tag, int count) {
+    void* handle = dlopen("libcallsmalloc" EXT, RTLD_NOW);
+    ASSERT(handle);
+    Dl_info info;
+    ASSERT_NE(dladdr(dlsym(handle, "call_malloc"), &info), 0);
+
+    char dir[] = "/tmp/asprof-symbols-XXXXXX";
+    ASSERT(mkdtemp(dir));
+
+    Profiler* profiler = Profiler::instance();
+    CodeCacheArray* libs = profiler->nativeLibs();
+    int threads[] = {1, 4};
+    for (int t = 0; t < 2; t++) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "lib%s%d_", tag, threads[t]);
+        ASSERT_EQ(loadLibraryCopies(info.dli_fname, dir, prefix, count), true);
+
+        int count_before = libs->count();
+        Symbols::setParseThreads(threads[t]);
+        u64 start = OS::nanotime();
+        profiler->updateSymbols(false);
+        u64 elapsed = OS::nanotime() - start;
+        Symbols::setParseThreads(0);
+
+        int parsed = libs->count() - count_before;
+        CHECK_EQ(parsed >= count, true);
+        printf("Parsing %d libraries with %d thread(s): %.2f ms\n", parsed, threads[t], elapsed / 1e6);
+
+        // Libraries are added in the order of their addresses regardless of the number of threads
+        for (int i = count_before + 1; i < libs->count(); i++) {
+            CHECK_EQ((*libs)[i - 1]->minAddress() < (*libs)[i]->minAddress(), true);
+        }
+        for (int i = count_before; i < libs->count(); i++) {
+            const char* name = (*libs)[i]->name();
+            if (strstr(name, prefix) != NULL) {
+                CHECK((*libs)[i]->findSymbol("call_malloc"));
+            }
+        }
+        removeLibraryCopies(dir, prefix, count);
+    }
+
+    rmdir(dir);
+}
+
+TEST_CASE(ParallelParsing_order) {
+    parseLibraryCopies(test_case, "parseorder", 16);
+}
+
+// Parsing of libraries is what the profiler does at startup before the first sample can be taken
+BENCHMARK_CASE(ParallelParsing_benchmark) {
+    parseLibraryCopies(test_case, "parse", BENCHMARK_LIBS);
+}
+
 #endif // __linux__
@@ -7,10 +7,12 @@
 #include "testRunner.hpp"
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
-int main() {
-    return TestRunner::instance()->runAllTests();
+int main(int argc, char** argv) {
+    bool benchmarks = argc > 1 && strcmp(argv[1], "--benchmark") == 0;
+    return TestRunner::instance()->runAllTests(benchmarks);
 }
 
 TestRunner* TestRunner::instance() {
@@ -30,14 +32,17 @@ bool fileReadable(const char* filename) {
     return r != -1;
 }
 
-int TestRunner::runAllTests() {
+int TestRunner::runAllTests(bool benchmarks) {
     int passed = 0;
     int failed = 0;
     int skipped = 0;
     int total_assertions = 0;
     int i = 1;
     double total_duration = 0;
-    const int total_tests = testCases().size();
+    int total_tests = 0;
+    for (auto& pair : testCases()) {
+        total_tests += pair.second.benchmark == benchmarks ? 1 : 0;
+    }
 
     const bool redirected = !isatty(STDOUT_FILENO);
     const char* red = redirected ? "" : "\033[31m";
@@ -55,6 +60,9 @@ int TestRunner::runAllTests() {
 
     for (auto& pair : testCases()) {
         auto& test_case = pair.second;
+        if (test_case.benchmark != benchmarks) {
+            continue;
+        }
         bool force_skip = has_only && !test_case.only;
 
         printf("Running %s @ %s:%d\n", test_case.name.c_str(), test_case.filename.c_str(), test_case.line_no);
@@ -33,21 +33,23 @@ class TestRunner {
         return _test_cases;
     }
 
-    int runAllTests();
+    int runAllTests(bool benchmarks);
 };
 
 struct TestCase {
     std::string name;
     std::function<void()> test_function;
     bool only; // only run this test when true, ignore all others.
+    bool benchmark; // run only with --benchmark, which skips all regular tests.
     std::string filename;
     int line_no;
     int assertion_count = 0;
     bool has_failed_assertions = false;
     bool skipped = false;
 
-    TestCase(const std::string& name, std::function<void()> test_function, bool only, const std::string& filename, int line_no)
-        : name(name), test_function(test_function), only(only), filename(filename), line_no(line_no) {}
+    TestCase(const std::string& name, std::function<void()> test_function, bool only, bool benchmark,
+             const std::string& filename, int line_no)
+        : name(name), test_function(test_function), only(only), benchmark(benchmark), filename(filename), line_no(line_no) {}
 };
 
 #define ASSERT(condition) ASSERT_NE(condition, NULL)
@@ -118,39 +120,42 @@ struct TestCase {
 #define CHECK_LT(val1, val2) CHECK_OP(val1, <, val2)
 #define CHECK_LTE(val1, val2) CHECK_OP(val1, <=, val2)
 
-#define __TEST_CASE(test_name, precondition, only)                                                        \
-    void test_name(TestCase& test_case);                                                                  \
-    void test_name##_runner();                                                                            \
-    static TestRegistrar test_name##_registrar(#test_name, test_name##_runner, only, __FILE__, __LINE__); \
-    void test_name##_runner() {                                                                           \
-        TestCase& test_case = TestRunner::instance()->testCases().at(#test_name);                         \
-        test_case.assertion_count = 0;                                                                    \
-        if (!(precondition)) {                                                                            \
-            test_case.skipped = true;                                                                     \
-            return;                                                                                       \
-        }                                                                                                 \
-        test_name(test_case);                                                                             \
-        if (!test_case.has_failed_assertions && test_case.assertion_count == 0) {                         \
-            printf("%s: No assertions were made.\n", #test_name);                                         \
-        }                                                                                                 \
-        return;                                                                                           \
-    }                                                                                                     \
+#define __TEST_CASE(test_name, precondition, only, benchmark)                                                        \
+    void test_name(TestCase& test_case);                                                                             \
+    void test_name##_runner();                                                                                       \
+    static TestRegistrar test_name##_registrar(#test_name, test_name##_runner, only, benchmark, __FILE__, __LINE__); \
+    void test_name##_runner() {                                                                                      \
+        TestCase& test_case = TestRunner::instance()->testCases().at(#test_name);                                    \
+        test_case.assertion_count = 0;                                                                               \
+        if (!(precondition)) {                                                                                       \
+            test_case.skipped = true;                                                                                \
+            return;                                                                                                  \
+        }                                                                                                            \
+        test_name(test_case);                                                                                        \
+        if (!benchmark && !test_case.has_failed_assertions && test_case.assertion_count == 0) {                      \
+            printf("%s: No assertions were made.\n", #test_name);                                                    \
+        }                                                                                                            \
+        return;                                                                                                      \
+    }                                                                                                                \
     void test_name(TestCase& test_case)
 
 #define __SELECT_IMPL(_1, _2, NAME, ...) NAME
 #define TEST_CASE(...) __SELECT_IMPL(__VA_ARGS__, __TEST_CASE2, __TEST_CASE1)(__VA_ARGS__)
 #define ONLY_TEST_CASE(...) __SELECT_IMPL(__VA_ARGS__, __ONLY_TEST_CASE2, __ONLY_TEST_CASE1)(__VA_ARGS__)
 
-#define __TEST_CASE1(test_name) __TEST_CASE(test_name, true, false)
-#define __TEST_CASE2(test_name, precondition) __TEST_CASE(test_name, precondition, false)
+#define __TEST_CASE1(test_name) __TEST_CASE(test_name, true, false, false)
+#define __TEST_CASE2(test_name, precondition) __TEST_CASE(test_name, precondition, false, false)
+
+#define __ONLY_TEST_CASE1(test_name) __TEST_CASE(test_name, true, true, false)
+#define __ONLY_TEST_CASE2(test_name, precondition) __TEST_CASE(test_name, precondition, true, false)
 
-#define __ONLY_TEST_CASE1(test_name) __TEST_CASE(test_name, true, true)
-#define __ONLY_TEST_CASE2(test_name, precondition) __TEST_CASE(test_name, precondition, true)
+// Benchmarks are not part of the regular test run; make bench-cpp runs them
+#define BENCHMARK_CASE(test_name) __TEST_CASE(test_name, true, false, true)
 
 struct TestRegistrar {
-    TestRegistrar(const std::string& name, std::function<void()> test_function, bool only, const std::string& filename,
-                  int line_no) {
-        TestRunner::instance()->testCases().emplace(name, TestCase(name, test_function, only, filename, line_no));
+    TestRegistrar(const std::string& name, std::function<void()> test_function, bool only, bool benchmark,
+                  const std::string& filename, int line_no) {
+        TestRunner::instance()->testCases().emplace(name, TestCase(name, test_function, only, benchmark, filename, line_no));
     }
 };
 